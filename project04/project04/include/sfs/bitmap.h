@@ -0,0 +1,48 @@
+/* bitmap.h: SimpleFS packed bitmap */
+
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Bitmap Constants */
+
+#define BITS_PER_WORD (64)
+
+/* Bitmap Structure */
+
+typedef struct Bitmap Bitmap;
+struct Bitmap {
+    uint64_t* words; /* Packed bits (1 means set) */
+    size_t bits;     /* Number of bits in bitmap */
+    size_t nwords;   /* Number of words in bitmap */
+    size_t count;    /* Number of set bits (updated atomically) */
+    size_t cursor;   /* Where the next search begins (next-fit) */
+};
+
+/* Bitmap Functions */
+
+Bitmap* bitmap_create(size_t bits, bool set);
+void bitmap_delete(Bitmap* bitmap);
+
+bool bitmap_test(Bitmap* bitmap, size_t bit);
+void bitmap_set(Bitmap* bitmap, size_t bit);
+void bitmap_clear(Bitmap* bitmap, size_t bit);
+void bitmap_set_range(Bitmap* bitmap, size_t start, size_t length);
+void bitmap_clear_range(Bitmap* bitmap, size_t start, size_t length);
+
+ssize_t bitmap_find(Bitmap* bitmap, size_t start);
+ssize_t bitmap_find_run(Bitmap* bitmap, size_t start, size_t length);
+ssize_t bitmap_find_in(Bitmap* bitmap, size_t start, size_t end);
+ssize_t bitmap_find_run_in(Bitmap* bitmap, size_t start, size_t end, size_t length);
+size_t bitmap_run_length(Bitmap* bitmap, size_t start);
+size_t bitmap_run_length_in(Bitmap* bitmap, size_t start, size_t end);
+ssize_t bitmap_allocate(Bitmap* bitmap);
+size_t bitmap_recount(Bitmap* bitmap);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
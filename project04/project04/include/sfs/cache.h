@@ -0,0 +1,45 @@
+/* cache.h: SimpleFS block cache */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "sfs/disk.h"
+
+/* Cache Structures */
+
+typedef struct CacheEntry CacheEntry;
+struct CacheEntry {
+    size_t block;          /* Block number held by this entry */
+    bool valid;            /* Whether or not entry holds a block */
+    bool dirty;            /* Whether or not entry must be written back */
+    CacheEntry* prev;      /* Previous entry in LRU list (more recent) */
+    CacheEntry* next;      /* Next entry in LRU list (less recent) */
+    CacheEntry* chain;     /* Next entry in hash bucket */
+    char data[BLOCK_SIZE]; /* Cached block contents */
+};
+
+typedef struct Cache Cache;
+struct Cache {
+    size_t capacity;       /* Number of blocks cache can hold */
+    size_t nbuckets;       /* Number of hash buckets (power of two) */
+    CacheEntry* entries;   /* Backing array of entries */
+    CacheEntry** buckets;  /* Hash buckets indexed by block number */
+    CacheEntry lru;        /* LRU list sentinel (next is most recent) */
+};
+
+/* Cache Functions */
+
+Cache* cache_create(size_t capacity);
+void cache_delete(Cache* cache);
+
+CacheEntry* cache_lookup(Cache* cache, size_t block);
+CacheEntry* cache_victim(Cache* cache);
+void cache_assign(Cache* cache, CacheEntry* entry, size_t block);
+void cache_invalidate(Cache* cache, CacheEntry* entry);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
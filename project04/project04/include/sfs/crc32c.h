@@ -0,0 +1,22 @@
+/* crc32c.h: SimpleFS CRC32C checksums */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* CRC32C Constants */
+
+#define CRC32C_POLYNOMIAL (0x82f63b78) /* Castagnoli polynomial (bit-reversed) */
+
+/* CRC32C Functions */
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+uint32_t crc32c_software(uint32_t crc, const void* data, size_t length);
+bool crc32c_hardware();
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,48 @@
+/* dedup.h: SimpleFS block deduplication index */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Dedup Constants */
+
+#define DEDUP_INDEX_MIN (64) /* Fewest slots in an index (it doubles as it fills) */
+
+/* Dedup Structures */
+
+typedef struct DedupEntry DedupEntry;
+struct DedupEntry {
+    uint32_t hash;  /* Hash of block contents */
+    uint32_t block; /* Block holding those contents (0 if slot is empty) */
+};
+
+/**
+ * A DedupIndex maps the hash of a block's contents to the block holding
+ * them, in an open-addressed table (linear probing, at most half full).
+ * Several blocks may share a hash; a lookup returns the first one found, so
+ * callers must compare contents before trusting a match.  The index is not
+ * locked: its owner guards it.
+ */
+typedef struct DedupIndex DedupIndex;
+struct DedupIndex {
+    DedupEntry* entries; /* Slots (power of two) */
+    size_t capacity;     /* Number of slots */
+    size_t count;        /* Number of slots in use */
+};
+
+/* Dedup Functions */
+
+DedupIndex* dedup_create(size_t capacity);
+void dedup_delete(DedupIndex* index);
+
+bool dedup_insert(DedupIndex* index, uint32_t hash, uint32_t block);
+bool dedup_remove(DedupIndex* index, uint32_t hash, uint32_t block);
+uint32_t dedup_lookup(DedupIndex* index, uint32_t hash);
+void dedup_clear(DedupIndex* index);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
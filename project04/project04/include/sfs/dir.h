@@ -0,0 +1,98 @@
+/* dir.h: SimpleFS directories and path names */
+
+#ifndef DIR_H
+#define DIR_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "sfs/fs.h"
+
+/* Directory Constants */
+
+#define DIR_MAGIC         (0x52494453) /* "SDIR" */
+#define DIR_NAME_MAX      (58)         /* Longest name of a directory entry */
+#define DIR_BLOCK_ENTRIES (63)         /* Number of entries per directory block */
+#define DIR_LOAD_PERCENT  (75)         /* Fullest the buckets get before doubling */
+#define DCACHE_ENTRIES    (4096)       /* Number of names held by the dentry cache */
+
+/* Directory Structures */
+
+typedef enum {
+    ENTRY_FILE = 1,      /* Regular file */
+    ENTRY_DIRECTORY = 2, /* Directory */
+} EntryType;
+
+typedef struct DirEntry DirEntry;
+struct DirEntry {
+    uint32_t inode_number;     /* Inode the name refers to */
+    uint8_t type;              /* EntryType of the Inode */
+    uint8_t length;            /* Length of name */
+    char name[DIR_NAME_MAX];   /* Name (not NUL-terminated) */
+};
+
+/**
+ * A directory is a file whose first block is a DirHeader and whose other
+ * blocks are DirBlocks.  A name hashes to one of the bucket blocks right
+ * after the header; a full bucket chains to overflow blocks appended to the
+ * file.  Once the entries fill DIR_LOAD_PERCENT of the bucket blocks, the
+ * directory is rewritten with twice as many buckets, so a lookup reads one
+ * block (plus the header) however large the directory grows.
+ */
+typedef struct DirHeader DirHeader;
+struct DirHeader {
+    uint32_t magic;     /* Directory magic number */
+    uint32_t parent;    /* Inode of parent directory (itself for the root) */
+    uint32_t buckets;   /* Number of bucket blocks after the header */
+    uint32_t blocks;    /* Number of blocks in use (header, buckets, overflow) */
+    uint32_t entries;   /* Number of entries in directory */
+};
+
+typedef struct DirBlock DirBlock;
+struct DirBlock {
+    uint32_t next;                         /* Next block in bucket chain (0 if last) */
+    uint32_t count;                        /* Number of entries in use */
+    DirEntry entries[DIR_BLOCK_ENTRIES];   /* Entries (packed at the front) */
+};
+
+typedef struct Dentry Dentry;
+struct Dentry {
+    bool valid;         /* Whether or not slot holds a name */
+    uint32_t parent;    /* Directory holding the name */
+    DirEntry entry;     /* Cached directory entry */
+};
+
+/**
+ * A DirTree resolves path names from the root directory of a mounted
+ * FileSystem, remembering recently used names in a direct-mapped dentry
+ * cache (keyed by parent directory and name) so that walking a path does
+ * not reread the directories along it.  Every operation holds the lock, so
+ * a DirTree may be shared by several threads.
+ */
+typedef struct DirTree DirTree;
+struct DirTree {
+    FileSystem* fs;         /* Mounted FileSystem */
+    uint32_t root;          /* Inode of root directory */
+    Dentry* dentries;       /* Dentry cache slots */
+    size_t hits;            /* Number of names found in the dentry cache */
+    size_t misses;          /* Number of names read from a directory */
+    pthread_mutex_t lock;   /* Guards directories and dentry cache */
+};
+
+/* Directory Functions */
+
+DirTree* dir_open(FileSystem* fs);
+void dir_close(DirTree* tree);
+
+ssize_t dir_lookup(DirTree* tree, const char* path, EntryType* type);
+ssize_t dir_create(DirTree* tree, const char* path);
+ssize_t dir_mkdir(DirTree* tree, const char* path);
+bool dir_unlink(DirTree* tree, const char* path);
+ssize_t dir_list(DirTree* tree, const char* path, DirEntry** entries);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
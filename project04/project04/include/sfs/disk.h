@@ -3,32 +3,118 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 /* Disk Constants */
 
 #define BLOCK_SIZE (1 << 12)
 #define DISK_FAILURE (-1)
+#define DISK_QUEUE_DEPTH (64) /* Default io_uring queue depth */
+
+/* Disk Backends */
+
+typedef enum {
+    DISK_PREAD,    /* pread/pwrite on the disk image file */
+    DISK_MMAP,     /* memcpy to/from a shared mapping of the disk image */
+    DISK_URING,    /* Batched asynchronous reads/writes through io_uring */
+    DISK_BACKENDS, /* Number of backends */
+} DiskBackend;
+
+/* Disk Devices */
+
+typedef enum {
+    DISK_IDEAL,    /* No modeled cost (whatever the disk image file costs) */
+    DISK_HDD,      /* Seek, rotation, and transfer time of a spinning disk */
+    DISK_SSD,      /* Request latency overlapped up to a queue depth, plus transfer time */
+    DISK_DEVICES,  /* Number of devices */
+} DiskDevice;
+
+/* Disk Model */
+
+/**
+ * A DiskModel charges every block transferred to or from the disk image the
+ * time the device would have taken.  A hard disk pays a seek (from the
+ * shortest seek up to a full stroke, growing with the square root of the
+ * distance) and half a rotation whenever a request does not start where the
+ * last one ended; a solid state disk pays its latency once for every
+ * queue_depth requests queued together (and for each request that is not
+ * queued).  Both then pay for the bytes at bandwidth.
+ */
+typedef struct DiskModel DiskModel;
+struct DiskModel {
+    DiskDevice device;      /* Kind of device modeled */
+    uint64_t seek_ns;       /* Seek across the whole disk (hdd) */
+    uint64_t track_ns;      /* Shortest seek (hdd) */
+    uint64_t rotation_ns;   /* One revolution (hdd) */
+    uint64_t latency_ns;    /* Time to service one request (ssd) */
+    unsigned queue_depth;   /* Requests serviced at once (ssd) */
+    uint64_t bandwidth;     /* Bytes transferred per second */
+    bool delay;             /* Whether to also sleep for the modeled time */
+};
 
 /* Disk Structure */
 
+/**
+ * Every Disk function may be called from several threads at once, except
+ * disk_open, disk_close, disk_cache, disk_queue_depth, and disk_model.  The counters are
+ * updated atomically; the block cache and submission queue are guarded by
+ * lock, and a drain waits for requests queued by every thread.
+ */
 typedef struct Disk Disk;
 
 struct Disk {
-    int fd;        /* File descriptor of disk image	*/
-    size_t blocks; /* Number of blocks in disk image	*/
-    size_t reads;  /* Number of reads to disk image	*/
-    size_t writes; /* Number of writes to disk image	*/
+    int fd;              /* File descriptor of disk image	*/
+    size_t blocks;       /* Number of blocks in disk image	*/
+    size_t reads;        /* Number of reads to disk image	*/
+    size_t writes;       /* Number of writes to disk image	*/
+    size_t hits;         /* Number of reads served by block cache */
+    size_t misses;       /* Number of reads that missed block cache */
+    size_t evictions;    /* Number of blocks evicted from block cache */
+    struct Cache* cache; /* Write-back block cache (NULL if disabled) */
+    DiskBackend backend; /* How blocks are transferred to disk image */
+    char* map;           /* Mapping of disk image (mmap backend only) */
+    struct Uring* ring;  /* Submission queue (uring backend only) */
+    DiskModel model;     /* Device whose cost is modeled */
+    uint64_t modeled_ns; /* Time the modeled device spent transferring blocks */
+    size_t head;         /* Block following the last one transferred (hdd) */
+    size_t queued;       /* Requests queued since the last drain (ssd) */
+    pthread_mutex_t lock;/* Guards block cache and submission queue (recursive) */
 };
 
 /* Disk Functions */
 
 Disk* disk_open(const char* path, size_t blocks);
+Disk* disk_open_backend(const char* path, size_t blocks, DiskBackend backend);
 void disk_close(Disk* disk);
 
 ssize_t disk_read(Disk* disk, size_t block, char* data);
 ssize_t disk_write(Disk* disk, size_t block, char* data);
+ssize_t disk_read_shared(Disk* disk, size_t block, char* data);
+
+ssize_t disk_readv(Disk* disk, const size_t* blocks, char** data, size_t count);
+ssize_t disk_writev(Disk* disk, const size_t* blocks, char** data, size_t count);
+
+bool disk_queue_read(Disk* disk, size_t block, char* data);
+bool disk_queue_write(Disk* disk, size_t block, char* data);
+bool disk_drain(Disk* disk);
+bool disk_queue_depth(Disk* disk, unsigned depth);
+
+bool disk_discard(Disk* disk, size_t block, size_t count);
+
+bool disk_cache(Disk* disk, size_t capacity);
+bool disk_flush(Disk* disk);
+
+const char* disk_map(Disk* disk, size_t block, size_t count);
+
+bool disk_backend_parse(const char* name, DiskBackend* backend);
+const char* disk_backend_name(DiskBackend backend);
+
+bool disk_model(Disk* disk, const DiskModel* model);
+bool disk_model_parse(const char* name, DiskModel* model);
+const char* disk_device_name(DiskDevice device);
 
 #endif
 
@@ -3,35 +3,137 @@
 #ifndef FS_H
 #define FS_H
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "sfs/bitmap.h"
 #include "sfs/disk.h"
 
 /* File System Constants */
 
 #define MAGIC_NUMBER (0xf0f03410)
+#define FS_VERSION (7)            /* On-disk format version written by fs_format */
 #define INODES_PER_BLOCK (128)    /* Number of inodes per block */
-#define POINTERS_PER_INODE (5)    /* Number of direct pointers per inode */
+#define POINTERS_PER_INODE (5)    /* Number of direct pointers per inode (version 0) */
+#define DIRECT_POINTERS_V1 (3)    /* Number of direct pointers per inode (version 1) */
 #define POINTERS_PER_BLOCK (1024) /* Number of pointers per block */
+#define BITS_PER_BITMAP_BLOCK (BLOCK_SIZE * 8) /* Blocks tracked by each free bitmap block */
+#define READAHEAD_STREAMS (8)     /* Number of sequential readers tracked at once */
+#define READAHEAD_MIN (8)         /* Initial read-ahead window in blocks */
+#define READAHEAD_MAX (256)       /* Largest read-ahead buffer in blocks */
+#define INODE_LOCKS (1024)        /* Most reader/writer locks striped across the inodes */
+#define ALLOC_SHARDS (16)         /* Most independently locked ranges of the free block bitmap */
+#define ALLOC_SHARD_MIN (4096)    /* Fewest blocks in each allocator shard */
+#define JOURNAL_RATIO (64)        /* One journal block per this many blocks (version 3) */
+#define JOURNAL_MIN (8)           /* Fewest journal blocks worth keeping (version 3) */
+#define JOURNAL_MAX (1024)        /* Most journal blocks (version 3) */
+#define CHECKSUMS_PER_BLOCK (1024) /* Data block checksums per checksum block (version 4) */
+#define INODE_INLINE (1 << 1)     /* Bit of valid set when data is kept in the pointers (version 5) */
+#define INLINE_DATA_MAX (24)      /* Largest file kept in its Inode (version 5) */
+#define EXTENT_BLOCKS (8)         /* Logical blocks compressed together (version 6) */
 
 /* File System Structures */
 
+typedef enum {
+    FORMAT_FAST = 0,           /* Clear only the inode table and discard data blocks */
+    FORMAT_SECURE = 1 << 0,    /* Overwrite every block with zeros */
+    FORMAT_CHECKSUMS = 1 << 1, /* Keep a checksum of every data block (may be combined with either) */
+    FORMAT_COMPRESSION = 1 << 2, /* Compress data in extents (implies FORMAT_CHECKSUMS) */
+    FORMAT_DEDUP = 1 << 3,     /* Share data blocks with the same contents (implies FORMAT_CHECKSUMS, not with FORMAT_COMPRESSION) */
+} FormatMode;
+
 typedef struct SuperBlock SuperBlock;
 struct SuperBlock {
-    uint32_t magic_number; /* File system magic number */
-    uint32_t blocks;       /* Number of blocks in file system */
-    uint32_t inode_blocks; /* Number of blocks reserved for inodes */
-    uint32_t inodes;       /* Number of inodes in file system */
+    uint32_t magic_number;    /* File system magic number */
+    uint32_t blocks;          /* Number of blocks in file system */
+    uint32_t inode_blocks;    /* Number of blocks reserved for inodes */
+    uint32_t inodes;          /* Number of inodes in file system */
+    uint32_t version;         /* On-disk format version (0 for original images) */
+    uint32_t bitmap_blocks;   /* Number of free bitmap blocks after inode blocks (version 2) */
+    uint32_t bitmap_checksum; /* Checksum of free bitmap blocks (version 2) */
+    uint32_t clean;           /* Whether free bitmap matches inode blocks (version 2) */
+    uint32_t journal_blocks;  /* Number of journal blocks after bitmap blocks (version 3) */
+    uint32_t journal_sequence;/* Sequence number of next journal transaction (version 3) */
+    uint32_t root_directory;  /* Inode of root directory plus one (version 3, 0 if none) */
+    uint32_t checksum_blocks; /* Number of checksum blocks after bitmap blocks (version 4, 0 if none) */
+    uint32_t extent_blocks;   /* Logical blocks per compressed extent (version 6, 0 if uncompressed) */
+    uint32_t dedup;           /* Whether data blocks are shared by contents (version 7) */
 };
 
+/**
+ * Version 2 file systems keep the free block bitmap on disk, right after the
+ * inode blocks, so mount does not have to walk every inode.  The bitmap is
+ * only trusted if the superblock is marked clean and the checksum matches;
+ * the first change after a sync marks the superblock unclean until the next
+ * sync writes the bitmap back.
+ *
+ * Version 3 file systems add a journal region after the bitmap blocks (on
+ * disks large enough to spare one).  Inode, bitmap, and pointer block
+ * changes from many operations are grouped into one transaction, logged to
+ * the journal with a single write, and only then written in place, so the
+ * metadata on disk always matches some committed state: mount replays the
+ * last transaction instead of walking every inode.  Data blocks are written
+ * in place before the transaction that points at them commits, and blocks
+ * released by a transaction are not reused until it commits.
+ *
+ * Version 4 file systems may be formatted with a checksum region between the
+ * bitmap blocks and the journal, holding the CRC32C of every data block
+ * with its low bit set (indexed by block number, 0 if not recorded, which no
+ * contents can match).  Every data block written
+ * records its checksum and every data block read is checked against it;
+ * checksum blocks are written back (or journaled) with the Inode blocks.
+ * Data written since the last sync or commit may be left with a stale
+ * checksum by a crash.
+ *
+ * Version 5 file systems keep files of at most INLINE_DATA_MAX bytes in the
+ * Inode itself, in place of the block pointers, marked by INODE_INLINE in
+ * valid.  Such files use no data blocks and are read straight from the
+ * Inode table; a write past INLINE_DATA_MAX moves the data out to a block.
+ *
+ * Version 6 file systems may be formatted to compress data in extents of
+ * extent_blocks logical blocks.  An extent whose LZ4 compressed bytes take at
+ * least one block fewer is stored in its first few pointers (the rest are
+ * holes), and the compressed length is recorded for its first data block in
+ * a second half of the checksum region (0 for blocks holding plain data).
+ * Extents are read and written whole, always to newly allocated blocks.
+ *
+ * Version 7 file systems may be formatted to share data blocks between (and
+ * within) Inodes that hold the same contents.  The number of pointers to
+ * each data block is kept in a second half of the checksum region, and the
+ * recorded checksum of every block in use is indexed in memory (rebuilt at
+ * mount), so a write looks up each block it would store and, once the
+ * contents compare equal, points at the existing block instead.  Shared blocks are never
+ * written in place: every write goes to a new block, and a block is only
+ * released when its last pointer goes.
+ */
+
+/**
+ * Version 0 inodes have five direct pointers and one indirect pointer.
+ * Version 1 inodes give the last two direct pointers over to double- and
+ * triple-indirect pointers and keep the upper bits of the size in what used
+ * to be the top half of valid (always zero in version 0).
+ */
 typedef struct Inode Inode;
 struct Inode {
-    uint32_t valid;                      /* Whether or not inode is valid */
-    uint32_t size;                       /* Size of file */
-    uint32_t direct[POINTERS_PER_INODE]; /* Direct pointers */
-    uint32_t indirect;                   /* Indirect pointers */
+    uint16_t valid;                              /* Whether or not inode is valid */
+    uint16_t size_high;                          /* Upper 16 bits of size (version 1) */
+    uint32_t size;                               /* Size of file (lower 32 bits) */
+    union {
+        struct {
+            union {
+                uint32_t direct[POINTERS_PER_INODE]; /* Direct pointers */
+                struct {
+                    uint32_t direct_v1[DIRECT_POINTERS_V1]; /* Direct pointers (version 1) */
+                    uint32_t double_indirect;    /* Double indirect pointer (version 1) */
+                    uint32_t triple_indirect;    /* Triple indirect pointer (version 1) */
+                };
+            };
+            uint32_t indirect;                   /* Indirect pointers */
+        };
+        char data[INLINE_DATA_MAX];              /* File data (version 5, if INODE_INLINE) */
+    };
 };
 
 typedef union Block Block;
@@ -42,13 +144,76 @@ union Block {
     char data[BLOCK_SIZE];                 /* View block as data */
 };
 
+typedef struct StatFS StatFS;
+struct StatFS {
+    uint32_t blocks;      /* Number of blocks in file system */
+    uint32_t data_blocks; /* Number of blocks available for data */
+    uint32_t free_blocks; /* Number of free blocks */
+    uint32_t inodes;      /* Number of inodes in file system */
+    uint32_t free_inodes; /* Number of free inodes */
+    uint32_t checksum_errors; /* Number of data blocks read back with the wrong checksum */
+    uint32_t shared_blocks; /* Number of data block pointers served by another's block (version 7) */
+};
+
+typedef struct ReadAhead ReadAhead;
+struct ReadAhead {
+    ssize_t inode_number; /* Inode being read (-1 if unused) */
+    size_t next_offset;   /* Offset at which a sequential read would begin */
+    uint32_t window;      /* Blocks to prefetch past each read (0 if random) */
+    uint64_t start;       /* First logical block held in buffer */
+    uint32_t count;       /* Number of blocks held in buffer */
+    uint32_t capacity;    /* Number of blocks buffer can hold */
+    char* buffer;         /* Prefetched data blocks */
+    pthread_mutex_t lock; /* Guards stream (shared by several inodes) */
+};
+
+/**
+ * An AllocShard is a word-aligned range of the free block bitmap with its
+ * own lock, so threads allocating and releasing blocks in different shards
+ * do not wait on each other.
+ */
+typedef struct AllocShard AllocShard;
+struct AllocShard {
+    pthread_mutex_t lock; /* Guards bits in [start, end) */
+    uint32_t start;       /* First block of shard */
+    uint32_t end;         /* Block after shard */
+};
+
 typedef struct FileSystem FileSystem;
 struct FileSystem {
-    Disk* disk;           /* Disk file system is mounted on */
-    bool* free_blocks;    /* Free block bitmap */
-    SuperBlock meta_data; /* File system meta data */
+    Disk* disk;               /* Disk file system is mounted on */
+    Bitmap* free_blocks;      /* Free block bitmap (set bits are free) */
+    Bitmap* free_inodes;      /* Free inode bitmap (set bits are free, cursor at or below first) */
+    SuperBlock meta_data;     /* File system meta data */
+    Block* inode_table;       /* In-memory copy of inode blocks */
+    bool* dirty_inode_blocks; /* Inode blocks modified since last sync */
+    bool* dirty_bitmap_blocks;/* Free bitmap blocks modified since last sync */
+    Block* checksum_table;    /* In-memory copy of checksum blocks (NULL if none) */
+    bool* dirty_checksum_blocks; /* Checksum blocks modified since last sync */
+    size_t checksum_errors;   /* Data blocks read back with the wrong checksum */
+    ReadAhead readahead[READAHEAD_STREAMS]; /* Sequential read streams */
+    pthread_rwlock_t* inode_locks;  /* Per-inode locks (inode number modulo ninode_locks) */
+    uint32_t ninode_locks;          /* Number of inode locks */
+    AllocShard shards[ALLOC_SHARDS];/* Allocator locks over free block bitmap */
+    uint32_t nshards;               /* Number of allocator shards */
+    pthread_rwlock_t sync_lock;     /* Shared by updates, exclusive for sync and fsck */
+    pthread_mutex_t table_lock;     /* Guards in-memory Inode table */
+    pthread_mutex_t super_lock;     /* Guards clean flag of superblock */
+    struct Journal* journal;        /* Metadata journal (NULL if version 3 journal is absent) */
+    size_t dirty_blocks;            /* Inode, bitmap, and checksum blocks modified since last commit */
+    struct DedupIndex* dedup_index; /* Contents of data blocks in use (NULL unless deduplicating) */
+    size_t shared_blocks;           /* Data block pointers beyond the first to each block */
+    pthread_mutex_t dedup_lock;     /* Guards dedup index, shared blocks, and reference counts */
 };
 
+/**
+ * Once mounted, fs_create, fs_remove, fs_stat, fs_statfs, fs_read,
+ * fs_read_map, fs_write, fs_sync, fs_fsck, and fs_scrub may be called from
+ * several threads at once.  Reads of an Inode share its lock while writes
+ * and removes hold it exclusively; locks are always taken in the order
+ * inode, sync, dedup, then table, shard, or superblock.
+ */
+
 /* File System Functions */
 
 void fs_debug(Disk* disk);
@@ -57,22 +222,36 @@ void fs_debug(Disk* disk);
  * An attempt to format an already-mounted disk should do nothing and return failure.
  */
 bool fs_format(FileSystem* fs, Disk* disk);
+bool fs_format_mode(FileSystem* fs, Disk* disk, FormatMode mode);
 
 bool fs_mount(FileSystem* fs, Disk* disk);
 void fs_unmount(FileSystem* fs);
+bool fs_sync(FileSystem* fs);
+ssize_t fs_fsck(FileSystem* fs);
+ssize_t fs_scrub(FileSystem* fs, size_t* checked);
 
 ssize_t fs_create(FileSystem* fs);
+ssize_t fs_create_many(FileSystem* fs, uint32_t* inode_numbers, size_t count);
 bool fs_remove(FileSystem* fs, size_t inode_number);
 ssize_t fs_stat(FileSystem* fs, size_t inode_number);
+bool fs_statfs(FileSystem* fs, StatFS* stat);
+ssize_t fs_root(FileSystem* fs);
+bool fs_set_root(FileSystem* fs, size_t inode_number);
 
 ssize_t fs_read(FileSystem* fs, size_t inode_number, char* data, size_t length, size_t offset);
+ssize_t fs_read_map(FileSystem* fs, size_t inode_number, size_t offset, const char** data);
 ssize_t fs_write(FileSystem* fs, size_t inode_number, char* data, size_t length, size_t offset);
 
-bool load_inode(Inode* inode, size_t inumber, Disk* disk);
+bool load_inode(Inode* inode, size_t inumber, FileSystem* fs);
+
+bool save_inode(Inode* inode, size_t inumber, FileSystem* fs);
 
-bool save_inode(Inode* inode, size_t inumber, Disk* disk);
+size_t inode_size(const Inode* inode);
+void set_inode_size(Inode* inode, size_t size);
 
 uint32_t allocate_free_block(FileSystem* fs);
+uint32_t allocate_free_extent(FileSystem* fs, uint32_t count, uint32_t* allocated);
+uint32_t reserve_free_blocks(FileSystem* fs, uint32_t* blocks, uint32_t count);
 
 #endif
 
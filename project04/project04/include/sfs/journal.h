@@ -0,0 +1,74 @@
+/* journal.h: SimpleFS metadata journal */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "sfs/disk.h"
+
+/* Journal Constants */
+
+#define JOURNAL_MAGIC   (0x4c4e524a) /* "JRNL" */
+#define JOURNAL_ENTRIES ((BLOCK_SIZE - 4 * sizeof(uint32_t)) / sizeof(uint32_t)) /* Most blocks in one transaction */
+
+/* Journal Structures */
+
+/**
+ * A transaction is logged as one header block followed by the new contents
+ * of every block it changes, written with a single request to the start of
+ * the journal region.  The checksum covers the header and every block, so a
+ * transaction torn by a crash is never replayed.
+ */
+typedef struct JournalHeader JournalHeader;
+struct JournalHeader {
+    uint32_t magic;                  /* Journal magic number */
+    uint32_t sequence;               /* Sequence number of transaction */
+    uint32_t count;                  /* Number of blocks in transaction */
+    uint32_t checksum;               /* Checksum of header and blocks (taken with this field zero) */
+    uint32_t homes[JOURNAL_ENTRIES]; /* Where each block belongs on disk */
+};
+
+typedef struct JournalEntry JournalEntry;
+struct JournalEntry {
+    uint32_t home;         /* Block number on disk */
+    char data[BLOCK_SIZE]; /* Latest contents of block */
+};
+
+typedef struct Journal Journal;
+struct Journal {
+    uint32_t start;        /* First block of journal region */
+    uint32_t blocks;       /* Number of blocks in journal region */
+    uint32_t capacity;     /* Most blocks logged by one transaction */
+    uint32_t sequence;     /* Sequence number of next transaction */
+    JournalEntry* entries; /* Blocks changed by running transaction */
+    size_t count;          /* Number of entries in use */
+    size_t size;           /* Number of entries allocated */
+    uint32_t* slots;       /* Hash of home block to entry index + 1 (0 if empty) */
+    size_t nslots;         /* Number of hash slots (power of two) */
+    uint32_t* frees;       /* Blocks released by running transaction */
+    size_t nfrees;         /* Number of blocks released */
+    size_t frees_size;     /* Number of releases allocated */
+    size_t commits;        /* Number of transactions logged */
+    pthread_mutex_t lock;  /* Guards entries and frees */
+};
+
+/* Journal Functions */
+
+Journal* journal_create(uint32_t start, uint32_t blocks, uint32_t sequence);
+void journal_delete(Journal* journal);
+
+bool journal_read(Journal* journal, Disk* disk, uint32_t block, char* data);
+bool journal_write(Journal* journal, Disk* disk, uint32_t block, const char* data);
+bool journal_release(Journal* journal, uint32_t block);
+
+bool journal_log(Journal* journal, Disk* disk, const uint32_t* homes, char** images, size_t count);
+bool journal_commit(Journal* journal, Disk* disk, const uint32_t* homes, char** images, size_t count);
+bool journal_replay(Disk* disk, uint32_t start, uint32_t blocks, uint32_t* sequence);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
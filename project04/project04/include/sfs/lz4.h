@@ -0,0 +1,23 @@
+/* lz4.h: SimpleFS LZ4 block compression */
+
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* LZ4 Constants */
+
+#define LZ4_MIN_MATCH (4)      /* Shortest match worth a sequence */
+#define LZ4_MAX_OFFSET (65535) /* Farthest back a match may start */
+#define LZ4_HASH_BITS (12)     /* Positions remembered by the compressor (2^bits) */
+
+/* LZ4 Functions */
+
+size_t lz4_compress(const void* data, size_t length, void* output, size_t capacity);
+ssize_t lz4_decompress(const void* data, size_t length, void* output, size_t capacity);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,90 @@
+/* stats.h: SimpleFS latency histograms and call tracing */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Stats Constants */
+
+#define STATS_BUCKETS (40)        /* Latency buckets (bucket b counts calls under 2^(b+1) ns) */
+#define STATS_TRACE_DEFAULT (4096) /* Trace records kept by stats_trace unless told otherwise */
+
+/* Stats Operations */
+
+typedef enum {
+    STAT_FS_MOUNT,      /* fs_mount */
+    STAT_FS_SYNC,       /* fs_sync */
+    STAT_FS_CREATE,     /* fs_create */
+    STAT_FS_REMOVE,     /* fs_remove */
+    STAT_FS_STAT,       /* fs_stat */
+    STAT_FS_READ,       /* fs_read */
+    STAT_FS_READ_MAP,   /* fs_read_map */
+    STAT_FS_WRITE,      /* fs_write */
+    STAT_DISK_READ,     /* disk_read */
+    STAT_DISK_WRITE,    /* disk_write */
+    STAT_DISK_READV,    /* disk_readv */
+    STAT_DISK_WRITEV,   /* disk_writev */
+    STAT_OPS,           /* Number of operations */
+} StatOp;
+
+/* Stats Structures */
+
+/**
+ * A Histogram counts the calls to one operation by how long they took, in
+ * buckets whose bounds double (so a few dozen cover nanoseconds to
+ * minutes).  Calls that return a negative result count as failures.
+ */
+typedef struct Histogram Histogram;
+struct Histogram {
+    size_t calls;                   /* Number of calls */
+    size_t failures;                /* Number of calls that failed */
+    uint64_t total_ns;              /* Total time spent in calls */
+    uint64_t max_ns;                /* Longest call */
+    size_t buckets[STATS_BUCKETS];  /* Calls taking [2^b, 2^(b+1)) ns (bucket 0 from 0) */
+};
+
+typedef struct TraceRecord TraceRecord;
+struct TraceRecord {
+    uint64_t start_ns;      /* When the call began (CLOCK_MONOTONIC) */
+    uint64_t duration_ns;   /* How long the call took */
+    uint64_t argument;      /* Inode or block number the call was given */
+    int64_t result;         /* What the call returned (negative on failure) */
+    uint32_t op;            /* StatOp of the call */
+    uint32_t thread;        /* Small number identifying the calling thread */
+};
+
+/**
+ * Histograms are always kept (with relaxed atomic updates) unless disabled
+ * by stats_enable; tracing keeps the most recent calls in a ring buffer and
+ * is off until stats_trace starts it.  Every function may be called from
+ * several threads at once.
+ */
+
+/* Stats Functions */
+
+uint64_t stats_start();
+void stats_record(StatOp op, uint64_t start, uint64_t argument, int64_t result);
+void stats_record_duration(StatOp op, uint64_t start, uint64_t duration, uint64_t argument, int64_t result);
+
+void stats_enable(bool enabled);
+bool stats_trace(size_t capacity);
+void stats_reset();
+
+void stats_histogram(StatOp op, Histogram* histogram);
+uint64_t stats_percentile(const Histogram* histogram, double fraction);
+size_t stats_trace_records(TraceRecord* records, size_t count);
+
+const char* stats_op_name(StatOp op);
+bool stats_op_parse(const char* name, StatOp* op);
+
+void stats_dump(FILE* stream);
+void stats_dump_histogram(FILE* stream, StatOp op);
+void stats_dump_trace(FILE* stream, size_t count);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,51 @@
+/* uring.h: SimpleFS io_uring submission queue */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Uring Structure */
+
+typedef struct Uring Uring;
+struct Uring {
+    int fd;                   /* io_uring file descriptor */
+    unsigned entries;         /* Submission queue size (queue depth) */
+    unsigned pending;         /* Requests queued but not yet submitted */
+    unsigned inflight;        /* Requests submitted but not yet completed */
+    size_t failures;          /* Failed or short requests since last drain */
+    size_t submits;           /* Number of io_uring_enter calls */
+
+    unsigned* sq_head;        /* Submission ring head (consumed by kernel) */
+    unsigned* sq_tail;        /* Submission ring tail (produced by us) */
+    unsigned* sq_mask;        /* Submission ring index mask */
+    unsigned* sq_array;       /* Submission ring indices into sqes */
+    struct io_uring_sqe* sqes;/* Submission queue entries */
+
+    unsigned* cq_head;        /* Completion ring head (consumed by us) */
+    unsigned* cq_tail;        /* Completion ring tail (produced by kernel) */
+    unsigned* cq_mask;        /* Completion ring index mask */
+    struct io_uring_cqe* cqes;/* Completion queue entries */
+
+    void* sq_ring;            /* Mapping of submission ring */
+    size_t sq_ring_size;      /* Size of submission ring mapping */
+    void* cq_ring;            /* Mapping of completion ring */
+    size_t cq_ring_size;      /* Size of completion ring mapping */
+    size_t sqes_size;         /* Size of submission entries mapping */
+};
+
+/* Uring Functions */
+
+Uring* uring_create(unsigned entries);
+void uring_delete(Uring* ring);
+
+bool uring_queue(Uring* ring, int fd, bool write, char* data, size_t length, off_t offset);
+bool uring_submit(Uring* ring, unsigned wait);
+bool uring_drain(Uring* ring);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,399 @@
+/* bitmap.c: SimpleFS packed bitmap
+ *
+ * The Bitmap packs one bit per item into 64-bit words so that searches can
+ * skip a whole word of clear bits at a time (using count-trailing-zeros) and
+ * counts can be computed with popcount.  It also keeps a running count of set
+ * bits and a next-fit cursor so that allocation resumes where it left off
+ * rather than rescanning from the beginning.
+ *
+ * The count is updated atomically, so threads may change bits in different
+ * words at the same time (the caller keeps threads out of each other's
+ * words, for instance by splitting the bitmap into word-aligned ranges).
+ **/
+
+#include "sfs/bitmap.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* Internal Macros */
+
+#define WORD_INDEX(bit) ((bit) / BITS_PER_WORD)
+#define WORD_MASK(bit)  (1ULL << ((bit) % BITS_PER_WORD))
+#define COUNT_ADD(bitmap, n) __atomic_fetch_add(&(bitmap)->count, (n), __ATOMIC_RELAXED)
+#define COUNT_SUB(bitmap, n) __atomic_fetch_sub(&(bitmap)->count, (n), __ATOMIC_RELAXED)
+
+/* Internal Prototypes */
+
+size_t bitmap_scan(Bitmap* bitmap, size_t start, size_t end, bool set);
+void bitmap_update_range(Bitmap* bitmap, size_t start, size_t length, bool set);
+
+/* External Functions */
+
+/**
+ * Create a Bitmap with the specified number of bits by doing the following:
+ *
+ *  1. Allocate Bitmap structure and words.
+ *
+ *  2. Set every bit (if requested), leaving the tail of the last word clear
+ *  so searches never return a bit beyond the end.
+ *
+ * @param       bits        Number of bits in bitmap.
+ * @param       set         Whether or not bits start out set.
+ *
+ * @return      Pointer to newly allocated Bitmap structure (NULL on failure).
+ **/
+Bitmap* bitmap_create(size_t bits, bool set) {
+    Bitmap* bitmap = calloc(1, sizeof(Bitmap));
+    if (!bitmap) {
+        fprintf(stderr, "bitmap_create: calloc returned NULL\n");
+        return NULL;
+    }
+
+    bitmap->bits = bits;
+    bitmap->nwords = (bits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    bitmap->words = calloc(bitmap->nwords ? bitmap->nwords : 1, sizeof(uint64_t));
+    if (!bitmap->words) {
+        fprintf(stderr, "bitmap_create: calloc returned NULL\n");
+        free(bitmap);
+        return NULL;
+    }
+
+    if (set && bits) {
+        memset(bitmap->words, 0xff, bitmap->nwords * sizeof(uint64_t));
+        if (bits % BITS_PER_WORD) {
+            bitmap->words[bitmap->nwords - 1] = WORD_MASK(bits) - 1;
+        }
+        bitmap->count = bits;
+    }
+
+    return bitmap;
+}
+
+/**
+ * Release Bitmap structure memory.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ **/
+void bitmap_delete(Bitmap* bitmap) {
+    if (!bitmap) return;
+    free(bitmap->words);
+    free(bitmap);
+}
+
+/**
+ * Test whether specified bit is set.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       bit         Bit to test.
+ *
+ * @return      Whether or not bit is set (false if out of range).
+ **/
+bool bitmap_test(Bitmap* bitmap, size_t bit) {
+    if (bit >= bitmap->bits) return false;
+    return (bitmap->words[WORD_INDEX(bit)] & WORD_MASK(bit)) != 0;
+}
+
+/**
+ * Set specified bit, updating the count of set bits.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       bit         Bit to set (ignored if out of range).
+ **/
+void bitmap_set(Bitmap* bitmap, size_t bit) {
+    if (bit >= bitmap->bits) return;
+
+    uint64_t* word = &bitmap->words[WORD_INDEX(bit)];
+    if (!(*word & WORD_MASK(bit))) {
+        *word |= WORD_MASK(bit);
+        COUNT_ADD(bitmap, 1);
+    }
+}
+
+/**
+ * Clear specified bit, updating the count of set bits.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       bit         Bit to clear (ignored if out of range).
+ **/
+void bitmap_clear(Bitmap* bitmap, size_t bit) {
+    if (bit >= bitmap->bits) return;
+
+    uint64_t* word = &bitmap->words[WORD_INDEX(bit)];
+    if (*word & WORD_MASK(bit)) {
+        *word &= ~WORD_MASK(bit);
+        COUNT_SUB(bitmap, 1);
+    }
+}
+
+/**
+ * Set every bit in the range [start, start + length), updating the count of
+ * set bits.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       start       First bit to set.
+ * @param       length      Number of bits to set (truncated at end).
+ **/
+void bitmap_set_range(Bitmap* bitmap, size_t start, size_t length) {
+    bitmap_update_range(bitmap, start, length, true);
+}
+
+/**
+ * Clear every bit in the range [start, start + length), updating the count
+ * of set bits.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       start       First bit to clear.
+ * @param       length      Number of bits to clear (truncated at end).
+ **/
+void bitmap_clear_range(Bitmap* bitmap, size_t start, size_t length) {
+    bitmap_update_range(bitmap, start, length, false);
+}
+
+/**
+ * Find the first set bit at or after start, wrapping around to the beginning
+ * of the bitmap if necessary.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       start       Bit to begin searching from.
+ *
+ * @return      Index of set bit (-1 if no bits are set).
+ **/
+ssize_t bitmap_find(Bitmap* bitmap, size_t start) {
+    if (bitmap->count == 0) return -1;
+    if (start >= bitmap->bits) start = 0;
+
+    size_t index = WORD_INDEX(start);
+    uint64_t word = bitmap->words[index] & ~(WORD_MASK(start) - 1);
+
+    // Visit every word once, plus the starting word again for the bits before start
+    for (size_t n = 0; n <= bitmap->nwords; n++) {
+        if (word) {
+            return index * BITS_PER_WORD + __builtin_ctzll(word);
+        }
+
+        index = (index + 1) % bitmap->nwords;
+        word = bitmap->words[index];
+    }
+
+    return -1;
+}
+
+/**
+ * Find the first run of at least length consecutive set bits that begins at
+ * or after start, wrapping around to the beginning of the bitmap if
+ * necessary (a run never wraps past the end of the bitmap itself).
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       start       Bit to begin searching from.
+ * @param       length      Number of consecutive set bits required.
+ *
+ * @return      Index of first bit in run (-1 if no such run exists).
+ **/
+ssize_t bitmap_find_run(Bitmap* bitmap, size_t start, size_t length) {
+    if (length == 0 || bitmap->count < length) return -1;
+    if (start >= bitmap->bits) start = 0;
+
+    size_t position = start;
+    bool wrapped = false;
+    while (true) {
+        size_t first = bitmap_scan(bitmap, position, bitmap->bits, true);
+        if (wrapped && first >= start) {
+            return -1;
+        }
+
+        if (first >= bitmap->bits) {
+            if (wrapped) {
+                return -1;
+            }
+            wrapped = true;
+            position = 0;
+            continue;
+        }
+
+        size_t last = bitmap_scan(bitmap, first, bitmap->bits, false);
+        if (last - first >= length) {
+            return first;
+        }
+        position = last;
+    }
+}
+
+/**
+ * Find the first set bit in the range [start, end), without wrapping around.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       start       First bit of range.
+ * @param       end         Bit after range (truncated at end of bitmap).
+ *
+ * @return      Index of set bit (-1 if no bits in range are set).
+ **/
+ssize_t bitmap_find_in(Bitmap* bitmap, size_t start, size_t end) {
+    if (end > bitmap->bits) end = bitmap->bits;
+
+    size_t bit = bitmap_scan(bitmap, start, end, true);
+    return bit < end ? (ssize_t)bit : -1;
+}
+
+/**
+ * Find the first run of at least length consecutive set bits that lies
+ * wholly within the range [start, end), without wrapping around.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       start       First bit of range.
+ * @param       end         Bit after range (truncated at end of bitmap).
+ * @param       length      Number of consecutive set bits required.
+ *
+ * @return      Index of first bit in run (-1 if no such run exists).
+ **/
+ssize_t bitmap_find_run_in(Bitmap* bitmap, size_t start, size_t end, size_t length) {
+    if (end > bitmap->bits) end = bitmap->bits;
+    if (length == 0) return -1;
+
+    size_t position = start;
+    while (position < end && end - position >= length) {
+        size_t first = bitmap_scan(bitmap, position, end, true);
+        if (first >= end) {
+            return -1;
+        }
+
+        size_t last = bitmap_scan(bitmap, first, end, false);
+        if (last - first >= length) {
+            return first;
+        }
+        position = last;
+    }
+
+    return -1;
+}
+
+/**
+ * Count consecutive set bits beginning at start.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       start       First bit of run.
+ *
+ * @return      Length of run (0 if start is clear or out of range).
+ **/
+size_t bitmap_run_length(Bitmap* bitmap, size_t start) {
+    if (!bitmap_test(bitmap, start)) return 0;
+    return bitmap_scan(bitmap, start, bitmap->bits, false) - start;
+}
+
+/**
+ * Count consecutive set bits beginning at start, stopping at end.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       start       First bit of run.
+ * @param       end         Bit at which to stop counting.
+ *
+ * @return      Length of run (0 if start is clear or out of range).
+ **/
+size_t bitmap_run_length_in(Bitmap* bitmap, size_t start, size_t end) {
+    if (end > bitmap->bits) end = bitmap->bits;
+    if (start >= end || !bitmap_test(bitmap, start)) return 0;
+    return bitmap_scan(bitmap, start, end, false) - start;
+}
+
+/**
+ * Find and clear the next set bit using the next-fit cursor, then advance
+ * the cursor past it.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ *
+ * @return      Index of bit that was cleared (-1 if no bits are set).
+ **/
+ssize_t bitmap_allocate(Bitmap* bitmap) {
+    ssize_t bit = bitmap_find(bitmap, bitmap->cursor);
+    if (bit < 0) return -1;
+
+    bitmap_clear(bitmap, bit);
+    bitmap->cursor = bit + 1;
+    return bit;
+}
+
+/**
+ * Recompute the count of set bits from scratch.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ *
+ * @return      Number of set bits.
+ **/
+size_t bitmap_recount(Bitmap* bitmap) {
+    size_t count = 0;
+    for (size_t i = 0; i < bitmap->nwords; i++) {
+        count += __builtin_popcountll(bitmap->words[i]);
+    }
+
+    __atomic_store_n(&bitmap->count, count, __ATOMIC_RELAXED);
+    return count;
+}
+
+/* Internal Functions */
+
+/**
+ * Find the first bit in [start, end) whose value matches set, without
+ * wrapping around, by skipping whole words that cannot match.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       start       Bit to begin scanning from.
+ * @param       end         Bit at which to stop (at most bitmap->bits).
+ * @param       set         Whether to look for a set or a clear bit.
+ *
+ * @return      Index of matching bit (end if there is none).
+ **/
+size_t bitmap_scan(Bitmap* bitmap, size_t start, size_t end, bool set) {
+    size_t position = start;
+    while (position < end) {
+        size_t index = WORD_INDEX(position);
+        uint64_t word = set ? bitmap->words[index] : ~bitmap->words[index];
+        word &= ~(WORD_MASK(position) - 1);
+
+        if (word) {
+            size_t bit = index * BITS_PER_WORD + __builtin_ctzll(word);
+            return bit < end ? bit : end;
+        }
+        position = (index + 1) * BITS_PER_WORD;
+    }
+
+    return end;
+}
+
+/**
+ * Set or clear every bit in the range [start, start + length) a word at a
+ * time, using popcount to keep the count of set bits current.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       start       First bit to update.
+ * @param       length      Number of bits to update (truncated at end).
+ * @param       set         Whether to set or clear the bits.
+ **/
+void bitmap_update_range(Bitmap* bitmap, size_t start, size_t length, bool set) {
+    if (start >= bitmap->bits) return;
+    if (length > bitmap->bits - start) length = bitmap->bits - start;
+
+    size_t position = start;
+    size_t end = start + length;
+    while (position < end) {
+        size_t index = WORD_INDEX(position);
+        size_t word_end = (index + 1) * BITS_PER_WORD;
+        if (word_end > end) word_end = end;
+
+        uint64_t mask = ~(WORD_MASK(position) - 1);
+        if (word_end % BITS_PER_WORD) {
+            mask &= WORD_MASK(word_end) - 1;
+        }
+
+        uint64_t* word = &bitmap->words[index];
+        if (set) {
+            COUNT_ADD(bitmap, __builtin_popcountll(~*word & mask));
+            *word |= mask;
+        } else {
+            COUNT_SUB(bitmap, __builtin_popcountll(*word & mask));
+            *word &= ~mask;
+        }
+        position = word_end;
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
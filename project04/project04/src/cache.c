@@ -0,0 +1,222 @@
+/* cache.c: SimpleFS block cache
+ *
+ * The Cache is a fixed-size pool of block-sized entries indexed by a hash
+ * table on block number and ordered by a doubly-linked circular LRU list
+ * (most recently used at the front).  It only manages memory; the Disk
+ * decides when entries are filled from or written back to the disk image.
+ **/
+
+#include "sfs/cache.h"
+
+#include <string.h>
+
+#include "sfs/logging.h"
+
+/* Internal Prototypes */
+
+size_t cache_hash(Cache* cache, size_t block);
+void cache_unlink(CacheEntry* entry);
+void cache_push_front(Cache* cache, CacheEntry* entry);
+void cache_unchain(Cache* cache, CacheEntry* entry);
+
+/* External Functions */
+
+/**
+ * Create a Cache that can hold the specified number of blocks by doing the
+ * following:
+ *
+ *  1. Allocate Cache structure, entries, and hash buckets.
+ *
+ *  2. Place every (invalid) entry on the LRU list.
+ *
+ * @param       capacity    Number of blocks to cache.
+ *
+ * @return      Pointer to newly allocated Cache structure (NULL on failure).
+ **/
+Cache* cache_create(size_t capacity) {
+    if (capacity == 0) return NULL;
+
+    Cache* cache = calloc(1, sizeof(Cache));
+    if (!cache) {
+        fprintf(stderr, "cache_create: calloc returned NULL\n");
+        return NULL;
+    }
+
+    cache->capacity = capacity;
+    cache->nbuckets = 1;
+    while (cache->nbuckets < capacity) {
+        cache->nbuckets <<= 1;
+    }
+
+    cache->entries = calloc(capacity, sizeof(CacheEntry));
+    cache->buckets = calloc(cache->nbuckets, sizeof(CacheEntry*));
+    if (!cache->entries || !cache->buckets) {
+        fprintf(stderr, "cache_create: calloc returned NULL\n");
+        cache_delete(cache);
+        return NULL;
+    }
+
+    cache->lru.next = &cache->lru;
+    cache->lru.prev = &cache->lru;
+    for (size_t i = 0; i < capacity; i++) {
+        cache_push_front(cache, &cache->entries[i]);
+    }
+
+    return cache;
+}
+
+/**
+ * Release Cache structure memory.
+ *
+ * Note: Dirty entries are discarded; flush them through the Disk first.
+ *
+ * @param       cache       Pointer to Cache structure.
+ **/
+void cache_delete(Cache* cache) {
+    if (!cache) return;
+    free(cache->entries);
+    free(cache->buckets);
+    free(cache);
+}
+
+/**
+ * Search Cache for specified block and, if found, mark it most recently
+ * used.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       block       Block number to search for.
+ *
+ * @return      Pointer to entry holding block (NULL if not cached).
+ **/
+CacheEntry* cache_lookup(Cache* cache, size_t block) {
+    for (CacheEntry* curr = cache->buckets[cache_hash(cache, block)]; curr; curr = curr->chain) {
+        if (curr->block == block) {
+            cache_unlink(curr);
+            cache_push_front(cache, curr);
+            return curr;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Return the entry that should be reused for a new block: the least recently
+ * used entry (invalid entries naturally collect at the back of the list).
+ *
+ * Note: The caller is responsible for writing back the entry if it is dirty
+ * before calling cache_assign.
+ *
+ * @param       cache       Pointer to Cache structure.
+ *
+ * @return      Pointer to entry to reuse.
+ **/
+CacheEntry* cache_victim(Cache* cache) {
+    return cache->lru.prev;
+}
+
+/**
+ * Assign entry to hold specified block by doing the following:
+ *
+ *  1. Remove entry from the hash bucket of its previous block.
+ *
+ *  2. Insert entry into the hash bucket of the new block.
+ *
+ *  3. Mark entry as clean and most recently used.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       entry       Entry to assign (usually from cache_victim).
+ * @param       block       Block number entry will now hold.
+ **/
+void cache_assign(Cache* cache, CacheEntry* entry, size_t block) {
+    if (entry->valid) {
+        cache_unchain(cache, entry);
+    }
+
+    size_t bucket = cache_hash(cache, block);
+    entry->block = block;
+    entry->valid = true;
+    entry->dirty = false;
+    entry->chain = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+
+    cache_unlink(entry);
+    cache_push_front(cache, entry);
+}
+
+/**
+ * Drop entry from Cache and move it to the back of the LRU list so it is
+ * reused first.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       entry       Entry to invalidate.
+ **/
+void cache_invalidate(Cache* cache, CacheEntry* entry) {
+    if (!entry->valid) return;
+
+    cache_unchain(cache, entry);
+    entry->valid = false;
+    entry->dirty = false;
+
+    cache_unlink(entry);
+    entry->next = &cache->lru;
+    entry->prev = cache->lru.prev;
+    cache->lru.prev->next = entry;
+    cache->lru.prev = entry;
+}
+
+/* Internal Functions */
+
+/**
+ * Compute hash bucket for specified block.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       block       Block number.
+ *
+ * @return      Index into hash buckets.
+ **/
+size_t cache_hash(Cache* cache, size_t block) {
+    return (block * 2654435761UL) & (cache->nbuckets - 1);
+}
+
+/**
+ * Remove entry from LRU list.
+ *
+ * @param       entry       Entry to remove.
+ **/
+void cache_unlink(CacheEntry* entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+}
+
+/**
+ * Insert entry at the front (most recently used end) of LRU list.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       entry       Entry to insert.
+ **/
+void cache_push_front(Cache* cache, CacheEntry* entry) {
+    entry->prev = &cache->lru;
+    entry->next = cache->lru.next;
+    cache->lru.next->prev = entry;
+    cache->lru.next = entry;
+}
+
+/**
+ * Remove entry from the hash bucket of the block it currently holds.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       entry       Entry to remove.
+ **/
+void cache_unchain(Cache* cache, CacheEntry* entry) {
+    CacheEntry** link = &cache->buckets[cache_hash(cache, entry->block)];
+    while (*link && *link != entry) {
+        link = &(*link)->chain;
+    }
+    if (*link) {
+        *link = entry->chain;
+    }
+    entry->chain = NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,204 @@
+/* crc32c.c: SimpleFS CRC32C checksums
+ *
+ * CRC32C (the Castagnoli polynomial used by iSCSI, ext4, and btrfs) has
+ * instructions of its own on x86 processors with SSE4.2 and on ARMv8
+ * processors with the CRC extension, which checksum eight bytes at a time.
+ * The first call picks the instructions if the processor has them and falls
+ * back to a table-driven (slicing-by-8) loop otherwise; both give the same
+ * results.
+ **/
+
+#include "sfs/crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+/* Internal Prototypes */
+
+void crc32c_init();
+uint32_t crc32c_instructions(uint32_t crc, const unsigned char* data, size_t length);
+
+/* Internal Variables */
+
+pthread_once_t Crc32cOnce = PTHREAD_ONCE_INIT;
+uint32_t Crc32cTable[8][256];   /* Slicing-by-8 tables (Table[0] is the byte-wise table) */
+bool Crc32cHardware = false;    /* Whether or not the processor has CRC32C instructions */
+
+/* External Functions */
+
+/**
+ * Extend a CRC32C checksum over a buffer (start with a crc of 0).
+ *
+ * @param       crc         Checksum of the data before this buffer.
+ * @param       data        Buffer to checksum.
+ * @param       length      Number of bytes in buffer.
+ *
+ * @return      Checksum of the data including this buffer.
+ **/
+uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+    pthread_once(&Crc32cOnce, crc32c_init);
+    if (Crc32cHardware) {
+        return ~crc32c_instructions(~crc, data, length);
+    }
+    return crc32c_software(crc, data, length);
+}
+
+/**
+ * Extend a CRC32C checksum over a buffer without the CRC32C instructions,
+ * eight bytes at a time.
+ *
+ * @param       crc         Checksum of the data before this buffer.
+ * @param       data        Buffer to checksum.
+ * @param       length      Number of bytes in buffer.
+ *
+ * @return      Checksum of the data including this buffer.
+ **/
+uint32_t crc32c_software(uint32_t crc, const void* data, size_t length) {
+    pthread_once(&Crc32cOnce, crc32c_init);
+
+    const unsigned char* bytes = data;
+    uint32_t value = ~crc;
+    while (length >= 8) {
+        uint32_t low, high;
+        memcpy(&low, bytes, sizeof(low));
+        memcpy(&high, bytes + 4, sizeof(high));
+        low ^= value;
+        value = Crc32cTable[7][low & 0xff] ^ Crc32cTable[6][(low >> 8) & 0xff] ^
+                Crc32cTable[5][(low >> 16) & 0xff] ^ Crc32cTable[4][low >> 24] ^
+                Crc32cTable[3][high & 0xff] ^ Crc32cTable[2][(high >> 8) & 0xff] ^
+                Crc32cTable[1][(high >> 16) & 0xff] ^ Crc32cTable[0][high >> 24];
+        bytes += 8;
+        length -= 8;
+    }
+
+    while (length--) {
+        value = Crc32cTable[0][(value ^ *bytes++) & 0xff] ^ (value >> 8);
+    }
+    return ~value;
+}
+
+/**
+ * Report whether crc32c uses the processor's CRC32C instructions.
+ *
+ * @return      Whether or not the CRC32C instructions are in use.
+ **/
+bool crc32c_hardware() {
+    pthread_once(&Crc32cOnce, crc32c_init);
+    return Crc32cHardware;
+}
+
+/* Internal Functions */
+
+/**
+ * Build the slicing-by-8 tables and check for the CRC32C instructions (run
+ * once).
+ **/
+void crc32c_init() {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t value = n;
+        for (int k = 0; k < 8; k++) {
+            value = (value & 1) ? (value >> 1) ^ CRC32C_POLYNOMIAL : value >> 1;
+        }
+        Crc32cTable[0][n] = value;
+    }
+
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t previous = Crc32cTable[t - 1][n];
+            Crc32cTable[t][n] = Crc32cTable[0][previous & 0xff] ^ (previous >> 8);
+        }
+    }
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    Crc32cHardware = __builtin_cpu_supports("sse4.2");
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    Crc32cHardware = true;
+#endif
+}
+
+#if defined(__x86_64__)
+
+/**
+ * Extend a raw (uninverted) CRC32C over a buffer with the SSE4.2 crc32
+ * instruction, eight bytes at a time once the buffer is aligned.
+ *
+ * @param       crc         Raw checksum of the data before this buffer.
+ * @param       data        Buffer to checksum.
+ * @param       length      Number of bytes in buffer.
+ *
+ * @return      Raw checksum of the data including this buffer.
+ **/
+__attribute__((target("sse4.2")))
+uint32_t crc32c_instructions(uint32_t crc, const unsigned char* data, size_t length) {
+    while (length > 0 && ((uintptr_t)data & 7)) {
+        crc = __builtin_ia32_crc32qi(crc, *data++);
+        length--;
+    }
+
+    uint64_t value = crc;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        value = __builtin_ia32_crc32di(value, word);
+        data += 8;
+        length -= 8;
+    }
+
+    crc = value;
+    while (length--) {
+        crc = __builtin_ia32_crc32qi(crc, *data++);
+    }
+    return crc;
+}
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+
+/**
+ * Extend a raw (uninverted) CRC32C over a buffer with the ARMv8 crc32c
+ * instructions, eight bytes at a time.
+ *
+ * @param       crc         Raw checksum of the data before this buffer.
+ * @param       data        Buffer to checksum.
+ * @param       length      Number of bytes in buffer.
+ *
+ * @return      Raw checksum of the data including this buffer.
+ **/
+uint32_t crc32c_instructions(uint32_t crc, const unsigned char* data, size_t length) {
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+        data += 8;
+        length -= 8;
+    }
+
+    while (length--) {
+        crc = __crc32cb(crc, *data++);
+    }
+    return crc;
+}
+
+#else
+
+/**
+ * Stand-in for the CRC32C instructions on processors without them (never
+ * called, since crc32c_init leaves Crc32cHardware false).
+ *
+ * @param       crc         Raw checksum of the data before this buffer.
+ * @param       data        Buffer to checksum.
+ * @param       length      Number of bytes in buffer.
+ *
+ * @return      Raw checksum of the data including this buffer.
+ **/
+uint32_t crc32c_instructions(uint32_t crc, const unsigned char* data, size_t length) {
+    return ~crc32c_software(~crc, data, length);
+}
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,199 @@
+/* dedup.c: SimpleFS block deduplication index
+ *
+ * The DedupIndex is a flat array of (hash, block) slots searched by linear
+ * probing from the slot the hash falls in.  It doubles whenever it would be
+ * more than half full, and a removal shifts the rest of its probe run back
+ * instead of leaving a tombstone, so lookups never slow down as blocks come
+ * and go.
+ **/
+
+#include "sfs/dedup.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* Internal Prototypes */
+
+size_t dedup_slot(DedupIndex* index, uint32_t hash);
+bool dedup_grow(DedupIndex* index);
+
+/* External Functions */
+
+/**
+ * Create an empty DedupIndex with room for about the specified number of
+ * blocks before it has to grow.
+ *
+ * @param       capacity    Number of blocks expected.
+ *
+ * @return      Pointer to newly allocated DedupIndex (NULL on failure).
+ **/
+DedupIndex* dedup_create(size_t capacity) {
+    DedupIndex* index = calloc(1, sizeof(DedupIndex));
+    if (!index) {
+        fprintf(stderr, "dedup_create: calloc returned NULL\n");
+        return NULL;
+    }
+
+    index->capacity = DEDUP_INDEX_MIN;
+    while (index->capacity < 2 * capacity) {
+        index->capacity <<= 1;
+    }
+
+    index->entries = calloc(index->capacity, sizeof(DedupEntry));
+    if (!index->entries) {
+        fprintf(stderr, "dedup_create: calloc returned NULL\n");
+        free(index);
+        return NULL;
+    }
+
+    return index;
+}
+
+/**
+ * Release DedupIndex structure memory.
+ *
+ * @param       index       Pointer to DedupIndex structure.
+ **/
+void dedup_delete(DedupIndex* index) {
+    if (!index) return;
+    free(index->entries);
+    free(index);
+}
+
+/**
+ * Record that a block holds contents with the specified hash (growing the
+ * index first if it is half full).
+ *
+ * @param       index       Pointer to DedupIndex structure.
+ * @param       hash        Hash of block contents.
+ * @param       block       Block number (not 0).
+ *
+ * @return      Whether or not the block was added.
+ **/
+bool dedup_insert(DedupIndex* index, uint32_t hash, uint32_t block) {
+    if (block == 0 || (2 * (index->count + 1) > index->capacity && !dedup_grow(index))) {
+        return false;
+    }
+
+    size_t slot = dedup_slot(index, hash);
+    while (index->entries[slot].block) {
+        slot = (slot + 1) & (index->capacity - 1);
+    }
+
+    index->entries[slot] = (DedupEntry){.hash = hash, .block = block};
+    index->count++;
+    return true;
+}
+
+/**
+ * Remove a block from the index by doing the following:
+ *
+ *  1. Find its slot along the probe run of its hash.
+ *
+ *  2. Move every later entry of the run that may live there back into the
+ *  hole, so no run is ever broken.
+ *
+ * @param       index       Pointer to DedupIndex structure.
+ * @param       hash        Hash the block was added with.
+ * @param       block       Block number.
+ *
+ * @return      Whether or not the block was found.
+ **/
+bool dedup_remove(DedupIndex* index, uint32_t hash, uint32_t block) {
+    size_t mask = index->capacity - 1;
+    size_t hole = dedup_slot(index, hash);
+    while (index->entries[hole].block && (index->entries[hole].block != block || index->entries[hole].hash != hash)) {
+        hole = (hole + 1) & mask;
+    }
+    if (!index->entries[hole].block) {
+        return false;
+    }
+
+    for (size_t next = (hole + 1) & mask; index->entries[next].block; next = (next + 1) & mask) {
+        // An entry stays put if its home slot lies after the hole (cyclically) and at or before it
+        size_t home = dedup_slot(index, index->entries[next].hash);
+        bool stays = hole <= next ? (hole < home && home <= next) : (hole < home || home <= next);
+        if (!stays) {
+            index->entries[hole] = index->entries[next];
+            hole = next;
+        }
+    }
+
+    index->entries[hole] = (DedupEntry){0};
+    index->count--;
+    return true;
+}
+
+/**
+ * Find a block recorded with the specified hash.
+ *
+ * @param       index       Pointer to DedupIndex structure.
+ * @param       hash        Hash of contents wanted.
+ *
+ * @return      Block number (0 if none has that hash).
+ **/
+uint32_t dedup_lookup(DedupIndex* index, uint32_t hash) {
+    for (size_t slot = dedup_slot(index, hash); index->entries[slot].block; slot = (slot + 1) & (index->capacity - 1)) {
+        if (index->entries[slot].hash == hash) {
+            return index->entries[slot].block;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Remove every block from the index (keeping its slots).
+ *
+ * @param       index       Pointer to DedupIndex structure.
+ **/
+void dedup_clear(DedupIndex* index) {
+    memset(index->entries, 0, index->capacity * sizeof(DedupEntry));
+    index->count = 0;
+}
+
+/* Internal Functions */
+
+/**
+ * Compute the slot where the probe run of a hash begins.
+ *
+ * @param       index       Pointer to DedupIndex structure.
+ * @param       hash        Hash of block contents.
+ *
+ * @return      Index into slots.
+ **/
+size_t dedup_slot(DedupIndex* index, uint32_t hash) {
+    return (hash * 2654435761UL) & (index->capacity - 1);
+}
+
+/**
+ * Double the number of slots, adding every entry again.
+ *
+ * @param       index       Pointer to DedupIndex structure.
+ *
+ * @return      Whether or not the slots could be allocated.
+ **/
+bool dedup_grow(DedupIndex* index) {
+    DedupEntry* old = index->entries;
+    size_t capacity = index->capacity;
+
+    index->entries = calloc(2 * capacity, sizeof(DedupEntry));
+    if (!index->entries) {
+        fprintf(stderr, "dedup_grow: calloc returned NULL\n");
+        index->entries = old;
+        return false;
+    }
+
+    index->capacity = 2 * capacity;
+    index->count = 0;
+    for (size_t i = 0; i < capacity; i++) {
+        if (old[i].block) {
+            dedup_insert(index, old[i].hash, old[i].block);
+        }
+    }
+
+    free(old);
+    return true;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,691 @@
+/* dir.c: SimpleFS directories and path names
+ *
+ * Directories are ordinary files (see DirHeader in dir.h) read and written
+ * a whole block at a time through fs_read and fs_write, so they need no
+ * support from the file system beyond recording where the root directory
+ * lives.  Path names are resolved one component at a time from the root,
+ * with the dentry cache answering most lookups without reading a directory.
+ **/
+
+#include "sfs/dir.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sfs/logging.h"
+
+/* Internal Structures */
+
+typedef union DirPage DirPage;
+union DirPage {
+    DirHeader header;      /* View block as directory header */
+    DirBlock block;        /* View block as bucket or overflow block */
+    char data[BLOCK_SIZE]; /* View block as data */
+};
+
+/* Internal Prototypes */
+
+ssize_t dir_add(DirTree* tree, const char* path, EntryType type);
+bool dir_split(const char* path, size_t* end, const char** name, size_t* length);
+bool dir_resolve(DirTree* tree, const char* path, size_t end, DirEntry* result);
+bool dir_find(DirTree* tree, uint32_t dir, const char* name, size_t length, DirEntry* entry);
+bool dir_init(FileSystem* fs, uint32_t dir, uint32_t parent);
+bool dir_insert(FileSystem* fs, uint32_t dir, const DirEntry* entry);
+bool dir_erase(FileSystem* fs, uint32_t dir, const char* name, size_t length);
+bool dir_grow(FileSystem* fs, uint32_t dir, DirHeader* header);
+bool dir_read(FileSystem* fs, uint32_t dir, uint32_t index, uint32_t count, DirPage* pages);
+bool dir_write(FileSystem* fs, uint32_t dir, uint32_t index, uint32_t count, DirPage* pages);
+bool dir_header(FileSystem* fs, uint32_t dir, DirPage* page);
+bool dir_matches(const DirEntry* entry, const char* name, size_t length);
+uint32_t dir_hash(const char* name, size_t length);
+Dentry* dcache_slot(DirTree* tree, uint32_t parent, const char* name, size_t length);
+
+/* External Functions */
+
+/**
+ * Open the directory tree of a mounted FileSystem by doing the following:
+ *
+ *  1. Find the root directory, creating an empty one (and recording it in
+ *  the superblock) if the FileSystem has none yet.
+ *
+ *  2. Allocate DirTree structure and dentry cache.
+ *
+ * @param       fs          Pointer to mounted FileSystem structure.
+ *
+ * @return      Pointer to newly allocated DirTree structure (NULL on failure).
+ **/
+DirTree* dir_open(FileSystem* fs) {
+    ssize_t root = fs_root(fs);
+    if (root < 0) {
+        root = fs_create(fs);
+        if (root < 0) {
+            fprintf(stderr, "dir_open: couldn't create root directory\n");
+            return NULL;
+        }
+        if (!dir_init(fs, root, root) || !fs_set_root(fs, root)) {
+            fprintf(stderr, "dir_open: couldn't record root directory\n");
+            fs_remove(fs, root);
+            return NULL;
+        }
+    }
+
+    DirPage page;
+    if (!dir_header(fs, root, &page)) {
+        fprintf(stderr, "dir_open: inode %ld is not a directory\n", root);
+        return NULL;
+    }
+
+    DirTree* tree = calloc(1, sizeof(DirTree));
+    if (!tree) {
+        fprintf(stderr, "dir_open: calloc returned NULL\n");
+        return NULL;
+    }
+
+    tree->dentries = calloc(DCACHE_ENTRIES, sizeof(Dentry));
+    if (!tree->dentries) {
+        fprintf(stderr, "dir_open: calloc returned NULL\n");
+        free(tree);
+        return NULL;
+    }
+
+    tree->fs = fs;
+    tree->root = root;
+    pthread_mutex_init(&tree->lock, NULL);
+    return tree;
+}
+
+/**
+ * Release DirTree structure memory (the directories stay on disk).
+ *
+ * @param       tree        Pointer to DirTree structure.
+ **/
+void dir_close(DirTree* tree) {
+    if (!tree) return;
+
+    pthread_mutex_destroy(&tree->lock);
+    free(tree->dentries);
+    free(tree);
+}
+
+/**
+ * Resolve a path name to an Inode.
+ *
+ * @param       tree        Pointer to DirTree structure.
+ * @param       path        Path name (from the root directory).
+ * @param       type        Set to the EntryType of the Inode (may be NULL).
+ *
+ * @return      Inode number (-1 if the path does not exist).
+ **/
+ssize_t dir_lookup(DirTree* tree, const char* path, EntryType* type) {
+    pthread_mutex_lock(&tree->lock);
+    DirEntry entry;
+    bool found = dir_resolve(tree, path, strlen(path), &entry);
+    pthread_mutex_unlock(&tree->lock);
+
+    if (!found) {
+        return -1;
+    }
+    if (type) {
+        *type = entry.type;
+    }
+    return entry.inode_number;
+}
+
+/**
+ * Create an empty file at a path name (its parent directory must exist).
+ *
+ * @param       tree        Pointer to DirTree structure.
+ * @param       path        Path name of new file.
+ *
+ * @return      Inode number of new file (-1 on failure or if the name exists).
+ **/
+ssize_t dir_create(DirTree* tree, const char* path) {
+    return dir_add(tree, path, ENTRY_FILE);
+}
+
+/**
+ * Create an empty directory at a path name (its parent directory must
+ * exist).
+ *
+ * @param       tree        Pointer to DirTree structure.
+ * @param       path        Path name of new directory.
+ *
+ * @return      Inode number of new directory (-1 on failure or if the name
+ *              exists).
+ **/
+ssize_t dir_mkdir(DirTree* tree, const char* path) {
+    return dir_add(tree, path, ENTRY_DIRECTORY);
+}
+
+/**
+ * Remove a file or empty directory by doing the following:
+ *
+ *  1. Find the entry in its parent directory (a directory must be empty).
+ *
+ *  2. Remove the entry from the parent and from the dentry cache.
+ *
+ *  3. Remove the Inode and its data.
+ *
+ * @param       tree        Pointer to DirTree structure.
+ * @param       path        Path name to remove.
+ *
+ * @return      Whether or not the path was removed.
+ **/
+bool dir_unlink(DirTree* tree, const char* path) {
+    size_t end, length;
+    const char* name;
+    if (!dir_split(path, &end, &name, &length)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&tree->lock);
+    FileSystem* fs = tree->fs;
+    DirEntry parent, entry;
+    DirPage page;
+    bool success = dir_resolve(tree, path, end, &parent) &&
+                   parent.type == ENTRY_DIRECTORY &&
+                   dir_find(tree, parent.inode_number, name, length, &entry);
+
+    if (success && entry.type == ENTRY_DIRECTORY) {
+        success = dir_header(fs, entry.inode_number, &page) && page.header.entries == 0;
+    }
+
+    if (success) {
+        Dentry* dentry = dcache_slot(tree, parent.inode_number, name, length);
+        if (dentry->valid && dentry->parent == parent.inode_number && dir_matches(&dentry->entry, name, length)) {
+            dentry->valid = false;
+        }
+        success = dir_erase(fs, parent.inode_number, name, length) && fs_remove(fs, entry.inode_number);
+    }
+
+    pthread_mutex_unlock(&tree->lock);
+    return success;
+}
+
+/**
+ * List the entries of a directory.
+ *
+ * @param       tree        Pointer to DirTree structure.
+ * @param       path        Path name of directory.
+ * @param       entries     Set to a newly allocated array of entries (which
+ *                          the caller must free).
+ *
+ * @return      Number of entries (-1 on failure or if path is not a
+ *              directory).
+ **/
+ssize_t dir_list(DirTree* tree, const char* path, DirEntry** entries) {
+    pthread_mutex_lock(&tree->lock);
+    FileSystem* fs = tree->fs;
+    DirEntry dir;
+    DirPage header;
+    DirPage* pages = NULL;
+    ssize_t count = -1;
+
+    if (dir_resolve(tree, path, strlen(path), &dir) && dir.type == ENTRY_DIRECTORY &&
+        dir_header(fs, dir.inode_number, &header)) {
+        pages = calloc(header.header.blocks, sizeof(DirPage));
+        *entries = calloc(header.header.entries + 1, sizeof(DirEntry));
+        if (pages && *entries && dir_read(fs, dir.inode_number, 0, header.header.blocks, pages)) {
+            count = 0;
+            for (uint32_t b = 1; b < header.header.blocks; b++) {
+                for (uint32_t i = 0; i < pages[b].block.count && count < header.header.entries; i++) {
+                    (*entries)[count++] = pages[b].block.entries[i];
+                }
+            }
+        } else {
+            free(*entries);
+            *entries = NULL;
+        }
+    }
+
+    free(pages);
+    pthread_mutex_unlock(&tree->lock);
+    return count;
+}
+
+/* Internal Functions */
+
+/**
+ * Create a file or directory at a path name by doing the following:
+ *
+ *  1. Resolve the parent directory and check the name is not taken.
+ *
+ *  2. Allocate an Inode (and write an empty directory to it).
+ *
+ *  3. Insert the entry into the parent and the dentry cache.
+ *
+ * @param       tree        Pointer to DirTree structure.
+ * @param       path        Path name to create.
+ * @param       type        EntryType to create.
+ *
+ * @return      Inode number (-1 on failure).
+ **/
+ssize_t dir_add(DirTree* tree, const char* path, EntryType type) {
+    size_t end, length;
+    const char* name;
+    if (!dir_split(path, &end, &name, &length)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&tree->lock);
+    FileSystem* fs = tree->fs;
+    DirEntry parent, entry;
+    ssize_t inode_number = -1;
+    if (dir_resolve(tree, path, end, &parent) && parent.type == ENTRY_DIRECTORY &&
+        !dir_find(tree, parent.inode_number, name, length, &entry)) {
+        inode_number = fs_create(fs);
+    }
+
+    if (inode_number >= 0) {
+        entry = (DirEntry){.inode_number = inode_number, .type = type, .length = length};
+        memcpy(entry.name, name, length);
+
+        if ((type == ENTRY_DIRECTORY && !dir_init(fs, inode_number, parent.inode_number)) ||
+            !dir_insert(fs, parent.inode_number, &entry)) {
+            fs_remove(fs, inode_number);
+            inode_number = -1;
+        } else {
+            Dentry* dentry = dcache_slot(tree, parent.inode_number, name, length);
+            *dentry = (Dentry){.valid = true, .parent = parent.inode_number, .entry = entry};
+        }
+    }
+
+    pthread_mutex_unlock(&tree->lock);
+    return inode_number;
+}
+
+/**
+ * Split a path name into its parent (everything before the last component)
+ * and its last component, ignoring trailing slashes.
+ *
+ * @param       path        Path name.
+ * @param       end         Set to the length of the parent part of path.
+ * @param       name        Set to the start of the last component.
+ * @param       length      Set to the length of the last component.
+ *
+ * @return      Whether or not the last component is a valid name (not
+ *              empty, ".", "..", or longer than DIR_NAME_MAX).
+ **/
+bool dir_split(const char* path, size_t* end, const char** name, size_t* length) {
+    size_t last = strlen(path);
+    while (last > 0 && path[last - 1] == '/') {
+        last--;
+    }
+
+    size_t first = last;
+    while (first > 0 && path[first - 1] != '/') {
+        first--;
+    }
+
+    *end = first;
+    *name = path + first;
+    *length = last - first;
+    if (*length == 0 || *length > DIR_NAME_MAX) {
+        return false;
+    }
+    return !(dir_matches(&(DirEntry){.length = 1, .name = "."}, *name, *length) ||
+             dir_matches(&(DirEntry){.length = 2, .name = ".."}, *name, *length));
+}
+
+/**
+ * Resolve the first end characters of a path name by walking it one
+ * component at a time from the root directory ("." stays put and ".."
+ * moves to the parent directory).
+ *
+ * @param       tree        Pointer to DirTree structure.
+ * @param       path        Path name.
+ * @param       end         Number of characters of path to resolve.
+ * @param       result      Set to the entry the path names.
+ *
+ * @return      Whether or not every component was found.
+ **/
+bool dir_resolve(DirTree* tree, const char* path, size_t end, DirEntry* result) {
+    DirEntry current = {.inode_number = tree->root, .type = ENTRY_DIRECTORY};
+    const char* stop = path + end;
+    const char* next = path;
+
+    while (next < stop) {
+        while (next < stop && *next == '/') {
+            next++;
+        }
+
+        const char* name = next;
+        while (next < stop && *next != '/') {
+            next++;
+        }
+
+        size_t length = next - name;
+        if (length == 0 || (length == 1 && name[0] == '.')) {
+            continue;
+        }
+
+        if (current.type != ENTRY_DIRECTORY) {
+            return false;
+        }
+
+        if (length == 2 && name[0] == '.' && name[1] == '.') {
+            DirPage page;
+            if (!dir_header(tree->fs, current.inode_number, &page)) {
+                return false;
+            }
+            current = (DirEntry){.inode_number = page.header.parent, .type = ENTRY_DIRECTORY};
+        } else if (!dir_find(tree, current.inode_number, name, length, &current)) {
+            return false;
+        }
+    }
+
+    *result = current;
+    return true;
+}
+
+/**
+ * Find a name in a directory, checking the dentry cache before reading the
+ * name's bucket chain (and caching what is found).
+ *
+ * @param       tree        Pointer to DirTree structure.
+ * @param       dir         Inode of directory.
+ * @param       name        Name to find.
+ * @param       length      Length of name.
+ * @param       entry       Set to the entry found.
+ *
+ * @return      Whether or not the name was found.
+ **/
+bool dir_find(DirTree* tree, uint32_t dir, const char* name, size_t length, DirEntry* entry) {
+    if (length > DIR_NAME_MAX) {
+        return false;
+    }
+
+    Dentry* dentry = dcache_slot(tree, dir, name, length);
+    if (dentry->valid && dentry->parent == dir && dir_matches(&dentry->entry, name, length)) {
+        tree->hits++;
+        *entry = dentry->entry;
+        return true;
+    }
+    tree->misses++;
+
+    DirPage header, page;
+    if (!dir_header(tree->fs, dir, &header)) {
+        return false;
+    }
+
+    uint32_t index = 1 + dir_hash(name, length) % header.header.buckets;
+    while (index && index < header.header.blocks && dir_read(tree->fs, dir, index, 1, &page)) {
+        for (uint32_t i = 0; i < page.block.count && i < DIR_BLOCK_ENTRIES; i++) {
+            if (dir_matches(&page.block.entries[i], name, length)) {
+                *entry = page.block.entries[i];
+                *dentry = (Dentry){.valid = true, .parent = dir, .entry = *entry};
+                return true;
+            }
+        }
+        index = page.block.next;
+    }
+
+    return false;
+}
+
+/**
+ * Write an empty directory (a header and one empty bucket) to an Inode.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       dir         Inode of new directory.
+ * @param       parent      Inode of parent directory.
+ *
+ * @return      Whether or not the directory was written.
+ **/
+bool dir_init(FileSystem* fs, uint32_t dir, uint32_t parent) {
+    DirPage pages[2] = {{{0}}};
+    pages[0].header = (DirHeader){
+        .magic = DIR_MAGIC,
+        .parent = parent,
+        .buckets = 1,
+        .blocks = 2,
+    };
+    return dir_write(fs, dir, 0, 2, pages);
+}
+
+/**
+ * Insert an entry into a directory by doing the following:
+ *
+ *  1. Walk the bucket chain for the name, checking it is not taken and
+ *  finding the first block with room.
+ *
+ *  2. If every block in the chain is full, link a new overflow block to the
+ *  end of the chain.
+ *
+ *  3. Add the entry and update the header, doubling the buckets if they are
+ *  now too full.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       dir         Inode of directory.
+ * @param       entry       Entry to insert.
+ *
+ * @return      Whether or not the entry was inserted.
+ **/
+bool dir_insert(FileSystem* fs, uint32_t dir, const DirEntry* entry) {
+    DirPage header, page, room;
+    if (!dir_header(fs, dir, &header)) {
+        return false;
+    }
+
+    uint32_t index = 1 + dir_hash(entry->name, entry->length) % header.header.buckets;
+    uint32_t last = index;
+    uint32_t target = 0;
+    while (index) {
+        if (!dir_read(fs, dir, index, 1, &page)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < page.block.count; i++) {
+            if (dir_matches(&page.block.entries[i], entry->name, entry->length)) {
+                return false;
+            }
+        }
+        if (!target && page.block.count < DIR_BLOCK_ENTRIES) {
+            target = index;
+            room = page;
+        }
+        last = index;
+        index = page.block.next;
+    }
+
+    // Chain a new overflow block after the last (full) block
+    if (!target) {
+        target = header.header.blocks++;
+        page.block.next = target;
+        if (!dir_write(fs, dir, last, 1, &page)) {
+            return false;
+        }
+        memset(&room, 0, sizeof(room));
+    }
+
+    room.block.entries[room.block.count++] = *entry;
+    if (!dir_write(fs, dir, target, 1, &room)) {
+        return false;
+    }
+
+    header.header.entries++;
+    if ((uint64_t)header.header.entries * 100 > (uint64_t)header.header.buckets * DIR_BLOCK_ENTRIES * DIR_LOAD_PERCENT) {
+        return dir_grow(fs, dir, &header.header);
+    }
+    return dir_write(fs, dir, 0, 1, &header);
+}
+
+/**
+ * Remove a name from a directory, moving the last entry of its block into
+ * the hole so the entries stay packed.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       dir         Inode of directory.
+ * @param       name        Name to remove.
+ * @param       length      Length of name.
+ *
+ * @return      Whether or not the name was removed.
+ **/
+bool dir_erase(FileSystem* fs, uint32_t dir, const char* name, size_t length) {
+    DirPage header, page;
+    if (!dir_header(fs, dir, &header)) {
+        return false;
+    }
+
+    uint32_t index = 1 + dir_hash(name, length) % header.header.buckets;
+    while (index && dir_read(fs, dir, index, 1, &page)) {
+        for (uint32_t i = 0; i < page.block.count; i++) {
+            if (!dir_matches(&page.block.entries[i], name, length)) {
+                continue;
+            }
+
+            page.block.entries[i] = page.block.entries[--page.block.count];
+            memset(&page.block.entries[page.block.count], 0, sizeof(DirEntry));
+            header.header.entries--;
+            return dir_write(fs, dir, index, 1, &page) && dir_write(fs, dir, 0, 1, &header);
+        }
+        index = page.block.next;
+    }
+
+    return false;
+}
+
+/**
+ * Rewrite a directory with twice as many buckets by doing the following:
+ *
+ *  1. Read every block in use.
+ *
+ *  2. Rehash each entry into the new buckets, chaining overflow blocks
+ *  after them as needed.
+ *
+ *  3. Write the new header, buckets, and overflow blocks with one request
+ *  (blocks past the new end of the directory are no longer referenced).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       dir         Inode of directory.
+ * @param       header      Current header (updated to the new one).
+ *
+ * @return      Whether or not the directory was rewritten.
+ **/
+bool dir_grow(FileSystem* fs, uint32_t dir, DirHeader* header) {
+    uint32_t buckets = header->buckets * 2;
+    uint32_t capacity = 1 + buckets + header->entries / DIR_BLOCK_ENTRIES + 1;
+    DirPage* old = calloc(header->blocks, sizeof(DirPage));
+    DirPage* pages = calloc(capacity, sizeof(DirPage));
+    bool success = old && pages && dir_read(fs, dir, 1, header->blocks - 1, old + 1);
+
+    uint32_t used = 1 + buckets;
+    for (uint32_t b = 1; success && b < header->blocks; b++) {
+        for (uint32_t i = 0; i < old[b].block.count; i++) {
+            DirEntry* entry = &old[b].block.entries[i];
+            uint32_t index = 1 + dir_hash(entry->name, entry->length) % buckets;
+            while (pages[index].block.count == DIR_BLOCK_ENTRIES) {
+                if (!pages[index].block.next) {
+                    pages[index].block.next = used++;
+                }
+                index = pages[index].block.next;
+            }
+            pages[index].block.entries[pages[index].block.count++] = *entry;
+        }
+    }
+
+    if (success) {
+        header->buckets = buckets;
+        header->blocks = used;
+        pages[0].header = *header;
+        success = dir_write(fs, dir, 0, used, pages);
+    }
+
+    free(old);
+    free(pages);
+    return success;
+}
+
+/**
+ * Read consecutive blocks of a directory.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       dir         Inode of directory.
+ * @param       index       First block (within the directory) to read.
+ * @param       count       Number of blocks to read.
+ * @param       pages       Buffer to read blocks into.
+ *
+ * @return      Whether or not every block was read.
+ **/
+bool dir_read(FileSystem* fs, uint32_t dir, uint32_t index, uint32_t count, DirPage* pages) {
+    size_t length = (size_t)count * BLOCK_SIZE;
+    return fs_read(fs, dir, pages->data, length, (size_t)index * BLOCK_SIZE) == (ssize_t)length;
+}
+
+/**
+ * Write consecutive blocks of a directory.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       dir         Inode of directory.
+ * @param       index       First block (within the directory) to write.
+ * @param       count       Number of blocks to write.
+ * @param       pages       Blocks to write.
+ *
+ * @return      Whether or not every block was written.
+ **/
+bool dir_write(FileSystem* fs, uint32_t dir, uint32_t index, uint32_t count, DirPage* pages) {
+    size_t length = (size_t)count * BLOCK_SIZE;
+    return fs_write(fs, dir, pages->data, length, (size_t)index * BLOCK_SIZE) == (ssize_t)length;
+}
+
+/**
+ * Read the header of a directory and check it.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       dir         Inode of directory.
+ * @param       page        Buffer to read header into.
+ *
+ * @return      Whether or not the Inode holds a directory.
+ **/
+bool dir_header(FileSystem* fs, uint32_t dir, DirPage* page) {
+    return dir_read(fs, dir, 0, 1, page) &&
+           page->header.magic == DIR_MAGIC &&
+           page->header.buckets > 0 &&
+           page->header.blocks > page->header.buckets;
+}
+
+/**
+ * Check whether a directory entry holds the specified name.
+ *
+ * @param       entry       Pointer to DirEntry structure.
+ * @param       name        Name to compare.
+ * @param       length      Length of name.
+ *
+ * @return      Whether or not the names are equal.
+ **/
+bool dir_matches(const DirEntry* entry, const char* name, size_t length) {
+    return entry->length == length && memcmp(entry->name, name, length) == 0;
+}
+
+/**
+ * Compute the 32-bit FNV-1a hash of a name.
+ *
+ * @param       name        Name to hash.
+ * @param       length      Length of name.
+ *
+ * @return      Hash of name.
+ **/
+uint32_t dir_hash(const char* name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Find the dentry cache slot for a name in a directory.
+ *
+ * @param       tree        Pointer to DirTree structure.
+ * @param       parent      Inode of directory.
+ * @param       name        Name.
+ * @param       length      Length of name.
+ *
+ * @return      Pointer to the slot (which may hold another name).
+ **/
+Dentry* dcache_slot(DirTree* tree, uint32_t parent, const char* name, size_t length) {
+    uint32_t hash = dir_hash(name, length) ^ (parent * 2654435761u);
+    return &tree->dentries[hash % DCACHE_ENTRIES];
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
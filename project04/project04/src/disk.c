@@ -1,22 +1,87 @@
 /* disk.c: SimpleFS disk emulator */
 
+#define _GNU_SOURCE /* fallocate */
+
 #include "sfs/disk.h"
 
 #include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "sfs/cache.h"
 #include "sfs/logging.h"
+#include "sfs/stats.h"
+#include "sfs/uring.h"
+#include "sfs/utils.h"
+
+/* Internal Constants */
+
+#define DISK_MAX_RUN (1024) /* Most blocks moved by one preadv/pwritev (Linux IOV_MAX) */
+
+/* Internal Macros */
+
+#define DISK_COUNT(disk, counter, n) \
+    __atomic_fetch_add(&(disk)->counter, (n), __ATOMIC_RELAXED)
 
 /* Internal Prototyes */
 
 bool disk_sanity_check(Disk* disk, size_t blocknum, const char* data);
+bool disk_vector_check(Disk* disk, const size_t* blocks, char** data, size_t count);
+ssize_t disk_read_raw(Disk* disk, size_t block, char* data);
+ssize_t disk_write_raw(Disk* disk, size_t block, char* data);
+CacheEntry* disk_cache_fill(Disk* disk, size_t block, bool load);
+ssize_t disk_transfer_run(Disk* disk, size_t block, char** data, size_t count, bool write);
+ssize_t disk_transfer_iov(Disk* disk, size_t block, char** data, size_t count, bool write);
+size_t disk_uncached_run(Disk* disk, const size_t* blocks, size_t count);
+void disk_transferred(Disk* disk, size_t block, size_t count, bool write, bool queued);
+uint64_t disk_model_cost(Disk* disk, size_t block, size_t count, bool queued);
+bool disk_lock(Disk* disk);
+void disk_unlock(Disk* disk, bool locked);
+
+/* Internal Variables */
+
+/* Default parameters of each device: a 7200 RPM hard disk and an NVMe
+ * solid state disk */
+const DiskModel DiskModels[DISK_DEVICES] = {
+    [DISK_IDEAL] = {.device = DISK_IDEAL},
+    [DISK_HDD]   = {.device = DISK_HDD, .seek_ns = 16000000, .track_ns = 1000000, .rotation_ns = 8333333,
+                    .bandwidth = 150000000},
+    [DISK_SSD]   = {.device = DISK_SSD, .latency_ns = 80000, .queue_depth = 32, .bandwidth = 2000000000},
+};
 
 /* External Functions */
 
 /**
  *
- * Opens disk at specified path with the specified number of blocks by doing
- * the following:
+ * Opens disk at specified path with the specified number of blocks using the
+ * default backend (taken from the SFS_DISK_BACKEND environment variable, or
+ * pread if unset).
+ *
+ * @param       path        Path to disk image to create.
+ * @param       blocks      Number of blocks to allocate for disk image.
+ *
+ * @return      Pointer to newly allocated and configured Disk structure (NULL
+ *              on failure).
+ **/
+Disk* disk_open(const char* path, size_t blocks) {
+    DiskBackend backend = DISK_PREAD;
+    const char* name = getenv("SFS_DISK_BACKEND");
+    if (name && !disk_backend_parse(name, &backend)) {
+        fprintf(stderr, "disk_open: unknown backend %s\n", name);
+        return NULL;
+    }
+
+    return disk_open_backend(path, blocks, backend);
+}
+
+/**
+ *
+ * Opens disk at specified path with the specified number of blocks and
+ * backend by doing the following:
  *
  *  1. Allocate Disk structure and sets appropriate attributes.
  *
@@ -24,15 +89,31 @@ bool disk_sanity_check(Disk* disk, size_t blocknum, const char* data);
  *
  *  3. Truncate file to desired file size (blocks * BLOCK_SIZE).
  *
+ *  4. Map the whole file into memory (mmap backend only).
+ *
+ *  5. Set up the submission queue (uring backend only), falling back to
+ *  pread if io_uring is unavailable.
+ *
+ *  6. Model the device named by the SFS_DISK_MODEL environment variable
+ *  (ideal if unset).
+ *
  * @param       path        Path to disk image to create.
  * @param       blocks      Number of blocks to allocate for disk image.
+ * @param       backend     How blocks are transferred to the disk image.
  *
  * @return      Pointer to newly allocated and configured Disk structure (NULL
  *              on failure).
  **/
-Disk* disk_open(const char* path, size_t blocks) {
+Disk* disk_open_backend(const char* path, size_t blocks, DiskBackend backend) {
     if (!path || blocks < 3) return NULL;
 
+    DiskModel model = DiskModels[DISK_IDEAL];
+    const char* name = getenv("SFS_DISK_MODEL");
+    if (name && !disk_model_parse(name, &model)) {
+        fprintf(stderr, "disk_open: unknown model %s\n", name);
+        return NULL;
+    }
+
     Disk* disk = calloc(1, sizeof(Disk));
     if (!disk) {
         fprintf(stderr, "disk_open: calloc returned NULL\n");
@@ -54,25 +135,67 @@ Disk* disk_open(const char* path, size_t blocks) {
         return NULL;
     }
 
+    if (backend == DISK_MMAP) {
+        disk->map = mmap(NULL, blocks * BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+        if (disk->map == MAP_FAILED) {
+            fprintf(stderr, "disk_open: mmap failed %s\n", strerror(errno));
+            close(disk->fd);
+            free(disk);
+            return NULL;
+        }
+    }
+
+    if (backend == DISK_URING && !(disk->ring = uring_create(DISK_QUEUE_DEPTH))) {
+        fprintf(stderr, "disk_open: io_uring unavailable, falling back to pread\n");
+        backend = DISK_PREAD;
+    }
+
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&disk->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+
     disk->blocks = blocks;
+    disk->backend = backend;
+    disk->model = model;
     return disk;
 }
 
 /**
  * Close disk structure by doing the following:
  *
- *  1. Close disk file descriptor.
+ *  1. Write back and release block cache (if any).
+ *
+ *  2. Unmap disk image (mmap backend), tear down the submission queue
+ *  (uring backend), and close disk file descriptor.
  *
- *  2. Report number of disk reads and writes.
+ *  3. Report number of disk reads and writes (and cache statistics and
+ *  modeled device time).
  *
- *  3. Release disk structure memory.
+ *  4. Release disk structure memory.
  *
  * @param       disk        Pointer to Disk structure.
  */
 void disk_close(Disk* disk) {
+    disk_cache(disk, 0);
+
     // Report number of disk reads and writes
     printf("%lu disk block reads\n", disk->reads);
     printf("%lu disk block writes\n", disk->writes);
+    if (disk->hits || disk->misses) {
+        printf("%lu cache hits\n", disk->hits);
+        printf("%lu cache misses\n", disk->misses);
+        printf("%lu cache evictions\n", disk->evictions);
+    }
+    if (disk->model.device != DISK_IDEAL) {
+        printf("%.6f seconds modeled %s time\n", disk->modeled_ns / 1e9, disk_device_name(disk->model.device));
+    }
+    if (disk->map) {
+        munmap(disk->map, disk->blocks * BLOCK_SIZE);
+    }
+    uring_delete(disk->ring);
+    pthread_mutex_destroy(&disk->lock);
     close(disk->fd);
     free(disk);
 }
@@ -87,6 +210,9 @@ void disk_close(Disk* disk) {
  *
  *  3. Read from block to data buffer (must be BLOCK_SIZE).
  *
+ * Note: With a block cache enabled, the block is served from the cache when
+ * present and only read from the disk image on a miss.
+ *
  * @param       disk        Pointer to Disk structure.
  * @param       block       Block number to perform operation on.
  * @param       data        Data buffer.
@@ -97,13 +223,58 @@ void disk_close(Disk* disk) {
 ssize_t disk_read(Disk* disk, size_t block, char* data) {
     if (!disk_sanity_check(disk, block, data)) return DISK_FAILURE;
 
-    ssize_t nread = pread(disk->fd, data, BLOCK_SIZE, block * BLOCK_SIZE);
-    if (nread < 0) {
-        fprintf(stderr, "disk_read: read failed %s\n", strerror(errno));
+    uint64_t start = stats_start();
+    bool locked = disk_lock(disk);
+    ssize_t result = BLOCK_SIZE;
+    if (!disk->cache) {
+        result = disk_read_raw(disk, block, data);
+    } else {
+        CacheEntry* entry = cache_lookup(disk->cache, block);
+        if (entry) {
+            DISK_COUNT(disk, hits, 1);
+        } else {
+            DISK_COUNT(disk, misses, 1);
+            entry = disk_cache_fill(disk, block, true);
+        }
+
+        if (entry) {
+            memcpy(data, entry->data, BLOCK_SIZE);
+        } else {
+            result = DISK_FAILURE;
+        }
+    }
+
+    disk_unlock(disk, locked);
+    stats_record(STAT_DISK_READ, start, block, result);
+    return result;
+}
+
+/**
+ * Read a block straight from the disk image, bypassing the block cache and
+ * submission queue, so that any number of threads may read at once.
+ *
+ * Note: Flush the Disk first so the image holds any blocks the cache has not
+ * written back yet.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to perform operation on.
+ * @param       data        Data buffer.
+ *
+ * @return      Number of bytes read.
+ *              (BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_read_shared(Disk* disk, size_t block, char* data) {
+    if (!disk_sanity_check(disk, block, data)) return DISK_FAILURE;
+
+    ssize_t nread = BLOCK_SIZE;
+    if (disk->map) {
+        memcpy(data, disk->map + block * BLOCK_SIZE, BLOCK_SIZE);
+    } else if ((nread = pread(disk->fd, data, BLOCK_SIZE, block * BLOCK_SIZE)) < 0) {
+        fprintf(stderr, "disk_read_shared: read failed %s\n", strerror(errno));
         return DISK_FAILURE;
     }
 
-    disk->reads++;
+    disk_transferred(disk, block, 1, false, false);
     return nread;
 }
 
@@ -117,6 +288,9 @@ ssize_t disk_read(Disk* disk, size_t block, char* data) {
  *
  *  3. Write data buffer (must be BLOCK_SIZE) to disk block.
  *
+ * Note: With a block cache enabled, the block is only marked dirty in the
+ * cache and written to the disk image on eviction or disk_flush.
+ *
  * @param       disk        Pointer to Disk structure.
  * @param       block       Block number to perform operation on.
  * @param       data        Data buffer.
@@ -127,17 +301,796 @@ ssize_t disk_read(Disk* disk, size_t block, char* data) {
 ssize_t disk_write(Disk* disk, size_t block, char* data) {
     if (!disk_sanity_check(disk, block, data)) return DISK_FAILURE;
 
+    uint64_t start = stats_start();
+    bool locked = disk_lock(disk);
+    ssize_t result = BLOCK_SIZE;
+    if (!disk->cache) {
+        result = disk_write_raw(disk, block, data);
+    } else {
+        CacheEntry* entry = cache_lookup(disk->cache, block);
+        if (entry || (entry = disk_cache_fill(disk, block, false))) {
+            memcpy(entry->data, data, BLOCK_SIZE);
+            entry->dirty = true;
+        } else {
+            result = DISK_FAILURE;
+        }
+    }
+
+    disk_unlock(disk, locked);
+    stats_record(STAT_DISK_WRITE, start, block, result);
+    return result;
+}
+
+/**
+ * Read a list of blocks into the corresponding data buffers by doing the
+ * following:
+ *
+ *  1. Perform sanity check on every block and buffer.
+ *
+ *  2. Serve any blocks present in the block cache from the cache.
+ *
+ *  3. Read each remaining run of consecutive block numbers with a single
+ *  preadv (bypassing the block cache).
+ *
+ * Note: With the uring backend, every uncached block is queued and the whole
+ * batch is submitted and reaped together once the list has been walked.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Block numbers to read.
+ * @param       data        Data buffers (each must be BLOCK_SIZE).
+ * @param       count       Number of blocks to read.
+ *
+ * @return      Number of bytes read.
+ *              (count * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_readv(Disk* disk, const size_t* blocks, char** data, size_t count) {
+    if (!disk_vector_check(disk, blocks, data, count)) return DISK_FAILURE;
+
+    uint64_t start = stats_start();
+    bool locked = disk_lock(disk);
+    ssize_t result = count * BLOCK_SIZE;
+    size_t i = 0;
+    while (i < count) {
+        CacheEntry* entry = disk->cache ? cache_lookup(disk->cache, blocks[i]) : NULL;
+        if (entry) {
+            memcpy(data[i], entry->data, BLOCK_SIZE);
+            DISK_COUNT(disk, hits, 1);
+            i++;
+            continue;
+        }
+
+        size_t run = disk_uncached_run(disk, blocks + i, count - i);
+        if (disk_transfer_run(disk, blocks[i], data + i, run, false) == DISK_FAILURE) {
+            result = DISK_FAILURE;
+            break;
+        }
+        if (disk->cache) {
+            DISK_COUNT(disk, misses, run);
+        }
+        i += run;
+    }
+
+    if (!disk_drain(disk)) {
+        result = DISK_FAILURE;
+    }
+
+    disk_unlock(disk, locked);
+    stats_record(STAT_DISK_READV, start, count ? blocks[0] : 0, result);
+    return result;
+}
+
+/**
+ * Write the data buffers to the corresponding list of blocks by doing the
+ * following:
+ *
+ *  1. Perform sanity check on every block and buffer.
+ *
+ *  2. Write each run of consecutive block numbers with a single pwritev.
+ *
+ *  3. Refresh any copies of the written blocks held in the block cache.
+ *
+ * Note: Unlike disk_write, this always writes through to the disk image.  With
+ * the uring backend, every block is queued and submitted as a single batch.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Block numbers to write.
+ * @param       data        Data buffers (each must be BLOCK_SIZE).
+ * @param       count       Number of blocks to write.
+ *
+ * @return      Number of bytes written.
+ *              (count * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_writev(Disk* disk, const size_t* blocks, char** data, size_t count) {
+    if (!disk_vector_check(disk, blocks, data, count)) return DISK_FAILURE;
+
+    uint64_t start = stats_start();
+    bool locked = disk_lock(disk);
+    ssize_t result = count * BLOCK_SIZE;
+    size_t i = 0;
+    while (i < count) {
+        size_t run = 1;
+        while (i + run < count && run < DISK_MAX_RUN && blocks[i + run] == blocks[i] + run) {
+            run++;
+        }
+
+        if (disk_transfer_run(disk, blocks[i], data + i, run, true) == DISK_FAILURE) {
+            result = DISK_FAILURE;
+            break;
+        }
+        i += run;
+    }
+
+    if (!disk_drain(disk)) {
+        result = DISK_FAILURE;
+    }
+
+    if (result != DISK_FAILURE && disk->cache) {
+        for (size_t i = 0; i < count; i++) {
+            CacheEntry* entry = cache_lookup(disk->cache, blocks[i]);
+            if (entry) {
+                memcpy(entry->data, data[i], BLOCK_SIZE);
+                entry->dirty = false;
+            }
+        }
+    }
+
+    disk_unlock(disk, locked);
+    stats_record(STAT_DISK_WRITEV, start, count ? blocks[0] : 0, result);
+    return result;
+}
+
+/**
+ * Queue a read of specified block into data buffer without waiting for it to
+ * complete by doing the following:
+ *
+ *  1. Perform sanity check.
+ *
+ *  2. Serve the block from the block cache if present.
+ *
+ *  3. Place the read on the submission queue (uring backend), or read it
+ *  immediately (other backends).
+ *
+ * Note: The data buffer must not be used until disk_drain returns, and
+ * queued requests are not ordered with respect to each other.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to perform operation on.
+ * @param       data        Data buffer.
+ *
+ * @return      Whether or not the read was queued.
+ **/
+bool disk_queue_read(Disk* disk, size_t block, char* data) {
+    if (!disk_sanity_check(disk, block, data)) return false;
+
+    if (!disk->ring) {
+        return disk_read(disk, block, data) != DISK_FAILURE;
+    }
+
+    bool locked = disk_lock(disk);
+    bool queued = true;
+    CacheEntry* entry = disk->cache ? cache_lookup(disk->cache, block) : NULL;
+    if (entry) {
+        memcpy(data, entry->data, BLOCK_SIZE);
+        DISK_COUNT(disk, hits, 1);
+    } else {
+        if (disk->cache) {
+            DISK_COUNT(disk, misses, 1);
+        }
+        queued = disk_transfer_run(disk, block, &data, 1, false) != DISK_FAILURE;
+    }
+
+    disk_unlock(disk, locked);
+    return queued;
+}
+
+/**
+ * Queue a write of data buffer to specified block without waiting for it to
+ * complete by doing the following:
+ *
+ *  1. Perform sanity check.
+ *
+ *  2. Write the block into the block cache if enabled.
+ *
+ *  3. Place the write on the submission queue (uring backend), or write it
+ *  immediately (other backends).
+ *
+ * Note: The data buffer must not be modified until disk_drain returns, and
+ * queued requests are not ordered with respect to each other.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to perform operation on.
+ * @param       data        Data buffer.
+ *
+ * @return      Whether or not the write was queued.
+ **/
+bool disk_queue_write(Disk* disk, size_t block, char* data) {
+    if (!disk_sanity_check(disk, block, data)) return false;
+
+    if (!disk->ring || disk->cache) {
+        return disk_write(disk, block, data) != DISK_FAILURE;
+    }
+
+    bool locked = disk_lock(disk);
+    bool queued = disk_transfer_run(disk, block, &data, 1, true) != DISK_FAILURE;
+    disk_unlock(disk, locked);
+    return queued;
+}
+
+/**
+ * Submit every queued read and write and wait for all of them to complete
+ * (a no-op for backends that do not queue).
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      Whether or not every queued request succeeded.
+ **/
+bool disk_drain(Disk* disk) {
+    if (!disk || !disk->ring) return true;
+
+    bool locked = disk_lock(disk);
+    bool drained = uring_drain(disk->ring);
+    __atomic_store_n(&disk->queued, 0, __ATOMIC_RELAXED);
+    disk_unlock(disk, locked);
+
+    if (!drained) {
+        fprintf(stderr, "disk_drain: queued request failed\n");
+    }
+    return drained;
+}
+
+/**
+ * Change the queue depth of the uring backend by draining and replacing its
+ * submission queue.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       depth       Maximum number of requests queued or in flight.
+ *
+ * @return      Whether or not the queue was successfully resized (false for
+ *              other backends).
+ **/
+bool disk_queue_depth(Disk* disk, unsigned depth) {
+    if (!disk || !disk->ring || depth == 0) return false;
+
+    Uring* ring = uring_create(depth);
+    bool locked = disk_lock(disk);
+    bool drained = ring && disk_drain(disk);
+    if (drained) {
+        uring_delete(disk->ring);
+        disk->ring = ring;
+    }
+    disk_unlock(disk, locked);
+
+    if (!drained) {
+        uring_delete(ring);
+    }
+    return drained;
+}
+
+/**
+ * Discard a run of blocks by doing the following:
+ *
+ *  1. Drop any cached copies of the blocks (dirty or not).
+ *
+ *  2. Wait for any queued requests.
+ *
+ *  3. Punch a hole in the disk image file so the blocks read back as zeros
+ *  and no longer take up space.
+ *
+ * Note: Discarding is best effort; if the underlying file system cannot punch
+ * holes the blocks keep their old contents.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block of run.
+ * @param       count       Number of blocks in run.
+ *
+ * @return      Whether or not the blocks now read back as zeros.
+ **/
+bool disk_discard(Disk* disk, size_t block, size_t count) {
+    if (!disk || block >= disk->blocks || count > disk->blocks - block) return false;
+
+    bool locked = disk_lock(disk);
+    if (disk->cache) {
+        for (size_t i = 0; i < disk->cache->capacity; i++) {
+            CacheEntry* entry = &disk->cache->entries[i];
+            if (entry->valid && entry->block >= block && entry->block < block + count) {
+                cache_invalidate(disk->cache, entry);
+            }
+        }
+    }
+
+    bool drained = disk_drain(disk);
+    disk_unlock(disk, locked);
+    if (!drained) {
+        return false;
+    }
+
+    return fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, block * BLOCK_SIZE, count * BLOCK_SIZE) == 0;
+}
+
+/**
+ * Enable, resize, or disable (capacity of 0) the write-back block cache by
+ * doing the following:
+ *
+ *  1. Write back and release any existing cache.
+ *
+ *  2. Allocate a new cache with the specified number of blocks.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       capacity    Number of blocks to cache (0 to disable).
+ *
+ * @return      Whether or not the cache was successfully configured.
+ **/
+bool disk_cache(Disk* disk, size_t capacity) {
+    if (!disk) return false;
+
+    pthread_mutex_lock(&disk->lock);
+    bool success = true;
+    if (disk->cache) {
+        if ((success = disk_flush(disk))) {
+            cache_delete(disk->cache);
+            disk->cache = NULL;
+        }
+    }
+
+    if (success && capacity > 0) {
+        disk->cache = cache_create(capacity);
+        success = disk->cache != NULL;
+    }
+
+    pthread_mutex_unlock(&disk->lock);
+    return success;
+}
+
+/**
+ * Write back every dirty block in the block cache to the disk image (as a
+ * single batch with the uring backend).
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      Whether or not all dirty blocks were written back.
+ **/
+bool disk_flush(Disk* disk) {
+    if (!disk || !disk->cache) return true;
+
+    bool locked = disk_lock(disk);
+    bool success = true;
+    for (size_t i = 0; i < disk->cache->capacity && success; i++) {
+        CacheEntry* entry = &disk->cache->entries[i];
+        if (!entry->valid || !entry->dirty) {
+            continue;
+        }
+
+        char* data = entry->data;
+        success = disk_transfer_run(disk, entry->block, &data, 1, true) != DISK_FAILURE;
+        entry->dirty = !success;
+    }
+
+    success = disk_drain(disk) && success;
+    disk_unlock(disk, locked);
+    return success;
+}
+
+/**
+ * Return a pointer directly into the mapped disk image for a run of blocks
+ * (mmap backend only), writing back any dirty cached copies of those blocks
+ * first so the mapping is current.
+ *
+ * Note: The pointer is only valid until the disk is closed, and stays
+ * current only as long as the blocks are not rewritten through the cache.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block of run.
+ * @param       count       Number of blocks in run.
+ *
+ * @return      Pointer to first block (NULL if not mapped or out of range).
+ **/
+const char* disk_map(Disk* disk, size_t block, size_t count) {
+    if (!disk || !disk->map || count == 0 || block >= disk->blocks || count > disk->blocks - block) {
+        return NULL;
+    }
+
+    bool locked = disk_lock(disk);
+    bool success = true;
+    if (disk->cache) {
+        for (size_t i = block; i < block + count && success; i++) {
+            CacheEntry* entry = cache_lookup(disk->cache, i);
+            if (entry && entry->dirty) {
+                success = disk_write_raw(disk, i, entry->data) != DISK_FAILURE;
+                entry->dirty = !success;
+            }
+        }
+    }
+    disk_unlock(disk, locked);
+
+    if (!success) {
+        return NULL;
+    }
+
+    disk_transferred(disk, block, count, false, false);
+    return disk->map + block * BLOCK_SIZE;
+}
+
+/**
+ * Look up a backend by name ("pread", "mmap", or "uring").
+ *
+ * @param       name        Name of backend.
+ * @param       backend     Set to the matching backend.
+ *
+ * @return      Whether or not name matched a backend.
+ **/
+bool disk_backend_parse(const char* name, DiskBackend* backend) {
+    for (DiskBackend b = 0; b < DISK_BACKENDS; b++) {
+        if (strcmp(name, disk_backend_name(b)) == 0) {
+            *backend = b;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Return the name of a backend.
+ *
+ * @param       backend     Backend to name.
+ *
+ * @return      Name of backend.
+ **/
+const char* disk_backend_name(DiskBackend backend) {
+    switch (backend) {
+        case DISK_PREAD: return "pread";
+        case DISK_MMAP:  return "mmap";
+        case DISK_URING: return "uring";
+        default:         return "unknown";
+    }
+}
+
+/**
+ * Model a different device (or none, for a NULL model), starting with the
+ * head at block 0 and nothing queued.  Time already modeled is kept.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       model       Device parameters (NULL for the ideal device).
+ *
+ * @return      Whether or not the model was valid (it needs a bandwidth, and
+ *              a queue depth for an ssd).
+ **/
+bool disk_model(Disk* disk, const DiskModel* model) {
+    if (!disk) return false;
+
+    if (!model) {
+        model = &DiskModels[DISK_IDEAL];
+    }
+
+    if (model->device >= DISK_DEVICES || (model->device != DISK_IDEAL && model->bandwidth == 0) ||
+        (model->device == DISK_SSD && model->queue_depth == 0)) {
+        fprintf(stderr, "disk_model: invalid %s model\n", disk_device_name(model->device));
+        return false;
+    }
+
+    bool locked = disk_lock(disk);
+    disk->model = *model;
+    disk->head = 0;
+    disk->queued = 0;
+    disk_unlock(disk, locked);
+    return true;
+}
+
+/**
+ * Look up the default parameters of a device by name ("ideal", "hdd", or
+ * "ssd").
+ *
+ * @param       name        Name of device.
+ * @param       model       Set to the default model of the matching device.
+ *
+ * @return      Whether or not name matched a device.
+ **/
+bool disk_model_parse(const char* name, DiskModel* model) {
+    for (DiskDevice d = 0; d < DISK_DEVICES; d++) {
+        if (strcmp(name, disk_device_name(d)) == 0) {
+            *model = DiskModels[d];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Return the name of a device.
+ *
+ * @param       device      Device to name.
+ *
+ * @return      Name of device.
+ **/
+const char* disk_device_name(DiskDevice device) {
+    switch (device) {
+        case DISK_IDEAL: return "ideal";
+        case DISK_HDD:   return "hdd";
+        case DISK_SSD:   return "ssd";
+        default:         return "unknown";
+    }
+}
+
+/* Internal Functions */
+
+/**
+ * Read block directly from the disk image, bypassing the block cache.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to perform operation on.
+ * @param       data        Data buffer.
+ *
+ * @return      Number of bytes read.
+ *              (BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_read_raw(Disk* disk, size_t block, char* data) {
+    if (disk->ring) {
+        if (disk_transfer_run(disk, block, &data, 1, false) == DISK_FAILURE || !disk_drain(disk)) {
+            return DISK_FAILURE;
+        }
+        return BLOCK_SIZE;
+    }
+
+    if (disk->map) {
+        memcpy(data, disk->map + block * BLOCK_SIZE, BLOCK_SIZE);
+        disk_transferred(disk, block, 1, false, false);
+        return BLOCK_SIZE;
+    }
+
+    ssize_t nread = pread(disk->fd, data, BLOCK_SIZE, block * BLOCK_SIZE);
+    if (nread < 0) {
+        fprintf(stderr, "disk_read: read failed %s\n", strerror(errno));
+        return DISK_FAILURE;
+    }
+
+    disk_transferred(disk, block, 1, false, false);
+    return nread;
+}
+
+/**
+ * Write block directly to the disk image, bypassing the block cache.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to perform operation on.
+ * @param       data        Data buffer.
+ *
+ * @return      Number of bytes written.
+ *              (BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_write_raw(Disk* disk, size_t block, char* data) {
+    if (disk->ring) {
+        if (disk_transfer_run(disk, block, &data, 1, true) == DISK_FAILURE || !disk_drain(disk)) {
+            return DISK_FAILURE;
+        }
+        return BLOCK_SIZE;
+    }
+
+    if (disk->map) {
+        memcpy(disk->map + block * BLOCK_SIZE, data, BLOCK_SIZE);
+        disk_transferred(disk, block, 1, true, false);
+        return BLOCK_SIZE;
+    }
+
     ssize_t nread = pwrite(disk->fd, data, BLOCK_SIZE, block * BLOCK_SIZE);
     if (nread < 0) {
         fprintf(stderr, "disk_read: read failed %s\n", strerror(errno));
         return DISK_FAILURE;
     }
 
-    disk->writes++;
+    disk_transferred(disk, block, 1, true, false);
     return nread;
 }
 
-/* Internal Functions */
+/**
+ * Find a cache entry for specified block by doing the following:
+ *
+ *  1. Take the least recently used entry, writing it back if dirty.
+ *
+ *  2. Load the block from the disk image (if requested).
+ *
+ *  3. Assign the entry to the block.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to cache.
+ * @param       load        Whether or not to read block contents from disk.
+ *
+ * @return      Pointer to cache entry (NULL on failure).
+ **/
+CacheEntry* disk_cache_fill(Disk* disk, size_t block, bool load) {
+    Cache* cache = disk->cache;
+    CacheEntry* entry = cache_victim(cache);
+
+    if (entry->valid) {
+        if (entry->dirty && disk_write_raw(disk, entry->block, entry->data) == DISK_FAILURE) {
+            return NULL;
+        }
+        DISK_COUNT(disk, evictions, 1);
+    }
+
+    if (load && disk_read_raw(disk, block, entry->data) == DISK_FAILURE) {
+        cache_invalidate(cache, entry);
+        return NULL;
+    }
+
+    cache_assign(cache, entry, block);
+    return entry;
+}
+
+/**
+ * Transfer a run of consecutive blocks to or from separate data buffers
+ * (with a single preadv or pwritev, or memcpy for the mmap backend), counting
+ * every block transferred and charging the modeled device for them.
+ *
+ * Note: With the uring backend, each block is only queued; the caller must
+ * disk_drain before using the buffers.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block of run.
+ * @param       data        Data buffers (each must be BLOCK_SIZE).
+ * @param       count       Number of blocks in run (at most DISK_MAX_RUN).
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      Number of bytes transferred.
+ *              (count * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_transfer_run(Disk* disk, size_t block, char** data, size_t count, bool write) {
+    if (disk->map) {
+        for (size_t i = 0; i < count; i++) {
+            if (write) {
+                memcpy(disk->map + (block + i) * BLOCK_SIZE, data[i], BLOCK_SIZE);
+            } else {
+                memcpy(data[i], disk->map + (block + i) * BLOCK_SIZE, BLOCK_SIZE);
+            }
+        }
+    } else if (disk->ring) {
+        for (size_t i = 0; i < count; i++) {
+            if (!uring_queue(disk->ring, disk->fd, write, data[i], BLOCK_SIZE, (block + i) * BLOCK_SIZE)) {
+                fprintf(stderr, "disk_transfer_run: unable to queue block %lu\n", block + i);
+                return DISK_FAILURE;
+            }
+        }
+    } else if (disk_transfer_iov(disk, block, data, count, write) == DISK_FAILURE) {
+        return DISK_FAILURE;
+    }
+
+    disk_transferred(disk, block, count, write, disk->ring != NULL);
+    return count * BLOCK_SIZE;
+}
+
+/**
+ * Transfer a run of consecutive blocks to or from separate data buffers with
+ * a single preadv or pwritev on the disk image file.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block of run.
+ * @param       data        Data buffers (each must be BLOCK_SIZE).
+ * @param       count       Number of blocks in run (at most DISK_MAX_RUN).
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      Number of bytes transferred.
+ *              (count * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_transfer_iov(Disk* disk, size_t block, char** data, size_t count, bool write) {
+    struct iovec iov[DISK_MAX_RUN];
+    for (size_t i = 0; i < count; i++) {
+        iov[i].iov_base = data[i];
+        iov[i].iov_len = BLOCK_SIZE;
+    }
+
+    ssize_t nbytes;
+    if (write) {
+        nbytes = pwritev(disk->fd, iov, count, block * BLOCK_SIZE);
+    } else {
+        nbytes = preadv(disk->fd, iov, count, block * BLOCK_SIZE);
+    }
+
+    if (nbytes != (ssize_t)(count * BLOCK_SIZE)) {
+        fprintf(stderr, "disk_transfer_iov: %s failed %s\n", write ? "pwritev" : "preadv",
+                nbytes < 0 ? strerror(errno) : "short transfer");
+        return DISK_FAILURE;
+    }
+
+    return nbytes;
+}
+
+/**
+ * Measure how many of the leading blocks in a list form a run of
+ * consecutive block numbers that are not held by the block cache.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Block numbers (the first is known to be uncached).
+ * @param       count       Number of blocks in list.
+ *
+ * @return      Length of run (at least 1, at most DISK_MAX_RUN).
+ **/
+size_t disk_uncached_run(Disk* disk, const size_t* blocks, size_t count) {
+    size_t run = 1;
+    while (run < count && run < DISK_MAX_RUN && blocks[run] == blocks[0] + run) {
+        if (disk->cache && cache_lookup(disk->cache, blocks[run])) {
+            break;
+        }
+        run++;
+    }
+
+    return run;
+}
+
+/**
+ * Account for a run of blocks transferred to or from the disk image by doing
+ * the following:
+ *
+ *  1. Count the blocks read or written.
+ *
+ *  2. Charge the modeled device for the request.
+ *
+ *  3. Sleep for the charge (if the model asks for a delay).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block of run.
+ * @param       count       Number of blocks in run.
+ * @param       write       Whether blocks were written (true) or read (false).
+ * @param       queued      Whether the request was queued to be drained later.
+ **/
+void disk_transferred(Disk* disk, size_t block, size_t count, bool write, bool queued) {
+    if (write) {
+        DISK_COUNT(disk, writes, count);
+    } else {
+        DISK_COUNT(disk, reads, count);
+    }
+
+    if (disk->model.device == DISK_IDEAL) {
+        return;
+    }
+
+    uint64_t cost = disk_model_cost(disk, block, count, queued);
+    DISK_COUNT(disk, modeled_ns, cost);
+
+    if (disk->model.delay && cost > 0) {
+        struct timespec delay = {cost / 1000000000, cost % 1000000000};
+        while (nanosleep(&delay, &delay) < 0 && errno == EINTR);
+    }
+}
+
+/**
+ * Compute how long the modeled device takes to service one request:
+ *
+ *  - hdd: seek and wait half a rotation unless the request starts where the
+ *  last one ended, then transfer the blocks.
+ *
+ *  - ssd: wait out the latency unless the request overlaps one queued before
+ *  it (up to the lesser of the model and submission queue depths), then
+ *  transfer the blocks.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block of request.
+ * @param       count       Number of blocks in request.
+ * @param       queued      Whether the request was queued to be drained later.
+ *
+ * @return      Modeled time in nanoseconds.
+ **/
+uint64_t disk_model_cost(Disk* disk, size_t block, size_t count, bool queued) {
+    const DiskModel* model = &disk->model;
+    uint64_t cost = (uint64_t)((double)count * BLOCK_SIZE * 1e9 / model->bandwidth);
+
+    if (model->device == DISK_HDD) {
+        size_t head = __atomic_exchange_n(&disk->head, block + count, __ATOMIC_RELAXED);
+        if (head != block) {
+            size_t distance = head > block ? head - block : block - head;
+            double stroke = sqrt((double)distance / disk->blocks);
+            cost += model->track_ns + (uint64_t)((model->seek_ns - min(model->seek_ns, model->track_ns)) * stroke);
+            cost += model->rotation_ns / 2;
+        }
+    } else if (model->device == DISK_SSD) {
+        size_t depth = queued ? min(model->queue_depth, disk->ring->entries) : 1;
+        size_t position = queued ? __atomic_fetch_add(&disk->queued, 1, __ATOMIC_RELAXED) : 0;
+        if (position % depth == 0) {
+            cost += model->latency_ns;
+        }
+    }
+
+    return cost;
+}
 
 /**
  * Perform sanity check before read or write operation by doing the following:
@@ -161,12 +1114,12 @@ bool disk_sanity_check(Disk* disk, size_t block, const char* data) {
         return false;
     }
 
-    if (fcntl(disk->fd, F_GETFL) < 0) {
+    if (disk->backend == DISK_MMAP ? !disk->map : fcntl(disk->fd, F_GETFL) < 0) {
         fprintf(stderr, "disk_sanity_check: Invalid file descriptor\n");
         return false;
     }
 
-    if (disk->blocks <= block || block < 0) {
+    if (disk->blocks <= block) {
         fprintf(stderr, "disk_sanity_check: Block requested exceeds allocated blocks\n");
         return false;
     }
@@ -179,4 +1132,75 @@ bool disk_sanity_check(Disk* disk, size_t block, const char* data) {
     return true;
 }
 
+/**
+ * Perform sanity check before a vectored read or write operation: check the
+ * disk once, then every block and data buffer in the list.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Block numbers to perform operation on.
+ * @param       data        Data buffers.
+ * @param       count       Number of blocks.
+ *
+ * @return      Whether or not it is safe to perform a read/write operation
+ *              (true for safe, false for unsafe).
+ **/
+bool disk_vector_check(Disk* disk, const size_t* blocks, char** data, size_t count) {
+    if (!blocks || !data) {
+        fprintf(stderr, "disk_vector_check: Invalid block or data list\n");
+        return false;
+    }
+
+    if (count == 0) {
+        return disk_sanity_check(disk, 0, "");
+    }
+
+    if (!disk_sanity_check(disk, blocks[0], data[0])) {
+        return false;
+    }
+
+    for (size_t i = 1; i < count; i++) {
+        if (disk->blocks <= blocks[i]) {
+            fprintf(stderr, "disk_vector_check: Block requested exceeds allocated blocks\n");
+            return false;
+        }
+
+        if (!data[i]) {
+            fprintf(stderr, "disk_vector_check: Invalid data pointer\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Take the Disk lock if this Disk has a block cache or submission queue
+ * (neither is thread-safe); plain pread/pwrite and mmap transfers need no
+ * lock, since the counters are updated atomically.
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      Whether or not the lock was taken (pass to disk_unlock).
+ **/
+bool disk_lock(Disk* disk) {
+    if (!disk->cache && !disk->ring) {
+        return false;
+    }
+
+    pthread_mutex_lock(&disk->lock);
+    return true;
+}
+
+/**
+ * Release the Disk lock if disk_lock took it.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       locked      Result of disk_lock.
+ **/
+void disk_unlock(Disk* disk, bool locked) {
+    if (locked) {
+        pthread_mutex_unlock(&disk->lock);
+    }
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
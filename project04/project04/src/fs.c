@@ -3,13 +3,162 @@
 #include "sfs/fs.h"
 
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "sfs/bitmap.h"
+#include "sfs/crc32c.h"
+#include "sfs/dedup.h"
+#include "sfs/journal.h"
 #include "sfs/logging.h"
+#include "sfs/lz4.h"
+#include "sfs/stats.h"
 #include "sfs/utils.h"
 
+/* Internal Constants */
+
+#define BLOCK_MAP_SLOTS (6)   /* One cached pointer block per level of each indirect tree */
+#define SCAN_THREADS_MAX (64) /* Most threads used to walk the inode blocks */
+#define EXTENT_SIZE (EXTENT_BLOCKS * BLOCK_SIZE) /* Bytes of data in each compressed extent */
+
+/* Internal Structures */
+
+/**
+ * A BlockMap translates the logical blocks of one Inode to data blocks,
+ * caching the last pointer block it visited at every level of each indirect
+ * tree so a sequential walk reads each pointer block once.
+ **/
+typedef struct BlockMap BlockMap;
+struct BlockMap {
+    FileSystem* fs;                    /* FileSystem the Inode belongs to */
+    Inode* inode;                      /* Inode being mapped (saved by caller) */
+    uint32_t direct;                   /* Number of direct pointers */
+    uint32_t trees;                    /* Number of indirect trees */
+    uint32_t numbers[BLOCK_MAP_SLOTS]; /* Pointer block held by each slot (0 if none) */
+    bool dirty[BLOCK_MAP_SLOTS];       /* Slots modified since they were loaded */
+    bool failed;                       /* Whether a pointer block transfer failed */
+    Block slots[BLOCK_MAP_SLOTS];      /* Cached pointer blocks */
+};
+
+/**
+ * A SharedBlock follows one logical block through a write on a
+ * deduplicating FileSystem, from its new contents to the data block that
+ * ends up holding them.
+ **/
+typedef struct SharedBlock SharedBlock;
+struct SharedBlock {
+    const char* contents; /* New contents of block */
+    uint32_t hash;        /* Checksum of contents (see block_checksum) */
+    uint32_t old;         /* Data block before the write (0 if hole) */
+    uint32_t found;       /* Data block found in the dedup index (0 if none) */
+    uint32_t twin;        /* Earlier block of this write with the same contents (plus one, 0 if none) */
+    uint32_t block;       /* Data block after the write (0 if hole) */
+    bool hole;            /* Whether contents are all zeros */
+    bool held;            /* Whether a reference to found is held (until it matches) */
+    bool referenced;      /* Whether a reference to block is held for the new pointer */
+};
+
+/**
+ * A ScanTask is one thread's share of a walk over the inode blocks: a range
+ * of inode blocks, plus either a partial free block bitmap (mount and fsck)
+ * or a buffer of debug output, merged in order once every thread is done.
+ **/
+typedef struct ScanTask ScanTask;
+struct ScanTask {
+    FileSystem* fs;      /* FileSystem being scanned (NULL for fs_debug) */
+    Disk* disk;          /* Disk pointer blocks are read from */
+    uint32_t version;    /* On-disk format version */
+    uint32_t first;      /* First inode block (index into inode table) */
+    uint32_t last;       /* One past last inode block */
+    Bitmap* free_blocks; /* Partial free block bitmap */
+    uint32_t* references;/* Pointers found to each block (shared by every task, NULL unless deduplicating) */
+    char* output;        /* Debug output (from open_memstream) */
+    size_t length;       /* Length of debug output */
+    size_t checked;      /* Number of data blocks checked (scrub) */
+    size_t errors;       /* Number of data blocks with the wrong checksum (scrub) */
+    bool failed;         /* Whether a pointer block could not be read (or a pointer was out of range) */
+};
+
+/* Internal Variables */
+
+const Block ZeroBlock = {{0}};              /* Contents of every hole */
+__thread char InlineCopy[INLINE_DATA_MAX]; /* Inline data last mapped by this thread */
+
+/* Internal Prototypes */
+
+bool write_back(FileSystem* fs);
+bool commit_transaction(FileSystem* fs);
+bool transaction_full(FileSystem* fs);
+void commit_if_full(FileSystem* fs);
+uint32_t* release_deferred(FileSystem* fs, size_t* nfrees);
+void restore_deferred(FileSystem* fs, uint32_t* frees, size_t nfrees);
+bool commit_deferred(FileSystem* fs);
+bool remove_inode(FileSystem* fs, size_t inode_number);
+ssize_t read_inode_data(FileSystem* fs, size_t inode_number, char* data, size_t length, size_t offset);
+ssize_t map_inode_data(FileSystem* fs, size_t inode_number, size_t offset, const char** data);
+ssize_t write_inode_data(FileSystem* fs, size_t inode_number, char* data, size_t length, size_t offset);
+bool spill_inline_data(FileSystem* fs, size_t inode_number, Inode* inode);
+ssize_t read_extents(FileSystem* fs, BlockMap* map, char* data, size_t length, size_t offset);
+ssize_t write_extents(FileSystem* fs, size_t inode_number, Inode* inode, char* data, size_t length, size_t offset);
+bool load_extent(FileSystem* fs, BlockMap* map, uint64_t index, char* extent);
+bool store_extent(FileSystem* fs, BlockMap* map, uint64_t index, char* extent, size_t length);
+ssize_t write_shared(FileSystem* fs, size_t inode_number, Inode* inode, char* data, size_t length, size_t offset);
+pthread_rwlock_t* inode_lock(FileSystem* fs, size_t inode_number);
+bool init_locks(FileSystem* fs);
+void destroy_locks(FileSystem* fs);
+uint32_t shard_index(FileSystem* fs, size_t block);
+uint32_t allocate_from_shard(FileSystem* fs, AllocShard* shard, size_t from, uint32_t count, bool whole, uint32_t* allocated);
+void block_map_init(BlockMap* map, FileSystem* fs, Inode* inode);
+uint64_t block_map_capacity(BlockMap* map);
+uint32_t block_map_get(BlockMap* map, uint64_t logical);
+bool block_map_set(BlockMap* map, uint64_t logical, uint32_t block);
+bool block_map_flush(BlockMap* map);
+uint32_t* block_map_pointer(BlockMap* map, uint64_t logical, bool allocate, int* leaf);
+bool block_map_load(BlockMap* map, int slot, uint32_t block, bool read);
+bool mark_indirect_blocks(ScanTask* task, uint32_t block, uint32_t levels);
+bool mark_data_block(ScanTask* task, uint32_t block);
+bool release_indirect_blocks(FileSystem* fs, uint32_t block, uint32_t levels);
+void release_block(FileSystem* fs, uint32_t block);
+void retire_block(FileSystem* fs, uint32_t block);
+void release_data_block(FileSystem* fs, uint32_t block);
+void mark_inode_dirty(FileSystem* fs, uint32_t index);
+void mark_bitmap_dirty(FileSystem* fs, uint32_t start, uint32_t length);
+void record_checksums(FileSystem* fs, const size_t* blocks, char** buffers, size_t count);
+bool verify_checksums(FileSystem* fs, const size_t* blocks, char** buffers, size_t count);
+bool checksum_matches(FileSystem* fs, size_t block, const char* data);
+void mark_checksum_dirty(FileSystem* fs, uint32_t index);
+uint32_t* extent_entry(FileSystem* fs, size_t block);
+void record_extent(FileSystem* fs, size_t block, uint32_t length);
+uint32_t* refcount_entry(FileSystem* fs, size_t block);
+void add_references(FileSystem* fs, uint32_t block, uint32_t count);
+void drop_reference(FileSystem* fs, uint32_t block);
+bool load_dedup_index(FileSystem* fs);
+void mark_unclean(FileSystem* fs);
+bool write_superblock(FileSystem* fs, bool clean);
+bool load_free_blocks(FileSystem* fs);
+void load_free_inodes(FileSystem* fs);
+ssize_t allocate_inode(FileSystem* fs);
+bool scan_free_blocks(FileSystem* fs, size_t* recounted);
+void* scan_inode_blocks(void* arg);
+void* debug_inode_blocks(void* arg);
+void* scrub_inode_blocks(void* arg);
+bool scrub_indirect_blocks(ScanTask* task, uint32_t block, uint32_t levels);
+void scrub_block(ScanTask* task, uint32_t block);
+size_t scan_tasks(ScanTask* tasks, Disk* disk, uint32_t version, uint32_t inode_blocks);
+void scan_run(ScanTask* tasks, size_t count, void* (*worker)(void*));
+bool queue_bitmap_block(Disk* disk, Bitmap* bitmap, uint32_t start, uint32_t index, Block* stage);
+char* bitmap_block_data(Bitmap* bitmap, uint32_t index, Block* stage);
+uint32_t first_data_block(FileSystem* fs);
+uint32_t checksum(const char* data, size_t length);
+uint32_t block_checksum(const char* data);
+uint32_t direct_pointers(FileSystem* fs);
+bool is_zero(const char* data, size_t length);
+ReadAhead* readahead_stream(FileSystem* fs, size_t inode_number, size_t offset);
+bool readahead_fill(FileSystem* fs, ReadAhead* stream, BlockMap* map, uint64_t start_block, uint64_t end_block, uint64_t file_blocks);
+void readahead_invalidate(FileSystem* fs, size_t inode_number);
+
 /* External Functions */
 
 /**
@@ -17,7 +166,8 @@
  *
  *  1. Read SuperBlock and report its information.
  *
- *  2. Read Inode Table and report information about each Inode.
+ *  2. Read Inode Table and report information about each Inode (with the
+ *  inode blocks split across threads, and their reports printed in order).
  *
  * @param       disk        Pointer to Disk structure.
  **/
@@ -35,66 +185,77 @@ void fs_debug(Disk* disk) {
     printf("    %u blocks\n", block.super.blocks);
     printf("    %u inode blocks\n", block.super.inode_blocks);
     printf("    %u inodes\n", block.super.inodes);
+    if (block.super.version) {
+        printf("    version %u\n", block.super.version);
+    }
+    if (block.super.version >= 2) {
+        printf("    %u bitmap blocks (%s)\n", block.super.bitmap_blocks, block.super.clean ? "clean" : "unclean");
+    }
+    if (block.super.version >= 3) {
+        printf("    %u journal blocks\n", block.super.journal_blocks);
+    }
+    if (block.super.version >= 4 && block.super.checksum_blocks) {
+        printf("    %u checksum blocks\n", block.super.checksum_blocks);
+    }
+    if (block.super.version >= 6 && block.super.extent_blocks) {
+        printf("    %u blocks per compressed extent\n", block.super.extent_blocks);
+    }
+    if (block.super.version >= 7 && block.super.dedup) {
+        printf("    data blocks shared by contents\n");
+    }
 
-    /* Read Inodes */
-    Block inode_block = {{0}};
-    for (int i = 0; i < block.super.inode_blocks; i++) {
-        if (disk_read(disk, i + 1, inode_block.data) == DISK_FAILURE) {
-            continue;
-        }
-        for (int j = 0; j < INODES_PER_BLOCK; j++) {
-            Inode inode = inode_block.inodes[j];
-            if (!inode.valid) {
-                continue;
-            }
-            printf("Inode %d:\n", j);
-            printf("    size: %d bytes\n", inode.size);
-            printf("    direct blocks:");
-
-            // print direct blocks
-            int num_blocks = (inode.size + (BLOCK_SIZE - 1)) / BLOCK_SIZE;
-            for (int k = 0; k < POINTERS_PER_INODE; k++) {
-                if (k >= num_blocks) {
-                    continue;
-                }
-                printf(" %d", inode.direct[k]);
-            }
-            printf("\n");
-            if (num_blocks <= POINTERS_PER_INODE) {
-                continue;
-            }
-            Block indirect_block = {{0}};
-            if (disk_read(disk, inode.indirect, indirect_block.data) == DISK_FAILURE) {
-                continue;
-            }
+    /* Read Inodes (split across threads, each reading straight from the disk image) */
+    if (!disk_flush(disk)) {
+        return;
+    }
 
-            printf("    indirect block: %d\n", inode.indirect);
-            printf("    indirect data blocks:");
+    ScanTask tasks[SCAN_THREADS_MAX];
+    size_t count = scan_tasks(tasks, disk, block.super.version, block.super.inode_blocks);
+    scan_run(tasks, count, debug_inode_blocks);
 
-            // print indirect blocks
-            for (int k = 0; k < num_blocks - POINTERS_PER_INODE; k++) {
-                printf(" %d", indirect_block.pointers[k]);
-            }
-            printf("\n");
+    for (size_t t = 0; t < count; t++) {
+        if (tasks[t].output) {
+            fwrite(tasks[t].output, 1, tasks[t].length, stdout);
+            free(tasks[t].output);
         }
     }
 }
 
+/**
+ * Format Disk quickly (see fs_format_mode with FORMAT_FAST).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       disk    Pointer to Disk structure.
+ * @return      Whether or not all disk operations were successful.
+ **/
+bool fs_format(FileSystem* fs, Disk* disk) {
+    return fs_format_mode(fs, disk, FORMAT_FAST);
+}
+
 /**
  * Format Disk by doing the following:
  *
  *  1. Write SuperBlock (with appropriate magic number, number of blocks,
- *  number of inode blocks, and number of inodes).
+ *  number of inode blocks, number of inodes, and format version).
+ *
+ *  2. Clear the inode blocks, write the free block bitmap, clear any
+ *  checksum blocks, and clear the journal header (so no earlier transaction
+ *  is ever replayed).
  *
- *  2. Clear all remaining blocks.
+ *  3. Clear the data blocks: a fast format only discards them (they are
+ *  unreachable once every inode is invalid and the bitmap marks them free),
+ *  while a secure format overwrites each one.
  *
  * Note: Do not format a mounted Disk!
  *
  * @param       fs      Pointer to FileSystem structure.
  * @param       disk    Pointer to Disk structure.
+ * @param       mode    FORMAT_FAST or FORMAT_SECURE (either may include
+ *                      FORMAT_CHECKSUMS, and one of FORMAT_COMPRESSION or
+ *                      FORMAT_DEDUP).
  * @return      Whether or not all disk operations were successful.
  **/
-bool fs_format(FileSystem* fs, Disk* disk) {
+bool fs_format_mode(FileSystem* fs, Disk* disk, FormatMode mode) {
     if (fs->disk) {
         fprintf(stderr, "Cannot format a mounted disk.\n");
         return false;
@@ -105,21 +266,86 @@ bool fs_format(FileSystem* fs, Disk* disk) {
         return false;
     }
 
+    if ((mode & FORMAT_COMPRESSION) && (mode & FORMAT_DEDUP)) {
+        fprintf(stderr, "Cannot format disk with both compression and deduplication.\n");
+        return false;
+    }
+
     fs->meta_data.magic_number = MAGIC_NUMBER;
     fs->meta_data.blocks = disk->blocks;
 
     float inode_blocks = (float)fs->meta_data.blocks / 10;
     fs->meta_data.inode_blocks = ceil(inode_blocks);
     fs->meta_data.inodes = fs->meta_data.inode_blocks * INODES_PER_BLOCK;
+    fs->meta_data.version = FS_VERSION;
+    fs->meta_data.bitmap_blocks = (fs->meta_data.blocks + BITS_PER_BITMAP_BLOCK - 1) / BITS_PER_BITMAP_BLOCK;
+
+    // Small disks cannot spare enough blocks for a useful journal
+    uint32_t journal_blocks = fs->meta_data.blocks / JOURNAL_RATIO;
+    fs->meta_data.journal_blocks = (journal_blocks >= JOURNAL_MIN) ? min(journal_blocks, JOURNAL_MAX) : 0;
+    fs->meta_data.journal_sequence = 1;
+    fs->meta_data.root_directory = 0;
+    fs->meta_data.checksum_blocks = (mode & FORMAT_CHECKSUMS) ? (fs->meta_data.blocks + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK : 0;
+
+    // Compressed extents record their lengths (and shared blocks their reference counts) in a second half of the checksum region
+    fs->meta_data.extent_blocks = (mode & FORMAT_COMPRESSION) ? EXTENT_BLOCKS : 0;
+    fs->meta_data.dedup = (mode & FORMAT_DEDUP) ? 1 : 0;
+    if (mode & (FORMAT_COMPRESSION | FORMAT_DEDUP)) {
+        fs->meta_data.checksum_blocks = 2 * ((fs->meta_data.blocks + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK);
+    }
+
+    // Every block before the first data block is in use
+    uint32_t bitmap_start = fs->meta_data.inode_blocks + 1;
+    uint32_t journal_start = bitmap_start + fs->meta_data.bitmap_blocks + fs->meta_data.checksum_blocks;
+    uint32_t data_start = journal_start + fs->meta_data.journal_blocks;
+    Bitmap* free_blocks = bitmap_create(fs->meta_data.blocks, true);
+    if (!free_blocks) {
+        return false;
+    }
+    if (data_start > fs->meta_data.blocks) {
+        fprintf(stderr, "Cannot format disk with too few blocks for its metadata.\n");
+        bitmap_delete(free_blocks);
+        return false;
+    }
+    bitmap_clear_range(free_blocks, 0, data_start);
+    fs->meta_data.bitmap_checksum = checksum((char*)free_blocks->words, free_blocks->nwords * sizeof(uint64_t));
+    fs->meta_data.clean = 1;
+
+    Block superblock = {0};
+    superblock.super = fs->meta_data;
+    if (disk_write(disk, 0, superblock.data) == DISK_FAILURE) {
+        fprintf(stderr, "Failed to write superblock during formatting.\n");
+        bitmap_delete(free_blocks);
+        return false;
+    }
 
     Block zeros = {0};
-    for (int i = 1; i < fs->meta_data.blocks; i++) {
-        if (disk_write(disk, i, zeros.data) == DISK_FAILURE) {
-            fprintf(stderr, "Failed to overwrite block %d during formatting.\n", i);
-            return false;
+    Block stage = {0};
+    bool success = true;
+    // A fast format clears only the first journal block: a transaction is never replayed without its header
+    uint32_t checksum_start = bitmap_start + fs->meta_data.bitmap_blocks;
+    uint32_t cleared = (mode & FORMAT_SECURE) ? fs->meta_data.blocks : journal_start + (data_start > journal_start);
+    for (uint32_t i = 1; i < cleared && success; i++) {
+        if (i >= bitmap_start && i < checksum_start) {
+            success = queue_bitmap_block(disk, free_blocks, bitmap_start, i - bitmap_start, &stage);
+        } else {
+            success = disk_queue_write(disk, i, zeros.data);
         }
+        if (!success) {
+            fprintf(stderr, "Failed to overwrite block %u during formatting.\n", i);
+        }
+    }
+
+    success = disk_drain(disk) && success && disk_flush(disk);
+    bitmap_delete(free_blocks);
+    if (!success) {
+        return false;
     }
 
+    // Discarding is only an optimization: stale journal and data blocks are never read
+    if (!(mode & FORMAT_SECURE) && cleared < fs->meta_data.blocks) {
+        disk_discard(disk, cleared, fs->meta_data.blocks - cleared);
+    }
     return true;
 }
 
@@ -131,6 +357,8 @@ bool fs_format(FileSystem* fs, Disk* disk) {
  * @return      Whether or not the mount operation was successful.
  **/
 bool fs_mount(FileSystem* fs, Disk* disk) {
+    uint64_t start = stats_start();
+
     // Do not mount a Disk that has already been mounted!
     if (fs->disk) {
         fprintf(stderr, "You fool. You have already mounted this disk! Mount something else.\n");
@@ -158,6 +386,27 @@ bool fs_mount(FileSystem* fs, Disk* disk) {
         return false;
     }
 
+    if (superblock.super.version > FS_VERSION) {
+        fprintf(stderr, "Unsupported file system version %u.\n", superblock.super.version);
+        return false;
+    }
+
+    uint32_t journal_blocks = superblock.super.version >= 3 ? superblock.super.journal_blocks : 0;
+    uint32_t checksum_blocks = superblock.super.version >= 4 ? superblock.super.checksum_blocks : 0;
+    uint32_t extent_blocks = superblock.super.version >= 6 ? superblock.super.extent_blocks : 0;
+    uint32_t dedup = superblock.super.version >= 7 ? superblock.super.dedup : 0;
+    uint32_t checksum_regions = (extent_blocks || dedup) ? 2 : 1;
+    if (superblock.super.version >= 2 &&
+        (superblock.super.bitmap_blocks != (superblock.super.blocks + BITS_PER_BITMAP_BLOCK - 1) / BITS_PER_BITMAP_BLOCK ||
+         (uint64_t)superblock.super.inode_blocks + superblock.super.bitmap_blocks + checksum_blocks + journal_blocks + 1 > superblock.super.blocks ||
+         journal_blocks == 1 ||
+         (extent_blocks && (extent_blocks != EXTENT_BLOCKS || !checksum_blocks)) ||
+         (dedup && (dedup != 1 || extent_blocks || !checksum_blocks)) ||
+         (checksum_blocks && checksum_blocks != checksum_regions * ((superblock.super.blocks + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK)))) {
+        fprintf(stderr, "Invalid free block bitmap, checksum, extent, or journal region.\n");
+        return false;
+    }
+
     // 2. Record FileSystem disk attribute.
     fs->disk = disk;
 
@@ -166,72 +415,277 @@ bool fs_mount(FileSystem* fs, Disk* disk) {
     fs->meta_data.inode_blocks = superblock.super.inode_blocks;
     fs->meta_data.inodes = superblock.super.inodes;
     fs->meta_data.magic_number = superblock.super.magic_number;
+    fs->meta_data.version = superblock.super.version;
+    if (fs->meta_data.version >= 2) {
+        fs->meta_data.bitmap_blocks = superblock.super.bitmap_blocks;
+        fs->meta_data.bitmap_checksum = superblock.super.bitmap_checksum;
+        fs->meta_data.clean = superblock.super.clean;
+    }
+    fs->meta_data.journal_blocks = journal_blocks;
+    fs->meta_data.journal_sequence = superblock.super.journal_sequence;
+    fs->meta_data.root_directory = superblock.super.version >= 3 ? superblock.super.root_directory : 0;
+    fs->meta_data.checksum_blocks = checksum_blocks;
+    fs->meta_data.extent_blocks = extent_blocks;
+    fs->meta_data.dedup = dedup;
+
+    // 4. Initialize FileSystem free blocks bitmap and inode table.
+    fs->free_blocks = bitmap_create(fs->meta_data.blocks, true);
+    fs->free_inodes = bitmap_create(fs->meta_data.inodes, true);
+    fs->inode_table = calloc(fs->meta_data.inode_blocks, sizeof(Block));
+    fs->dirty_inode_blocks = calloc(fs->meta_data.inode_blocks, sizeof(bool));
+    fs->dirty_bitmap_blocks = calloc(fs->meta_data.bitmap_blocks + 1, sizeof(bool));
+    if (checksum_blocks) {
+        fs->checksum_table = calloc(checksum_blocks, sizeof(Block));
+        fs->dirty_checksum_blocks = calloc(checksum_blocks, sizeof(bool));
+    }
+    if (!fs->free_blocks || !fs->free_inodes || !fs->inode_table || !fs->dirty_inode_blocks || !fs->dirty_bitmap_blocks ||
+        (checksum_blocks && (!fs->checksum_table || !fs->dirty_checksum_blocks)) || !init_locks(fs)) {
+        fprintf(stderr, "Couldn't allocate file system tables.\n");
+        goto fs_mount_failure;
+    }
 
-    // 4. Initialize FileSystem free blocks bitmap.
-    fs->free_blocks = calloc(fs->meta_data.blocks, sizeof(bool));
-    memset(fs->free_blocks, 1, fs->meta_data.blocks * sizeof(bool));
-
-    // Remove superblock from freelist
-    fs->free_blocks[0] = false;
-
-    // Walk the inode blocks
-    for (int i = 1; i < fs->meta_data.inode_blocks + 1; i++) {
-        Block inode_block = {0};
-        fs->free_blocks[i] = false;
+    // Replay the last journal transaction in case it never reached its home blocks
+    if (journal_blocks > 0) {
+        uint32_t journal_start = first_data_block(fs) - journal_blocks;
+        uint32_t sequence = fs->meta_data.journal_sequence;
+        if (!journal_replay(disk, journal_start, journal_blocks, &sequence)) {
+            fprintf(stderr, "Couldn't replay journal.\n");
+            goto fs_mount_failure;
+        }
 
-        if (disk_read(disk, i, inode_block.data) == DISK_FAILURE) {
-            return false;
+        fs->journal = journal_create(journal_start, journal_blocks, sequence);
+        if (!fs->journal) {
+            goto fs_mount_failure;
         }
-        // Walk the inodes in this block
-        for (int j = 0; j < INODES_PER_BLOCK; j++) {
-            Inode inode = inode_block.inodes[j];
-            if (!inode.valid) {
-                continue;
-            }
+    }
 
-            // Remove direct blocks in use by this inode from the free list
-            for (int k = 0; k < POINTERS_PER_INODE; k++) {
-                if (inode.direct[k] > 0) {
-                    fs->free_blocks[inode.direct[k]] = false;
-                }
-            }
+    // Load the inode (and checksum) blocks as one batch, keeping a copy of each for the mounted lifetime
+    for (uint32_t i = 1; i < fs->meta_data.inode_blocks + 1; i++) {
+        if (!disk_queue_read(disk, i, fs->inode_table[i - 1].data)) {
+            disk_drain(disk);
+            goto fs_mount_failure;
+        }
+    }
+    uint32_t checksum_start = fs->meta_data.inode_blocks + 1 + fs->meta_data.bitmap_blocks;
+    for (uint32_t i = 0; i < checksum_blocks; i++) {
+        if (!disk_queue_read(disk, checksum_start + i, fs->checksum_table[i].data)) {
+            disk_drain(disk);
+            goto fs_mount_failure;
+        }
+    }
+    if (!disk_drain(disk)) {
+        goto fs_mount_failure;
+    }
+    load_free_inodes(fs);
 
-            // Similarly, remove indirect block and valid indirect data blocks from the free list
-            if (inode.indirect < 1) {
-                continue;
-            }
+    // Trust the free block bitmap on disk if it is intact, otherwise walk every inode (recounting the pointers to each block)
+    if (!load_free_blocks(fs) && !scan_free_blocks(fs, NULL)) {
+        goto fs_mount_failure;
+    }
 
-            fs->free_blocks[inode.indirect] = false;
+    // Index the contents of every shared data block from its recorded checksum
+    if (dedup && !load_dedup_index(fs)) {
+        fprintf(stderr, "Couldn't build deduplication index.\n");
+        goto fs_mount_failure;
+    }
 
-            Block indirect_block = {0};
-            if (disk_read(disk, inode.indirect, indirect_block.data) == DISK_FAILURE) {
-                return false;
-            }
+    // Begin next-fit allocation at the first data block
+    fs->free_blocks->cursor = first_data_block(fs);
 
-            for (int k = 0; k < POINTERS_PER_BLOCK; k++) {
-                if (indirect_block.pointers[k] > 0) {
-                    fs->free_blocks[indirect_block.pointers[k]] = false;
-                }
-            }
-        }
+    for (int i = 0; i < READAHEAD_STREAMS; i++) {
+        fs->readahead[i].inode_number = -1;
     }
-
+    stats_record(STAT_FS_MOUNT, start, 0, 0);
     return true;
+
+fs_mount_failure:
+    fs->disk = NULL;
+    fs_unmount(fs);
+    stats_record(STAT_FS_MOUNT, start, 0, -1);
+    return false;
 }
 
 /**
  * Unmount FileSystem from internal Disk by doing the following:
  *
- *  1. Set FileSystem disk attribute.
+ *  1. Write back dirty inode blocks and any dirty blocks cached by the Disk.
+ *
+ *  2. Set FileSystem disk attribute.
  *
- *  2. Release free blocks bitmap.
+ *  3. Release free blocks bitmap, inode table, journal, dedup index, and
+ *  read-ahead buffers.
  *
  * @param       fs      Pointer to FileSystem structure.
  **/
 void fs_unmount(FileSystem* fs) {
+    if (fs->disk && !fs_sync(fs)) {
+        fprintf(stderr, "Failed to write back file system during unmount.\n");
+    }
     fs->disk = NULL;
-    free(fs->free_blocks);
+    destroy_locks(fs);
+    bitmap_delete(fs->free_blocks);
     fs->free_blocks = NULL;
+    bitmap_delete(fs->free_inodes);
+    fs->free_inodes = NULL;
+    free(fs->inode_table);
+    fs->inode_table = NULL;
+    free(fs->dirty_inode_blocks);
+    fs->dirty_inode_blocks = NULL;
+    free(fs->dirty_bitmap_blocks);
+    fs->dirty_bitmap_blocks = NULL;
+    free(fs->checksum_table);
+    fs->checksum_table = NULL;
+    free(fs->dirty_checksum_blocks);
+    fs->dirty_checksum_blocks = NULL;
+    fs->checksum_errors = 0;
+    journal_delete(fs->journal);
+    fs->journal = NULL;
+    fs->dirty_blocks = 0;
+    dedup_delete(fs->dedup_index);
+    fs->dedup_index = NULL;
+    fs->shared_blocks = 0;
+    for (int i = 0; i < READAHEAD_STREAMS; i++) {
+        free(fs->readahead[i].buffer);
+        fs->readahead[i] = (ReadAhead){.inode_number = -1};
+    }
+}
+
+/**
+ * Write back FileSystem state to Disk by doing the following:
+ *
+ *  1. Write every dirty block of the in-memory Inode table and free block
+ *  bitmap as one batch (committed through the journal, along with any
+ *  pointer blocks it holds, if there is one).
+ *
+ *  2. Flush any dirty blocks cached by the Disk.
+ *
+ *  3. Mark the superblock clean (with the checksum of the bitmap) once the
+ *  bitmap on Disk matches the Inode table on Disk.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Whether or not all disk operations were successful.
+ **/
+bool fs_sync(FileSystem* fs) {
+    if (!fs->disk) {
+        return false;
+    }
+
+    uint64_t start = stats_start();
+    pthread_rwlock_wrlock(&fs->sync_lock);
+    bool success = write_back(fs);
+    pthread_rwlock_unlock(&fs->sync_lock);
+    stats_record(STAT_FS_SYNC, start, 0, success ? 0 : -1);
+    return success;
+}
+
+/**
+ * Check the free block bitmap against the Inode table by doing the
+ * following:
+ *
+ *  1. Commit the running journal transaction, then rebuild the free block
+ *  bitmap by walking every Inode and pointer block (what mount does when the
+ *  bitmap on Disk cannot be trusted), recounting the pointers to each shared
+ *  data block along the way.
+ *
+ *  2. Count the blocks whose state differs from the bitmap in use (and whose
+ *  reference count was wrong).
+ *
+ *  3. Replace the bitmap in use with the rebuilt one (written back by the
+ *  next sync), and rebuild the dedup index from the new counts.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Number of blocks repaired (-1 on failure).
+ **/
+ssize_t fs_fsck(FileSystem* fs) {
+    if (!fs->disk) {
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&fs->sync_lock);
+    Bitmap* old = fs->free_blocks;
+    ssize_t repaired = -1;
+    if (fs->journal && !commit_transaction(fs)) {
+        pthread_rwlock_unlock(&fs->sync_lock);
+        return -1;
+    }
+
+    size_t recounted = 0;
+    fs->free_blocks = bitmap_create(fs->meta_data.blocks, true);
+    if (!fs->free_blocks || !scan_free_blocks(fs, &recounted)) {
+        bitmap_delete(fs->free_blocks);
+        fs->free_blocks = old;
+    } else {
+        repaired = recounted;
+        for (size_t w = 0; w < old->nwords; w++) {
+            repaired += __builtin_popcountll(old->words[w] ^ fs->free_blocks->words[w]);
+        }
+
+        fs->free_blocks->cursor = old->cursor;
+        bitmap_delete(old);
+    }
+
+    if (repaired >= 0 && fs->dedup_index && !load_dedup_index(fs)) {
+        repaired = -1;
+    }
+
+    pthread_rwlock_unlock(&fs->sync_lock);
+    return repaired;
+}
+
+/**
+ * Check every data block in use against its recorded checksum by doing the
+ * following:
+ *
+ *  1. Write back (or commit) every dirty block, so the image on Disk holds
+ *  the current data and metadata.
+ *
+ *  2. Walk every Inode and pointer block, split across threads the way
+ *  mount does, reading each data block straight from the disk image.
+ *
+ *  3. Count the blocks whose contents do not match their checksum (added to
+ *  the errors reported by fs_statfs).
+ *
+ * Note: Updates wait for the scrub to finish.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       checked Set to the number of data blocks checked (may be
+ *                      NULL).
+ * @return      Number of data blocks with the wrong checksum (-1 on failure
+ *              or if the FileSystem keeps no checksums).
+ **/
+ssize_t fs_scrub(FileSystem* fs, size_t* checked) {
+    if (!fs->disk || !fs->checksum_table) {
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&fs->sync_lock);
+    if (!write_back(fs)) {
+        pthread_rwlock_unlock(&fs->sync_lock);
+        return -1;
+    }
+
+    ScanTask tasks[SCAN_THREADS_MAX];
+    size_t count = scan_tasks(tasks, fs->disk, fs->meta_data.version, fs->meta_data.inode_blocks);
+    for (size_t t = 0; t < count; t++) {
+        tasks[t].fs = fs;
+    }
+    scan_run(tasks, count, scrub_inode_blocks);
+
+    ssize_t errors = 0;
+    size_t total = 0;
+    for (size_t t = 0; t < count; t++) {
+        errors = (errors < 0 || tasks[t].failed) ? -1 : errors + (ssize_t)tasks[t].errors;
+        total += tasks[t].checked;
+    }
+    pthread_rwlock_unlock(&fs->sync_lock);
+
+    if (errors > 0) {
+        __atomic_add_fetch(&fs->checksum_errors, errors, __ATOMIC_RELAXED);
+    }
+    if (checked) {
+        *checked = total;
+    }
+    return errors;
 }
 
 /**
@@ -241,35 +695,70 @@ void fs_unmount(FileSystem* fs) {
  *
  *  2. Reserve free inode in Inode table.
  *
- * Note: Be sure to record updates to Inode table to Disk.
+ * Note: Updates are made to the in-memory Inode table and recorded to Disk
+ * by fs_sync (or fs_unmount).  The search holds the table lock, so threads
+ * creating at the same time never claim the same Inode.
  *
  * @param       fs      Pointer to FileSystem structure.
  * @return      Inode number of allocated Inode.
  **/
 ssize_t fs_create(FileSystem* fs) {
-    Block inode_table = {0};
-    for (int i = 1; i < fs->meta_data.inode_blocks + 1; i++) {
-        if (disk_read(fs->disk, i, inode_table.data) == DISK_FAILURE) {
-            fprintf(stderr, "uh oh\n");
-            return -1;
-        }
+    if (!fs->disk) {
+        return -1;
+    }
 
-        for (int j = 0; j < INODES_PER_BLOCK; j++) {
-            if (inode_table.inodes[j].valid == 0) {
-                // Found an inode!
-                inode_table.inodes[j].valid = 1;
-                if (disk_write(fs->disk, i, inode_table.data) == DISK_FAILURE) {
-                    fprintf(stderr, "uh oh\n");
-                    return -1;
-                }
+    uint64_t start = stats_start();
+    pthread_rwlock_rdlock(&fs->sync_lock);
+    mark_unclean(fs);
+    pthread_mutex_lock(&fs->table_lock);
+    ssize_t inode_number = allocate_inode(fs);
+    pthread_mutex_unlock(&fs->table_lock);
+    pthread_rwlock_unlock(&fs->sync_lock);
+    commit_if_full(fs);
+    stats_record(STAT_FS_CREATE, start, 0, inode_number);
+
+    // Couldn't find an inode (-1). Darn!
+    return inode_number;
+}
 
-                return j;
-            }
+/**
+ * Create many new Inodes at once by doing the following:
+ *
+ *  1. Take the lowest free Inodes from the free inode bitmap under a single
+ *  hold of the Inode table lock.
+ *
+ *  2. Mark each Inode valid, so that every Inode block touched is dirtied
+ *  (and later written) once no matter how many of its Inodes were taken.
+ *
+ * Note: If fewer than count Inodes are free, all of the free Inodes are
+ * created.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_numbers   Array to store new Inode numbers in.
+ * @param       count           Number of Inodes to create.
+ * @return      Number of Inodes created (-1 if FileSystem is not mounted).
+ **/
+ssize_t fs_create_many(FileSystem* fs, uint32_t* inode_numbers, size_t count) {
+    if (!fs->disk) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&fs->sync_lock);
+    mark_unclean(fs);
+    pthread_mutex_lock(&fs->table_lock);
+    size_t created = 0;
+    while (created < count) {
+        ssize_t inode_number = allocate_inode(fs);
+        if (inode_number < 0) {
+            break;
         }
+        inode_numbers[created++] = inode_number;
     }
+    pthread_mutex_unlock(&fs->table_lock);
+    pthread_rwlock_unlock(&fs->sync_lock);
+    commit_if_full(fs);
 
-    // Couldn't find an inode. Darn!
-    return -1;
+    return created;
 }
 
 /**
@@ -277,62 +766,42 @@ ssize_t fs_create(FileSystem* fs) {
  *
  *  1. Load and check status of Inode.
  *
- *  2. Release any direct blocks.
+ *  2. Mark Inode as free in Inode table.
+ *
+ *  3. Release any direct blocks.
  *
- *  3. Release any indirect blocks.
+ *  4. Release any indirect blocks (and double and triple indirect trees).
  *
- *  4. Mark Inode as free in Inode table.
+ * Freeing the Inode first means a removal only ever moves forward: if a
+ * pointer block cannot be read, the blocks below it are left allocated
+ * (for fsck to reclaim) rather than left behind a valid Inode that points
+ * at blocks already released.
+ *
+ * Note: Released blocks are only marked free in the bitmap; their contents
+ * are left in place rather than overwritten with zeros.  With a journal,
+ * they are not marked free until the removal commits.  A data block shared
+ * with other Inodes (version 7) only loses one reference, and is released
+ * with its last.
  *
  * @param       fs              Pointer to FileSystem structure.
  * @param       inode_number    Inode to remove.
  * @return      Whether or not removing the specified Inode was successful.
  **/
 bool fs_remove(FileSystem* fs, size_t inode_number) {
-    Block zeros = {0};
-    Inode inode = {0};
-
-    if (!load_inode(&inode, inode_number, fs->disk)) {
+    pthread_rwlock_t* lock = inode_lock(fs, inode_number);
+    if (!lock) {
         return false;
     }
 
-    // Release indirect block and indirect data blocks from the free list
-    if (inode.indirect > 0) {
-        Block indirect_block = {0};
-        if (disk_read(fs->disk, inode.indirect, indirect_block.data) == DISK_FAILURE) {
-            return false;
-        }
-
-        for (int k = 0; k < POINTERS_PER_BLOCK; k++) {
-            if (indirect_block.pointers[k] > 0) {
-                if (disk_write(fs->disk, indirect_block.pointers[k], zeros.data) == DISK_FAILURE) {
-                    return false;
-                }
-                fs->free_blocks[indirect_block.pointers[k]] = true;
-            }
-        }
-
-        if (disk_write(fs->disk, inode.indirect, zeros.data) == DISK_FAILURE) {
-            return false;
-        }
-
-        fs->free_blocks[inode.indirect] = true;
-    }
-
-    // Release direct blocks in use by this inode
-    for (int k = 0; k < POINTERS_PER_INODE; k++) {
-        if (inode.direct[k] > 0) {
-            if (disk_write(fs->disk, inode.direct[k], zeros.data) == DISK_FAILURE) {
-                return false;
-            }
-            fs->free_blocks[inode.direct[k]] = true;
-        }
-    }
-
-    // Set inode invalid
-    Inode new_inode = {0};
-    save_inode(&new_inode, inode_number, fs->disk);
-
-    return true;
+    uint64_t start = stats_start();
+    pthread_rwlock_wrlock(lock);
+    pthread_rwlock_rdlock(&fs->sync_lock);
+    bool success = remove_inode(fs, inode_number);
+    pthread_rwlock_unlock(&fs->sync_lock);
+    pthread_rwlock_unlock(lock);
+    commit_if_full(fs);
+    stats_record(STAT_FS_REMOVE, start, inode_number, success ? 0 : -1);
+    return success;
 }
 
 /**
@@ -343,17 +812,87 @@ bool fs_remove(FileSystem* fs, size_t inode_number) {
  * @return      Size of specified Inode (-1 if does not exist).
  **/
 ssize_t fs_stat(FileSystem* fs, size_t inode_number) {
+    uint64_t start = stats_start();
     Inode inode = {0};
+    ssize_t size = load_inode(&inode, inode_number, fs) ? (ssize_t)inode_size(&inode) : -1;
+    stats_record(STAT_FS_STAT, start, inode_number, size);
+    return size;
+}
 
-    if (!load_inode(&inode, inode_number, fs->disk)) {
-        return -1;
+/**
+ * Report FileSystem usage from the maintained free block count (without
+ * scanning the free block bitmap or Inode table).  Blocks released by the
+ * running journal transaction count as free.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       stat    StatFS structure to fill in.
+ * @return      Whether or not the FileSystem is mounted.
+ **/
+bool fs_statfs(FileSystem* fs, StatFS* stat) {
+    if (!fs->disk) {
+        return false;
     }
 
-    if (inode.valid) {
-        return inode.size;
-    } else {
+    pthread_rwlock_rdlock(&fs->sync_lock);
+    stat->blocks = fs->meta_data.blocks;
+    stat->data_blocks = fs->meta_data.blocks - first_data_block(fs);
+    stat->free_blocks = __atomic_load_n(&fs->free_blocks->count, __ATOMIC_RELAXED);
+    if (fs->journal) {
+        pthread_mutex_lock(&fs->journal->lock);
+        stat->free_blocks += fs->journal->nfrees;
+        pthread_mutex_unlock(&fs->journal->lock);
+    }
+    stat->inodes = fs->meta_data.inodes;
+    pthread_mutex_lock(&fs->table_lock);
+    stat->free_inodes = fs->free_inodes->count;
+    pthread_mutex_unlock(&fs->table_lock);
+    stat->checksum_errors = __atomic_load_n(&fs->checksum_errors, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&fs->dedup_lock);
+    stat->shared_blocks = fs->shared_blocks;
+    pthread_mutex_unlock(&fs->dedup_lock);
+    pthread_rwlock_unlock(&fs->sync_lock);
+    return true;
+}
+
+/**
+ * Return the Inode holding the root directory (recorded in the superblock
+ * by fs_set_root).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Inode number of root directory (-1 if there is none).
+ **/
+ssize_t fs_root(FileSystem* fs) {
+    if (!fs->disk) {
         return -1;
     }
+
+    pthread_mutex_lock(&fs->super_lock);
+    ssize_t inode_number = (ssize_t)fs->meta_data.root_directory - 1;
+    pthread_mutex_unlock(&fs->super_lock);
+    return inode_number;
+}
+
+/**
+ * Record the Inode holding the root directory in the superblock (written
+ * right away, keeping its clean flag as it is).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode of root directory.
+ * @return      Whether or not the superblock was written (false before
+ *              version 3, which has nowhere to record it).
+ **/
+bool fs_set_root(FileSystem* fs, size_t inode_number) {
+    if (!fs->disk || fs->meta_data.version < 3 || inode_number >= fs->meta_data.inodes) {
+        return false;
+    }
+
+    pthread_rwlock_rdlock(&fs->sync_lock);
+    pthread_mutex_lock(&fs->super_lock);
+    fs->meta_data.root_directory = inode_number + 1;
+    bool success = write_superblock(fs, fs->meta_data.clean);
+    pthread_mutex_unlock(&fs->super_lock);
+    pthread_rwlock_unlock(&fs->sync_lock);
+    return success;
 }
 
 /**
@@ -362,9 +901,17 @@ ssize_t fs_stat(FileSystem* fs, size_t inode_number) {
  *
  *  1. Load Inode information.
  *
- *  2. Continuously read blocks and copy data to buffer.
+ *  2. For a sequential reader, serve the range from its read-ahead buffer,
+ *  refilling the buffer (with an adaptive window past the range) if needed.
  *
- *  Note: Data is read from direct blocks first, and then from indirect blocks.
+ *  3. Otherwise, map every logical block in the range to its data block,
+ *  zero-filling holes (blocks with no data block) instead of reading them.
+ *
+ *  4. Read all the data blocks with one vectored disk request, placing whole
+ *  blocks directly in the buffer and staging partial ones.
+ *
+ *  Note: Data is read from direct blocks first, and then from the indirect,
+ *  double indirect, and triple indirect trees.
  *
  * @param       fs              Pointer to FileSystem structure.
  * @param       inode_number    Inode to read data from.
@@ -374,258 +921,2984 @@ ssize_t fs_stat(FileSystem* fs, size_t inode_number) {
  * @return      Number of bytes read (-1 on error).
  **/
 ssize_t fs_read(FileSystem* fs, size_t inode_number, char* data, size_t length, size_t offset) {
-    Inode inode = {0};
-    if (!load_inode(&inode, inode_number, fs->disk)) {
+    pthread_rwlock_t* lock = inode_lock(fs, inode_number);
+    if (!lock) {
         return -1;
     }
 
-    // Return successful read of 0 if read is not possible.
-    if (inode.size < 1 || offset >= inode.size) {
-        return 0;
-    }
-
-    // Truncate requested length to the file size.
-    length = min(inode.size - offset, length);
-
-    // Determine which logical data block to begin the read at.
-    uint32_t start_block = offset / BLOCK_SIZE;
-    uint32_t offset_into_block = offset % BLOCK_SIZE;
-
-    ssize_t bytes_read = 0;
+    uint64_t start = stats_start();
+    pthread_rwlock_rdlock(lock);
+    ssize_t result = read_inode_data(fs, inode_number, data, length, offset);
+    pthread_rwlock_unlock(lock);
+    stats_record(STAT_FS_READ, start, inode_number, result);
+    return result;
+}
 
-    for (uint32_t i = start_block; length > 0; i++) {
-        // Determine how many bytes to read from this data block.
-        ssize_t length_to_read;
-        if (i == 0) {
-            length_to_read = min(BLOCK_SIZE - offset, length);
-        } else {
-            length_to_read = min(BLOCK_SIZE, length);
-        }
+/**
+ * Map data from the specified Inode beginning at the specified offset
+ * without copying it, by doing the following:
+ *
+ *  1. Load Inode information.
+ *
+ *  2. Find the data block holding offset and extend the run for as long as
+ *  the following logical blocks are physically adjacent.
+ *
+ *  3. Hand out a pointer into the mapped disk image for that run (or to a
+ *  block of zeros for a hole).
+ *
+ * Note: Only available on a Disk using the mmap backend, and not for data
+ * stored compressed (use fs_read instead).  The pointer stays valid until
+ * the Disk is closed, but the data may change if the Inode is written.  Data
+ * kept in the Inode is copied out instead, and that copy is only valid until
+ * the calling thread maps data again.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to read data from.
+ * @param       offset          Byte offset from which to begin reading.
+ * @param       data            Set to point at the data.
+ * @return      Number of bytes available at data (0 at end of file, -1 on
+ *              error or if the Disk is not mapped).
+ **/
+ssize_t fs_read_map(FileSystem* fs, size_t inode_number, size_t offset, const char** data) {
+    pthread_rwlock_t* lock = inode_lock(fs, inode_number);
+    if (!lock) {
+        return -1;
+    }
+
+    uint64_t start = stats_start();
+    pthread_rwlock_rdlock(lock);
+    ssize_t result = map_inode_data(fs, inode_number, offset, data);
+    pthread_rwlock_unlock(lock);
+    stats_record(STAT_FS_READ_MAP, start, inode_number, result);
+    return result;
+}
+
+/**
+ * Write to the specified Inode from the data buffer exactly length bytes
+ * beginning from the specified offset by doing the following:
+ *
+ *  1. Load Inode information.  A file that stays within INLINE_DATA_MAX
+ *  bytes is written into the Inode itself (version 5); one that grows past
+ *  it first has its inline data moved out to a data block.
+ *
+ *  2. Map every logical block in the range to a data block, allocating any
+ *  missing data blocks from a single up-front reservation (and any missing
+ *  pointer blocks right after it).  Blocks that would be all zeros and have
+ *  no data block yet are left as holes.
+ *
+ *  3. Read the old contents of a partial first or last block that is
+ *  already mapped (one vectored request for both), so the bytes around the
+ *  written range are kept; whole blocks are never read.
+ *
+ *  4. Write all the data blocks with one vectored disk request, followed by
+ *  any pointer blocks that changed (which join the running journal
+ *  transaction instead, if there is one).
+ *
+ *  5. If the disk filled before every block was written, commit the running
+ *  journal transaction to free the blocks it released and try once more.
+ *
+ *  Note: Data is written to direct blocks first, and then to the indirect,
+ *  double indirect, and triple indirect trees.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       data            Buffer with data to copy
+ * @param       length          Number of bytes to write.
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes read (-1 on error).
+ **/
+ssize_t fs_write(FileSystem* fs, size_t inode_number, char* data, size_t length, size_t offset) {
+    pthread_rwlock_t* lock = inode_lock(fs, inode_number);
+    if (!lock) {
+        return -1;
+    }
+
+    uint64_t start = stats_start();
+    pthread_rwlock_wrlock(lock);
+    pthread_rwlock_rdlock(&fs->sync_lock);
+    ssize_t result = write_inode_data(fs, inode_number, data, length, offset);
+    pthread_rwlock_unlock(&fs->sync_lock);
+    if (result != (ssize_t)length && commit_deferred(fs)) {
+        pthread_rwlock_rdlock(&fs->sync_lock);
+        result = write_inode_data(fs, inode_number, data, length, offset);
+        pthread_rwlock_unlock(&fs->sync_lock);
+    }
+    pthread_rwlock_unlock(lock);
+    commit_if_full(fs);
+    stats_record(STAT_FS_WRITE, start, inode_number, result);
+    return result;
+}
+
+/**
+ * Helper function that copies the inode with number inumber out of the in-memory inode table, saving into the passed inode structure.
+ * @param inode Inode structure into which the table entry should be copied.
+ * @param inumber The logical inode number of the inode we wish to load.
+ * @param fs The mounted file system on which the desired inode resides.
+ * @returns On success, returns true and places the desired inode into the passed inode structure. On failure, returns false.
+ */
+bool load_inode(Inode* inode, size_t inumber, FileSystem* fs) {
+    /* On disk, inodes are saved in a series of blocks starting at logical block 1 (since the superblock resides in block 0) and continuing through to block N + 1, where N is the number of inode blocks. The in-memory table mirrors those blocks starting at index 0, so we compute the table block in which the inode resides as well as the inode's offset within that block. -SN */
+    if (!fs->disk || inumber >= fs->meta_data.inodes) {
+        return false;
+    }
+
+    int iblock = inumber / INODES_PER_BLOCK;
+    int ioffset = inumber % INODES_PER_BLOCK;
+
+    pthread_mutex_lock(&fs->table_lock);
+    Inode table_inode = fs->inode_table[iblock].inodes[ioffset];
+    pthread_mutex_unlock(&fs->table_lock);
+
+    if (!table_inode.valid) {
+        fprintf(stderr, "Cannot load invalid inode.\n");
+        return false;
+    }
+
+    *inode = table_inode;
+    return true;
+}
+
+/**
+ * Writes an inode structure to a specified inode number in the in-memory inode table and marks its block dirty.
+ *
+ * @returns Whether or not the save completed successfully
+ */
+bool save_inode(Inode* inode, size_t inumber, FileSystem* fs) {
+    if (!fs->disk || inumber >= fs->meta_data.inodes) {
+        return false;
+    }
+
+    int iblock = inumber / INODES_PER_BLOCK;
+    int ioffset = inumber % INODES_PER_BLOCK;
+
+    pthread_mutex_lock(&fs->table_lock);
+    fs->inode_table[iblock].inodes[ioffset] = *inode;
+    mark_inode_dirty(fs, iblock);
+    if (!inode->valid) {
+        bitmap_set(fs->free_inodes, inumber);
+        fs->free_inodes->cursor = min(fs->free_inodes->cursor, inumber);
+    }
+    pthread_mutex_unlock(&fs->table_lock);
+    return true;
+}
+
+/**
+ * Return the size of an Inode, combining the lower 32 bits with the upper
+ * bits kept alongside valid (always zero in version 0 inodes).
+ *
+ * @param       inode   Pointer to Inode structure.
+ * @return      Size of file in bytes.
+ **/
+size_t inode_size(const Inode* inode) {
+    return ((size_t)inode->size_high << 32) | inode->size;
+}
+
+/**
+ * Set the size of an Inode, splitting it into lower and upper bits.
+ *
+ * @param       inode   Pointer to Inode structure.
+ * @param       size    Size of file in bytes (at most 48 bits).
+ **/
+void set_inode_size(Inode* inode, size_t size) {
+    inode->size = (uint32_t)size;
+    inode->size_high = (uint16_t)(size >> 32);
+}
+
+/**
+ * Allocate a free data block using the next-fit cursor of the free block
+ * bitmap, so successive allocations continue where the last one ended.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Block number of allocated block (0 if disk is full).
+ **/
+uint32_t allocate_free_block(FileSystem* fs) {
+    uint32_t allocated = 0;
+    return allocate_free_extent(fs, 1, &allocated);
+}
+
+/**
+ * Allocate up to count contiguous free blocks in one step by doing the
+ * following:
+ *
+ *  1. Search for a run of count free blocks starting at the next-fit cursor,
+ *  visiting the allocator shard holding the cursor, then every other shard,
+ *  then the start of the first shard again.
+ *
+ *  2. If there is no such run, settle for the run that begins at the next
+ *  free block (truncated to count), visiting the shards in the same order.
+ *
+ *  3. Remove the run from the free block bitmap and advance the cursor.
+ *
+ * Note: A run never crosses a shard boundary.  Shards another thread holds
+ * are skipped at first and only waited for once the rest have been tried.
+ * The blocks released by the running journal transaction are never handed
+ * out before it commits (see commit_deferred).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       count       Number of blocks wanted.
+ * @param       allocated   Set to the number of blocks actually allocated.
+ * @return      First block of allocated extent (0 if disk is full).
+ **/
+uint32_t allocate_free_extent(FileSystem* fs, uint32_t count, uint32_t* allocated) {
+    *allocated = 0;
+    size_t cursor = __atomic_load_n(&fs->free_blocks->cursor, __ATOMIC_RELAXED);
+    if (cursor >= fs->meta_data.blocks) {
+        cursor = 0;
+    }
+    uint32_t home = shard_index(fs, cursor);
+
+    for (int pass = 0; pass < 2; pass++) {
+        bool skipped[ALLOC_SHARDS + 1] = {false};
+        for (int wait = 0; wait < 2; wait++) {
+            for (uint32_t n = 0; n <= fs->nshards; n++) {
+                AllocShard* shard = &fs->shards[(home + n) % fs->nshards];
+                if (wait && !skipped[n]) {
+                    continue;
+                }
+                if (wait) {
+                    pthread_mutex_lock(&shard->lock);
+                } else if (pthread_mutex_trylock(&shard->lock) != 0) {
+                    skipped[n] = true;
+                    continue;
+                }
+
+                size_t from = (n == 0) ? cursor : shard->start;
+                uint32_t start = allocate_from_shard(fs, shard, from, count, pass == 0, allocated);
+                pthread_mutex_unlock(&shard->lock);
+                if (*allocated > 0) {
+                    return start;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Reserve count free blocks as a sequence of extents, storing the block
+ * numbers in order so consecutive entries are physically contiguous where
+ * possible.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       blocks      Array to store reserved block numbers in.
+ * @param       count       Number of blocks wanted.
+ * @return      Number of blocks reserved (less than count if disk fills).
+ **/
+uint32_t reserve_free_blocks(FileSystem* fs, uint32_t* blocks, uint32_t count) {
+    uint32_t reserved = 0;
+    while (reserved < count) {
+        uint32_t length = 0;
+        uint32_t start = allocate_free_extent(fs, count - reserved, &length);
+        if (length == 0) {
+            break;
+        }
+
+        for (uint32_t i = 0; i < length; i++) {
+            blocks[reserved++] = start + i;
+        }
+    }
+
+    return reserved;
+}
+
+/* Internal Functions */
+
+/**
+ * Write back the dirty Inode, free bitmap, and checksum blocks and mark the
+ * superblock clean (the body of fs_sync, called with the sync lock held
+ * exclusively).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Whether or not all disk operations were successful.
+ **/
+bool write_back(FileSystem* fs) {
+    if (fs->journal && !commit_transaction(fs)) {
+        fprintf(stderr, "Couldn't commit journal transaction.\n");
+        return false;
+    }
+
+    for (uint32_t i = 0; i < fs->meta_data.inode_blocks; i++) {
+        if (!fs->dirty_inode_blocks[i]) {
+            continue;
+        }
+
+        if (!disk_queue_write(fs->disk, i + 1, fs->inode_table[i].data)) {
+            fprintf(stderr, "Couldn't write back inode block %u.\n", i + 1);
+            disk_drain(fs->disk);
+            return false;
+        }
+        fs->dirty_inode_blocks[i] = false;
+    }
+
+    Block stage = {0};
+    for (uint32_t i = 0; i < fs->meta_data.bitmap_blocks; i++) {
+        if (!fs->dirty_bitmap_blocks[i]) {
+            continue;
+        }
+
+        if (!queue_bitmap_block(fs->disk, fs->free_blocks, fs->meta_data.inode_blocks + 1, i, &stage)) {
+            fprintf(stderr, "Couldn't write back free bitmap block %u.\n", i);
+            disk_drain(fs->disk);
+            return false;
+        }
+        fs->dirty_bitmap_blocks[i] = false;
+    }
+
+    uint32_t checksum_start = fs->meta_data.inode_blocks + 1 + fs->meta_data.bitmap_blocks;
+    for (uint32_t i = 0; i < fs->meta_data.checksum_blocks; i++) {
+        if (!fs->dirty_checksum_blocks[i]) {
+            continue;
+        }
+
+        if (!disk_queue_write(fs->disk, checksum_start + i, fs->checksum_table[i].data)) {
+            fprintf(stderr, "Couldn't write back checksum block %u.\n", i);
+            disk_drain(fs->disk);
+            return false;
+        }
+        fs->dirty_checksum_blocks[i] = false;
+    }
+    __atomic_store_n(&fs->dirty_blocks, 0, __ATOMIC_RELAXED);
+
+    if (!disk_drain(fs->disk) || !disk_flush(fs->disk)) {
+        return false;
+    }
+
+    if (fs->meta_data.version >= 2 && !fs->meta_data.clean) {
+        return write_superblock(fs, true);
+    }
+    return true;
+}
+
+/**
+ * Commit the running journal transaction by doing the following (called
+ * with the sync lock held exclusively):
+ *
+ *  1. Return the blocks it released to the free block bitmap, so the
+ *  transaction records them free.  No other thread can allocate them until
+ *  the sync lock is dropped.
+ *
+ *  2. Gather every dirty Inode, free bitmap, and checksum block.
+ *
+ *  3. Log them, along with the pointer blocks held by the Journal, as one
+ *  transaction and write them in place.
+ *
+ *  4. If that failed, take the released blocks out of the bitmap again and
+ *  hand them back to the Journal, so they are only reused once a commit is
+ *  durable.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Whether or not all disk operations were successful.
+ **/
+bool commit_transaction(FileSystem* fs) {
+    size_t nfrees = 0;
+    uint32_t* frees = release_deferred(fs, &nfrees);
+
+    uint32_t total = fs->meta_data.inode_blocks + fs->meta_data.bitmap_blocks + fs->meta_data.checksum_blocks;
+    uint32_t* homes = calloc(total, sizeof(uint32_t));
+    char** images = calloc(total, sizeof(char*));
+    if (!homes || !images) {
+        free(homes);
+        free(images);
+        restore_deferred(fs, frees, nfrees);
+        return false;
+    }
+
+    Block stage = {0};
+    size_t count = 0;
+    for (uint32_t i = 0; i < fs->meta_data.inode_blocks; i++) {
+        if (fs->dirty_inode_blocks[i]) {
+            homes[count] = i + 1;
+            images[count++] = fs->inode_table[i].data;
+        }
+    }
+    for (uint32_t i = 0; i < fs->meta_data.bitmap_blocks; i++) {
+        if (fs->dirty_bitmap_blocks[i]) {
+            homes[count] = fs->meta_data.inode_blocks + 1 + i;
+            images[count++] = bitmap_block_data(fs->free_blocks, i, &stage);
+        }
+    }
+    for (uint32_t i = 0; i < fs->meta_data.checksum_blocks; i++) {
+        if (fs->dirty_checksum_blocks[i]) {
+            homes[count] = fs->meta_data.inode_blocks + 1 + fs->meta_data.bitmap_blocks + i;
+            images[count++] = fs->checksum_table[i].data;
+        }
+    }
+
+    bool success = journal_commit(fs->journal, fs->disk, homes, images, count);
+    if (success) {
+        memset(fs->dirty_inode_blocks, 0, fs->meta_data.inode_blocks * sizeof(bool));
+        memset(fs->dirty_bitmap_blocks, 0, fs->meta_data.bitmap_blocks * sizeof(bool));
+        if (fs->dirty_checksum_blocks) {
+            memset(fs->dirty_checksum_blocks, 0, fs->meta_data.checksum_blocks * sizeof(bool));
+        }
+        __atomic_store_n(&fs->dirty_blocks, 0, __ATOMIC_RELAXED);
+        free(frees);
+    } else {
+        restore_deferred(fs, frees, nfrees);
+    }
+
+    free(homes);
+    free(images);
+    return success;
+}
+
+/**
+ * Check whether the running journal transaction holds half as many blocks
+ * as one transaction can log (the journal lock guards its count).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Whether or not the transaction should be committed.
+ **/
+bool transaction_full(FileSystem* fs) {
+    pthread_mutex_lock(&fs->journal->lock);
+    size_t count = fs->journal->count;
+    pthread_mutex_unlock(&fs->journal->lock);
+
+    return count + __atomic_load_n(&fs->dirty_blocks, __ATOMIC_RELAXED) >= fs->journal->capacity / 2;
+}
+
+/**
+ * Commit the running journal transaction once it is full, so the changes of
+ * many operations go to the journal together and a transaction still fits
+ * in one journal write (called with no locks held).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ **/
+void commit_if_full(FileSystem* fs) {
+    if (!fs->journal || !transaction_full(fs)) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&fs->sync_lock);
+    if (transaction_full(fs) && !commit_transaction(fs)) {
+        fprintf(stderr, "Couldn't commit journal transaction.\n");
+    }
+    pthread_rwlock_unlock(&fs->sync_lock);
+}
+
+/**
+ * Return the blocks released by the running journal transaction to the free
+ * block bitmap as it commits (called with the sync lock held exclusively).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       nfrees  Set to the number of blocks returned.
+ * @return      Array of blocks returned (for restore_deferred if the commit
+ *              fails; the caller frees it).
+ **/
+uint32_t* release_deferred(FileSystem* fs, size_t* nfrees) {
+    Journal* journal = fs->journal;
+    pthread_mutex_lock(&journal->lock);
+    uint32_t* frees = journal->frees;
+    *nfrees = journal->nfrees;
+    journal->frees = NULL;
+    journal->nfrees = 0;
+    journal->frees_size = 0;
+    pthread_mutex_unlock(&journal->lock);
+
+    for (size_t i = 0; i < *nfrees; i++) {
+        release_block(fs, frees[i]);
+    }
+    return frees;
+}
+
+/**
+ * Undo release_deferred after a failed commit: take the blocks out of the
+ * free block bitmap again and put them back ahead of any blocks released
+ * since (called with the sync lock held exclusively).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       frees   Array of blocks returned by release_deferred.
+ * @param       nfrees  Number of blocks in array.
+ **/
+void restore_deferred(FileSystem* fs, uint32_t* frees, size_t nfrees) {
+    if (nfrees == 0) {
+        free(frees);
+        return;
+    }
+
+    for (size_t i = 0; i < nfrees; i++) {
+        AllocShard* shard = &fs->shards[shard_index(fs, frees[i])];
+        pthread_mutex_lock(&shard->lock);
+        bitmap_clear(fs->free_blocks, frees[i]);
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    Journal* journal = fs->journal;
+    pthread_mutex_lock(&journal->lock);
+    uint32_t* merged = realloc(frees, (nfrees + journal->nfrees) * sizeof(uint32_t));
+    if (merged) {
+        if (journal->nfrees > 0) {
+            memcpy(merged + nfrees, journal->frees, journal->nfrees * sizeof(uint32_t));
+        }
+        free(journal->frees);
+        journal->frees = merged;
+        journal->nfrees += nfrees;
+        journal->frees_size = journal->nfrees;
+    } else {
+        fprintf(stderr, "restore_deferred: realloc returned NULL\n");
+        free(frees);
+    }
+    pthread_mutex_unlock(&journal->lock);
+}
+
+/**
+ * Commit the running journal transaction if it released any blocks, so a
+ * write that found the disk full can try again once they are free (called
+ * with at most the Inode lock held).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Whether or not blocks were released by a commit.
+ **/
+bool commit_deferred(FileSystem* fs) {
+    if (!fs->journal) {
+        return false;
+    }
+
+    pthread_rwlock_wrlock(&fs->sync_lock);
+    pthread_mutex_lock(&fs->journal->lock);
+    bool deferred = fs->journal->nfrees > 0;
+    pthread_mutex_unlock(&fs->journal->lock);
+    bool committed = deferred && commit_transaction(fs);
+    pthread_rwlock_unlock(&fs->sync_lock);
+    return committed;
+}
+
+/**
+ * Release the blocks of an Inode and mark it free (the body of fs_remove,
+ * called with the Inode locked exclusively).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to remove.
+ * @return      Whether or not removing the specified Inode was successful.
+ **/
+bool remove_inode(FileSystem* fs, size_t inode_number) {
+    Inode inode = {0};
+
+    if (!load_inode(&inode, inode_number, fs)) {
+        return false;
+    }
+    mark_unclean(fs);
+
+    // Set inode invalid before releasing anything it points to
+    Inode new_inode = {0};
+    if (!save_inode(&new_inode, inode_number, fs)) {
+        return false;
+    }
+    readahead_invalidate(fs, inode_number);
+
+    // Inline data is not block pointers, so there is nothing more to release
+    if (inode.valid & INODE_INLINE) {
+        return true;
+    }
+
+    // Release direct blocks in use by this inode
+    for (uint32_t k = 0; k < direct_pointers(fs); k++) {
+        if (inode.direct[k] > 0) {
+            release_data_block(fs, inode.direct[k]);
+        }
+    }
+
+    // Release indirect blocks and the data blocks they point to
+    bool success = release_indirect_blocks(fs, inode.indirect, 1);
+    if (fs->meta_data.version >= 1) {
+        success = release_indirect_blocks(fs, inode.double_indirect, 2) && success;
+        success = release_indirect_blocks(fs, inode.triple_indirect, 3) && success;
+    }
+    if (!success) {
+        fprintf(stderr, "Couldn't release every block of inode %lu.\n", inode_number);
+    }
+
+    return success;
+}
+
+/**
+ * Read data from an Inode (the body of fs_read, called with the Inode
+ * locked for reading).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to read data from.
+ * @param       data            Buffer to copy data to.
+ * @param       length          Number of bytes to read.
+ * @param       offset          Byte offset from which to begin reading.
+ * @return      Number of bytes read (-1 on error).
+ **/
+ssize_t read_inode_data(FileSystem* fs, size_t inode_number, char* data, size_t length, size_t offset) {
+    Inode inode = {0};
+    if (!load_inode(&inode, inode_number, fs)) {
+        return -1;
+    }
+
+    // Return successful read of 0 if read is not possible.
+    size_t size = inode_size(&inode);
+    if (size < 1 || offset >= size) {
+        return 0;
+    }
+
+    // Inline data is copied straight out of the Inode.
+    if (inode.valid & INODE_INLINE) {
+        length = min(size - offset, length);
+        memcpy(data, inode.data + offset, length);
+        return length;
+    }
+
+    BlockMap map;
+    block_map_init(&map, fs, &inode);
+
+    // Truncate requested length to the file size (and the largest file an inode can map).
+    size_t capacity = block_map_capacity(&map) * BLOCK_SIZE;
+    if (offset >= capacity) {
+        return 0;
+    }
+    length = min(size - offset, length);
+    length = min(capacity - offset, length);
+
+    // Compressed file systems read whole extents rather than blocks (and no read-ahead).
+    if (fs->meta_data.extent_blocks) {
+        return read_extents(fs, &map, data, length, offset);
+    }
+
+    // Determine which logical data blocks the read covers.
+    uint64_t start_block = offset / BLOCK_SIZE;
+    size_t offset_into_block = offset % BLOCK_SIZE;
+    uint64_t end_block = (offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t nblocks = end_block - start_block;
+    size_t tail_length = (offset + length) % BLOCK_SIZE;
+
+    // Sequential readers are served from the read-ahead buffer.
+    ReadAhead* stream = readahead_stream(fs, inode_number, offset);
+    stream->next_offset = offset + length;
+    if (stream->window && readahead_fill(fs, stream, &map, start_block, end_block, (size + BLOCK_SIZE - 1) / BLOCK_SIZE)) {
+        memcpy(data, stream->buffer + (start_block - stream->start) * BLOCK_SIZE + offset_into_block, length);
+        pthread_mutex_unlock(&stream->lock);
+        return length;
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    size_t* blocks = calloc(nblocks, sizeof(size_t));
+    char** buffers = calloc(nblocks, sizeof(char*));
+    if (!blocks || !buffers) {
+        free(blocks);
+        free(buffers);
+        return -1;
+    }
+
+    // Whole blocks are read straight into the caller's buffer; the partial first and last blocks are staged.
+    Block head = {{0}};
+    Block tail = {{0}};
+    bool head_partial = offset_into_block > 0 || length < BLOCK_SIZE;
+    size_t nread = 0;
+    for (size_t n = 0; n < nblocks; n++) {
+        char* buffer;
+        if (n == 0 && head_partial) {
+            buffer = head.data;
+        } else if (n == nblocks - 1 && tail_length > 0) {
+            buffer = tail.data;
+        } else {
+            buffer = data + n * BLOCK_SIZE - offset_into_block;
+        }
+
+        // Holes read back as zeros without touching the disk.
+        uint32_t block = block_map_get(&map, start_block + n);
+        if (block == 0) {
+            memset(buffer, 0, BLOCK_SIZE);
+            continue;
+        }
+
+        blocks[nread] = block;
+        buffers[nread++] = buffer;
+    }
+
+    ssize_t result = map.failed ? DISK_FAILURE : disk_readv(fs->disk, blocks, buffers, nread);
+    bool verified = result != DISK_FAILURE && verify_checksums(fs, blocks, buffers, nread);
+    free(blocks);
+    free(buffers);
+    if (!verified) {
+        return -1;
+    }
+
+    if (head_partial) {
+        memcpy(data, head.data + offset_into_block, min(BLOCK_SIZE - offset_into_block, length));
+    }
+    if (nblocks > 1 && tail_length > 0) {
+        memcpy(data + length - tail_length, tail.data, tail_length);
+    }
+
+    return length;
+}
+
+/**
+ * Map data from an Inode (the body of fs_read_map, called with the Inode
+ * locked for reading).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to read data from.
+ * @param       offset          Byte offset from which to begin reading.
+ * @param       data            Set to point at the data.
+ * @return      Number of bytes available at data (-1 on error).
+ **/
+ssize_t map_inode_data(FileSystem* fs, size_t inode_number, size_t offset, const char** data) {
+    Inode inode = {0};
+    if (!fs->disk || !fs->disk->map || !load_inode(&inode, inode_number, fs)) {
+        return -1;
+    }
+
+    size_t size = inode_size(&inode);
+    if (offset >= size) {
+        return 0;
+    }
+
+    // Inline data maps to a copy taken while the Inode is locked, since the Inode table changes under other writers.
+    if (inode.valid & INODE_INLINE) {
+        memcpy(InlineCopy, inode.data, size);
+        *data = InlineCopy + offset;
+        return size - offset;
+    }
+
+    BlockMap map;
+    block_map_init(&map, fs, &inode);
+
+    uint64_t start_block = offset / BLOCK_SIZE;
+    uint64_t end_block = min((size + BLOCK_SIZE - 1) / BLOCK_SIZE, block_map_capacity(&map));
+    if (start_block >= end_block) {
+        return 0;
+    }
+
+    // Compressed extents cannot be mapped, and a run of plain data stops at the end of its extent.
+    if (fs->meta_data.extent_blocks) {
+        uint64_t extent_start = start_block - start_block % EXTENT_BLOCKS;
+        uint32_t head = block_map_get(&map, extent_start);
+        if (map.failed || (head && *extent_entry(fs, head))) {
+            return -1;
+        }
+        end_block = min(end_block, extent_start + EXTENT_BLOCKS);
+    }
+
+    // Holes map to a shared block of zeros.
+    uint32_t first = block_map_get(&map, start_block);
+    if (first == 0 && !map.failed) {
+        *data = ZeroBlock.data + offset % BLOCK_SIZE;
+        return min((size_t)BLOCK_SIZE - offset % BLOCK_SIZE, size - offset);
+    }
+
+    // Extend the run while the next logical block is the next physical block.
+    uint32_t run = 1;
+    while (start_block + run < end_block && run < fs->disk->blocks) {
+        if (block_map_get(&map, start_block + run) != first + run) {
+            break;
+        }
+        run++;
+    }
+
+    const char* mapped = !map.failed ? disk_map(fs->disk, first, run) : NULL;
+    if (!mapped) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < run; i++) {
+        size_t block = first + i;
+        char* buffer = (char*)mapped + (size_t)i * BLOCK_SIZE;
+        if (!verify_checksums(fs, &block, &buffer, 1)) {
+            return -1;
+        }
+    }
+
+    *data = mapped + offset % BLOCK_SIZE;
+    return min((size_t)run * BLOCK_SIZE - offset % BLOCK_SIZE, size - offset);
+}
+
+/**
+ * Write data to an Inode (the body of fs_write, called with the Inode
+ * locked exclusively).  A write that fails leaves no new data block mapped
+ * and the size unchanged.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       data            Buffer with data to copy.
+ * @param       length          Number of bytes to write.
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes written (-1 on error).
+ **/
+ssize_t write_inode_data(FileSystem* fs, size_t inode_number, char* data, size_t length, size_t offset) {
+    Inode inode = {0};
+    if (!load_inode(&inode, inode_number, fs)) {
+        return -1;
+    }
+    mark_unclean(fs);
+
+    // Tiny files are kept in the Inode until a write goes past INLINE_DATA_MAX.
+    if ((inode.valid & INODE_INLINE) ||
+        (fs->meta_data.version >= 5 && inode_size(&inode) == 0 && length > 0)) {
+        if (offset + length <= INLINE_DATA_MAX) {
+            inode.valid |= INODE_INLINE;
+            memcpy(inode.data + offset, data, length);
+            set_inode_size(&inode, max(offset + length, inode_size(&inode)));
+            readahead_invalidate(fs, inode_number);
+            return save_inode(&inode, inode_number, fs) ? (ssize_t)length : -1;
+        }
+
+        if ((inode.valid & INODE_INLINE) && !spill_inline_data(fs, inode_number, &inode)) {
+            return -1;
+        }
+    }
+
+    // Compressed file systems write whole extents rather than blocks.
+    if (fs->meta_data.extent_blocks) {
+        return write_extents(fs, inode_number, &inode, data, length, offset);
+    }
+
+    // Deduplicated file systems share blocks rather than write them in place.
+    if (fs->meta_data.dedup) {
+        return write_shared(fs, inode_number, &inode, data, length, offset);
+    }
+
+    ssize_t bytes_written = 0;
+    bool failed = false;
+
+    BlockMap map;
+    block_map_init(&map, fs, &inode);
+    readahead_invalidate(fs, inode_number);
+
+    // Calculate the start and end indices of the data blocks to be written (capped at the largest file an inode can map).
+    uint64_t start_block = offset / BLOCK_SIZE;
+    size_t offset_into_block = offset % BLOCK_SIZE;
+    uint64_t end_block = (length + offset) / BLOCK_SIZE;
+    if ((length + offset) % BLOCK_SIZE > 0) {
+        end_block++;
+    }
+    end_block = min(end_block, block_map_capacity(&map));
+    size_t nblocks = (end_block > start_block) ? end_block - start_block : 0;
+
+    // Reserve every data block this write needs up front so the whole write is laid out contiguously where possible.
+    uint32_t needed = 0;
+    for (uint64_t i = start_block; i < end_block; i++) {
+        size_t begin = max(i * BLOCK_SIZE, offset);
+        size_t end = min((i + 1) * BLOCK_SIZE, offset + length);
+        if (block_map_get(&map, i) == 0 && !is_zero(data + begin - offset, end - begin)) {
+            needed++;
+        }
+    }
+    if (map.failed) {
+        fprintf(stderr, "Couldn't read indirect data block.\n");
+        return -1;
+    }
+
+    uint32_t* reserved = calloc(max(needed, 1), sizeof(uint32_t));
+    uint64_t* logicals = calloc(max(needed, 1), sizeof(uint64_t));
+    size_t* blocks = calloc(max(nblocks, 1), sizeof(size_t));
+    char** buffers = calloc(max(nblocks, 1), sizeof(char*));
+    if (!reserved || !logicals || !blocks || !buffers) {
+        fprintf(stderr, "Couldn't allocate block reservation.\n");
+        free(reserved);
+        free(logicals);
+        free(blocks);
+        free(buffers);
+        return -1;
+    }
+    uint32_t nreserved = reserve_free_blocks(fs, reserved, needed);
+    uint32_t next_reserved = 0;
+
+    // Partial first and last blocks are staged (with their old contents if already mapped); whole blocks are written straight from the caller's buffer.
+    Block stages[2] = {{{0}}};
+    size_t stage_offsets[2];
+    size_t stage_lengths[2];
+    const char* stage_sources[2];
+    size_t old_blocks[2];
+    char* old_buffers[2];
+    size_t nstaged = 0;
+    size_t nold = 0;
+    size_t nmapped = 0;
+
+    for (uint64_t i = start_block; i < end_block; i++) {
+        /**
+         * Determine the number of bytes to write to this data block.
+         * Case 1: First block. If there is an offset, we need to write starting at the offset to the end of the block, not exceeding the requested write length.
+         * Case 2: Anything else. Write up to the requested length, not exceeding block size.
+         */
+        size_t length_to_write = min(BLOCK_SIZE - offset_into_block, length);
+
+        // Take the data block from the reservation if needed (the block map allocates any pointer blocks on the way).
+        uint32_t block = block_map_get(&map, i);
+        bool fresh = (block == 0);
+        bool hole = fresh && is_zero(data + bytes_written, length_to_write);
+        if (fresh && !hole) {
+            if (next_reserved == nreserved || !block_map_set(&map, i, reserved[next_reserved])) {
+                fprintf(stderr, "Couldn't allocate data block %lu.\n", i);
+                break;
+            }
+            logicals[next_reserved] = i;
+            block = reserved[next_reserved++];
+        }
+
+        if (!hole) {
+            blocks[nmapped] = block;
+            if (length_to_write == BLOCK_SIZE) {
+                buffers[nmapped] = data + bytes_written;
+            } else {
+                // The new bytes are merged once any old contents have been read
+                Block* stage = &stages[nstaged];
+                stage_offsets[nstaged] = offset_into_block;
+                stage_lengths[nstaged] = length_to_write;
+                stage_sources[nstaged++] = data + bytes_written;
+                if (!fresh) {
+                    old_blocks[nold] = block;
+                    old_buffers[nold++] = stage->data;
+                }
+                buffers[nmapped] = stage->data;
+            }
+            nmapped++;
+        }
+
+        bytes_written += length_to_write;
+        length -= length_to_write;
+        offset_into_block = 0;
+    }
+
+    // Read the old contents of partial blocks in one request and merge the new bytes into them.
+    if (nold > 0 && (disk_readv(fs->disk, old_blocks, old_buffers, nold) == DISK_FAILURE ||
+                     !verify_checksums(fs, old_blocks, old_buffers, nold))) {
+        fprintf(stderr, "Couldn't read partial data blocks.\n");
+        failed = true;
+        nmapped = 0;
+    }
+    for (size_t k = 0; k < nstaged; k++) {
+        memcpy(stages[k].data + stage_offsets[k], stage_sources[k], stage_lengths[k]);
+    }
+
+    // Write every mapped data block in one request.
+    if (nmapped > 0 && disk_writev(fs->disk, blocks, buffers, nmapped) == DISK_FAILURE) {
+        fprintf(stderr, "Couldn't write data blocks.\n");
+        failed = true;
+    } else {
+        record_checksums(fs, blocks, buffers, nmapped);
+    }
+
+    // If the write failed, unmap the blocks it took from the reservation (a pointer block already written back by the block map must not keep pointing at them).
+    if (failed) {
+        for (uint32_t k = 0; k < next_reserved; k++) {
+            if (block_map_set(&map, logicals[k], 0)) {
+                release_block(fs, reserved[k]);
+            }
+        }
+    }
+
+    // Return any reserved blocks that went unused.
+    for (; next_reserved < nreserved; next_reserved++) {
+        release_block(fs, reserved[next_reserved]);
+    }
+    free(reserved);
+    free(logicals);
+    free(blocks);
+    free(buffers);
+
+    // Record any new indirect pointers (or the undone ones).
+    if (!block_map_flush(&map)) {
+        fprintf(stderr, "Couldn't update indirect blocks.\n");
+        failed = true;
+    }
+
+    // Compute the new size of the inode (unless the write failed) and save it.
+    if (!failed) {
+        set_inode_size(&inode, max(offset + bytes_written, inode_size(&inode)));
+    }
+    if (!save_inode(&inode, inode_number, fs) || failed) {
+        return -1;
+    }
+
+    return bytes_written;
+}
+
+/**
+ * Move the inline data of an Inode out to a data block, so the Inode can
+ * hold block pointers again (called with the Inode locked exclusively).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode holding inline data.
+ * @param       inode           Set to the Inode as saved.
+ * @return      Whether or not the data was moved.
+ **/
+bool spill_inline_data(FileSystem* fs, size_t inode_number, Inode* inode) {
+    // Write a whole block, so the write is not kept inline again, then restore the size.
+    Block block = {{0}};
+    size_t size = inode_size(inode);
+    memcpy(block.data, inode->data, size);
+
+    memset(inode->data, 0, INLINE_DATA_MAX);
+    inode->valid &= ~INODE_INLINE;
+    if (!save_inode(inode, inode_number, fs) ||
+        write_inode_data(fs, inode_number, block.data, BLOCK_SIZE, 0) != BLOCK_SIZE ||
+        !load_inode(inode, inode_number, fs)) {
+        fprintf(stderr, "Couldn't move inline data of inode %lu.\n", inode_number);
+        return false;
+    }
+
+    set_inode_size(inode, size);
+    return save_inode(inode, inode_number, fs);
+}
+
+/**
+ * Read data from an Inode on a compressed FileSystem, loading every extent
+ * the read covers (and only those) and copying out the bytes asked for.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       map             BlockMap of the Inode.
+ * @param       data            Buffer to copy data to.
+ * @param       length          Number of bytes to read (all within the file).
+ * @param       offset          Byte offset from which to begin reading.
+ * @return      Number of bytes read (-1 on error).
+ **/
+ssize_t read_extents(FileSystem* fs, BlockMap* map, char* data, size_t length, size_t offset) {
+    char* extent = malloc(EXTENT_SIZE);
+    if (!extent) {
+        return -1;
+    }
+
+    size_t copied = 0;
+    while (copied < length) {
+        uint64_t index = (offset + copied) / EXTENT_SIZE;
+        size_t offset_into_extent = (offset + copied) % EXTENT_SIZE;
+        size_t chunk = min(EXTENT_SIZE - offset_into_extent, length - copied);
+        if (!load_extent(fs, map, index, extent)) {
+            free(extent);
+            return -1;
+        }
+
+        memcpy(data + copied, extent + offset_into_extent, chunk);
+        copied += chunk;
+    }
+
+    free(extent);
+    return length;
+}
+
+/**
+ * Write data to an Inode on a compressed FileSystem by doing the following
+ * for every extent the write covers:
+ *
+ *  1. Load the old contents of the extent, unless the write replaces all of
+ *  it.
+ *
+ *  2. Merge the new bytes in.
+ *
+ *  3. Store the extent (compressed if that saves a block) in new blocks.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       inode           Inode as loaded (saved with its new size).
+ * @param       data            Buffer with data to copy.
+ * @param       length          Number of bytes to write.
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes written (-1 on error).
+ **/
+ssize_t write_extents(FileSystem* fs, size_t inode_number, Inode* inode, char* data, size_t length, size_t offset) {
+    BlockMap map;
+    block_map_init(&map, fs, inode);
+    readahead_invalidate(fs, inode_number);
+
+    // Cap the write at the largest file an inode can map.
+    size_t capacity = block_map_capacity(&map) * BLOCK_SIZE;
+    length = offset < capacity ? min(length, capacity - offset) : 0;
+    size_t size = max(inode_size(inode), offset + length);
+
+    char* extent = malloc(EXTENT_SIZE);
+    if (!extent) {
+        return -1;
+    }
+
+    bool failed = false;
+    size_t written = 0;
+    while (written < length) {
+        uint64_t index = (offset + written) / EXTENT_SIZE;
+        size_t offset_into_extent = (offset + written) % EXTENT_SIZE;
+        size_t chunk = min(EXTENT_SIZE - offset_into_extent, length - written);
+        size_t extent_length = min((size_t)EXTENT_SIZE, size - index * EXTENT_SIZE);
+
+        if (offset_into_extent == 0 && chunk == extent_length) {
+            memset(extent + chunk, 0, EXTENT_SIZE - chunk);
+        } else if (!load_extent(fs, &map, index, extent)) {
+            failed = true;
+            break;
+        }
+
+        memcpy(extent + offset_into_extent, data + written, chunk);
+        if (!store_extent(fs, &map, index, extent, extent_length)) {
+            failed = true;
+            break;
+        }
+        written += chunk;
+    }
+    free(extent);
+
+    // Record any new indirect pointers.
+    if (!block_map_flush(&map)) {
+        fprintf(stderr, "Couldn't update indirect blocks.\n");
+        failed = true;
+    }
+
+    set_inode_size(inode, max(offset + written, inode_size(inode)));
+    if (!save_inode(inode, inode_number, fs) || failed) {
+        return -1;
+    }
+
+    return written;
+}
+
+/**
+ * Load the contents of one extent of an Inode by doing the following:
+ *
+ *  1. Look up the compressed length recorded for its first data block.
+ *
+ *  2. If it is compressed, read only the blocks holding the compressed bytes
+ *  and decompress them.
+ *
+ *  3. Otherwise read every mapped block in place (holes read as zeros).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       map     BlockMap of the Inode.
+ * @param       index   Extent number within the file.
+ * @param       extent  Buffer of EXTENT_SIZE bytes to fill.
+ * @return      Whether or not the extent was loaded.
+ **/
+bool load_extent(FileSystem* fs, BlockMap* map, uint64_t index, char* extent) {
+    uint64_t first = index * EXTENT_BLOCKS;
+    uint32_t head = block_map_get(map, first);
+    uint32_t packed_length = head ? *extent_entry(fs, head) : 0;
+    char* packed = packed_length ? malloc(EXTENT_SIZE) : NULL;
+    size_t blocks[EXTENT_BLOCKS];
+    char* buffers[EXTENT_BLOCKS];
+    size_t nread = 0;
+    bool success = !packed_length || packed;
+
+    memset(extent, 0, EXTENT_SIZE);
+    for (uint32_t i = 0; i < EXTENT_BLOCKS && success; i++) {
+        if (packed_length && i * BLOCK_SIZE >= packed_length) {
+            break;
+        }
+
+        uint32_t block = i ? block_map_get(map, first + i) : head;
+        if (block) {
+            blocks[nread] = block;
+            buffers[nread++] = (packed ? packed : extent) + i * BLOCK_SIZE;
+        } else if (packed_length) {
+            success = false;
+        }
+    }
+
+    success = success && !map->failed &&
+              (nread == 0 || disk_readv(fs->disk, blocks, buffers, nread) != DISK_FAILURE) &&
+              verify_checksums(fs, blocks, buffers, nread) &&
+              (!packed_length || lz4_decompress(packed, packed_length, extent, EXTENT_SIZE) >= 0);
+    if (!success) {
+        fprintf(stderr, "Couldn't load extent %lu.\n", index);
+    }
+
+    free(packed);
+    return success;
+}
+
+/**
+ * Store the contents of one extent of an Inode by doing the following:
+ *
+ *  1. Compress the contents, keeping the result only if it takes at least
+ *  one block fewer than the blocks that are not all zeros (otherwise those
+ *  are stored as they are).
+ *
+ *  2. Write the blocks to newly reserved data blocks, recording the
+ *  compressed length (if any) for the first.
+ *
+ *  3. Point the extent at the new blocks (holes for the rest) and, once
+ *  every pointer is recorded, retire the old ones.
+ *
+ * If a pointer cannot be recorded, the extent is pointed back at its old
+ * blocks and every reserved block is released.
+ *
+ * Note: Never writing in place means a failed or interrupted store leaves
+ * the old extent intact.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       map     BlockMap of the Inode.
+ * @param       index   Extent number within the file.
+ * @param       extent  Contents of extent (zero past length).
+ * @param       length  Number of bytes of extent within the file.
+ * @return      Whether or not the extent was stored.
+ **/
+bool store_extent(FileSystem* fs, BlockMap* map, uint64_t index, char* extent, size_t length) {
+    uint64_t first = index * EXTENT_BLOCKS;
+    size_t count = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    char* packed = calloc(EXTENT_BLOCKS, BLOCK_SIZE);
+    if (!packed) {
+        return false;
+    }
+
+    size_t nonzero = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        nonzero += !is_zero(extent + i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    size_t packed_length = nonzero > 1 ? lz4_compress(extent, length, packed, (nonzero - 1) * BLOCK_SIZE) : 0;
+    size_t blocks[EXTENT_BLOCKS];
+    char* buffers[EXTENT_BLOCKS];
+    uint32_t positions[EXTENT_BLOCKS];
+    uint32_t nwrite = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (packed_length ? i * BLOCK_SIZE < packed_length : !is_zero(extent + i * BLOCK_SIZE, BLOCK_SIZE)) {
+            buffers[nwrite] = (packed_length ? packed : extent) + i * BLOCK_SIZE;
+            positions[nwrite++] = i;
+        }
+    }
+
+    uint32_t reserved[EXTENT_BLOCKS];
+    uint32_t nreserved = reserve_free_blocks(fs, reserved, nwrite);
+    for (uint32_t i = 0; i < nreserved; i++) {
+        blocks[i] = reserved[i];
+    }
+
+    bool success = nreserved == nwrite &&
+                   (nwrite == 0 || disk_writev(fs->disk, blocks, buffers, nwrite) != DISK_FAILURE);
+    if (!success) {
+        fprintf(stderr, "Couldn't write extent %lu.\n", index);
+        for (uint32_t i = 0; i < nreserved; i++) {
+            release_block(fs, reserved[i]);
+        }
+        free(packed);
+        return false;
+    }
+
+    // The checksums are taken from the buffers written, so the compressed copy is kept until then
+    record_checksums(fs, blocks, buffers, nwrite);
+    free(packed);
+    if (packed_length) {
+        record_extent(fs, blocks[0], packed_length);
+    }
+
+    // Point the extent at the new blocks, keeping the old ones until every pointer is recorded.
+    uint32_t olds[EXTENT_BLOCKS];
+    uint32_t news[EXTENT_BLOCKS];
+    uint32_t next = 0;
+    uint32_t mapped = 0;
+    while (mapped < EXTENT_BLOCKS) {
+        olds[mapped] = block_map_get(map, first + mapped);
+        news[mapped] = (next < nwrite && positions[next] == mapped) ? reserved[next++] : 0;
+        if (olds[mapped] != news[mapped] && !block_map_set(map, first + mapped, news[mapped])) {
+            break;
+        }
+        mapped++;
+    }
+
+    if (mapped < EXTENT_BLOCKS) {
+        fprintf(stderr, "Couldn't map extent %lu.\n", index);
+        // Those pointers are already in place, so putting the old blocks back needs no allocation.
+        while (mapped > 0) {
+            mapped--;
+            if (olds[mapped] != news[mapped]) {
+                block_map_set(map, first + mapped, olds[mapped]);
+            }
+        }
+        for (uint32_t i = 0; i < nwrite; i++) {
+            release_block(fs, reserved[i]);
+        }
+        return false;
+    }
+
+    for (uint32_t i = 0; i < EXTENT_BLOCKS; i++) {
+        if (olds[i] && olds[i] != news[i]) {
+            retire_block(fs, olds[i]);
+        }
+    }
+
+    return !map->failed;
+}
+
+/**
+ * Write data to an Inode on a deduplicating FileSystem by doing the
+ * following:
+ *
+ *  1. Gather the new contents of every block the write covers, reading the
+ *  old contents of a partial first or last block that is already mapped.
+ *
+ *  2. Hash every block that is not all zeros and look for the same contents
+ *  among the earlier blocks of this write, then in the dedup index (taking a
+ *  reference to any block found there, so it cannot be released meanwhile).
+ *
+ *  3. Read the blocks found in the index with one vectored request, keeping
+ *  only those whose contents really are the same.
+ *
+ *  4. Write the blocks left over to newly reserved data blocks with one
+ *  vectored request and add them to the index.
+ *
+ *  5. Point every logical block at its data block (blocks of zeros become
+ *  holes) and drop the references to the data blocks they replace.
+ *
+ * If any step fails, every logical block is pointed back at its old data
+ * block, the references taken along the way are dropped, and the size is
+ * left alone.
+ *
+ * Note: A block rewritten with the contents it already has is left alone,
+ * and no shared block is ever written in place.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       inode           Inode as loaded (saved with its new size).
+ * @param       data            Buffer with data to copy.
+ * @param       length          Number of bytes to write.
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes written (-1 on error).
+ **/
+ssize_t write_shared(FileSystem* fs, size_t inode_number, Inode* inode, char* data, size_t length, size_t offset) {
+    BlockMap map;
+    block_map_init(&map, fs, inode);
+    readahead_invalidate(fs, inode_number);
+
+    // Cap the write at the largest file an inode can map.
+    size_t capacity = block_map_capacity(&map) * BLOCK_SIZE;
+    length = offset < capacity ? min(length, capacity - offset) : 0;
+    uint64_t start_block = offset / BLOCK_SIZE;
+    size_t offset_into_block = offset % BLOCK_SIZE;
+    size_t nblocks = length ? (offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE - start_block : 0;
+
+    SharedBlock* shared = calloc(max(nblocks, 1), sizeof(SharedBlock));
+    size_t* blocks = calloc(max(nblocks, 1), sizeof(size_t));
+    char** buffers = calloc(max(nblocks, 1), sizeof(char*));
+    DedupIndex* seen = dedup_create(nblocks);
+    char* copies = NULL;
+    uint32_t* reserved = NULL;
+    uint32_t nfresh = 0;
+    uint32_t nreserved = 0;
+    size_t done = 0;
+    bool failed = !shared || !blocks || !buffers || !seen;
+    if (failed) {
+        fprintf(stderr, "Couldn't allocate block lists.\n");
+        goto write_shared_done;
+    }
+
+    // 1. Partial first and last blocks are staged with their old contents; whole blocks are hashed straight from the caller's buffer.
+    Block stages[2] = {{{0}}};
+    size_t stage_begins[2];
+    size_t stage_ends[2];
+    size_t nstaged = 0;
+    size_t nold = 0;
+    for (size_t n = 0; n < nblocks; n++) {
+        size_t begin = (n == 0) ? offset_into_block : 0;
+        size_t end = min((size_t)BLOCK_SIZE, offset_into_block + length - n * BLOCK_SIZE);
+        shared[n].old = block_map_get(&map, start_block + n);
+        if (begin == 0 && end == BLOCK_SIZE) {
+            shared[n].contents = data + n * BLOCK_SIZE - offset_into_block;
+            continue;
+        }
+
+        Block* stage = &stages[nstaged];
+        stage_begins[nstaged] = begin;
+        stage_ends[nstaged++] = end;
+        shared[n].contents = stage->data;
+        if (shared[n].old) {
+            blocks[nold] = shared[n].old;
+            buffers[nold++] = stage->data;
+        }
+    }
+
+    if (map.failed || (nold > 0 && (disk_readv(fs->disk, blocks, buffers, nold) == DISK_FAILURE ||
+                                    !verify_checksums(fs, blocks, buffers, nold)))) {
+        fprintf(stderr, "Couldn't read partial data blocks.\n");
+        failed = true;
+        goto write_shared_done;
+    }
+    for (size_t n = 0, k = 0; n < nblocks && k < nstaged; n++) {
+        if (shared[n].contents == stages[k].data) {
+            memcpy(stages[k].data + stage_begins[k], data + n * BLOCK_SIZE + stage_begins[k] - offset_into_block,
+                   stage_ends[k] - stage_begins[k]);
+            k++;
+        }
+    }
+
+    // 2. Hash every block, pairing it with an earlier block of this write or a block in the index with the same hash.
+    for (size_t n = 0; n < nblocks; n++) {
+        shared[n].hole = is_zero(shared[n].contents, BLOCK_SIZE);
+        if (shared[n].hole) {
+            continue;
+        }
+
+        shared[n].hash = block_checksum(shared[n].contents);
+        uint32_t twin = dedup_lookup(seen, shared[n].hash);
+        if (twin && memcmp(shared[twin - 1].contents, shared[n].contents, BLOCK_SIZE) == 0) {
+            shared[n].twin = twin;
+        } else {
+            dedup_insert(seen, shared[n].hash, n + 1);
+        }
+    }
+
+    size_t nfound = 0;
+    pthread_mutex_lock(&fs->dedup_lock);
+    for (size_t n = 0; n < nblocks; n++) {
+        if (shared[n].hole || shared[n].twin) {
+            continue;
+        }
+
+        // The old block cannot be released by anyone else while the Inode is locked
+        shared[n].found = dedup_lookup(fs->dedup_index, shared[n].hash);
+        if (shared[n].found && shared[n].found != shared[n].old) {
+            add_references(fs, shared[n].found, 1);
+            shared[n].held = true;
+        }
+        nfound += shared[n].found != 0;
+    }
+    pthread_mutex_unlock(&fs->dedup_lock);
+
+    // 3. Compare the blocks found with the new contents (if they cannot be read, none are shared).
+    copies = malloc(max(nfound, 1) * BLOCK_SIZE);
+    if (!copies) {
+        failed = true;
+        goto write_shared_done;
+    }
+    nfound = 0;
+    for (size_t n = 0; n < nblocks; n++) {
+        if (shared[n].found) {
+            blocks[nfound] = shared[n].found;
+            buffers[nfound] = copies + nfound * BLOCK_SIZE;
+            nfound++;
+        }
+    }
+
+    bool compared = nfound == 0 || disk_readv(fs->disk, blocks, buffers, nfound) != DISK_FAILURE;
+    nfound = 0;
+    for (size_t n = 0; n < nblocks; n++) {
+        if (shared[n].found) {
+            if (compared && memcmp(copies + nfound * BLOCK_SIZE, shared[n].contents, BLOCK_SIZE) == 0) {
+                shared[n].block = shared[n].found;
+                shared[n].referenced = shared[n].held;
+                shared[n].held = false;
+            }
+            nfound++;
+        }
+        nfresh += !shared[n].hole && !shared[n].twin && !shared[n].block;
+    }
+
+    // 4. Write the new contents to fresh blocks in one request.
+    reserved = calloc(max(nfresh, 1), sizeof(uint32_t));
+    nreserved = reserved ? reserve_free_blocks(fs, reserved, nfresh) : 0;
+    if (nreserved != nfresh) {
+        fprintf(stderr, "Couldn't allocate data blocks.\n");
+        failed = true;
+        goto write_shared_done;
+    }
+
+    uint32_t next = 0;
+    for (size_t n = 0; n < nblocks; n++) {
+        if (!shared[n].hole && !shared[n].twin && !shared[n].block) {
+            blocks[next] = reserved[next];
+            buffers[next] = (char*)shared[n].contents;
+            next++;
+        }
+    }
+    if (nfresh > 0 && disk_writev(fs->disk, blocks, buffers, nfresh) == DISK_FAILURE) {
+        fprintf(stderr, "Couldn't write data blocks.\n");
+        failed = true;
+        goto write_shared_done;
+    }
+    record_checksums(fs, blocks, buffers, nfresh);
+
+    // Index the fresh blocks and count the pointers every block is about to gain.
+    next = 0;
+    pthread_mutex_lock(&fs->dedup_lock);
+    for (size_t n = 0; n < nblocks; n++) {
+        if (shared[n].twin) {
+            shared[n].block = shared[shared[n].twin - 1].block;
+            add_references(fs, shared[n].block, 1);
+            shared[n].referenced = true;
+        } else if (!shared[n].hole && !shared[n].block) {
+            shared[n].block = reserved[next++];
+            dedup_insert(fs->dedup_index, shared[n].hash, shared[n].block);
+            add_references(fs, shared[n].block, 1);
+            shared[n].referenced = true;
+        }
+    }
+    pthread_mutex_unlock(&fs->dedup_lock);
+    nreserved = 0;
+
+    // 5. Point the logical blocks at their data blocks (the block map allocates any pointer blocks on the way).
+    for (; done < nblocks; done++) {
+        if (shared[done].block != shared[done].old && !block_map_set(&map, start_block + done, shared[done].block)) {
+            fprintf(stderr, "Couldn't map data block %lu.\n", start_block + done);
+            failed = true;
+            break;
+        }
+    }
+
+    // On failure, point the logical blocks already mapped back at their old data blocks (those left mapped keep their new block).
+    while (failed && done > 0 && block_map_set(&map, start_block + done - 1, shared[done - 1].old)) {
+        done--;
+    }
+
+write_shared_done:
+    // Drop the references to replaced blocks, blocks found with other contents, and (on failure) blocks never pointed at.
+    if (shared && fs->dedup_index) {
+        pthread_mutex_lock(&fs->dedup_lock);
+        for (size_t n = 0; n < nblocks; n++) {
+            if (shared[n].held) {
+                drop_reference(fs, shared[n].found);
+            }
+            if (n >= done && shared[n].referenced) {
+                drop_reference(fs, shared[n].block);
+            } else if (n < done && shared[n].old && (shared[n].referenced || shared[n].hole)) {
+                drop_reference(fs, shared[n].old);
+            }
+        }
+        pthread_mutex_unlock(&fs->dedup_lock);
+    }
+    for (uint32_t i = 0; i < nreserved; i++) {
+        release_block(fs, reserved[i]);
+    }
+    free(shared);
+    free(blocks);
+    free(buffers);
+    dedup_delete(seen);
+    free(copies);
+    free(reserved);
+
+    // Record any new indirect pointers.
+    if (!block_map_flush(&map)) {
+        fprintf(stderr, "Couldn't update indirect blocks.\n");
+        failed = true;
+    }
+
+    if (!failed) {
+        set_inode_size(inode, max(offset + length, inode_size(inode)));
+    }
+    if (!save_inode(inode, inode_number, fs) || failed) {
+        return -1;
+    }
+
+    return length;
+}
+
+/**
+ * Find the lock covering an Inode (locks are striped across the inodes).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to lock.
+ * @return      Pointer to lock (NULL if unmounted or out of range).
+ **/
+pthread_rwlock_t* inode_lock(FileSystem* fs, size_t inode_number) {
+    if (!fs->disk || inode_number >= fs->meta_data.inodes) {
+        return NULL;
+    }
+
+    return &fs->inode_locks[inode_number % fs->ninode_locks];
+}
+
+/**
+ * Initialize the FileSystem locks by doing the following:
+ *
+ *  1. Allocate one reader/writer lock per Inode, up to INODE_LOCKS.
+ *
+ *  2. Split the free block bitmap into word-aligned allocator shards of at
+ *  least ALLOC_SHARD_MIN blocks each, up to ALLOC_SHARDS.
+ *
+ *  3. Initialize the sync, table, superblock, dedup, and read-ahead locks.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Whether or not the locks could be allocated.
+ **/
+bool init_locks(FileSystem* fs) {
+    fs->ninode_locks = min(fs->meta_data.inodes, INODE_LOCKS);
+    fs->inode_locks = calloc(fs->ninode_locks, sizeof(pthread_rwlock_t));
+    if (!fs->inode_locks) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < fs->ninode_locks; i++) {
+        pthread_rwlock_init(&fs->inode_locks[i], NULL);
+    }
+
+    size_t nwords = (fs->meta_data.blocks + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    fs->nshards = max(1, min(ALLOC_SHARDS, fs->meta_data.blocks / ALLOC_SHARD_MIN));
+    for (uint32_t s = 0; s < fs->nshards; s++) {
+        AllocShard* shard = &fs->shards[s];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->start = nwords * s / fs->nshards * BITS_PER_WORD;
+        shard->end = (s + 1 == fs->nshards) ? fs->meta_data.blocks : nwords * (s + 1) / fs->nshards * BITS_PER_WORD;
+    }
+
+    pthread_rwlock_init(&fs->sync_lock, NULL);
+    pthread_mutex_init(&fs->table_lock, NULL);
+    pthread_mutex_init(&fs->super_lock, NULL);
+    pthread_mutex_init(&fs->dedup_lock, NULL);
+    for (int i = 0; i < READAHEAD_STREAMS; i++) {
+        pthread_mutex_init(&fs->readahead[i].lock, NULL);
+    }
+    return true;
+}
+
+/**
+ * Destroy the FileSystem locks (if init_locks set them up).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ **/
+void destroy_locks(FileSystem* fs) {
+    if (!fs->inode_locks) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < fs->ninode_locks; i++) {
+        pthread_rwlock_destroy(&fs->inode_locks[i]);
+    }
+    free(fs->inode_locks);
+    fs->inode_locks = NULL;
+    fs->ninode_locks = 0;
+
+    for (uint32_t s = 0; s < fs->nshards; s++) {
+        pthread_mutex_destroy(&fs->shards[s].lock);
+    }
+    fs->nshards = 0;
+
+    pthread_rwlock_destroy(&fs->sync_lock);
+    pthread_mutex_destroy(&fs->table_lock);
+    pthread_mutex_destroy(&fs->super_lock);
+    pthread_mutex_destroy(&fs->dedup_lock);
+    for (int i = 0; i < READAHEAD_STREAMS; i++) {
+        pthread_mutex_destroy(&fs->readahead[i].lock);
+    }
+}
+
+/**
+ * Find the allocator shard covering a block.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       block   Block number.
+ * @return      Index of shard.
+ **/
+uint32_t shard_index(FileSystem* fs, size_t block) {
+    uint32_t s = 0;
+    while (s + 1 < fs->nshards && block >= fs->shards[s].end) {
+        s++;
+    }
+    return s;
+}
+
+/**
+ * Allocate up to count contiguous free blocks from one allocator shard
+ * (called with the shard locked), searching from the specified block to the
+ * end of the shard.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       shard       Pointer to AllocShard structure.
+ * @param       from        Block to begin searching from.
+ * @param       count       Number of blocks wanted.
+ * @param       whole       Whether only a run of count blocks will do (false
+ *                          settles for the run at the next free block).
+ * @param       allocated   Set to the number of blocks allocated.
+ * @return      First block of allocated extent (0 if none was found).
+ **/
+uint32_t allocate_from_shard(FileSystem* fs, AllocShard* shard, size_t from, uint32_t count, bool whole, uint32_t* allocated) {
+    Bitmap* free_blocks = fs->free_blocks;
+    ssize_t start;
+    size_t length = count;
+    if (whole) {
+        start = bitmap_find_run_in(free_blocks, from, shard->end, count);
+    } else {
+        start = bitmap_find_in(free_blocks, from, shard->end);
+        if (start >= 0) {
+            length = min(count, bitmap_run_length_in(free_blocks, start, shard->end));
+        }
+    }
+    if (start < 0) {
+        return 0;
+    }
+
+    bitmap_clear_range(free_blocks, start, length);
+    __atomic_store_n(&free_blocks->cursor, start + length, __ATOMIC_RELAXED);
+    mark_bitmap_dirty(fs, start, length);
+    *allocated = length;
+    return start;
+}
+
+
+/**
+ * Prepare a BlockMap for the specified Inode, with the number of direct
+ * pointers and indirect trees set by the FileSystem version.
+ *
+ * @param       map     Pointer to BlockMap structure.
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       inode   Pointer to Inode structure (updated in place).
+ **/
+void block_map_init(BlockMap* map, FileSystem* fs, Inode* inode) {
+    map->fs = fs;
+    map->inode = inode;
+    map->direct = direct_pointers(fs);
+    map->trees = fs->meta_data.version >= 1 ? 3 : 1;
+    map->failed = false;
+    memset(map->numbers, 0, sizeof(map->numbers));
+    memset(map->dirty, 0, sizeof(map->dirty));
+}
+
+/**
+ * Return the number of logical blocks the BlockMap can address, limited to
+ * what the size field can describe.
+ *
+ * @param       map     Pointer to BlockMap structure.
+ * @return      Number of addressable logical blocks.
+ **/
+uint64_t block_map_capacity(BlockMap* map) {
+    uint64_t capacity = map->direct;
+    uint64_t span = POINTERS_PER_BLOCK;
+    for (uint32_t tree = 0; tree < map->trees; tree++) {
+        capacity += span;
+        span *= POINTERS_PER_BLOCK;
+    }
+
+    return min(capacity, (1ULL << 48) / BLOCK_SIZE);
+}
+
+/**
+ * Look up the data block backing a logical block.
+ *
+ * @param       map     Pointer to BlockMap structure.
+ * @param       logical Logical block number within the file.
+ * @return      Data block number (0 if unmapped; map->failed is set if a
+ *              pointer block could not be read).
+ **/
+uint32_t block_map_get(BlockMap* map, uint64_t logical) {
+    int leaf;
+    uint32_t* pointer = block_map_pointer(map, logical, false, &leaf);
+    return pointer ? *pointer : 0;
+}
+
+/**
+ * Point a logical block at the specified data block, allocating any pointer
+ * blocks missing along the way.
+ *
+ * Note: Changes to pointer blocks are held in the BlockMap until
+ * block_map_flush; changes to the Inode are left for the caller to save.
+ *
+ * @param       map     Pointer to BlockMap structure.
+ * @param       logical Logical block number within the file.
+ * @param       block   Data block number.
+ * @return      Whether or not the pointer was recorded.
+ **/
+bool block_map_set(BlockMap* map, uint64_t logical, uint32_t block) {
+    int leaf;
+    uint32_t* pointer = block_map_pointer(map, logical, true, &leaf);
+    if (!pointer) {
+        return false;
+    }
+
+    *pointer = block;
+    if (leaf >= 0) {
+        map->dirty[leaf] = true;
+    }
+    return true;
+}
+
+/**
+ * Write every modified pointer block held by the BlockMap back to Disk (or
+ * to the running journal transaction).
+ *
+ * @param       map     Pointer to BlockMap structure.
+ * @return      Whether or not every pointer block transfer succeeded.
+ **/
+bool block_map_flush(BlockMap* map) {
+    for (int slot = 0; slot < BLOCK_MAP_SLOTS; slot++) {
+        if (!map->dirty[slot]) {
+            continue;
+        }
+
+        if (!journal_write(map->fs->journal, map->fs->disk, map->numbers[slot], map->slots[slot].data)) {
+            map->failed = true;
+        }
+        map->dirty[slot] = false;
+    }
+
+    return !map->failed;
+}
+
+/**
+ * Find the pointer that holds the data block for a logical block by doing
+ * the following:
+ *
+ *  1. Use the direct pointers for the first logical blocks.
+ *
+ *  2. Otherwise pick the indirect tree covering the logical block and
+ *  descend it one level at a time, keeping each pointer block in the slot
+ *  for that tree and level (allocating zeroed pointer blocks if requested).
+ *
+ * @param       map         Pointer to BlockMap structure.
+ * @param       logical     Logical block number within the file.
+ * @param       allocate    Whether to allocate missing pointer blocks.
+ * @param       leaf        Set to the slot holding the pointer (-1 if the
+ *                          pointer lives in the Inode).
+ * @return      Pointer to the data block number (NULL if unmapped, out of
+ *              range, or on failure).
+ **/
+uint32_t* block_map_pointer(BlockMap* map, uint64_t logical, bool allocate, int* leaf) {
+    *leaf = -1;
+    if (logical < map->direct) {
+        return &map->inode->direct[logical];
+    }
+    logical -= map->direct;
+
+    uint32_t* roots[] = {&map->inode->indirect, &map->inode->double_indirect, &map->inode->triple_indirect};
+    uint64_t span = POINTERS_PER_BLOCK;
+    uint32_t tree = 0;
+    while (tree < map->trees && logical >= span) {
+        logical -= span;
+        span *= POINTERS_PER_BLOCK;
+        tree++;
+    }
+    if (tree == map->trees) {
+        return NULL;
+    }
+
+    // Slots are laid out as [indirect] [double, leaf] [triple, middle, leaf]
+    uint32_t* pointer = roots[tree];
+    int parent = -1;
+    int first = tree * (tree + 1) / 2;
+    for (uint32_t level = 0; level <= tree; level++) {
+        int slot = first + level;
+        if (*pointer == 0) {
+            uint32_t block = allocate ? allocate_free_block(map->fs) : 0;
+            if (block == 0) {
+                return NULL;
+            }
+            if (!block_map_load(map, slot, block, false)) {
+                release_block(map->fs, block);
+                return NULL;
+            }
+            *pointer = block;
+            map->dirty[slot] = true;
+            if (parent >= 0) {
+                map->dirty[parent] = true;
+            }
+        } else if (!block_map_load(map, slot, *pointer, true)) {
+            return NULL;
+        }
+
+        span /= POINTERS_PER_BLOCK;
+        pointer = &map->slots[slot].pointers[(logical / span) % POINTERS_PER_BLOCK];
+        parent = slot;
+    }
+
+    *leaf = parent;
+    return pointer;
+}
+
+/**
+ * Make a BlockMap slot hold the specified pointer block, writing back the
+ * block it held if modified, then reading the new one (or zeroing it for a
+ * newly allocated block).
+ *
+ * @param       map     Pointer to BlockMap structure.
+ * @param       slot    Slot to load.
+ * @param       block   Pointer block number.
+ * @param       read    Whether to read the block (false zeroes it).
+ * @return      Whether or not the slot now holds the block.
+ **/
+bool block_map_load(BlockMap* map, int slot, uint32_t block, bool read) {
+    if (map->numbers[slot] == block) {
+        return true;
+    }
+
+    FileSystem* fs = map->fs;
+    if (map->dirty[slot] && !journal_write(fs->journal, fs->disk, map->numbers[slot], map->slots[slot].data)) {
+        map->failed = true;
+        return false;
+    }
+    map->dirty[slot] = false;
+    map->numbers[slot] = 0;
+
+    if (!read) {
+        memset(map->slots[slot].data, 0, BLOCK_SIZE);
+    } else if (!journal_read(fs->journal, fs->disk, block, map->slots[slot].data)) {
+        map->failed = true;
+        return false;
+    }
+
+    map->numbers[slot] = block;
+    return true;
+}
+
+/**
+ * Remove a pointer block, and every block reachable from it, from a scan
+ * task's free block bitmap during a scan (safe to call from several threads
+ * at once).
+ *
+ * @param       task        Pointer to ScanTask structure.
+ * @param       block       Pointer block (0 if the tree is empty).
+ * @param       levels      Levels of pointer blocks (1 for indirect).
+ * @return      Whether or not every pointer block could be read.
+ **/
+bool mark_indirect_blocks(ScanTask* task, uint32_t block, uint32_t levels) {
+    if (block == 0) {
+        return true;
+    }
+
+    bitmap_clear(task->free_blocks, block);
+
+    Block pointer_block = {0};
+    if (disk_read_shared(task->disk, block, pointer_block.data) == DISK_FAILURE) {
+        return false;
+    }
+
+    for (int k = 0; k < POINTERS_PER_BLOCK; k++) {
+        uint32_t pointer = pointer_block.pointers[k];
+        if (pointer == 0) {
+            continue;
+        }
+
+        if (levels > 1) {
+            if (!mark_indirect_blocks(task, pointer, levels - 1)) {
+                return false;
+            }
+        } else if (!mark_data_block(task, pointer)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Remove a data block from a scan task's free block bitmap, counting the
+ * pointer to it if the FileSystem shares blocks (the counts are shared by
+ * every task, so they are updated atomically).
+ *
+ * @param       task        Pointer to ScanTask structure.
+ * @param       block       Data block.
+ * @return      Whether or not the block lies in the data region.
+ **/
+bool mark_data_block(ScanTask* task, uint32_t block) {
+    if (block < first_data_block(task->fs) || block >= task->fs->meta_data.blocks) {
+        fprintf(stderr, "Data block pointer %u is out of range.\n", block);
+        return false;
+    }
+
+    bitmap_clear(task->free_blocks, block);
+    if (task->references) {
+        __atomic_add_fetch(&task->references[block], 1, __ATOMIC_RELAXED);
+    }
+    return true;
+}
+
+/**
+ * Release a pointer block, and every block reachable from it, back to the
+ * free block bitmap (the blocks themselves are left as they are, and shared
+ * data blocks only lose a reference).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       block   Pointer block (0 if the tree is empty).
+ * @param       levels  Levels of pointer blocks (1 for indirect).
+ * @return      Whether or not every disk operation succeeded.
+ **/
+bool release_indirect_blocks(FileSystem* fs, uint32_t block, uint32_t levels) {
+    if (block == 0) {
+        return true;
+    }
+
+    Block pointer_block = {0};
+    if (!journal_read(fs->journal, fs->disk, block, pointer_block.data)) {
+        return false;
+    }
+
+    for (int k = 0; k < POINTERS_PER_BLOCK; k++) {
+        uint32_t pointer = pointer_block.pointers[k];
+        if (pointer == 0) {
+            continue;
+        }
+
+        if (levels > 1) {
+            if (!release_indirect_blocks(fs, pointer, levels - 1)) {
+                return false;
+            }
+        } else {
+            release_data_block(fs, pointer);
+        }
+    }
+
+    retire_block(fs, block);
+    return true;
+}
+
+/**
+ * Return a block to the free block bitmap.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       block   Block to release.
+ **/
+void release_block(FileSystem* fs, uint32_t block) {
+    AllocShard* shard = &fs->shards[shard_index(fs, block)];
+    pthread_mutex_lock(&shard->lock);
+    bitmap_set(fs->free_blocks, block);
+    pthread_mutex_unlock(&shard->lock);
+    mark_bitmap_dirty(fs, block, 1);
+}
+
+/**
+ * Release a block that was in use by an Inode: with a journal, the block is
+ * only returned to the free block bitmap once the release commits.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       block   Block to release.
+ **/
+void retire_block(FileSystem* fs, uint32_t block) {
+    if (!fs->journal || !journal_release(fs->journal, block)) {
+        release_block(fs, block);
+    }
+}
+
+/**
+ * Release a data block that was in use by an Inode: a block shared by
+ * contents only loses the reference, and is retired once it has none left.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       block   Data block to release.
+ **/
+void release_data_block(FileSystem* fs, uint32_t block) {
+    if (!fs->dedup_index) {
+        retire_block(fs, block);
+        return;
+    }
+
+    pthread_mutex_lock(&fs->dedup_lock);
+    drop_reference(fs, block);
+    pthread_mutex_unlock(&fs->dedup_lock);
+}
+
+/**
+ * Record that an inode block changed, so it is written back by the next
+ * sync (called with the table lock held).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       index   Index of inode block in Inode table.
+ **/
+void mark_inode_dirty(FileSystem* fs, uint32_t index) {
+    if (!fs->dirty_inode_blocks[index]) {
+        fs->dirty_inode_blocks[index] = true;
+        __atomic_add_fetch(&fs->dirty_blocks, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Record that the state of a run of blocks changed, so the free bitmap
+ * blocks covering them are written back by the next sync.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       start   First block of run.
+ * @param       length  Number of blocks in run.
+ **/
+void mark_bitmap_dirty(FileSystem* fs, uint32_t start, uint32_t length) {
+    if (fs->meta_data.bitmap_blocks == 0 || length == 0) {
+        return;
+    }
+
+    uint32_t last = (start + length - 1) / BITS_PER_BITMAP_BLOCK;
+    for (uint32_t i = start / BITS_PER_BITMAP_BLOCK; i <= last; i++) {
+        if (!__atomic_exchange_n(&fs->dirty_bitmap_blocks[i], true, __ATOMIC_RELAXED)) {
+            __atomic_add_fetch(&fs->dirty_blocks, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Record the checksums of data blocks that were just written (and that they
+ * start no compressed extent), marking the checksum blocks holding them
+ * dirty (does nothing without checksums).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       blocks  Data blocks written.
+ * @param       buffers Contents written to each block.
+ * @param       count   Number of blocks written.
+ **/
+void record_checksums(FileSystem* fs, const size_t* blocks, char** buffers, size_t count) {
+    if (!fs->checksum_table) {
+        return;
+    }
+
+    // Each block belongs to one Inode, locked by the writer, so only the dirty flags need the table lock
+    for (size_t i = 0; i < count; i++) {
+        fs->checksum_table[blocks[i] / CHECKSUMS_PER_BLOCK].pointers[blocks[i] % CHECKSUMS_PER_BLOCK] =
+            block_checksum(buffers[i]);
+        if (fs->meta_data.extent_blocks) {
+            *extent_entry(fs, blocks[i]) = 0;
+        }
+    }
+
+    pthread_mutex_lock(&fs->table_lock);
+    for (size_t i = 0; i < count; i++) {
+        mark_checksum_dirty(fs, blocks[i] / CHECKSUMS_PER_BLOCK);
+        if (fs->meta_data.extent_blocks) {
+            mark_checksum_dirty(fs, fs->meta_data.checksum_blocks / 2 + blocks[i] / CHECKSUMS_PER_BLOCK);
+        }
+    }
+    pthread_mutex_unlock(&fs->table_lock);
+}
+
+/**
+ * Record that a checksum block changed, so it is written back by the next
+ * sync (called with the table lock held).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       index   Index of block in checksum table.
+ **/
+void mark_checksum_dirty(FileSystem* fs, uint32_t index) {
+    if (!fs->dirty_checksum_blocks[index]) {
+        fs->dirty_checksum_blocks[index] = true;
+        __atomic_add_fetch(&fs->dirty_blocks, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Find where the compressed length of an extent starting at a data block
+ * is kept (in the second half of the checksum table).
+ *
+ * @param       fs      Pointer to FileSystem structure (compressed).
+ * @param       block   Data block.
+ * @return      Pointer to compressed length (0 if the block holds plain data).
+ **/
+uint32_t* extent_entry(FileSystem* fs, size_t block) {
+    uint32_t index = fs->meta_data.checksum_blocks / 2 + block / CHECKSUMS_PER_BLOCK;
+    return &fs->checksum_table[index].pointers[block % CHECKSUMS_PER_BLOCK];
+}
+
+/**
+ * Record the compressed length of an extent just written starting at a
+ * data block (after its checksums).
+ *
+ * @param       fs      Pointer to FileSystem structure (compressed).
+ * @param       block   First data block of extent.
+ * @param       length  Number of compressed bytes.
+ **/
+void record_extent(FileSystem* fs, size_t block, uint32_t length) {
+    *extent_entry(fs, block) = length;
+
+    pthread_mutex_lock(&fs->table_lock);
+    mark_checksum_dirty(fs, fs->meta_data.checksum_blocks / 2 + block / CHECKSUMS_PER_BLOCK);
+    pthread_mutex_unlock(&fs->table_lock);
+}
+
+/**
+ * Find where the number of pointers to a data block is kept (in the second
+ * half of the checksum table).
+ *
+ * @param       fs      Pointer to FileSystem structure (deduplicating).
+ * @param       block   Data block.
+ * @return      Pointer to reference count (0 if the block is not in use).
+ **/
+uint32_t* refcount_entry(FileSystem* fs, size_t block) {
+    uint32_t index = fs->meta_data.checksum_blocks / 2 + block / CHECKSUMS_PER_BLOCK;
+    return &fs->checksum_table[index].pointers[block % CHECKSUMS_PER_BLOCK];
+}
+
+/**
+ * Add pointers to a data block (called with the dedup lock held; the block
+ * must already be in the dedup index, or be added to it by the caller).
+ *
+ * @param       fs      Pointer to FileSystem structure (deduplicating).
+ * @param       block   Data block.
+ * @param       count   Number of pointers added.
+ **/
+void add_references(FileSystem* fs, uint32_t block, uint32_t count) {
+    uint32_t* entry = refcount_entry(fs, block);
+    fs->shared_blocks += *entry ? count : count - 1;
+    *entry += count;
+
+    pthread_mutex_lock(&fs->table_lock);
+    mark_checksum_dirty(fs, fs->meta_data.checksum_blocks / 2 + block / CHECKSUMS_PER_BLOCK);
+    pthread_mutex_unlock(&fs->table_lock);
+}
+
+/**
+ * Remove one pointer to a data block (called with the dedup lock held).  A
+ * block left with no pointers leaves the dedup index and is retired.
+ *
+ * @param       fs      Pointer to FileSystem structure (deduplicating).
+ * @param       block   Data block.
+ **/
+void drop_reference(FileSystem* fs, uint32_t block) {
+    uint32_t* entry = refcount_entry(fs, block);
+    if (*entry > 1) {
+        fs->shared_blocks--;
+        (*entry)--;
+    } else {
+        *entry = 0;
+        dedup_remove(fs->dedup_index, fs->checksum_table[block / CHECKSUMS_PER_BLOCK].pointers[block % CHECKSUMS_PER_BLOCK], block);
+        retire_block(fs, block);
+    }
+
+    pthread_mutex_lock(&fs->table_lock);
+    mark_checksum_dirty(fs, fs->meta_data.checksum_blocks / 2 + block / CHECKSUMS_PER_BLOCK);
+    pthread_mutex_unlock(&fs->table_lock);
+}
+
+/**
+ * Build the dedup index from the checksum table: every data block with
+ * pointers to it is indexed by its recorded checksum, and every pointer
+ * beyond the first to a block counts as shared.
+ *
+ * @param       fs      Pointer to FileSystem structure (deduplicating).
+ * @return      Whether or not the index could be allocated.
+ **/
+bool load_dedup_index(FileSystem* fs) {
+    pthread_mutex_lock(&fs->dedup_lock);
+    if (!fs->dedup_index) {
+        fs->dedup_index = dedup_create(fs->meta_data.blocks - fs->free_blocks->count);
+    } else {
+        dedup_clear(fs->dedup_index);
+    }
+
+    bool success = fs->dedup_index != NULL;
+    fs->shared_blocks = 0;
+    for (uint32_t block = first_data_block(fs); success && block < fs->meta_data.blocks; block++) {
+        uint32_t references = *refcount_entry(fs, block);
+        if (references) {
+            success = dedup_insert(fs->dedup_index, fs->checksum_table[block / CHECKSUMS_PER_BLOCK].pointers[block % CHECKSUMS_PER_BLOCK], block);
+            fs->shared_blocks += references - 1;
+        }
+    }
+    pthread_mutex_unlock(&fs->dedup_lock);
+    return success;
+}
+
+/**
+ * Check data blocks that were just read against their recorded checksums,
+ * reporting and counting any that do not match (always true without
+ * checksums).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       blocks  Data blocks read.
+ * @param       buffers Contents read from each block.
+ * @param       count   Number of blocks read.
+ * @return      Whether or not every block matched.
+ **/
+bool verify_checksums(FileSystem* fs, const size_t* blocks, char** buffers, size_t count) {
+    bool verified = true;
+    for (size_t i = 0; fs->checksum_table && i < count; i++) {
+        if (!checksum_matches(fs, blocks[i], buffers[i])) {
+            fprintf(stderr, "Checksum mismatch in data block %lu.\n", blocks[i]);
+            __atomic_add_fetch(&fs->checksum_errors, 1, __ATOMIC_RELAXED);
+            verified = false;
+        }
+    }
+    return verified;
+}
+
+/**
+ * Compare the contents of a data block with its recorded checksum.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       block   Data block.
+ * @param       data    Contents of block.
+ * @return      Whether or not the contents match (true if no checksum is
+ *              recorded).
+ **/
+bool checksum_matches(FileSystem* fs, size_t block, const char* data) {
+    uint32_t expected = fs->checksum_table[block / CHECKSUMS_PER_BLOCK].pointers[block % CHECKSUMS_PER_BLOCK];
+    return expected == 0 || block_checksum(data) == expected;
+}
+
+/**
+ * Mark the superblock on Disk unclean before the first change since the
+ * last sync, so a crash before the next sync makes mount walk every Inode
+ * rather than trust a stale free block bitmap.
+ *
+ * Note: Every change calls this once, up front, with the sync lock held
+ * (so no sync can mark the superblock clean before the change is made) but
+ * before the Inode table or any allocation shard is locked, so the
+ * superblock write never holds up the threads waiting on them.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ **/
+void mark_unclean(FileSystem* fs) {
+    pthread_mutex_lock(&fs->super_lock);
+    if (fs->meta_data.clean && !write_superblock(fs, false)) {
+        fprintf(stderr, "Couldn't mark superblock unclean.\n");
+    }
+    pthread_mutex_unlock(&fs->super_lock);
+}
+
+/**
+ * Write the superblock, marked clean (with the checksum of the free block
+ * bitmap) or unclean, and flush it to Disk.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       clean   Whether the bitmap on Disk matches the Inode table.
+ * @return      Whether or not all disk operations were successful.
+ **/
+bool write_superblock(FileSystem* fs, bool clean) {
+    fs->meta_data.clean = clean;
+    if (fs->journal) {
+        pthread_mutex_lock(&fs->journal->lock);
+        fs->meta_data.journal_sequence = fs->journal->sequence;
+        pthread_mutex_unlock(&fs->journal->lock);
+    }
+    if (clean) {
+        fs->meta_data.bitmap_checksum = checksum((char*)fs->free_blocks->words,
+                                                 fs->free_blocks->nwords * sizeof(uint64_t));
+    }
 
-        // Load the data block and read its contents.
-        Block data_block = {0};
-        if (i < POINTERS_PER_INODE) {
-            // Read from direct block
-            if (disk_read(fs->disk, inode.direct[i], data_block.data) == DISK_FAILURE) {
-                return -1;
-            }
-            memcpy(data + bytes_read, data_block.data + offset_into_block, length_to_read);
-        } else {
-            // Read from indirect block
-            Block indirect_block = {0};
-            if (disk_read(fs->disk, inode.indirect, indirect_block.data) == DISK_FAILURE) {
-                return -1;
-            }
-            if (disk_read(fs->disk, indirect_block.pointers[i - POINTERS_PER_INODE], data_block.data) == DISK_FAILURE) {
-                return -1;
+    Block superblock = {0};
+    superblock.super = fs->meta_data;
+    return disk_write(fs->disk, 0, superblock.data) != DISK_FAILURE && disk_flush(fs->disk);
+}
+
+/**
+ * Build the free inode bitmap from the in-memory Inode table (every Inode
+ * that is not valid is free).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ **/
+void load_free_inodes(FileSystem* fs) {
+    Bitmap* free_inodes = fs->free_inodes;
+    for (uint32_t i = 0; i < fs->meta_data.inode_blocks; i++) {
+        for (uint32_t j = 0; j < INODES_PER_BLOCK; j++) {
+            if (fs->inode_table[i].inodes[j].valid) {
+                bitmap_clear(free_inodes, i * INODES_PER_BLOCK + j);
             }
-            memcpy(data + bytes_read, data_block.data + offset_into_block, length_to_read);
         }
+    }
 
-        // If we have reached the end of the length requested to read, break early.
-        bytes_read += length_to_read;
-        length -= length_to_read;
-        offset_into_block = 0;
+    // Keep the cursor at the lowest free inode, so fs_create hands it out first
+    ssize_t first = bitmap_find(free_inodes, 0);
+    free_inodes->cursor = first < 0 ? 0 : first;
+}
+
+/**
+ * Take the lowest free Inode and mark it valid (called with the Inode table
+ * locked).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Inode number (-1 if every Inode is in use).
+ **/
+ssize_t allocate_inode(FileSystem* fs) {
+    ssize_t inode_number = bitmap_allocate(fs->free_inodes);
+    if (inode_number < 0) {
+        return -1;
     }
 
-    return bytes_read;
+    uint32_t iblock = inode_number / INODES_PER_BLOCK;
+    Inode* inode = &fs->inode_table[iblock].inodes[inode_number % INODES_PER_BLOCK];
+    memset(inode, 0, sizeof(Inode));
+    inode->valid = 1;
+    mark_inode_dirty(fs, iblock);
+    return inode_number;
 }
 
 /**
- * Write to the specified Inode from the data buffer exactly length bytes
- * beginning from the specified offset by doing the following:
+ * Load the free block bitmap from Disk by doing the following:
  *
- *  1. Load Inode information.
+ *  1. Check that the superblock was marked clean by the last sync (or that
+ *  the bitmap is kept by the journal, which always leaves it matching the
+ *  Inode table on Disk).
  *
- *  2. Continuously copy data from buffer to blocks.
+ *  2. Read the bitmap blocks as one batch.
  *
- *  Note: Data is read from direct blocks first, and then from indirect blocks.
+ *  3. Verify the checksum recorded in the superblock (if clean) and copy the
+ *  bitmap.
  *
- * @param       fs              Pointer to FileSystem structure.
- * @param       inode_number    Inode to write data to.
- * @param       data            Buffer with data to copy
- * @param       length          Number of bytes to write.
- * @param       offset          Byte offset from which to begin writing.
- * @return      Number of bytes read (-1 on error).
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Whether or not the bitmap on Disk could be trusted.
  **/
-ssize_t fs_write(FileSystem* fs, size_t inode_number, char* data, size_t length, size_t offset) {
-    Inode inode = {0};
-    if (!load_inode(&inode, inode_number, fs->disk)) {
-        return -1;
+bool load_free_blocks(FileSystem* fs) {
+    if (fs->meta_data.version < 2) {
+        return false;
     }
 
-    ssize_t bytes_written = 0;
+    if (!fs->meta_data.clean && !fs->journal) {
+        fprintf(stderr, "File system was not synced cleanly; rebuilding free block bitmap.\n");
+        return false;
+    }
 
-    // Calculate the start and end indices of the data blocks to be written.
-    uint32_t start_block = offset / BLOCK_SIZE;
-    uint32_t offset_into_block = offset % BLOCK_SIZE;
-    uint32_t end_block = (length + offset) / BLOCK_SIZE;
-    if ((length + offset) % BLOCK_SIZE > 0) {
-        end_block++;
+    char* region = calloc(fs->meta_data.bitmap_blocks, BLOCK_SIZE);
+    if (!region) {
+        return false;
     }
 
-    for (uint32_t i = start_block; i < end_block; i++) {
-        /**
-         * Determine the number of bytes to write to this data block.
-         * Case 1: Data block 0. If there is an offset, we need to write starting at the offset to the end of the block, not exceeding the requested write length.
-         * Case 2: Anything else. Write up to the requested length, not exceeding block size.
-         */
-        ssize_t length_to_write;
-        if (i == 0) {
-            length_to_write = min(BLOCK_SIZE - offset, length);
+    bool success = true;
+    for (uint32_t i = 0; i < fs->meta_data.bitmap_blocks && success; i++) {
+        success = disk_queue_read(fs->disk, fs->meta_data.inode_blocks + 1 + i, region + i * BLOCK_SIZE);
+    }
+    success = disk_drain(fs->disk) && success;
+
+    size_t bytes = fs->free_blocks->nwords * sizeof(uint64_t);
+    if (success && fs->meta_data.clean && checksum(region, bytes) != fs->meta_data.bitmap_checksum) {
+        fprintf(stderr, "Free block bitmap checksum mismatch; rebuilding free block bitmap.\n");
+        success = false;
+    }
+
+    if (success) {
+        memcpy(fs->free_blocks->words, region, bytes);
+        bitmap_recount(fs->free_blocks);
+    }
+
+    free(region);
+    return success;
+}
+
+/**
+ * Rebuild the free block bitmap by doing the following:
+ *
+ *  1. Split the inode blocks across threads, each of which walks its Inodes
+ *  and every pointer block they reach into a partial bitmap of its own.
+ *
+ *  2. Merge the partial bitmaps: a block is free only if every thread found
+ *  it free.
+ *
+ *  3. Mark the whole bitmap on Disk for rewriting by the next sync.
+ *
+ *  4. If the FileSystem shares blocks, replace the reference count of every
+ *  data block with the number of pointers the threads found to it.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       recounted   Set to the number of reference counts that were
+ *                          wrong (may be NULL).
+ * @return      Whether or not every pointer block could be read.
+ **/
+bool scan_free_blocks(FileSystem* fs, size_t* recounted) {
+    // Pointer blocks are read straight from the disk image
+    if (!disk_flush(fs->disk)) {
+        return false;
+    }
+
+    ScanTask tasks[SCAN_THREADS_MAX];
+    size_t count = scan_tasks(tasks, fs->disk, fs->meta_data.version, fs->meta_data.inode_blocks);
+    uint32_t* references = fs->meta_data.dedup ? calloc(fs->meta_data.blocks, sizeof(uint32_t)) : NULL;
+    bool success = !fs->meta_data.dedup || references;
+    for (size_t t = 0; t < count; t++) {
+        tasks[t].fs = fs;
+        tasks[t].free_blocks = bitmap_create(fs->meta_data.blocks, true);
+        tasks[t].references = references;
+        success = success && tasks[t].free_blocks;
+    }
+
+    if (success) {
+        scan_run(tasks, count, scan_inode_blocks);
+    }
+
+    Bitmap* free_blocks = fs->free_blocks;
+    bitmap_set_range(free_blocks, 0, free_blocks->bits);
+
+    // Remove superblock, inode blocks, free bitmap blocks, and journal blocks from freelist
+    bitmap_clear_range(free_blocks, 0, first_data_block(fs));
+
+    for (size_t t = 0; t < count; t++) {
+        if (success && !tasks[t].failed) {
+            for (size_t w = 0; w < free_blocks->nwords; w++) {
+                free_blocks->words[w] &= tasks[t].free_blocks->words[w];
+            }
         } else {
-            length_to_write = min(BLOCK_SIZE, length);
+            success = false;
+        }
+        bitmap_delete(tasks[t].free_blocks);
+    }
+
+    if (!success) {
+        free(references);
+        return false;
+    }
+
+    bitmap_recount(free_blocks);
+    mark_bitmap_dirty(fs, 0, fs->meta_data.blocks);
+    mark_unclean(fs);
+
+    size_t wrong = 0;
+    pthread_mutex_lock(&fs->table_lock);
+    for (uint32_t block = first_data_block(fs); references && block < fs->meta_data.blocks; block++) {
+        uint32_t* entry = refcount_entry(fs, block);
+        if (*entry != references[block]) {
+            *entry = references[block];
+            mark_checksum_dirty(fs, fs->meta_data.checksum_blocks / 2 + block / CHECKSUMS_PER_BLOCK);
+            wrong++;
         }
+    }
+    pthread_mutex_unlock(&fs->table_lock);
+    free(references);
+
+    if (recounted) {
+        *recounted = wrong;
+    }
+    return true;
+}
+
+/**
+ * Walk the Inodes in one ScanTask's range of inode blocks, removing every
+ * block they use from the task's partial free block bitmap (and counting the
+ * pointers to each data block, if asked to).
+ *
+ * @param       arg     Pointer to ScanTask structure.
+ * @return      NULL.
+ **/
+void* scan_inode_blocks(void* arg) {
+    ScanTask* task = arg;
+    FileSystem* fs = task->fs;
+
+    // Walk the inode blocks
+    for (uint32_t i = task->first; i < task->last; i++) {
+        Block* inode_block = &fs->inode_table[i];
 
-        Block data_block = {0};
-        memcpy(data_block.data + offset_into_block, data + bytes_written, length_to_write);
+        // Walk the inodes in this block (inline data uses no blocks)
+        for (int j = 0; j < INODES_PER_BLOCK; j++) {
+            Inode inode = inode_block->inodes[j];
+            if (!inode.valid || (inode.valid & INODE_INLINE)) {
+                continue;
+            }
 
-        if (i < POINTERS_PER_INODE) {
-            // Write to direct block, allocate new data block if needed.
-            if (inode.direct[i] == 0) {
-                uint32_t allocated_block = allocate_free_block(fs);
-                if (allocated_block == 0) {
-                    fprintf(stderr, "Couldn't allocate direct block %d\n", inode.direct[i]);
-                    goto fs_write_exit;
+            // Remove direct blocks in use by this inode from the free list
+            for (uint32_t k = 0; k < direct_pointers(fs); k++) {
+                if (inode.direct[k] > 0 && !mark_data_block(task, inode.direct[k])) {
+                    task->failed = true;
+                    return NULL;
                 }
-                inode.direct[i] = allocated_block;
             }
 
-            if (disk_write(fs->disk, inode.direct[i], data_block.data) == DISK_FAILURE) {
-                fprintf(stderr, "Couldn't write to direct block %d\n", inode.direct[i]);
-                return -1;
+            // Similarly, remove indirect blocks and the data blocks they point to from the free list
+            if (!mark_indirect_blocks(task, inode.indirect, 1) ||
+                (task->version >= 1 &&
+                 (!mark_indirect_blocks(task, inode.double_indirect, 2) ||
+                  !mark_indirect_blocks(task, inode.triple_indirect, 3)))) {
+                task->failed = true;
+                return NULL;
             }
-        } else {
-            // Write to indirect block, allocated indirct block if needed, allocated data block if needed.
-
-            // 1. If indirect block doesn't already exist, allocate one.
-            Block indirect_block = {0};
-            if (inode.indirect == 0) {
-                uint32_t allocated_block = allocate_free_block(fs);
-                if (allocated_block == 0) {
-                    fprintf(stderr, "Couldn't allocate indirect block.\n");
-                    goto fs_write_exit;
-                }
-                inode.indirect = allocated_block;
-            } else {
-                // 2. Otherwise, read the existing one.
-                if (disk_read(fs->disk, inode.indirect, indirect_block.data) == DISK_FAILURE) {
-                    fprintf(stderr, "Couldn't read indirect data block.\n");
-                    return -1;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Report information about each Inode in one ScanTask's range of inode
+ * blocks (for fs_debug), collecting the report in the task's output buffer.
+ *
+ * @param       arg     Pointer to ScanTask structure.
+ * @return      NULL.
+ **/
+void* debug_inode_blocks(void* arg) {
+    ScanTask* task = arg;
+    FILE* stream = open_memstream(&task->output, &task->length);
+    if (!stream) {
+        task->failed = true;
+        return NULL;
+    }
+
+    uint32_t direct = task->version >= 1 ? DIRECT_POINTERS_V1 : POINTERS_PER_INODE;
+
+    Block inode_block = {{0}};
+    for (uint32_t i = task->first; i < task->last; i++) {
+        if (disk_read_shared(task->disk, i + 1, inode_block.data) == DISK_FAILURE) {
+            continue;
+        }
+        for (int j = 0; j < INODES_PER_BLOCK; j++) {
+            Inode inode = inode_block.inodes[j];
+            if (!inode.valid) {
+                continue;
+            }
+            fprintf(stream, "Inode %d:\n", j);
+            fprintf(stream, "    size: %lu bytes\n", inode_size(&inode));
+            if (inode.valid & INODE_INLINE) {
+                fprintf(stream, "    inline data\n");
+                continue;
+            }
+            fprintf(stream, "    direct blocks:");
+
+            // print direct blocks
+            uint64_t num_blocks = (inode_size(&inode) + (BLOCK_SIZE - 1)) / BLOCK_SIZE;
+            for (uint32_t k = 0; k < direct; k++) {
+                if (k >= num_blocks) {
+                    continue;
                 }
+                fprintf(stream, " %d", inode.direct[k]);
             }
+            fprintf(stream, "\n");
+            if (num_blocks <= direct) {
+                continue;
+            }
+            Block indirect_block = {{0}};
+            if (inode.indirect && disk_read_shared(task->disk, inode.indirect, indirect_block.data) != DISK_FAILURE) {
+                fprintf(stream, "    indirect block: %d\n", inode.indirect);
+                fprintf(stream, "    indirect data blocks:");
 
-            // 3. In the indirect block, allocate a data block if necessary..
-            if (indirect_block.pointers[i - POINTERS_PER_INODE] == 0) {
-                uint32_t allocated_block = allocate_free_block(fs);
-                if (allocated_block == 0) {
-                    fprintf(stderr, "Couldn't allocate indirect data block. Got %d\n", allocated_block);
-                    goto fs_write_exit;
+                // print indirect blocks
+                for (uint64_t k = 0; k < num_blocks - direct && k < POINTERS_PER_BLOCK; k++) {
+                    fprintf(stream, " %d", indirect_block.pointers[k]);
                 }
-                indirect_block.pointers[i - POINTERS_PER_INODE] = allocated_block;
-                if (disk_write(fs->disk, inode.indirect, indirect_block.data) == DISK_FAILURE) {
-                    fprintf(stderr, "Couldn't update indirect block %d.\n", indirect_block.pointers[i - POINTERS_PER_INODE]);
-                    return -1;
+                fprintf(stream, "\n");
+            }
+
+            // version 1 inodes may continue into the double and triple indirect trees
+            if (direct == DIRECT_POINTERS_V1 && inode.double_indirect) {
+                fprintf(stream, "    double indirect block: %d\n", inode.double_indirect);
+            }
+            if (direct == DIRECT_POINTERS_V1 && inode.triple_indirect) {
+                fprintf(stream, "    triple indirect block: %d\n", inode.triple_indirect);
+            }
+        }
+    }
+
+    fclose(stream);
+    return NULL;
+}
+
+/**
+ * Check the data blocks of the Inodes in one ScanTask's range of inode
+ * blocks against their checksums (for fs_scrub).
+ *
+ * @param       arg     Pointer to ScanTask structure.
+ * @return      NULL.
+ **/
+void* scrub_inode_blocks(void* arg) {
+    ScanTask* task = arg;
+    FileSystem* fs = task->fs;
+
+    for (uint32_t i = task->first; i < task->last; i++) {
+        for (int j = 0; j < INODES_PER_BLOCK; j++) {
+            Inode inode = fs->inode_table[i].inodes[j];
+            if (!inode.valid || (inode.valid & INODE_INLINE)) {
+                continue;
+            }
+
+            for (uint32_t k = 0; k < direct_pointers(fs); k++) {
+                if (inode.direct[k] > 0) {
+                    scrub_block(task, inode.direct[k]);
                 }
             }
 
-            // 3. Write the data block.
-            if (disk_write(fs->disk, indirect_block.pointers[i - POINTERS_PER_INODE], data_block.data) == DISK_FAILURE) {
-                fprintf(stderr, "Couldn't write to indirect data block %d.\n", indirect_block.pointers[i - POINTERS_PER_INODE]);
-                return -1;
+            if (!scrub_indirect_blocks(task, inode.indirect, 1) ||
+                (task->version >= 1 &&
+                 (!scrub_indirect_blocks(task, inode.double_indirect, 2) ||
+                  !scrub_indirect_blocks(task, inode.triple_indirect, 3)))) {
+                task->failed = true;
+                return NULL;
             }
         }
+    }
 
-        bytes_written += length_to_write;
-        length -= length_to_write;
-        offset_into_block = 0;
+    return NULL;
+}
+
+/**
+ * Check every data block reachable from a pointer block against its
+ * checksum during a scrub.
+ *
+ * @param       task        Pointer to ScanTask structure.
+ * @param       block       Pointer block (0 if the tree is empty).
+ * @param       levels      Levels of pointer blocks (1 for indirect).
+ * @return      Whether or not every pointer block could be read.
+ **/
+bool scrub_indirect_blocks(ScanTask* task, uint32_t block, uint32_t levels) {
+    if (block == 0) {
+        return true;
     }
 
-    // Compute the new size of the inode and save it.
-fs_write_exit:
-    inode.size = max(offset + bytes_written, inode.size);
-    if (!save_inode(&inode, inode_number, fs->disk)) {
-        return -1;
+    Block pointer_block = {0};
+    if (disk_read_shared(task->disk, block, pointer_block.data) == DISK_FAILURE) {
+        return false;
     }
 
-    return bytes_written;
+    for (int k = 0; k < POINTERS_PER_BLOCK; k++) {
+        uint32_t pointer = pointer_block.pointers[k];
+        if (pointer == 0) {
+            continue;
+        }
+
+        if (levels > 1) {
+            if (!scrub_indirect_blocks(task, pointer, levels - 1)) {
+                return false;
+            }
+        } else {
+            scrub_block(task, pointer);
+        }
+    }
+
+    return true;
 }
 
 /**
- * Helper function that reads the inode with number inumber from disk, saving into the passed inode structure.
- * @param inode Inode structure into which disk contents should be read.
- * @param inumber The logical inode number of the inode we wish to load from disk.
- * @param disk The disk structure representing the disk on which the desired inode resides.
- * @returns On success, returns true and places the desired inode into the passed inode structure. On failure, returns false.
- */
-bool load_inode(Inode* inode, size_t inumber, Disk* disk) {
-    /* On disk, inodes are saved in a series of blocks starting at logical block 1 (since the superblock resides in block 0) and continuing through to block N + 1, where N is the number of inode blocks. To read the correct block given a logical inode number, we need to compute the block in which the inode resides as well as the inode's offset within that block. -SN */
-    int iblock = (inumber / INODES_PER_BLOCK) + 1;
-    int ioffset = inumber % INODES_PER_BLOCK;
+ * Read one data block straight from the disk image and compare it with its
+ * checksum during a scrub (a block that cannot be read counts as an error).
+ *
+ * @param       task        Pointer to ScanTask structure.
+ * @param       block       Data block.
+ **/
+void scrub_block(ScanTask* task, uint32_t block) {
+    Block data;
+    task->checked++;
+    if (disk_read_shared(task->disk, block, data.data) == DISK_FAILURE ||
+        !checksum_matches(task->fs, block, data.data)) {
+        fprintf(stderr, "Checksum mismatch in data block %u.\n", block);
+        task->errors++;
+    }
+}
 
-    Block inode_block = {0};
+/**
+ * Split the inode blocks into one range per scan thread.  The number of
+ * threads is taken from the SFS_SCAN_THREADS environment variable, or the
+ * number of online processors if unset, and is at most one per inode block.
+ *
+ * @param       tasks           Array of SCAN_THREADS_MAX ScanTask structures.
+ * @param       disk            Pointer to Disk structure.
+ * @param       version         On-disk format version.
+ * @param       inode_blocks    Number of inode blocks.
+ * @return      Number of tasks prepared.
+ **/
+size_t scan_tasks(ScanTask* tasks, Disk* disk, uint32_t version, uint32_t inode_blocks) {
+    const char* value = getenv("SFS_SCAN_THREADS");
+    long count = value ? strtol(value, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    count = max(1, min(count, min(SCAN_THREADS_MAX, max(inode_blocks, 1))));
+
+    for (long t = 0; t < count; t++) {
+        tasks[t] = (ScanTask){
+            .disk = disk,
+            .version = version,
+            .first = (uint64_t)inode_blocks * t / count,
+            .last = (uint64_t)inode_blocks * (t + 1) / count,
+        };
+    }
 
-    if (disk_read(disk, iblock, inode_block.data) == DISK_FAILURE) {
-        return false;
+    return count;
+}
+
+/**
+ * Run a worker over every ScanTask, one thread per task (the first task runs
+ * on the calling thread), and wait for them all.  A task whose thread cannot
+ * be started is run on the calling thread instead.
+ *
+ * @param       tasks   Array of ScanTask structures.
+ * @param       count   Number of tasks.
+ * @param       worker  Function to run on each task.
+ **/
+void scan_run(ScanTask* tasks, size_t count, void* (*worker)(void*)) {
+    pthread_t threads[SCAN_THREADS_MAX];
+    bool started[SCAN_THREADS_MAX] = {false};
+
+    for (size_t t = 1; t < count; t++) {
+        started[t] = pthread_create(&threads[t], NULL, worker, &tasks[t]) == 0;
     }
 
-    Inode disk_inode = inode_block.inodes[ioffset];
+    worker(&tasks[0]);
 
-    if (!disk_inode.valid) {
-        fprintf(stderr, "Cannot load invalid inode.\n");
-        return false;
+    for (size_t t = 1; t < count; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        } else {
+            worker(&tasks[t]);
+        }
+    }
+}
+
+/**
+ * Queue a write of one block of the free block bitmap, staging the final
+ * (partial) block in the given buffer.
+ *
+ * @param       disk    Pointer to Disk structure.
+ * @param       bitmap  Free block bitmap.
+ * @param       start   First free bitmap block on Disk.
+ * @param       index   Index of bitmap block to write.
+ * @param       stage   Buffer for the final block (valid until drained).
+ * @return      Whether or not the write was queued.
+ **/
+bool queue_bitmap_block(Disk* disk, Bitmap* bitmap, uint32_t start, uint32_t index, Block* stage) {
+    return disk_queue_write(disk, start + index, bitmap_block_data(bitmap, index, stage));
+}
+
+/**
+ * Return the contents of one block of the free block bitmap, staging the
+ * final (partial) block in the given buffer.
+ *
+ * @param       bitmap  Free block bitmap.
+ * @param       index   Index of bitmap block.
+ * @param       stage   Buffer for the final block.
+ * @return      Pointer to block contents.
+ **/
+char* bitmap_block_data(Bitmap* bitmap, uint32_t index, Block* stage) {
+    size_t offset = (size_t)index * BLOCK_SIZE;
+    size_t bytes = bitmap->nwords * sizeof(uint64_t);
+    char* data = (char*)bitmap->words + offset;
+
+    if (offset + BLOCK_SIZE > bytes) {
+        memset(stage->data, 0, BLOCK_SIZE);
+        if (offset < bytes) {
+            memcpy(stage->data, data, bytes - offset);
+        }
+        data = stage->data;
     }
 
-    inode->valid = disk_inode.valid;
-    inode->size = disk_inode.size;
-    inode->indirect = disk_inode.indirect;
+    return data;
+}
+
+/**
+ * Return the first block after the superblock, inode blocks, free bitmap
+ * blocks, checksum blocks, and journal blocks.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Block number of first data block.
+ **/
+uint32_t first_data_block(FileSystem* fs) {
+    return fs->meta_data.inode_blocks + fs->meta_data.bitmap_blocks + fs->meta_data.checksum_blocks +
+           fs->meta_data.journal_blocks + 1;
+}
 
-    for (int i = 0; i < POINTERS_PER_INODE; i++) {
-        inode->direct[i] = disk_inode.direct[i];
+/**
+ * Compute the 32-bit FNV-1a checksum of a buffer.
+ *
+ * @param       data    Data buffer.
+ * @param       length  Number of bytes in buffer.
+ * @return      Checksum of buffer.
+ **/
+uint32_t checksum(const char* data, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)data[i];
+        hash *= 16777619u;
     }
-    // *inode = disk_inode;
+    return hash;
+}
 
-    return true;
+/**
+ * Compute the checksum recorded for a data block: its CRC32C with the low
+ * bit set, so no contents ever record 0 (which means no checksum).
+ *
+ * @param       data    Contents of block.
+ * @return      Checksum of block (never 0).
+ **/
+uint32_t block_checksum(const char* data) {
+    return crc32c(0, data, BLOCK_SIZE) | 1;
 }
 
 /**
- * Writes an structure inode to a specified inode number on a specified disk.
+ * Return the number of direct pointers in each Inode of the FileSystem.
  *
- * @returns Whether or not the save completed successfully
- */
-bool save_inode(Inode* inode, size_t inumber, Disk* disk) {
-    int iblock = (inumber / INODES_PER_BLOCK) + 1;
-    int ioffset = inumber % INODES_PER_BLOCK;
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Number of direct pointers.
+ **/
+uint32_t direct_pointers(FileSystem* fs) {
+    return fs->meta_data.version >= 1 ? DIRECT_POINTERS_V1 : POINTERS_PER_INODE;
+}
+
+/**
+ * Find the read-ahead stream for an Inode, taking over its slot if another
+ * Inode held it, and update its sequential-access detection: a read that
+ * begins where the last one ended keeps the window open, while any other
+ * read closes it (a stream just taken over expects a read from the start
+ * of the file).
+ *
+ * Note: The stream is returned locked; the caller unlocks it when done.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode being read.
+ * @param       offset          Byte offset at which the read begins.
+ * @return      Pointer to ReadAhead stream.
+ **/
+ReadAhead* readahead_stream(FileSystem* fs, size_t inode_number, size_t offset) {
+    ReadAhead* stream = &fs->readahead[inode_number % READAHEAD_STREAMS];
+    pthread_mutex_lock(&stream->lock);
+    if (stream->inode_number != (ssize_t)inode_number) {
+        stream->inode_number = inode_number;
+        stream->next_offset = 0;
+        stream->window = 0;
+        stream->count = 0;
+    }
 
-    Block inode_block = {0};
+    if (offset != stream->next_offset) {
+        stream->window = 0;
+    } else if (stream->window == 0) {
+        stream->window = READAHEAD_MIN;
+    }
+    return stream;
+}
 
-    if (disk_read(disk, iblock, inode_block.data) == DISK_FAILURE) {
+/**
+ * Make the read-ahead buffer hold logical blocks [start_block, end_block)
+ * by doing the following:
+ *
+ *  1. Return right away if the buffer already holds the range.
+ *
+ *  2. Slide any buffered blocks at the start of the range to the front.
+ *
+ *  3. Read the rest of the range plus the window past it (up to the end of
+ *  the file) with one vectored disk request, zero-filling holes, then double
+ *  the window.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       stream      Pointer to ReadAhead stream.
+ * @param       map         Pointer to BlockMap for the Inode.
+ * @param       start_block First logical block of range.
+ * @param       end_block   Logical block after range.
+ * @param       file_blocks Number of logical blocks in the file.
+ * @return      Whether or not the buffer holds the range (false if the range
+ *              is too large to buffer or on failure).
+ **/
+bool readahead_fill(FileSystem* fs, ReadAhead* stream, BlockMap* map, uint64_t start_block, uint64_t end_block, uint64_t file_blocks) {
+    if (end_block - start_block > READAHEAD_MAX) {
         return false;
     }
 
-    inode_block.inodes[ioffset].valid = inode->valid;
-    inode_block.inodes[ioffset].size = inode->size;
-    inode_block.inodes[ioffset].indirect = inode->indirect;
+    if (start_block >= stream->start && end_block <= stream->start + stream->count) {
+        return true;
+    }
+
+    uint64_t fill_end = min(min(end_block + stream->window, file_blocks), start_block + READAHEAD_MAX);
+    uint32_t count = fill_end - start_block;
+    if (count > stream->capacity) {
+        char* buffer = realloc(stream->buffer, (size_t)count * BLOCK_SIZE);
+        if (!buffer) {
+            return false;
+        }
+        stream->buffer = buffer;
+        stream->capacity = count;
+    }
+
+    uint32_t keep = 0;
+    if (stream->count && start_block >= stream->start && start_block < stream->start + stream->count) {
+        keep = stream->start + stream->count - start_block;
+        memmove(stream->buffer, stream->buffer + (start_block - stream->start) * BLOCK_SIZE, (size_t)keep * BLOCK_SIZE);
+    }
+
+    size_t blocks[READAHEAD_MAX];
+    char* buffers[READAHEAD_MAX];
+    size_t nread = 0;
+    for (uint32_t i = keep; i < count; i++) {
+        char* buffer = stream->buffer + (size_t)i * BLOCK_SIZE;
+        uint32_t block = block_map_get(map, start_block + i);
+        if (block == 0) {
+            memset(buffer, 0, BLOCK_SIZE);
+            continue;
+        }
 
-    for (int i = 0; i < POINTERS_PER_INODE; i++) {
-        inode_block.inodes[ioffset].direct[i] = inode->direct[i];
+        blocks[nread] = block;
+        buffers[nread++] = buffer;
     }
 
-    if (disk_write(disk, iblock, inode_block.data) == DISK_FAILURE) {
+    stream->count = 0;
+    if (map->failed || disk_readv(fs->disk, blocks, buffers, nread) == DISK_FAILURE ||
+        !verify_checksums(fs, blocks, buffers, nread)) {
         return false;
     }
 
+    stream->start = start_block;
+    stream->count = count;
+    stream->window = min(stream->window * 2, READAHEAD_MAX);
     return true;
 }
 
-uint32_t allocate_free_block(FileSystem* fs) {
-    for (uint32_t i = 1; i < fs->meta_data.blocks; i++) {
-        if (fs->free_blocks[i]) {
-            fs->free_blocks[i] = false;
-            return i;
-        }
+/**
+ * Drop any data buffered for an Inode that has been written or removed.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode whose data changed.
+ **/
+void readahead_invalidate(FileSystem* fs, size_t inode_number) {
+    ReadAhead* stream = &fs->readahead[inode_number % READAHEAD_STREAMS];
+    pthread_mutex_lock(&stream->lock);
+    if (stream->inode_number == (ssize_t)inode_number) {
+        stream->count = 0;
     }
+    pthread_mutex_unlock(&stream->lock);
+}
 
-    return 0;
+/**
+ * Check whether a buffer holds nothing but zeros.
+ *
+ * @param       data    Buffer to check.
+ * @param       length  Number of bytes in buffer.
+ * @return      Whether or not every byte is zero.
+ **/
+bool is_zero(const char* data, size_t length) {
+    return length == 0 || (data[0] == 0 && memcmp(data, data + 1, length - 1) == 0);
 }
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
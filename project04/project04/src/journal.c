@@ -0,0 +1,493 @@
+/* journal.c: SimpleFS metadata journal
+ *
+ * The Journal buffers every metadata block a running transaction changes (in
+ * a growable array indexed by a hash table on block number), so operations
+ * between commits read back their own changes and a block changed by many
+ * operations is logged once.  A commit logs the buffered blocks, together
+ * with any blocks the caller supplies, as one transaction at the start of
+ * the journal region, then writes each block to its home location
+ * (checkpointing).  Since a transaction is fully checkpointed before the
+ * next one is logged, only the last transaction ever needs to be replayed.
+ **/
+
+#include "sfs/journal.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sfs/utils.h"
+
+/* Internal Constants */
+
+#define JOURNAL_INITIAL_SIZE (16) /* Number of entries allocated up front */
+
+/* Internal Prototypes */
+
+JournalEntry* journal_lookup(Journal* journal, uint32_t block);
+JournalEntry* journal_insert(Journal* journal, uint32_t block);
+bool journal_rehash(Journal* journal, size_t nslots);
+uint32_t journal_checksum(uint32_t hash, const char* data, size_t length);
+uint32_t journal_header_checksum(JournalHeader* header, char** images, size_t count);
+
+/* External Functions */
+
+/**
+ * Create a Journal for the specified region of the disk by doing the
+ * following:
+ *
+ *  1. Allocate Journal structure, entries, and hash slots.
+ *
+ *  2. Limit each transaction to what fits after the header block (and in
+ *  the header's list of home blocks).
+ *
+ * @param       start       First block of journal region.
+ * @param       blocks      Number of blocks in journal region (at least 2).
+ * @param       sequence    Sequence number of the next transaction.
+ *
+ * @return      Pointer to newly allocated Journal structure (NULL on failure).
+ **/
+Journal* journal_create(uint32_t start, uint32_t blocks, uint32_t sequence) {
+    if (blocks < 2) return NULL;
+
+    Journal* journal = calloc(1, sizeof(Journal));
+    if (!journal) {
+        fprintf(stderr, "journal_create: calloc returned NULL\n");
+        return NULL;
+    }
+
+    journal->start = start;
+    journal->blocks = blocks;
+    journal->capacity = min(blocks - 1, JOURNAL_ENTRIES);
+    journal->sequence = sequence;
+    journal->size = JOURNAL_INITIAL_SIZE;
+    journal->entries = calloc(journal->size, sizeof(JournalEntry));
+    if (!journal->entries || !journal_rehash(journal, 4 * JOURNAL_INITIAL_SIZE)) {
+        fprintf(stderr, "journal_create: calloc returned NULL\n");
+        journal_delete(journal);
+        return NULL;
+    }
+
+    pthread_mutex_init(&journal->lock, NULL);
+    return journal;
+}
+
+/**
+ * Release Journal structure memory (dropping any buffered blocks).
+ *
+ * @param       journal     Pointer to Journal structure.
+ **/
+void journal_delete(Journal* journal) {
+    if (!journal) return;
+
+    if (journal->slots) {
+        pthread_mutex_destroy(&journal->lock);
+    }
+    free(journal->entries);
+    free(journal->slots);
+    free(journal->frees);
+    free(journal);
+}
+
+/**
+ * Read a metadata block, taking the copy buffered by the running
+ * transaction if there is one.
+ *
+ * @param       journal     Pointer to Journal structure (NULL reads the disk).
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block to read.
+ * @param       data        Buffer to copy block to.
+ *
+ * @return      Whether or not the block could be read.
+ **/
+bool journal_read(Journal* journal, Disk* disk, uint32_t block, char* data) {
+    if (journal) {
+        pthread_mutex_lock(&journal->lock);
+        JournalEntry* entry = journal_lookup(journal, block);
+        if (entry) {
+            memcpy(data, entry->data, BLOCK_SIZE);
+        }
+        pthread_mutex_unlock(&journal->lock);
+
+        if (entry) {
+            return true;
+        }
+    }
+
+    return disk_read(disk, block, data) != DISK_FAILURE;
+}
+
+/**
+ * Record a change to a metadata block in the running transaction (it
+ * reaches the disk when the transaction commits).
+ *
+ * @param       journal     Pointer to Journal structure (NULL writes the disk).
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block to write.
+ * @param       data        New contents of block.
+ *
+ * @return      Whether or not the change was recorded.
+ **/
+bool journal_write(Journal* journal, Disk* disk, uint32_t block, const char* data) {
+    if (!journal) {
+        return disk_write(disk, block, (char*)data) != DISK_FAILURE;
+    }
+
+    pthread_mutex_lock(&journal->lock);
+    JournalEntry* entry = journal_lookup(journal, block);
+    if (!entry) {
+        entry = journal_insert(journal, block);
+    }
+    if (entry) {
+        memcpy(entry->data, data, BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return entry != NULL;
+}
+
+/**
+ * Record that a block was released by the running transaction, so that it
+ * is not handed out again (and overwritten) before the release commits.  Any
+ * buffered copy of the block is dropped, since it no longer needs to reach
+ * the disk.
+ *
+ * @param       journal     Pointer to Journal structure.
+ * @param       block       Block released.
+ *
+ * @return      Whether or not the release was recorded.
+ **/
+bool journal_release(Journal* journal, uint32_t block) {
+    pthread_mutex_lock(&journal->lock);
+    JournalEntry* entry = journal_lookup(journal, block);
+    if (entry) {
+        entry->home = 0;
+    }
+
+    if (journal->nfrees == journal->frees_size) {
+        size_t size = max(journal->frees_size * 2, JOURNAL_INITIAL_SIZE);
+        uint32_t* frees = realloc(journal->frees, size * sizeof(uint32_t));
+        if (!frees) {
+            pthread_mutex_unlock(&journal->lock);
+            return false;
+        }
+        journal->frees = frees;
+        journal->frees_size = size;
+    }
+
+    journal->frees[journal->nfrees++] = block;
+    pthread_mutex_unlock(&journal->lock);
+    return true;
+}
+
+/**
+ * Log one transaction by doing the following:
+ *
+ *  1. Fill in a header block with the sequence number, the home of every
+ *  block, and a checksum over the header and every block.
+ *
+ *  2. Write the header and blocks to the start of the journal region with
+ *  one vectored request.
+ *
+ * @param       journal     Pointer to Journal structure.
+ * @param       disk        Pointer to Disk structure.
+ * @param       homes       Home block of each image.
+ * @param       images      Contents of each block.
+ * @param       count       Number of blocks (at most journal->capacity).
+ *
+ * @return      Whether or not the transaction was logged.
+ **/
+bool journal_log(Journal* journal, Disk* disk, const uint32_t* homes, char** images, size_t count) {
+    if (count == 0 || count > journal->capacity) return false;
+
+    JournalHeader* header = calloc(1, sizeof(JournalHeader));
+    size_t* blocks = calloc(count + 1, sizeof(size_t));
+    char** buffers = calloc(count + 1, sizeof(char*));
+    bool success = header && blocks && buffers;
+    if (success) {
+        header->magic = JOURNAL_MAGIC;
+        header->sequence = journal->sequence;
+        header->count = count;
+        memcpy(header->homes, homes, count * sizeof(uint32_t));
+        header->checksum = journal_header_checksum(header, images, count);
+
+        blocks[0] = journal->start;
+        buffers[0] = (char*)header;
+        for (size_t i = 0; i < count; i++) {
+            blocks[i + 1] = journal->start + 1 + i;
+            buffers[i + 1] = images[i];
+        }
+        success = disk_writev(disk, blocks, buffers, count + 1) != DISK_FAILURE;
+    }
+
+    if (success) {
+        journal->sequence++;
+        journal->commits++;
+    } else {
+        fprintf(stderr, "journal_log: couldn't log transaction\n");
+    }
+
+    free(header);
+    free(blocks);
+    free(buffers);
+    return success;
+}
+
+/**
+ * Commit the running transaction by doing the following:
+ *
+ *  1. Gather the caller's blocks followed by every buffered block (except
+ *  those dropped since they were released).
+ *
+ *  2. Log them as one transaction and then checkpoint them to their home
+ *  locations (splitting them into several transactions if there are more
+ *  than fit in the journal, in which case only each part is atomic).
+ *
+ *  3. Empty the buffer.
+ *
+ * Note: The caller must keep other threads from changing blocks while the
+ * transaction commits (and must take care of the released blocks itself).
+ *
+ * @param       journal     Pointer to Journal structure.
+ * @param       disk        Pointer to Disk structure.
+ * @param       homes       Home block of each extra image.
+ * @param       images      Contents of each extra block.
+ * @param       count       Number of extra blocks.
+ *
+ * @return      Whether or not every block reached its home location.
+ **/
+bool journal_commit(Journal* journal, Disk* disk, const uint32_t* homes, char** images, size_t count) {
+    pthread_mutex_lock(&journal->lock);
+    size_t total = count + journal->count;
+    if (total == 0) {
+        pthread_mutex_unlock(&journal->lock);
+        return true;
+    }
+
+    uint32_t* all_homes = calloc(total, sizeof(uint32_t));
+    char** all_images = calloc(total, sizeof(char*));
+    size_t* blocks = calloc(total, sizeof(size_t));
+    bool success = all_homes && all_images && blocks;
+    if (success) {
+        if (count > 0) {
+            memcpy(all_homes, homes, count * sizeof(uint32_t));
+            memcpy(all_images, images, count * sizeof(char*));
+        }
+        total = count;
+        for (size_t i = 0; i < journal->count; i++) {
+            if (journal->entries[i].home) {
+                all_homes[total] = journal->entries[i].home;
+                all_images[total++] = journal->entries[i].data;
+            }
+        }
+        for (size_t i = 0; i < total; i++) {
+            blocks[i] = all_homes[i];
+        }
+    }
+
+    for (size_t done = 0; success && done < total; ) {
+        size_t batch = min(total - done, (size_t)journal->capacity);
+        success = journal_log(journal, disk, all_homes + done, all_images + done, batch) &&
+                  disk_writev(disk, blocks + done, all_images + done, batch) != DISK_FAILURE;
+        done += batch;
+    }
+    success = success && disk_flush(disk);
+
+    if (success) {
+        journal->count = 0;
+        memset(journal->slots, 0, journal->nslots * sizeof(uint32_t));
+    }
+
+    pthread_mutex_unlock(&journal->lock);
+    free(all_homes);
+    free(all_images);
+    free(blocks);
+    return success;
+}
+
+/**
+ * Replay the last transaction in a journal region by doing the following:
+ *
+ *  1. Read the header and check its magic number, block count, and sequence
+ *  number (older than sequence means it was already checkpointed).
+ *
+ *  2. Read the logged blocks and check the checksum (a torn transaction
+ *  never reached its home locations, so it is skipped).
+ *
+ *  3. Write each block to its home location.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       start       First block of journal region.
+ * @param       blocks      Number of blocks in journal region.
+ * @param       sequence    Oldest sequence number to replay; set to the
+ *                          sequence number after the one replayed.
+ *
+ * @return      Whether or not the journal could be read (and replayed).
+ **/
+bool journal_replay(Disk* disk, uint32_t start, uint32_t blocks, uint32_t* sequence) {
+    if (blocks < 2) return true;
+
+    JournalHeader header;
+    if (disk_read(disk, start, (char*)&header) == DISK_FAILURE) {
+        return false;
+    }
+
+    if (header.magic != JOURNAL_MAGIC || header.count == 0 || header.count > min(blocks - 1, JOURNAL_ENTRIES) ||
+        header.sequence < *sequence) {
+        return true;
+    }
+
+    for (uint32_t i = 0; i < header.count; i++) {
+        uint32_t home = header.homes[i];
+        if (home == 0 || home >= disk->blocks || (home >= start && home < start + blocks)) {
+            return true;
+        }
+    }
+
+    char* data = malloc((size_t)header.count * BLOCK_SIZE);
+    size_t* homes = calloc(header.count, sizeof(size_t));
+    char** images = calloc(header.count, sizeof(char*));
+    bool success = data && homes && images;
+    for (uint32_t i = 0; success && i < header.count; i++) {
+        homes[i] = start + 1 + i;
+        images[i] = data + (size_t)i * BLOCK_SIZE;
+    }
+
+    success = success && disk_readv(disk, homes, images, header.count) != DISK_FAILURE;
+    if (success && journal_header_checksum(&header, images, header.count) == header.checksum) {
+        for (uint32_t i = 0; i < header.count; i++) {
+            homes[i] = header.homes[i];
+        }
+        success = disk_writev(disk, homes, images, header.count) != DISK_FAILURE && disk_flush(disk);
+        *sequence = header.sequence + 1;
+    }
+
+    free(data);
+    free(homes);
+    free(images);
+    return success;
+}
+
+/* Internal Functions */
+
+/**
+ * Find the buffered entry for a block.
+ *
+ * @param       journal     Pointer to Journal structure.
+ * @param       block       Home block number.
+ *
+ * @return      Pointer to entry (NULL if block is not buffered).
+ **/
+JournalEntry* journal_lookup(Journal* journal, uint32_t block) {
+    size_t mask = journal->nslots - 1;
+    for (size_t slot = (block * 2654435761u) & mask; journal->slots[slot]; slot = (slot + 1) & mask) {
+        JournalEntry* entry = &journal->entries[journal->slots[slot] - 1];
+        if (entry->home == block) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Add an entry for a block, growing the entries and hash slots as needed.
+ *
+ * @param       journal     Pointer to Journal structure.
+ * @param       block       Home block number.
+ *
+ * @return      Pointer to new entry (NULL on failure).
+ **/
+JournalEntry* journal_insert(Journal* journal, uint32_t block) {
+    if (journal->count == journal->size) {
+        JournalEntry* entries = realloc(journal->entries, 2 * journal->size * sizeof(JournalEntry));
+        if (!entries) {
+            return NULL;
+        }
+        journal->entries = entries;
+        journal->size *= 2;
+    }
+
+    if (2 * (journal->count + 1) > journal->nslots && !journal_rehash(journal, 2 * journal->nslots)) {
+        return NULL;
+    }
+
+    JournalEntry* entry = &journal->entries[journal->count++];
+    entry->home = block;
+
+    size_t mask = journal->nslots - 1;
+    size_t slot = (block * 2654435761u) & mask;
+    while (journal->slots[slot]) {
+        slot = (slot + 1) & mask;
+    }
+    journal->slots[slot] = journal->count;
+    return entry;
+}
+
+/**
+ * Rebuild the hash slots with the specified number of slots.
+ *
+ * @param       journal     Pointer to Journal structure.
+ * @param       nslots      Number of slots (power of two).
+ *
+ * @return      Whether or not the slots could be allocated.
+ **/
+bool journal_rehash(Journal* journal, size_t nslots) {
+    uint32_t* slots = calloc(nslots, sizeof(uint32_t));
+    if (!slots) {
+        return false;
+    }
+
+    size_t mask = nslots - 1;
+    for (size_t i = 0; i < journal->count; i++) {
+        size_t slot = (journal->entries[i].home * 2654435761u) & mask;
+        while (slots[slot]) {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = i + 1;
+    }
+
+    free(journal->slots);
+    journal->slots = slots;
+    journal->nslots = nslots;
+    return true;
+}
+
+/**
+ * Continue an FNV-1a checksum over a buffer.
+ *
+ * @param       hash        Checksum so far.
+ * @param       data        Buffer to checksum.
+ * @param       length      Number of bytes in buffer.
+ *
+ * @return      Updated checksum.
+ **/
+uint32_t journal_checksum(uint32_t hash, const char* data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Compute the checksum of a transaction: its header (with the checksum
+ * field zero) followed by every logged block.
+ *
+ * @param       header      Pointer to JournalHeader structure.
+ * @param       images      Contents of each block.
+ * @param       count       Number of blocks.
+ *
+ * @return      Checksum of transaction.
+ **/
+uint32_t journal_header_checksum(JournalHeader* header, char** images, size_t count) {
+    uint32_t saved = header->checksum;
+    header->checksum = 0;
+    uint32_t hash = journal_checksum(2166136261u, (char*)header, sizeof(JournalHeader));
+    header->checksum = saved;
+
+    for (size_t i = 0; i < count; i++) {
+        hash = journal_checksum(hash, images[i], BLOCK_SIZE);
+    }
+    return hash;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,263 @@
+/* lz4.c: SimpleFS LZ4 block compression
+ *
+ * The LZ4 block format is a run of sequences, each a token byte (literal
+ * length in the high nibble, match length less LZ4_MIN_MATCH in the low),
+ * any extra length bytes, the literals, and a two-byte little-endian offset
+ * back to the match.  The last sequence is only literals, and no match
+ * starts within LZ4_MATCH_LIMIT bytes of the end or runs into the last
+ * LZ4_LAST_LITERALS bytes, so any LZ4 decoder can read what this writes.
+ *
+ * The compressor is greedy with a single hash table of recent positions and
+ * skips ahead faster the longer it goes without a match, so incompressible
+ * data costs little more than a copy.  The decompressor checks every length
+ * and offset against both buffers, so a corrupt block fails rather than
+ * overrunning them.
+ **/
+
+#include "sfs/lz4.h"
+
+#include <string.h>
+
+/* Internal Constants */
+
+#define LZ4_LAST_LITERALS (5)  /* Bytes at the end that are always literals */
+#define LZ4_MATCH_LIMIT (12)   /* No match starts within this many bytes of the end */
+#define LZ4_SKIP_TRIGGER (6)   /* Search step grows by one every 2^trigger misses */
+
+/* Internal Prototypes */
+
+uint32_t lz4_read32(const uint8_t* p);
+uint32_t lz4_hash(uint32_t sequence);
+uint8_t* lz4_length(uint8_t* output, size_t length);
+uint8_t* lz4_sequence(uint8_t* output, uint8_t* end, const uint8_t* literals, size_t nliterals,
+                      size_t offset, size_t match_length);
+
+/* External Functions */
+
+/**
+ * Compress a buffer into the LZ4 block format.
+ *
+ * @param       data        Buffer to compress.
+ * @param       length      Number of bytes in buffer.
+ * @param       output      Buffer to hold compressed bytes.
+ * @param       capacity    Number of bytes output can hold.
+ *
+ * @return      Number of compressed bytes (0 if they do not fit in capacity).
+ **/
+size_t lz4_compress(const void* data, size_t length, void* output, size_t capacity) {
+    const uint8_t* input = data;
+    const uint8_t* end = input + length;
+    const uint8_t* anchor = input;
+    uint8_t* op = output;
+    uint8_t* oend = op + capacity;
+
+    if (length > LZ4_MATCH_LIMIT) {
+        uint32_t table[1 << LZ4_HASH_BITS] = {0};   /* Position of last sequence with each hash, plus one */
+        const uint8_t* limit = end - LZ4_MATCH_LIMIT;
+        const uint8_t* match_end = end - LZ4_LAST_LITERALS;
+        const uint8_t* ip = input;
+        size_t misses = 0;
+
+        while (ip < limit) {
+            uint32_t sequence = lz4_read32(ip);
+            uint32_t hash = lz4_hash(sequence);
+            const uint8_t* match = table[hash] ? input + table[hash] - 1 : NULL;
+            table[hash] = ip - input + 1;
+
+            if (!match || ip - match > LZ4_MAX_OFFSET || lz4_read32(match) != sequence) {
+                ip += 1 + (misses++ >> LZ4_SKIP_TRIGGER);
+                continue;
+            }
+
+            // Extend the match backwards over literals and forwards as far as it goes
+            while (ip > anchor && match > input && ip[-1] == match[-1]) {
+                ip--;
+                match--;
+            }
+            size_t match_length = LZ4_MIN_MATCH;
+            while (ip + match_length < match_end && ip[match_length] == match[match_length]) {
+                match_length++;
+            }
+
+            op = lz4_sequence(op, oend, anchor, ip - anchor, ip - match, match_length);
+            if (!op) {
+                return 0;
+            }
+
+            ip += match_length;
+            anchor = ip;
+            misses = 0;
+            if (ip < limit) {
+                table[lz4_hash(lz4_read32(ip - 2))] = ip - 2 - input + 1;
+            }
+        }
+    }
+
+    op = lz4_sequence(op, oend, anchor, end - anchor, 0, 0);
+    return op ? (size_t)(op - (uint8_t*)output) : 0;
+}
+
+/**
+ * Decompress an LZ4 block.
+ *
+ * @param       data        Compressed bytes.
+ * @param       length      Number of compressed bytes.
+ * @param       output      Buffer to hold decompressed bytes.
+ * @param       capacity    Number of bytes output can hold.
+ *
+ * @return      Number of decompressed bytes (-1 if the block is corrupt or
+ *              does not fit in capacity).
+ **/
+ssize_t lz4_decompress(const void* data, size_t length, void* output, size_t capacity) {
+    const uint8_t* ip = data;
+    const uint8_t* iend = ip + length;
+    uint8_t* op = output;
+    uint8_t* oend = op + capacity;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        // Literals
+        size_t nliterals = token >> 4;
+        if (nliterals == 15) {
+            uint8_t extra;
+            do {
+                if (ip == iend) {
+                    return -1;
+                }
+                extra = *ip++;
+                nliterals += extra;
+            } while (extra == 255);
+        }
+        if (nliterals > (size_t)(iend - ip) || nliterals > (size_t)(oend - op)) {
+            return -1;
+        }
+        memcpy(op, ip, nliterals);
+        ip += nliterals;
+        op += nliterals;
+
+        // The last sequence has no match
+        if (ip == iend) {
+            break;
+        }
+
+        // Match
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t*)output)) {
+            return -1;
+        }
+
+        size_t match_length = token & 15;
+        if (match_length == 15) {
+            uint8_t extra;
+            do {
+                if (ip == iend) {
+                    return -1;
+                }
+                extra = *ip++;
+                match_length += extra;
+            } while (extra == 255);
+        }
+        match_length += LZ4_MIN_MATCH;
+        if (match_length > (size_t)(oend - op)) {
+            return -1;
+        }
+
+        // A match may overlap the bytes it produces, repeating a short pattern
+        const uint8_t* match = op - offset;
+        if (offset >= match_length) {
+            memcpy(op, match, match_length);
+            op += match_length;
+        } else {
+            for (size_t i = 0; i < match_length; i++) {
+                *op++ = *match++;
+            }
+        }
+    }
+
+    return op - (uint8_t*)output;
+}
+
+/* Internal Functions */
+
+uint32_t lz4_read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/**
+ * Hash four bytes down to LZ4_HASH_BITS bits (Knuth's multiplicative hash).
+ *
+ * @param       sequence    Four bytes of input.
+ *
+ * @return      Index into the hash table.
+ **/
+uint32_t lz4_hash(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/**
+ * Write the extra bytes of a length that did not fit in its nibble (the
+ * nibble already holds 15).
+ *
+ * @param       output      Where to write.
+ * @param       length      Length less 15.
+ *
+ * @return      Byte after those written.
+ **/
+uint8_t* lz4_length(uint8_t* output, size_t length) {
+    while (length >= 255) {
+        *output++ = 255;
+        length -= 255;
+    }
+    *output++ = length;
+    return output;
+}
+
+/**
+ * Write one sequence: its token, literals, and (unless match_length is 0)
+ * its match.
+ *
+ * @param       output          Where to write.
+ * @param       end             End of output buffer.
+ * @param       literals        Literal bytes.
+ * @param       nliterals       Number of literal bytes.
+ * @param       offset          Distance back to match.
+ * @param       match_length    Length of match (0 for the last sequence).
+ *
+ * @return      Byte after those written (NULL if they do not fit).
+ **/
+uint8_t* lz4_sequence(uint8_t* output, uint8_t* end, const uint8_t* literals, size_t nliterals,
+                      size_t offset, size_t match_length) {
+    size_t needed = 1 + nliterals + nliterals / 255 + 1 + (match_length ? 2 + match_length / 255 + 1 : 0);
+    if (needed > (size_t)(end - output)) {
+        return NULL;
+    }
+
+    uint8_t* token = output++;
+    *token = (nliterals >= 15 ? 15 : nliterals) << 4;
+    if (nliterals >= 15) {
+        output = lz4_length(output, nliterals - 15);
+    }
+    memcpy(output, literals, nliterals);
+    output += nliterals;
+
+    if (match_length) {
+        *output++ = offset & 0xff;
+        *output++ = offset >> 8;
+        size_t extra = match_length - LZ4_MIN_MATCH;
+        *token |= extra >= 15 ? 15 : extra;
+        if (extra >= 15) {
+            output = lz4_length(output, extra - 15);
+        }
+    }
+
+    return output;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
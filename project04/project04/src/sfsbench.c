@@ -0,0 +1,750 @@
+/* sfsbench.c: SimpleFS benchmark */
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+#include "sfs/utils.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define CHUNK_SIZE        (4*BUFSIZ) /* Same read size as sfssh copyout */
+#define MAX_RESULTS       (32)
+#define MAX_DEPTH         (64)       /* Deepest queue tried by bench_queue */
+#define FILE_FRACTION     (4)        /* Files rewritten and copied fill this fraction of the scratch image */
+#define WRITE_FILE_BLOCKS (64)       /* Size of file rewritten by bench_small_writes */
+#define WRITE_COUNT       (1000)     /* Small writes per iteration */
+#define WRITE_MAX         (512)      /* Largest small write */
+#define CHURN_COUNT       (1000)     /* Files created and removed per iteration */
+#define MOUNT_FILES       (1000)     /* Most one-block files present while mounting */
+
+/* Structures */
+
+typedef struct Samples Samples;
+struct Samples {
+    double *latencies;      /* Seconds taken by each operation */
+    size_t count;           /* Number of operations timed */
+    size_t capacity;        /* Number of latencies allocated */
+};
+
+typedef struct Result Result;
+struct Result {
+    const char *backend;    /* Name of disk backend */
+    const char *method;     /* How data was read or written */
+    size_t bytes;           /* Number of bytes read or written */
+    size_t ops;             /* Number of operations */
+    double seconds;         /* Wall-clock time */
+    double modeled;         /* Time the modeled disk spent transferring blocks */
+    double p50;             /* Median operation latency in seconds */
+    double p99;             /* 99th percentile operation latency in seconds */
+    size_t reads;           /* Number of disk block reads */
+    size_t writes;          /* Number of disk block writes */
+};
+
+/* Global Variables */
+
+Result Results[MAX_RESULTS];
+size_t NResults = 0;
+
+/* Benchmark Prototypes */
+
+bool bench_read(const char *path, size_t blocks, DiskBackend backend, bool mapped, size_t iterations);
+bool bench_queue(const char *path, size_t blocks, DiskBackend backend, unsigned depth, size_t iterations);
+bool bench_file(const char *path, size_t blocks, DiskBackend backend, size_t iterations);
+bool bench_small_writes(const char *path, size_t blocks, DiskBackend backend, size_t iterations);
+bool bench_churn(const char *path, size_t blocks, DiskBackend backend, size_t iterations);
+bool bench_mount(const char *path, size_t blocks, DiskBackend backend, size_t iterations);
+bool bench_copy(const char *path, size_t blocks, DiskBackend backend, size_t iterations);
+
+/* Utility Prototypes */
+
+void usage(const char *progname);
+double now();
+Disk *scratch_open(const char *path, size_t blocks, DiskBackend backend, FileSystem *fs, char *scratch);
+void scratch_close(Disk *disk, FileSystem *fs, const char *scratch);
+void samples_add(Samples *samples, double seconds);
+double samples_percentile(Samples *samples, double fraction);
+int compare_latencies(const void *a, const void *b);
+void record(const char *backend, const char *method, size_t bytes, double seconds, Samples *samples,
+            size_t reads, size_t writes, uint64_t modeled_ns);
+void report(bool machine);
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    size_t iterations = 10;
+    size_t scratch_blocks = 0;
+    bool machine = false;
+    int option;
+    while ((option = getopt(argc, argv, "d:i:ms:")) != -1) {
+        switch (option) {
+            case 'd': setenv("SFS_DISK_MODEL", optarg, 1); break;
+            case 'i': iterations = strtoul(optarg, NULL, 10); break;
+            case 'm': machine = true; break;
+            case 's': scratch_blocks = strtoul(optarg, NULL, 10); break;
+            default:  usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+
+    DiskModel model = {0};
+    const char *device_name = getenv("SFS_DISK_MODEL");
+    if (argc - optind != 2 || iterations == 0 || (device_name && !disk_model_parse(device_name, &model))) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *path = argv[optind];
+    size_t blocks = strtoul(argv[optind + 1], NULL, 10);
+    if (scratch_blocks == 0) {
+        scratch_blocks = blocks;
+    }
+
+    // With -m, stdout carries only the table: what disk_close reports goes to stderr meanwhile
+    int table = machine ? dup(STDOUT_FILENO) : -1;
+    if (machine && (table < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)) {
+        fprintf(stderr, "sfsbench: dup failed %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    bool success = bench_read(path, blocks, DISK_PREAD, false, iterations) &&
+                   bench_read(path, blocks, DISK_MMAP, false, iterations) &&
+                   bench_read(path, blocks, DISK_MMAP, true, iterations) &&
+                   bench_read(path, blocks, DISK_URING, false, iterations) &&
+                   bench_queue(path, blocks, DISK_PREAD, 1, iterations);
+
+    for (unsigned depth = 1; success && depth <= MAX_DEPTH; depth *= 8) {
+        success = bench_queue(path, blocks, DISK_URING, depth, iterations);
+    }
+
+    for (DiskBackend backend = DISK_PREAD; success && backend <= DISK_MMAP; backend++) {
+        success = bench_file(path, scratch_blocks, backend, iterations) &&
+                  bench_small_writes(path, scratch_blocks, backend, iterations) &&
+                  bench_churn(path, scratch_blocks, backend, iterations) &&
+                  bench_mount(path, scratch_blocks, backend, iterations) &&
+                  bench_copy(path, scratch_blocks, backend, iterations);
+    }
+
+    // Report once every disk has been closed so the tables are not interleaved
+    if (machine) {
+        fflush(stdout);
+        dup2(table, STDOUT_FILENO);
+        close(table);
+    }
+    report(machine);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Benchmark Functions */
+
+/**
+ * Read every file on the disk image from start to finish the way sfssh
+ * copyout does, repeated for the specified number of iterations, and report
+ * throughput.
+ *
+ * @param       path        Path to disk image.
+ * @param       blocks      Number of blocks in disk image.
+ * @param       backend     Disk backend to open image with.
+ * @param       mapped      Whether to use fs_read_map instead of fs_read.
+ * @param       iterations  Number of passes over the image.
+ *
+ * @return      Whether or not the benchmark ran successfully.
+ **/
+bool bench_read(const char *path, size_t blocks, DiskBackend backend, bool mapped, size_t iterations) {
+    Disk *disk = disk_open_backend(path, blocks, backend);
+    if (!disk) {
+        return false;
+    }
+
+    FileSystem fs = {0};
+    if (!fs_mount(&fs, disk)) {
+        disk_close(disk);
+        return false;
+    }
+
+    char buffer[CHUNK_SIZE];
+    Samples samples = {0};
+    size_t bytes = 0;
+    size_t reads = disk->reads;
+    size_t writes = disk->writes;
+    uint64_t modeled = disk->modeled_ns;
+    double start = now();
+
+    for (size_t n = 0; n < iterations; n++) {
+        for (size_t inode_number = 0; inode_number < fs.meta_data.inodes; inode_number++) {
+            if (!fs.inode_table[inode_number / INODES_PER_BLOCK].inodes[inode_number % INODES_PER_BLOCK].valid) {
+                continue;
+            }
+
+            size_t offset = 0;
+            while (true) {
+                const char *chunk = buffer;
+                double begin = now();
+                ssize_t result = mapped ? fs_read_map(&fs, inode_number, offset, &chunk)
+                                        : fs_read(&fs, inode_number, buffer, sizeof(buffer), offset);
+                if (result <= 0) {
+                    break;
+                }
+                samples_add(&samples, now() - begin);
+                bytes += result;
+                offset += result;
+            }
+        }
+    }
+
+    record(disk_backend_name(backend), mapped ? "map" : "read", bytes, now() - start, &samples,
+           disk->reads - reads, disk->writes - writes, disk->modeled_ns - modeled);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return true;
+}
+
+/**
+ * Read every block of the disk image by keeping up to depth block reads
+ * queued at once, repeated for the specified number of iterations, and
+ * report throughput (each read takes as long as the drain that completes
+ * it).
+ *
+ * @param       path        Path to disk image.
+ * @param       blocks      Number of blocks in disk image.
+ * @param       backend     Disk backend to open image with.
+ * @param       depth       Number of reads queued before each drain.
+ * @param       iterations  Number of passes over the image.
+ *
+ * @return      Whether or not the benchmark ran successfully.
+ **/
+bool bench_queue(const char *path, size_t blocks, DiskBackend backend, unsigned depth, size_t iterations) {
+    static const char *methods[] = {"qd1", "qd8", "qd64"};
+    static char buffers[MAX_DEPTH][BLOCK_SIZE];
+
+    Disk *disk = disk_open_backend(path, blocks, backend);
+    if (!disk) {
+        return false;
+    }
+
+    if (disk->backend == DISK_URING && !disk_queue_depth(disk, depth)) {
+        disk_close(disk);
+        return false;
+    }
+
+    bool success = true;
+    Samples samples = {0};
+    double start = now();
+
+    for (size_t n = 0; n < iterations && success; n++) {
+        for (size_t block = 0; block < blocks && success; block += depth) {
+            double begin = now();
+            size_t queued = 0;
+            for (; queued < depth && block + queued < blocks; queued++) {
+                success = success && disk_queue_read(disk, block + queued, buffers[queued]);
+            }
+            success = disk_drain(disk) && success;
+
+            double latency = now() - begin;
+            for (size_t i = 0; i < queued; i++) {
+                samples_add(&samples, latency);
+            }
+        }
+    }
+
+    if (success) {
+        size_t method = depth >= 64 ? 2 : depth >= 8 ? 1 : 0;
+        record(disk_backend_name(disk->backend), methods[method], disk->reads * BLOCK_SIZE, now() - start,
+               &samples, disk->reads, disk->writes, disk->modeled_ns);
+    } else {
+        free(samples.latencies);
+    }
+
+    disk_close(disk);
+    return success;
+}
+
+/**
+ * Write one file filling a fraction of a freshly formatted scratch image,
+ * then report four workloads on it, each repeated for the specified number
+ * of iterations:
+ *
+ *  1. Sequential writes of CHUNK_SIZE bytes from start to finish.
+ *
+ *  2. Random writes of one aligned block each (as many as the file has
+ *  blocks).
+ *
+ *  3. Sequential reads of CHUNK_SIZE bytes from start to finish.
+ *
+ *  4. Random reads of one aligned block each.
+ *
+ * The file is checked against a copy kept in memory at the end.
+ *
+ * @param       path        Path to disk image.
+ * @param       blocks      Number of blocks in scratch image.
+ * @param       backend     Disk backend to open scratch image with.
+ * @param       iterations  Number of passes over the file.
+ *
+ * @return      Whether or not the benchmark ran successfully.
+ **/
+bool bench_file(const char *path, size_t blocks, DiskBackend backend, size_t iterations) {
+    static const char *methods[] = {"seqwrite", "randwrite", "seqread", "randread"};
+
+    char scratch[BUFSIZ];
+    FileSystem fs = {0};
+    Disk *disk = scratch_open(path, blocks, backend, &fs, scratch);
+    if (!disk) {
+        return false;
+    }
+
+    size_t file_blocks = blocks / FILE_FRACTION;
+    size_t file_size = file_blocks * BLOCK_SIZE;
+    char *expected = malloc(file_size);
+    char *actual = malloc(file_size);
+    ssize_t inode_number = fs_create(&fs);
+    bool success = expected && actual && file_blocks > 0 && inode_number >= 0;
+
+    unsigned seed = 1;
+    for (size_t i = 0; success && i < file_size; i++) {
+        expected[i] = rand_r(&seed);
+    }
+
+    for (size_t method = 0; method < 4 && success; method++) {
+        bool writing = method < 2;
+        bool sequential = method % 2 == 0;
+        size_t length = sequential ? CHUNK_SIZE : BLOCK_SIZE;
+        size_t count = sequential ? (file_size + CHUNK_SIZE - 1) / CHUNK_SIZE : file_blocks;
+
+        Samples samples = {0};
+        size_t bytes = 0;
+        size_t reads = disk->reads;
+        size_t writes = disk->writes;
+        uint64_t modeled = disk->modeled_ns;
+        double start = now();
+
+        for (size_t n = 0; n < iterations * count && success; n++) {
+            size_t offset = sequential ? (n % count) * CHUNK_SIZE : (rand_r(&seed) % file_blocks) * BLOCK_SIZE;
+            size_t chunk = min(length, file_size - offset);
+            double begin = now();
+            ssize_t result = writing ? fs_write(&fs, inode_number, expected + offset, chunk, offset)
+                                     : fs_read(&fs, inode_number, actual + offset, chunk, offset);
+            samples_add(&samples, now() - begin);
+            success = result == (ssize_t)chunk;
+            bytes += chunk;
+        }
+
+        if (success) {
+            record(disk_backend_name(backend), methods[method], bytes, now() - start, &samples,
+                   disk->reads - reads, disk->writes - writes, disk->modeled_ns - modeled);
+        } else {
+            free(samples.latencies);
+        }
+    }
+
+    success = success && fs_read(&fs, inode_number, actual, file_size, 0) == (ssize_t)file_size &&
+              memcmp(actual, expected, file_size) == 0;
+    if (!success) {
+        fprintf(stderr, "bench_file: file does not match what was written\n");
+    }
+
+    free(expected);
+    free(actual);
+    scratch_close(disk, &fs, scratch);
+    return success;
+}
+
+/**
+ * Rewrite random unaligned ranges of up to WRITE_MAX bytes within one file
+ * of a freshly formatted scratch image (each a read-modify-write of one or
+ * two blocks), repeated for the specified number of iterations, and check
+ * the file against a copy kept in memory.
+ *
+ * @param       path        Path to disk image.
+ * @param       blocks      Number of blocks in scratch image.
+ * @param       backend     Disk backend to open scratch image with.
+ * @param       iterations  Number of batches of WRITE_COUNT writes.
+ *
+ * @return      Whether or not the benchmark ran successfully.
+ **/
+bool bench_small_writes(const char *path, size_t blocks, DiskBackend backend, size_t iterations) {
+    static char expected[WRITE_FILE_BLOCKS * BLOCK_SIZE];
+    static char actual[WRITE_FILE_BLOCKS * BLOCK_SIZE];
+
+    char scratch[BUFSIZ];
+    FileSystem fs = {0};
+    Disk *disk = scratch_open(path, blocks, backend, &fs, scratch);
+    if (!disk) {
+        return false;
+    }
+
+    ssize_t inode_number = fs_create(&fs);
+    unsigned seed = 1;
+    for (size_t i = 0; i < sizeof(expected); i++) {
+        expected[i] = rand_r(&seed);
+    }
+
+    bool success = inode_number >= 0 &&
+                   fs_write(&fs, inode_number, expected, sizeof(expected), 0) == sizeof(expected);
+    Samples samples = {0};
+    size_t bytes = 0;
+    size_t reads = disk->reads;
+    size_t writes = disk->writes;
+    uint64_t modeled = disk->modeled_ns;
+    double start = now();
+
+    for (size_t n = 0; n < iterations * WRITE_COUNT && success; n++) {
+        size_t length = 1 + rand_r(&seed) % WRITE_MAX;
+        size_t offset = rand_r(&seed) % (sizeof(expected) - length + 1);
+        memset(expected + offset, 'a' + n % 26, length);
+        double begin = now();
+        success = fs_write(&fs, inode_number, expected + offset, length, offset) == (ssize_t)length;
+        samples_add(&samples, now() - begin);
+        bytes += length;
+    }
+
+    double seconds = now() - start;
+    reads = disk->reads - reads;
+    writes = disk->writes - writes;
+    modeled = disk->modeled_ns - modeled;
+    success = success && fs_read(&fs, inode_number, actual, sizeof(actual), 0) == sizeof(actual) &&
+              memcmp(actual, expected, sizeof(expected)) == 0;
+    if (!success) {
+        fprintf(stderr, "bench_small_writes: file does not match what was written\n");
+    }
+
+    if (success) {
+        record(disk_backend_name(backend), "rmw", bytes, seconds, &samples, reads, writes, modeled);
+    } else {
+        free(samples.latencies);
+    }
+
+    scratch_close(disk, &fs, scratch);
+    return success;
+}
+
+/**
+ * Create a file, write one block to it, and remove it again, CHURN_COUNT
+ * times per iteration on a freshly formatted scratch image (each cycle is
+ * one operation).
+ *
+ * @param       path        Path to disk image.
+ * @param       blocks      Number of blocks in scratch image.
+ * @param       backend     Disk backend to open scratch image with.
+ * @param       iterations  Number of batches of CHURN_COUNT cycles.
+ *
+ * @return      Whether or not the benchmark ran successfully.
+ **/
+bool bench_churn(const char *path, size_t blocks, DiskBackend backend, size_t iterations) {
+    char scratch[BUFSIZ];
+    FileSystem fs = {0};
+    Disk *disk = scratch_open(path, blocks, backend, &fs, scratch);
+    if (!disk) {
+        return false;
+    }
+
+    Block block;
+    memset(block.data, 'c', BLOCK_SIZE);
+
+    bool success = true;
+    Samples samples = {0};
+    size_t bytes = 0;
+    size_t reads = disk->reads;
+    size_t writes = disk->writes;
+    uint64_t modeled = disk->modeled_ns;
+    double start = now();
+
+    for (size_t n = 0; n < iterations * CHURN_COUNT && success; n++) {
+        double begin = now();
+        ssize_t inode_number = fs_create(&fs);
+        success = inode_number >= 0 &&
+                  fs_write(&fs, inode_number, block.data, BLOCK_SIZE, 0) == BLOCK_SIZE &&
+                  fs_remove(&fs, inode_number);
+        samples_add(&samples, now() - begin);
+        bytes += BLOCK_SIZE;
+    }
+
+    if (success) {
+        record(disk_backend_name(backend), "churn", bytes, now() - start, &samples,
+               disk->reads - reads, disk->writes - writes, disk->modeled_ns - modeled);
+    } else {
+        fprintf(stderr, "bench_churn: create, write, or remove failed\n");
+        free(samples.latencies);
+    }
+
+    scratch_close(disk, &fs, scratch);
+    return success;
+}
+
+/**
+ * Fill a freshly formatted scratch image with up to MOUNT_FILES one-block
+ * files, then unmount and mount it again, once per iteration (each mount is
+ * one operation).
+ *
+ * @param       path        Path to disk image.
+ * @param       blocks      Number of blocks in scratch image.
+ * @param       backend     Disk backend to open scratch image with.
+ * @param       iterations  Number of mounts.
+ *
+ * @return      Whether or not the benchmark ran successfully.
+ **/
+bool bench_mount(const char *path, size_t blocks, DiskBackend backend, size_t iterations) {
+    char scratch[BUFSIZ];
+    FileSystem fs = {0};
+    Disk *disk = scratch_open(path, blocks, backend, &fs, scratch);
+    if (!disk) {
+        return false;
+    }
+
+    Block block;
+    memset(block.data, 'm', BLOCK_SIZE);
+
+    StatFS stat = {0};
+    bool success = fs_statfs(&fs, &stat);
+    size_t files = min(MOUNT_FILES, min(stat.free_inodes, stat.free_blocks / 2));
+    for (size_t f = 0; f < files && success; f++) {
+        ssize_t inode_number = fs_create(&fs);
+        success = inode_number >= 0 && fs_write(&fs, inode_number, block.data, BLOCK_SIZE, 0) == BLOCK_SIZE;
+    }
+    success = success && fs_sync(&fs);
+
+    Samples samples = {0};
+    size_t reads = disk->reads;
+    size_t writes = disk->writes;
+    uint64_t modeled = disk->modeled_ns;
+    double start = now();
+    for (size_t n = 0; n < iterations && success; n++) {
+        fs_unmount(&fs);
+        double begin = now();
+        success = fs_mount(&fs, disk);
+        samples_add(&samples, now() - begin);
+    }
+
+    if (success) {
+        record(disk_backend_name(backend), "mount", 0, now() - start, &samples,
+               disk->reads - reads, disk->writes - writes, disk->modeled_ns - modeled);
+    } else {
+        fprintf(stderr, "bench_mount: couldn't fill or mount scratch image\n");
+        free(samples.latencies);
+    }
+
+    scratch_close(disk, &fs, scratch);
+    return success;
+}
+
+/**
+ * Write one file filling a fraction of a freshly formatted scratch image,
+ * then copy it to a new file in CHUNK_SIZE pieces the way sfssh copyout and
+ * copyin would, removing the copy after each iteration (each piece read and
+ * written is one operation).  The last copy is checked against the file.
+ *
+ * @param       path        Path to disk image.
+ * @param       blocks      Number of blocks in scratch image.
+ * @param       backend     Disk backend to open scratch image with.
+ * @param       iterations  Number of copies.
+ *
+ * @return      Whether or not the benchmark ran successfully.
+ **/
+bool bench_copy(const char *path, size_t blocks, DiskBackend backend, size_t iterations) {
+    char scratch[BUFSIZ];
+    FileSystem fs = {0};
+    Disk *disk = scratch_open(path, blocks, backend, &fs, scratch);
+    if (!disk) {
+        return false;
+    }
+
+    size_t file_size = blocks / FILE_FRACTION * BLOCK_SIZE;
+    char *expected = malloc(file_size);
+    char *actual = malloc(file_size);
+    ssize_t source = fs_create(&fs);
+    bool success = expected && actual && file_size > 0 && source >= 0;
+
+    unsigned seed = 1;
+    for (size_t i = 0; success && i < file_size; i++) {
+        expected[i] = rand_r(&seed);
+    }
+    success = success && fs_write(&fs, source, expected, file_size, 0) == (ssize_t)file_size;
+
+    char buffer[CHUNK_SIZE];
+    Samples samples = {0};
+    size_t bytes = 0;
+    size_t reads = disk->reads;
+    size_t writes = disk->writes;
+    uint64_t modeled = disk->modeled_ns;
+    double start = now();
+
+    for (size_t n = 0; n < iterations && success; n++) {
+        ssize_t target = fs_create(&fs);
+        success = target >= 0;
+        for (size_t offset = 0; offset < file_size && success; offset += CHUNK_SIZE) {
+            double begin = now();
+            ssize_t result = fs_read(&fs, source, buffer, sizeof(buffer), offset);
+            success = result > 0 && fs_write(&fs, target, buffer, result, offset) == result;
+            samples_add(&samples, now() - begin);
+            bytes += result;
+        }
+
+        if (n == iterations - 1) {
+            success = success && fs_read(&fs, target, actual, file_size, 0) == (ssize_t)file_size &&
+                      memcmp(actual, expected, file_size) == 0;
+        }
+        success = success && fs_remove(&fs, target);
+    }
+
+    if (success) {
+        record(disk_backend_name(backend), "copy", bytes, now() - start, &samples,
+               disk->reads - reads, disk->writes - writes, disk->modeled_ns - modeled);
+    } else {
+        fprintf(stderr, "bench_copy: copy does not match the file\n");
+        free(samples.latencies);
+    }
+
+    free(expected);
+    free(actual);
+    scratch_close(disk, &fs, scratch);
+    return success;
+}
+
+/* Utility Functions */
+
+void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [-d ideal|hdd|ssd] [-i iterations] [-m] [-s scratch_blocks] <diskfile> <nblocks>\n", progname);
+    fprintf(stderr, "    -d  Model the time a hard or solid state disk would take (default SFS_DISK_MODEL)\n");
+    fprintf(stderr, "    -i  Passes over each workload (default 10)\n");
+    fprintf(stderr, "    -m  Print tab-separated results for other programs\n");
+    fprintf(stderr, "    -s  Blocks in the scratch image (default nblocks)\n");
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Format and mount a scratch image next to the disk image (with a
+ * ".scratch" suffix), so the disk image is never modified.
+ *
+ * @param       path        Path to disk image.
+ * @param       blocks      Number of blocks in scratch image.
+ * @param       backend     Disk backend to open scratch image with.
+ * @param       fs          FileSystem structure to mount scratch image on.
+ * @param       scratch     Set to path of scratch image (BUFSIZ bytes).
+ *
+ * @return      Pointer to Disk structure (NULL on failure).
+ **/
+Disk *scratch_open(const char *path, size_t blocks, DiskBackend backend, FileSystem *fs, char *scratch) {
+    snprintf(scratch, BUFSIZ, "%s.scratch", path);
+    unlink(scratch);
+
+    Disk *disk = disk_open_backend(scratch, blocks, backend);
+    if (!disk) {
+        return NULL;
+    }
+
+    if (!fs_format(fs, disk) || !fs_mount(fs, disk)) {
+        disk_close(disk);
+        unlink(scratch);
+        return NULL;
+    }
+
+    return disk;
+}
+
+/**
+ * Unmount and remove a scratch image.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       fs          FileSystem structure scratch image is mounted on.
+ * @param       scratch     Path of scratch image.
+ **/
+void scratch_close(Disk *disk, FileSystem *fs, const char *scratch) {
+    fs_unmount(fs);
+    disk_close(disk);
+    unlink(scratch);
+}
+
+void samples_add(Samples *samples, double seconds) {
+    if (samples->count == samples->capacity) {
+        size_t capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        double *latencies = realloc(samples->latencies, capacity * sizeof(double));
+        if (!latencies) {
+            return;
+        }
+        samples->latencies = latencies;
+        samples->capacity = capacity;
+    }
+    samples->latencies[samples->count++] = seconds;
+}
+
+/**
+ * Return the latency below which the specified fraction of operations
+ * finished (the samples must be sorted).
+ *
+ * @param       samples     Pointer to Samples structure.
+ * @param       fraction    Fraction of operations (0.5 for the median).
+ *
+ * @return      Latency in seconds (0 if nothing was timed).
+ **/
+double samples_percentile(Samples *samples, double fraction) {
+    if (samples->count == 0) {
+        return 0;
+    }
+    return samples->latencies[(size_t)(fraction * (samples->count - 1))];
+}
+
+int compare_latencies(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Record the result of one workload (taking the latencies from samples and
+ * freeing them).
+ *
+ * @param       backend     Name of disk backend.
+ * @param       method      Name of workload.
+ * @param       bytes       Number of bytes read or written.
+ * @param       seconds     Wall-clock time.
+ * @param       samples     Latency of each operation.
+ * @param       reads       Number of disk block reads.
+ * @param       writes      Number of disk block writes.
+ * @param       modeled_ns  Time the modeled disk spent transferring blocks.
+ **/
+void record(const char *backend, const char *method, size_t bytes, double seconds, Samples *samples,
+            size_t reads, size_t writes, uint64_t modeled_ns) {
+    qsort(samples->latencies, samples->count, sizeof(double), compare_latencies);
+    if (NResults < MAX_RESULTS) {
+        Results[NResults++] = (Result){backend, method, bytes, samples->count, seconds, modeled_ns / 1e9,
+                                       samples_percentile(samples, 0.5), samples_percentile(samples, 0.99),
+                                       reads, writes};
+    }
+    free(samples->latencies);
+    *samples = (Samples){0};
+}
+
+/**
+ * Print every result, either as a table or (for machine) as tab-separated
+ * lines under a header, with latencies in microseconds and the modeled disk
+ * time next to the wall-clock time.
+ *
+ * @param       machine     Whether to print tab-separated lines.
+ **/
+void report(bool machine) {
+    if (machine) {
+        printf("backend\tmethod\tbytes\tops\tseconds\tmodeled_seconds\tmb_per_s\tops_per_s\tp50_us\tp99_us\treads_per_op\twrites_per_op\n");
+    } else {
+        printf("\n%-8s %-9s %12s %8s %10s %10s %10s %12s %9s %9s %9s %9s\n", "backend", "method", "bytes", "ops",
+               "seconds", "modeled", "MB/s", "ops/s", "p50 us", "p99 us", "reads/op", "writes/op");
+    }
+
+    for (size_t i = 0; i < NResults; i++) {
+        Result *r = &Results[i];
+        double ops = r->ops ? r->ops : 1;
+        printf(machine ? "%s\t%s\t%lu\t%lu\t%.6f\t%.6f\t%.2f\t%.1f\t%.2f\t%.2f\t%.3f\t%.3f\n"
+                       : "%-8s %-9s %12lu %8lu %10.4f %10.4f %10.2f %12.1f %9.2f %9.2f %9.3f %9.3f\n",
+               r->backend, r->method, r->bytes, r->ops, r->seconds, r->modeled, r->bytes / (1024.0 * 1024.0) / r->seconds,
+               r->ops / r->seconds, r->p50 * 1e6, r->p99 * 1e6, r->reads / ops, r->writes / ops);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,48 +1,113 @@
 /* sfssh.c: SimpleFS shell */
 
+#include "sfs/dir.h"
 #include "sfs/disk.h"
 #include "sfs/fs.h"
+#include "sfs/stats.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 /* Macros */
 
 #define streq(a, b)     (strcmp((a), (b)) == 0)
+#define TRACE_SHOWN     (20)    /* Trace records printed by stats trace */
 
 /* Command Prototyes */
 
 void do_debug(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_format(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_mount(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_sync(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_fsck(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_scrub(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_create(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_remove(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_stat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_statfs(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_copyout(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_cat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_copyin(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_mkdir(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_touch(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_rm(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_ls(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_lookup(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_put(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_get(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_stats(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_help(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 
 /* Utility Prototypes */
 
+void usage(const char *progname);
 bool copyout(FileSystem *fs, size_t inode_number, const char *path);
 bool copyin(FileSystem *fs, const char *path, size_t inode_number);
+DirTree *open_tree(FileSystem *fs);
+void close_tree();
+
+/* Globals */
+
+DirTree *Tree = NULL;   /* Directory tree of mounted file system (opened by first path command) */
 
 /* Main Execution */
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <diskfile> <nblocks>\n", argv[0]);
+    size_t cache_blocks = 0;
+    unsigned queue_depth = 0;
+    DiskBackend backend = DISK_PREAD;
+    const char *backend_name = getenv("SFS_DISK_BACKEND");
+    const char *device_name = NULL;
+    bool delay = false;
+    DiskModel model;
+    int option;
+    while ((option = getopt(argc, argv, "b:c:d:q:s")) != -1) {
+        switch (option) {
+            case 'b': backend_name = optarg; break;
+            case 'c': cache_blocks = strtoul(optarg, NULL, 10); break;
+            case 'd': device_name = optarg; break;
+            case 'q': queue_depth = strtoul(optarg, NULL, 10); break;
+            case 's': delay = true; break;
+            default:  usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 2 || (backend_name && !disk_backend_parse(backend_name, &backend)) ||
+        (device_name && !disk_model_parse(device_name, &model))) {
+        usage(argv[0]);
         return EXIT_FAILURE;
     }
 
-    Disk *disk = disk_open(argv[1], atoi(argv[2]));
+    Disk *disk = disk_open_backend(argv[optind], atoi(argv[optind + 1]), backend);
     if (!disk) {
         return EXIT_FAILURE;
     }
 
+    if (queue_depth && disk->backend == DISK_URING && !disk_queue_depth(disk, queue_depth)) {
+        disk_close(disk);
+        return EXIT_FAILURE;
+    }
+
+    if (cache_blocks && !disk_cache(disk, cache_blocks)) {
+        disk_close(disk);
+        return EXIT_FAILURE;
+    }
+
+    if (device_name || delay) {
+        if (!device_name) {
+            model = disk->model;
+        }
+        model.delay = delay;
+        if (!disk_model(disk, &model)) {
+            disk_close(disk);
+            return EXIT_FAILURE;
+        }
+    }
+
     FileSystem fs = {0};
     while (true) {
         char line[BUFSIZ], cmd[BUFSIZ], arg1[BUFSIZ], arg2[BUFSIZ];
@@ -65,18 +130,42 @@ int main(int argc, char *argv[]) {
             do_format(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "mount")) {
             do_mount(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "sync")) {
+            do_sync(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "fsck")) {
+            do_fsck(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "scrub")) {
+            do_scrub(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "create")) {
             do_create(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "remove")) {
             do_remove(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "stat")) {
             do_stat(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "statfs")) {
+            do_statfs(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "copyout")) {
             do_copyout(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "cat")) {
             do_cat(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "copyin")) {
             do_copyin(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "mkdir")) {
+            do_mkdir(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "touch")) {
+            do_touch(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "rm")) {
+            do_rm(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "ls")) {
+            do_ls(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "lookup")) {
+            do_lookup(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "put")) {
+            do_put(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "get")) {
+            do_get(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "stats")) {
+            do_stats(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "help")) {
             do_help(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "exit") || streq(cmd, "quit")) {
@@ -87,6 +176,7 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    close_tree();
     fs_unmount(&fs);
     assert(fs.disk == NULL);
     assert(fs.free_blocks == NULL);
@@ -101,17 +191,44 @@ void do_debug(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
         printf("Usage: debug\n");
         return;
     }
+
+    // Write back the in-memory inode table so debug sees current state
+    if (fs->disk && !fs_sync(fs)) {
+        printf("sync failed!\n");
+    }
     fs_debug(disk);
 }
 
 void do_format(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
-    if (args != 1) {
-        printf("Usage: format\n");
-        return;
+    FormatMode mode = FORMAT_FAST;
+    for (int i = 1; i < args; i++) {
+        char *option = i == 1 ? arg1 : arg2;
+        if (streq(option, "secure")) {
+            mode |= FORMAT_SECURE;
+        } else if (streq(option, "checksums")) {
+            mode |= FORMAT_CHECKSUMS;
+        } else if (streq(option, "compressed")) {
+            mode |= FORMAT_COMPRESSION;
+        } else if (streq(option, "dedup")) {
+            mode |= FORMAT_DEDUP;
+        } else {
+            printf("Usage: format [secure] [checksums|compressed|dedup]\n");
+            return;
+        }
     }
 
-    if (fs_format(fs, disk)) {
+    close_tree();
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool formatted = fs_format_mode(fs, disk, mode);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (formatted) {
         printf("disk formatted.\n");
+        printf("%s%s format took %.6f seconds.\n", mode & FORMAT_SECURE ? "secure" : "fast",
+               mode & FORMAT_COMPRESSION ? " compressed" : mode & FORMAT_DEDUP ? " deduplicated" :
+               mode & FORMAT_CHECKSUMS ? " checksummed" : "",
+               (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
     } else {
         printf("format failed!\n");
     }
@@ -123,6 +240,7 @@ void do_mount(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
         return;
     }
 
+    close_tree();
     if (fs_mount(fs, disk)) {
         printf("disk mounted.\n");
     } else {
@@ -130,18 +248,73 @@ void do_mount(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     }
 }
 
-void do_create(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+void do_sync(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     if (args != 1) {
-        printf("Usage: create\n");
+        printf("Usage: sync\n");
         return;
     }
 
-    ssize_t inode_number = fs_create(fs);
-    if (inode_number >= 0) {
-        printf("created inode %ld.\n", inode_number);
+    if (fs_sync(fs)) {
+        printf("disk synced.\n");
+    } else {
+        printf("sync failed!\n");
+    }
+}
+
+void do_fsck(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+        printf("Usage: fsck\n");
+        return;
+    }
+
+    ssize_t repaired = fs_fsck(fs);
+    if (repaired >= 0) {
+        printf("free block bitmap checked, %ld blocks repaired.\n", repaired);
+    } else {
+        printf("fsck failed!\n");
+    }
+}
+
+void do_scrub(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+        printf("Usage: scrub\n");
+        return;
+    }
+
+    size_t checked = 0;
+    ssize_t errors = fs_scrub(fs, &checked);
+    if (errors >= 0) {
+        printf("%lu data blocks checked, %ld checksum errors.\n", checked, errors);
+    } else {
+        printf("scrub failed!\n");
+    }
+}
+
+void do_create(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args > 2) {
+        printf("Usage: create [count]\n");
+        return;
+    }
+
+    if (args == 1) {
+        ssize_t inode_number = fs_create(fs);
+        if (inode_number >= 0) {
+            printf("created inode %ld.\n", inode_number);
+        } else {
+            printf("create failed!\n");
+        }
+        return;
+    }
+
+    size_t count = strtoul(arg1, NULL, 10);
+    uint32_t *inode_numbers = calloc(count, sizeof(uint32_t));
+    ssize_t created = inode_numbers ? fs_create_many(fs, inode_numbers, count) : -1;
+    if (created > 0) {
+        printf("created %ld inodes (%u to %u).\n", created, inode_numbers[0], inode_numbers[created - 1]);
     } else {
         printf("create failed!\n");
     }
+    free(inode_numbers);
 }
 
 void do_remove(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
@@ -173,6 +346,27 @@ void do_stat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     }
 }
 
+void do_statfs(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+        printf("Usage: statfs\n");
+        return;
+    }
+
+    StatFS stat = {0};
+    if (fs_statfs(fs, &stat)) {
+        printf("%u of %u data blocks free (%u blocks, %u of %u inodes free).\n",
+               stat.free_blocks, stat.data_blocks, stat.blocks, stat.free_inodes, stat.inodes);
+        if (stat.checksum_errors > 0) {
+            printf("%u checksum errors.\n", stat.checksum_errors);
+        }
+        if (stat.shared_blocks > 0) {
+            printf("%u data blocks shared.\n", stat.shared_blocks);
+        }
+    } else {
+        printf("statfs failed!\n");
+    }
+}
+
 void do_copyout(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     if (args != 3) {
         printf("Usage: copyout <inode> <file>\n");
@@ -206,17 +400,169 @@ void do_copyin(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     }
 }
 
+void do_mkdir(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+        printf("Usage: mkdir <path>\n");
+        return;
+    }
+
+    DirTree *tree = open_tree(fs);
+    ssize_t inode_number = tree ? dir_mkdir(tree, arg1) : -1;
+    if (inode_number >= 0) {
+        printf("created directory %s as inode %ld.\n", arg1, inode_number);
+    } else {
+        printf("mkdir failed!\n");
+    }
+}
+
+void do_touch(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+        printf("Usage: touch <path>\n");
+        return;
+    }
+
+    DirTree *tree = open_tree(fs);
+    ssize_t inode_number = tree ? dir_create(tree, arg1) : -1;
+    if (inode_number >= 0) {
+        printf("created file %s as inode %ld.\n", arg1, inode_number);
+    } else {
+        printf("touch failed!\n");
+    }
+}
+
+void do_rm(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+        printf("Usage: rm <path>\n");
+        return;
+    }
+
+    DirTree *tree = open_tree(fs);
+    if (tree && dir_unlink(tree, arg1)) {
+        printf("removed %s.\n", arg1);
+    } else {
+        printf("rm failed!\n");
+    }
+}
+
+void do_ls(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args > 2) {
+        printf("Usage: ls [path]\n");
+        return;
+    }
+
+    DirTree *tree = open_tree(fs);
+    DirEntry *entries = NULL;
+    ssize_t count = tree ? dir_list(tree, args == 2 ? arg1 : "/", &entries) : -1;
+    if (count < 0) {
+        printf("ls failed!\n");
+        return;
+    }
+
+    for (ssize_t i = 0; i < count; i++) {
+        ssize_t bytes = fs_stat(fs, entries[i].inode_number);
+        printf("%c %8u %10ld %.*s%s\n", entries[i].type == ENTRY_DIRECTORY ? 'd' : '-',
+               entries[i].inode_number, bytes, entries[i].length, entries[i].name,
+               entries[i].type == ENTRY_DIRECTORY ? "/" : "");
+    }
+    free(entries);
+}
+
+void do_lookup(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+        printf("Usage: lookup <path>\n");
+        return;
+    }
+
+    DirTree *tree = open_tree(fs);
+    EntryType type = ENTRY_FILE;
+    ssize_t inode_number = tree ? dir_lookup(tree, arg1, &type) : -1;
+    if (inode_number >= 0) {
+        printf("%s is %s inode %ld.\n", arg1, type == ENTRY_DIRECTORY ? "directory" : "file", inode_number);
+    } else {
+        printf("lookup failed!\n");
+    }
+}
+
+void do_put(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 3) {
+        printf("Usage: put <file> <path>\n");
+        return;
+    }
+
+    DirTree *tree = open_tree(fs);
+    ssize_t inode_number = tree ? dir_create(tree, arg2) : -1;
+    if (inode_number < 0 || !copyin(fs, arg1, inode_number)) {
+        printf("put failed!\n");
+    }
+}
+
+void do_get(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 3) {
+        printf("Usage: get <path> <file>\n");
+        return;
+    }
+
+    DirTree *tree = open_tree(fs);
+    EntryType type = ENTRY_FILE;
+    ssize_t inode_number = tree ? dir_lookup(tree, arg1, &type) : -1;
+    if (inode_number < 0 || type != ENTRY_FILE || !copyout(fs, inode_number, arg2)) {
+        printf("get failed!\n");
+    }
+}
+
+void do_stats(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    StatOp op;
+    if (args == 1) {
+        stats_dump(stdout);
+        if (disk->model.device != DISK_IDEAL) {
+            printf("%.6f seconds modeled %s time\n", disk->modeled_ns / 1e9, disk_device_name(disk->model.device));
+        }
+    } else if (args == 2 && streq(arg1, "reset")) {
+        stats_reset();
+        printf("stats reset.\n");
+    } else if (args >= 2 && streq(arg1, "trace")) {
+        if (args == 3 && streq(arg2, "on")) {
+            if (stats_trace(STATS_TRACE_DEFAULT)) {
+                printf("tracing the last %d calls.\n", STATS_TRACE_DEFAULT);
+            } else {
+                printf("trace failed!\n");
+            }
+        } else if (args == 3 && streq(arg2, "off")) {
+            stats_trace(0);
+            printf("tracing stopped.\n");
+        } else {
+            stats_dump_trace(stdout, args == 3 ? strtoul(arg2, NULL, 10) : TRACE_SHOWN);
+        }
+    } else if (args == 2 && stats_op_parse(arg1, &op)) {
+        stats_dump_histogram(stdout, op);
+    } else {
+        printf("Usage: stats [reset | trace [on | off | count] | <operation>]\n");
+    }
+}
+
 void do_help(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     printf("Commands are:\n");
-    printf("    format\n");
+    printf("    format [secure] [checksums|compressed|dedup]\n");
     printf("    mount\n");
+    printf("    sync\n");
+    printf("    fsck\n");
+    printf("    scrub\n");
     printf("    debug\n");
-    printf("    create\n");
+    printf("    create  [count]\n");
     printf("    remove  <inode>\n");
     printf("    cat     <inode>\n");
     printf("    stat    <inode>\n");
+    printf("    statfs\n");
     printf("    copyin  <file> <inode>\n");
     printf("    copyout <inode> <file>\n");
+    printf("    mkdir   <path>\n");
+    printf("    touch   <path>\n");
+    printf("    rm      <path>\n");
+    printf("    ls      [path]\n");
+    printf("    lookup  <path>\n");
+    printf("    put     <file> <path>\n");
+    printf("    get     <path> <file>\n");
+    printf("    stats   [reset | trace [on | off | count] | <operation>]\n");
     printf("    help\n");
     printf("    quit\n");
     printf("    exit\n");
@@ -224,6 +570,24 @@ void do_help(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
 
 /* Utility Functions */
 
+void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [-b pread|mmap|uring] [-c cacheblocks] [-d ideal|hdd|ssd] [-q queuedepth] [-s] <diskfile> <nblocks>\n", progname);
+    fprintf(stderr, "    -d  Model the time a hard or solid state disk would take\n");
+    fprintf(stderr, "    -s  Sleep for the modeled time as well\n");
+}
+
+DirTree *open_tree(FileSystem *fs) {
+    if (!Tree && fs->disk) {
+        Tree = dir_open(fs);
+    }
+    return Tree;
+}
+
+void close_tree() {
+    dir_close(Tree);
+    Tree = NULL;
+}
+
 bool copyin(FileSystem *fs, const char *path, size_t inode_number) {
     FILE *stream = fopen(path, "r");
     if (!stream) {
@@ -264,11 +628,20 @@ bool copyout(FileSystem *fs, size_t inode_number, const char *path) {
     char buffer[4*BUFSIZ] = {0};
     size_t offset = 0;
     while (true) {
-        ssize_t result = fs_read(fs, inode_number, buffer, sizeof(buffer), offset);
+        // Write straight from the mapped disk image when there is one (compressed data has to be read)
+        const char *chunk = buffer;
+        ssize_t result = -1;
+        if (fs->disk && fs->disk->map) {
+            result = fs_read_map(fs, inode_number, offset, &chunk);
+        }
+        if (result < 0) {
+            chunk = buffer;
+            result = fs_read(fs, inode_number, buffer, sizeof(buffer), offset);
+        }
         if (result <= 0) {
             break;
         }
-        fwrite(buffer, 1, result, stream);
+        fwrite(chunk, 1, result, stream);
         offset += result;
     }
     printf("%lu bytes copied\n", offset);
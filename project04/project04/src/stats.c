@@ -0,0 +1,375 @@
+/* stats.c: SimpleFS latency histograms and call tracing
+ *
+ * Each instrumented call takes a timestamp on entry (stats_start) and hands
+ * it back on exit (stats_record), which adds the call to the histogram of
+ * its operation and, while tracing, to the ring buffer of recent calls.
+ * Histogram counters are bumped with relaxed atomics so threads never wait
+ * on each other; only the optional trace takes a lock.
+ **/
+
+#include "sfs/stats.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+/* Internal Prototypes */
+
+uint32_t stats_bucket(uint64_t nanoseconds);
+uint32_t stats_thread();
+
+/* Internal Variables */
+
+const char* StatOpNames[STAT_OPS] = {
+    "fs_mount", "fs_sync", "fs_create", "fs_remove", "fs_stat", "fs_read", "fs_read_map", "fs_write",
+    "disk_read", "disk_write", "disk_readv", "disk_writev",
+};
+
+Histogram Histograms[STAT_OPS];         /* Updated atomically */
+bool StatsEnabled = true;               /* Whether calls are timed at all */
+
+pthread_mutex_t TraceLock = PTHREAD_MUTEX_INITIALIZER;
+TraceRecord* TraceRecords = NULL;       /* Ring buffer of recent calls (NULL unless tracing) */
+size_t TraceCapacity = 0;               /* Number of records in ring buffer */
+size_t TraceNext = 0;                   /* Number of calls traced since tracing began */
+bool TraceEnabled = false;              /* Checked without the lock before taking it */
+
+uint32_t ThreadCount = 0;               /* Threads numbered so far */
+__thread uint32_t ThreadNumber = 0;     /* Number of calling thread (0 until first traced call) */
+
+/* External Functions */
+
+/**
+ * Take the timestamp that begins an instrumented call.
+ *
+ * @return      Nanoseconds on the monotonic clock (0 if stats are disabled).
+ **/
+uint64_t stats_start() {
+    if (!__atomic_load_n(&StatsEnabled, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Finish an instrumented call, timing it from its stats_start timestamp
+ * (see stats_record_duration).
+ *
+ * @param       op          Operation called.
+ * @param       start       Timestamp from stats_start (0 to ignore the call).
+ * @param       argument    Inode or block number the call was given.
+ * @param       result      What the call returned (negative on failure).
+ **/
+void stats_record(StatOp op, uint64_t start, uint64_t argument, int64_t result) {
+    if (start == 0) {
+        return;
+    }
+
+    uint64_t end = stats_start();
+    stats_record_duration(op, start, end > start ? end - start : 0, argument, result);
+}
+
+/**
+ * Record a call that took the specified time by doing the following:
+ *
+ *  1. Add its duration to the histogram of its operation.
+ *
+ *  2. While tracing, overwrite the oldest record in the ring buffer with it.
+ *
+ * @param       op          Operation called.
+ * @param       start       Timestamp from stats_start (0 to ignore the call).
+ * @param       duration    Nanoseconds the call took.
+ * @param       argument    Inode or block number the call was given.
+ * @param       result      What the call returned (negative on failure).
+ **/
+void stats_record_duration(StatOp op, uint64_t start, uint64_t duration, uint64_t argument, int64_t result) {
+    if (start == 0 || op >= STAT_OPS) {
+        return;
+    }
+
+    Histogram* histogram = &Histograms[op];
+    __atomic_add_fetch(&histogram->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->total_ns, duration, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->buckets[stats_bucket(duration)], 1, __ATOMIC_RELAXED);
+    if (result < 0) {
+        __atomic_add_fetch(&histogram->failures, 1, __ATOMIC_RELAXED);
+    }
+
+    uint64_t longest = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    while (duration > longest &&
+           !__atomic_compare_exchange_n(&histogram->max_ns, &longest, duration, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (!__atomic_load_n(&TraceEnabled, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    uint32_t thread = stats_thread();
+    pthread_mutex_lock(&TraceLock);
+    if (TraceRecords) {
+        TraceRecords[TraceNext++ % TraceCapacity] = (TraceRecord){start, duration, argument, result, op, thread};
+    }
+    pthread_mutex_unlock(&TraceLock);
+}
+
+/**
+ * Turn the timing of calls on or off (histograms and trace alike).
+ *
+ * @param       enabled     Whether calls should be timed.
+ **/
+void stats_enable(bool enabled) {
+    __atomic_store_n(&StatsEnabled, enabled, __ATOMIC_RELAXED);
+}
+
+/**
+ * Start tracing into a new ring buffer (discarding any earlier trace), or
+ * stop tracing.
+ *
+ * @param       capacity    Number of recent calls to keep (0 stops tracing).
+ * @return      Whether or not the ring buffer could be allocated.
+ **/
+bool stats_trace(size_t capacity) {
+    TraceRecord* records = capacity ? calloc(capacity, sizeof(TraceRecord)) : NULL;
+    if (capacity && !records) {
+        return false;
+    }
+
+    pthread_mutex_lock(&TraceLock);
+    free(TraceRecords);
+    TraceRecords = records;
+    TraceCapacity = capacity;
+    TraceNext = 0;
+    __atomic_store_n(&TraceEnabled, records != NULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&TraceLock);
+    return true;
+}
+
+/**
+ * Clear every histogram and forget the calls traced so far (tracing goes on
+ * if it was on).
+ **/
+void stats_reset() {
+    for (StatOp op = 0; op < STAT_OPS; op++) {
+        Histogram* histogram = &Histograms[op];
+        __atomic_store_n(&histogram->calls, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&histogram->failures, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&histogram->total_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&histogram->max_ns, 0, __ATOMIC_RELAXED);
+        for (size_t b = 0; b < STATS_BUCKETS; b++) {
+            __atomic_store_n(&histogram->buckets[b], 0, __ATOMIC_RELAXED);
+        }
+    }
+
+    pthread_mutex_lock(&TraceLock);
+    TraceNext = 0;
+    pthread_mutex_unlock(&TraceLock);
+}
+
+/**
+ * Copy the histogram of an operation (each counter is read atomically, so a
+ * copy taken under load may be off by the calls still in flight).
+ *
+ * @param       op          Operation.
+ * @param       histogram   Histogram structure to fill in.
+ **/
+void stats_histogram(StatOp op, Histogram* histogram) {
+    *histogram = (Histogram){0};
+    if (op >= STAT_OPS) {
+        return;
+    }
+
+    Histogram* source = &Histograms[op];
+    histogram->calls = __atomic_load_n(&source->calls, __ATOMIC_RELAXED);
+    histogram->failures = __atomic_load_n(&source->failures, __ATOMIC_RELAXED);
+    histogram->total_ns = __atomic_load_n(&source->total_ns, __ATOMIC_RELAXED);
+    histogram->max_ns = __atomic_load_n(&source->max_ns, __ATOMIC_RELAXED);
+    for (size_t b = 0; b < STATS_BUCKETS; b++) {
+        histogram->buckets[b] = __atomic_load_n(&source->buckets[b], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Estimate the latency below which a fraction of the calls finished (the
+ * upper bound of the bucket holding that call, capped at the longest call).
+ *
+ * @param       histogram   Pointer to Histogram structure.
+ * @param       fraction    Fraction of calls (0.5 for the median).
+ * @return      Latency in nanoseconds (0 if there were no calls).
+ **/
+uint64_t stats_percentile(const Histogram* histogram, double fraction) {
+    size_t total = 0;
+    for (size_t b = 0; b < STATS_BUCKETS; b++) {
+        total += histogram->buckets[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    size_t rank = (size_t)(fraction * (total - 1)) + 1;
+    size_t seen = 0;
+    for (size_t b = 0; b < STATS_BUCKETS; b++) {
+        seen += histogram->buckets[b];
+        if (seen >= rank) {
+            uint64_t bound = (b + 1 < 64) ? (uint64_t)1 << (b + 1) : UINT64_MAX;
+            return histogram->max_ns && histogram->max_ns < bound ? histogram->max_ns : bound;
+        }
+    }
+    return histogram->max_ns;
+}
+
+/**
+ * Copy the most recent trace records in the order the calls finished.
+ *
+ * @param       records     Array to copy records to.
+ * @param       count       Most records to copy.
+ * @return      Number of records copied.
+ **/
+size_t stats_trace_records(TraceRecord* records, size_t count) {
+    pthread_mutex_lock(&TraceLock);
+    size_t available = TraceNext < TraceCapacity ? TraceNext : TraceCapacity;
+    count = count < available ? count : available;
+    for (size_t i = 0; i < count; i++) {
+        records[i] = TraceRecords[(TraceNext - count + i) % TraceCapacity];
+    }
+    pthread_mutex_unlock(&TraceLock);
+    return count;
+}
+
+/**
+ * Return the name of an operation (the function it times).
+ *
+ * @param       op      Operation.
+ * @return      Name of operation ("unknown" if out of range).
+ **/
+const char* stats_op_name(StatOp op) {
+    return op < STAT_OPS ? StatOpNames[op] : "unknown";
+}
+
+/**
+ * Find an operation by name.
+ *
+ * @param       name    Name of operation (as returned by stats_op_name).
+ * @param       op      Set to the operation.
+ * @return      Whether or not the name was recognized.
+ **/
+bool stats_op_parse(const char* name, StatOp* op) {
+    for (StatOp o = 0; o < STAT_OPS; o++) {
+        if (strcmp(name, StatOpNames[o]) == 0) {
+            *op = o;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Print a line per operation that has been called: calls, failures, and
+ * mean, median, 99th percentile, and longest latency in microseconds.
+ *
+ * @param       stream  Stream to print to.
+ **/
+void stats_dump(FILE* stream) {
+    fprintf(stream, "%-12s %10s %8s %10s %10s %10s %10s\n",
+            "operation", "calls", "failed", "mean us", "p50 us", "p99 us", "max us");
+    for (StatOp op = 0; op < STAT_OPS; op++) {
+        Histogram histogram;
+        stats_histogram(op, &histogram);
+        if (histogram.calls == 0) {
+            continue;
+        }
+
+        fprintf(stream, "%-12s %10lu %8lu %10.2f %10.2f %10.2f %10.2f\n", stats_op_name(op),
+                histogram.calls, histogram.failures, histogram.total_ns / 1000.0 / histogram.calls,
+                stats_percentile(&histogram, 0.5) / 1000.0, stats_percentile(&histogram, 0.99) / 1000.0,
+                histogram.max_ns / 1000.0);
+    }
+}
+
+/**
+ * Print every non-empty bucket of an operation's histogram with a bar
+ * scaled to the fullest bucket.
+ *
+ * @param       stream  Stream to print to.
+ * @param       op      Operation.
+ **/
+void stats_dump_histogram(FILE* stream, StatOp op) {
+    Histogram histogram;
+    stats_histogram(op, &histogram);
+
+    size_t fullest = 1;
+    for (size_t b = 0; b < STATS_BUCKETS; b++) {
+        fullest = histogram.buckets[b] > fullest ? histogram.buckets[b] : fullest;
+    }
+
+    fprintf(stream, "%s: %lu calls, %lu failed\n", stats_op_name(op), histogram.calls, histogram.failures);
+    for (size_t b = 0; b < STATS_BUCKETS; b++) {
+        if (histogram.buckets[b] == 0) {
+            continue;
+        }
+
+        char bar[41] = {0};
+        memset(bar, '#', (histogram.buckets[b] * 40 + fullest - 1) / fullest);
+        fprintf(stream, "  < %12.3f us %10lu %s\n", ((uint64_t)1 << (b + 1)) / 1000.0, histogram.buckets[b], bar);
+    }
+}
+
+/**
+ * Print the most recent trace records in the order they finished, with
+ * start times relative to the earliest one printed.
+ *
+ * @param       stream  Stream to print to.
+ * @param       count   Most records to print.
+ **/
+void stats_dump_trace(FILE* stream, size_t count) {
+    TraceRecord* records = calloc(count ? count : 1, sizeof(TraceRecord));
+    if (!records) {
+        return;
+    }
+
+    count = stats_trace_records(records, count);
+    uint64_t base = count ? records[0].start_ns : 0;
+    for (size_t i = 1; i < count; i++) {
+        base = records[i].start_ns < base ? records[i].start_ns : base;
+    }
+
+    fprintf(stream, "%12s %6s %-12s %10s %10s %12s\n", "start us", "thread", "operation", "argument", "result", "duration us");
+    for (size_t i = 0; i < count; i++) {
+        TraceRecord* r = &records[i];
+        fprintf(stream, "%12.3f %6u %-12s %10lu %10ld %12.3f\n", (r->start_ns - base) / 1000.0,
+                r->thread, stats_op_name(r->op), r->argument, r->result, r->duration_ns / 1000.0);
+    }
+    free(records);
+}
+
+/* Internal Functions */
+
+/**
+ * Find the histogram bucket for a duration.
+ *
+ * @param       nanoseconds     Duration of call.
+ * @return      Bucket index (durations past the last bucket share it).
+ **/
+uint32_t stats_bucket(uint64_t nanoseconds) {
+    if (nanoseconds < 2) {
+        return 0;
+    }
+
+    uint32_t bucket = 63 - __builtin_clzll(nanoseconds);
+    return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+/**
+ * Number the calling thread the first time it is traced.
+ *
+ * @return      Number of calling thread (from 1).
+ **/
+uint32_t stats_thread() {
+    if (ThreadNumber == 0) {
+        ThreadNumber = __atomic_add_fetch(&ThreadCount, 1, __ATOMIC_RELAXED);
+    }
+    return ThreadNumber;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,284 @@
+/* uring.c: SimpleFS io_uring submission queue
+ *
+ * A minimal io_uring wrapper built directly on the io_uring_setup and
+ * io_uring_enter system calls.  Requests are placed on the shared submission
+ * ring without blocking, handed to the kernel in batches by uring_submit,
+ * and their completions are reaped in batches.  At most entries requests are
+ * ever queued or in flight, which keeps the completion ring from overflowing.
+ **/
+
+#include "sfs/uring.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+
+/* Internal Prototypes */
+
+void uring_reap(Uring* ring);
+
+#ifdef HAVE_IO_URING
+
+/* External Functions */
+
+/**
+ * Create an io_uring with the specified queue depth by doing the following:
+ *
+ *  1. Set up the ring with io_uring_setup.
+ *
+ *  2. Map the submission ring, completion ring, and submission entries.
+ *
+ *  3. Record pointers to the ring heads, tails, masks, and arrays.
+ *
+ * @param       entries     Queue depth (rounded up to a power of two by the
+ *                          kernel).
+ *
+ * @return      Pointer to newly allocated Uring structure (NULL on failure).
+ **/
+Uring* uring_create(unsigned entries) {
+    Uring* ring = calloc(1, sizeof(Uring));
+    if (!ring) {
+        fprintf(stderr, "uring_create: calloc returned NULL\n");
+        return NULL;
+    }
+
+    struct io_uring_params params = {0};
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        fprintf(stderr, "uring_create: io_uring_setup failed %s\n", strerror(errno));
+        free(ring);
+        return NULL;
+    }
+
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Newer kernels map both rings with a single mmap
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        goto uring_create_failure;
+    }
+
+    if (single) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            goto uring_create_failure;
+        }
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto uring_create_failure;
+    }
+
+    char* sq = ring->sq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+
+    char* cq = ring->cq_ring;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return ring;
+
+uring_create_failure:
+    fprintf(stderr, "uring_create: mmap failed %s\n", strerror(errno));
+    uring_delete(ring);
+    return NULL;
+}
+
+/**
+ * Wait for any requests in flight, then unmap and close the io_uring.
+ *
+ * @param       ring        Pointer to Uring structure.
+ **/
+void uring_delete(Uring* ring) {
+    if (!ring) return;
+
+    if (ring->sqes) {
+        uring_drain(ring);
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+    free(ring);
+}
+
+/**
+ * Place a read or write request on the submission ring without submitting
+ * it.  If the queue is full, submit what is queued and reap at least one
+ * completion to make room.
+ *
+ * Note: The data buffer must remain valid until the request completes, and
+ * queued requests may complete in any order.
+ *
+ * @param       ring        Pointer to Uring structure.
+ * @param       fd          File descriptor to transfer to or from.
+ * @param       write       Whether to write (true) or read (false).
+ * @param       data        Data buffer.
+ * @param       length      Number of bytes to transfer.
+ * @param       offset      Byte offset in file.
+ *
+ * @return      Whether or not the request was queued.
+ **/
+bool uring_queue(Uring* ring, int fd, bool write, char* data, size_t length, off_t offset) {
+    while (ring->pending + ring->inflight >= ring->entries) {
+        if (!uring_submit(ring, 1)) {
+            return false;
+        }
+    }
+
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)data;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = length;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    return true;
+}
+
+/**
+ * Hand every queued request to the kernel with one io_uring_enter, waiting
+ * for at least the specified number of completions, then reap whatever has
+ * completed.
+ *
+ * @param       ring        Pointer to Uring structure.
+ * @param       wait        Minimum number of completions to wait for.
+ *
+ * @return      Whether or not io_uring_enter succeeded.
+ **/
+bool uring_submit(Uring* ring, unsigned wait) {
+    unsigned outstanding = ring->pending + ring->inflight;
+    unsigned min_complete = wait < outstanding ? wait : outstanding;
+    if (ring->pending == 0 && min_complete == 0) {
+        uring_reap(ring);
+        return true;
+    }
+
+    int submitted;
+    do {
+        submitted = syscall(__NR_io_uring_enter, ring->fd, ring->pending, min_complete,
+                            min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (submitted < 0 && errno == EINTR);
+
+    if (submitted < 0) {
+        fprintf(stderr, "uring_submit: io_uring_enter failed %s\n", strerror(errno));
+        return false;
+    }
+
+    ring->submits++;
+    ring->pending -= submitted;
+    ring->inflight += submitted;
+    uring_reap(ring);
+    return true;
+}
+
+#else
+
+Uring* uring_create(unsigned entries) {
+    fprintf(stderr, "uring_create: io_uring is not available on this system\n");
+    return NULL;
+}
+
+void uring_delete(Uring* ring) {
+    free(ring);
+}
+
+bool uring_queue(Uring* ring, int fd, bool write, char* data, size_t length, off_t offset) {
+    return false;
+}
+
+bool uring_submit(Uring* ring, unsigned wait) {
+    return false;
+}
+
+#endif
+
+/**
+ * Submit every queued request and wait for every request in flight.
+ *
+ * @param       ring        Pointer to Uring structure.
+ *
+ * @return      Whether or not every request since the last drain completed
+ *              in full.
+ **/
+bool uring_drain(Uring* ring) {
+    while (ring->pending || ring->inflight) {
+        if (!uring_submit(ring, ring->pending + ring->inflight)) {
+            return false;
+        }
+    }
+
+    bool success = ring->failures == 0;
+    ring->failures = 0;
+    return success;
+}
+
+/* Internal Functions */
+
+/**
+ * Consume every available completion, counting requests that failed or
+ * transferred fewer bytes than requested.
+ *
+ * @param       ring        Pointer to Uring structure.
+ **/
+void uring_reap(Uring* ring) {
+#ifdef HAVE_IO_URING
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+        if (cqe->res < 0 || (uint64_t)cqe->res != cqe->user_data) {
+            ring->failures++;
+        }
+        head++;
+        ring->inflight--;
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+#endif
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,213 @@
+/* unit_bitmap.c: Unit tests for SimpleFS packed bitmap */
+
+#include "sfs/bitmap.h"
+#include "sfs/logging.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+/* Constants */
+
+#define BITMAP_BITS (200)
+
+/* Functions */
+
+int test_00_bitmap_create() {
+    debug("Check set bitmap");
+    Bitmap *bitmap = bitmap_create(BITMAP_BITS, true);
+    assert(bitmap);
+    assert(bitmap->bits   == BITMAP_BITS);
+    assert(bitmap->nwords == 4);
+    assert(bitmap->count  == BITMAP_BITS);
+    for (size_t b = 0; b < BITMAP_BITS; b++) {
+        assert(bitmap_test(bitmap, b));
+    }
+    assert(bitmap_test(bitmap, BITMAP_BITS) == false);
+    assert(bitmap_recount(bitmap) == BITMAP_BITS);
+    bitmap_delete(bitmap);
+
+    debug("Check clear bitmap");
+    bitmap = bitmap_create(BITMAP_BITS, false);
+    assert(bitmap);
+    assert(bitmap->count == 0);
+    assert(bitmap_find(bitmap, 0) < 0);
+    assert(bitmap_recount(bitmap) == 0);
+    bitmap_delete(bitmap);
+
+    return EXIT_SUCCESS;
+}
+
+int test_01_bitmap_set_clear() {
+    Bitmap *bitmap = bitmap_create(BITMAP_BITS, false);
+    assert(bitmap);
+
+    debug("Check set");
+    bitmap_set(bitmap, 0);
+    bitmap_set(bitmap, 63);
+    bitmap_set(bitmap, 64);
+    bitmap_set(bitmap, 64);
+    bitmap_set(bitmap, BITMAP_BITS - 1);
+    bitmap_set(bitmap, BITMAP_BITS);
+    assert(bitmap->count == 4);
+    assert(bitmap_test(bitmap, 63));
+    assert(bitmap_test(bitmap, 64));
+    assert(bitmap_test(bitmap, 65) == false);
+
+    debug("Check clear");
+    bitmap_clear(bitmap, 63);
+    bitmap_clear(bitmap, 63);
+    bitmap_clear(bitmap, 100);
+    assert(bitmap->count == 3);
+    assert(bitmap_test(bitmap, 63) == false);
+    assert(bitmap_recount(bitmap) == 3);
+
+    bitmap_delete(bitmap);
+    return EXIT_SUCCESS;
+}
+
+int test_02_bitmap_find() {
+    Bitmap *bitmap = bitmap_create(BITMAP_BITS, false);
+    assert(bitmap);
+
+    bitmap_set(bitmap, 5);
+    bitmap_set(bitmap, 130);
+
+    debug("Check find from start");
+    assert(bitmap_find(bitmap, 0) == 5);
+    assert(bitmap_find(bitmap, 5) == 5);
+
+    debug("Check find across words");
+    assert(bitmap_find(bitmap, 6) == 130);
+
+    debug("Check find wraps around");
+    assert(bitmap_find(bitmap, 131) == 5);
+    assert(bitmap_find(bitmap, BITMAP_BITS) == 5);
+
+    bitmap_delete(bitmap);
+    return EXIT_SUCCESS;
+}
+
+int test_03_bitmap_allocate() {
+    Bitmap *bitmap = bitmap_create(BITMAP_BITS, true);
+    assert(bitmap);
+
+    debug("Check next-fit allocation");
+    bitmap->cursor = 10;
+    for (size_t b = 10; b < BITMAP_BITS; b++) {
+        assert(bitmap_allocate(bitmap) == b);
+    }
+
+    debug("Check allocation wraps around");
+    assert(bitmap_allocate(bitmap) == 0);
+
+    debug("Check freed bit is reused after wrap");
+    bitmap_set(bitmap, 150);
+    for (size_t b = 1; b < 10; b++) {
+        assert(bitmap_allocate(bitmap) == b);
+    }
+    assert(bitmap_allocate(bitmap) == 150);
+
+    debug("Check allocation when full");
+    assert(bitmap->count == 0);
+    assert(bitmap_allocate(bitmap) < 0);
+
+    bitmap_delete(bitmap);
+    return EXIT_SUCCESS;
+}
+
+int test_04_bitmap_range() {
+    Bitmap *bitmap = bitmap_create(BITMAP_BITS, true);
+    assert(bitmap);
+
+    debug("Check clear range across words");
+    bitmap_clear_range(bitmap, 60, 80);
+    assert(bitmap->count == BITMAP_BITS - 80);
+    assert(bitmap_test(bitmap, 59));
+    assert(bitmap_test(bitmap, 60) == false);
+    assert(bitmap_test(bitmap, 139) == false);
+    assert(bitmap_test(bitmap, 140));
+
+    debug("Check run length");
+    assert(bitmap_run_length(bitmap, 0)   == 60);
+    assert(bitmap_run_length(bitmap, 100) == 0);
+    assert(bitmap_run_length(bitmap, 140) == BITMAP_BITS - 140);
+
+    debug("Check find run");
+    assert(bitmap_find_run(bitmap, 0, 60)  == 0);
+    assert(bitmap_find_run(bitmap, 0, 61)  == -1);
+    assert(bitmap_find_run(bitmap, 10, 50) == 10);
+    assert(bitmap_find_run(bitmap, 10, 55) == 140);
+    assert(bitmap_find_run(bitmap, 150, 55) == 0);
+
+    debug("Check set range truncates at end");
+    bitmap_set_range(bitmap, 100, BITMAP_BITS);
+    assert(bitmap->count == BITMAP_BITS - 40);
+    assert(bitmap_recount(bitmap) == BITMAP_BITS - 40);
+
+    bitmap_delete(bitmap);
+    return EXIT_SUCCESS;
+}
+
+int test_05_bitmap_range_limits() {
+    debug("Check searches stay within a range");
+    Bitmap *bitmap = bitmap_create(BITMAP_BITS, true);
+    assert(bitmap);
+
+    bitmap_clear_range(bitmap, 0, 64);
+    bitmap_clear_range(bitmap, 100, 28);
+    assert(bitmap_find_in(bitmap, 0, 64)    == -1);
+    assert(bitmap_find_in(bitmap, 0, 128)   == 64);
+    assert(bitmap_find_in(bitmap, 70, 100)  == 70);
+    assert(bitmap_find_in(bitmap, 100, 128) == -1);
+    assert(bitmap_find_in(bitmap, 150, BITMAP_BITS * 2) == 150);
+
+    debug("Check runs are cut off at the end of a range");
+    assert(bitmap_run_length_in(bitmap, 64, 128)  == 36);
+    assert(bitmap_run_length_in(bitmap, 64, 80)   == 16);
+    assert(bitmap_run_length_in(bitmap, 128, 128) == 0);
+    assert(bitmap_run_length_in(bitmap, 0, 64)    == 0);
+
+    debug("Check find run does not wrap or cross a range");
+    assert(bitmap_find_run_in(bitmap, 0, 128, 36)  == 64);
+    assert(bitmap_find_run_in(bitmap, 0, 128, 37)  == -1);
+    assert(bitmap_find_run_in(bitmap, 70, 128, 30) == 70);
+    assert(bitmap_find_run_in(bitmap, 70, 128, 31) == -1);
+    assert(bitmap_find_run_in(bitmap, 0, BITMAP_BITS, 40) == 128);
+    assert(bitmap_find_run_in(bitmap, 0, 64, 0) == -1);
+
+    bitmap_delete(bitmap);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test bitmap_create\n");
+        fprintf(stderr, "    1. Test bitmap_set/bitmap_clear\n");
+        fprintf(stderr, "    2. Test bitmap_find\n");
+        fprintf(stderr, "    3. Test bitmap_allocate\n");
+        fprintf(stderr, "    4. Test bitmap ranges and runs\n");
+        fprintf(stderr, "    5. Test bitmap searches within a range\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_bitmap_create(); break;
+        case 1:  status = test_01_bitmap_set_clear(); break;
+        case 2:  status = test_02_bitmap_find(); break;
+        case 3:  status = test_03_bitmap_allocate(); break;
+        case 4:  status = test_04_bitmap_range(); break;
+        case 5:  status = test_05_bitmap_range_limits(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
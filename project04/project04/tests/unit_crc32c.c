@@ -0,0 +1,98 @@
+/* unit_crc32c.c: Unit tests for SimpleFS CRC32C checksums */
+
+#include "sfs/crc32c.h"
+#include "sfs/logging.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Constants */
+
+#define DATA_SIZE (4096 + 64)
+
+/* Functions */
+
+int test_00_crc32c_vectors() {
+    debug("Check the standard check value");
+    assert(crc32c(0, "123456789", 9) == 0xe3069283);
+    assert(crc32c_software(0, "123456789", 9) == 0xe3069283);
+
+    debug("Check empty input leaves the checksum alone");
+    assert(crc32c(0, "", 0) == 0);
+    assert(crc32c(0x12345678, "", 0) == 0x12345678);
+
+    debug("Check 32 bytes of zeros (RFC 3720)");
+    char zeros[32] = {0};
+    assert(crc32c(0, zeros, sizeof(zeros)) == 0x8a9136aa);
+
+    return EXIT_SUCCESS;
+}
+
+int test_01_crc32c_software() {
+    static char data[DATA_SIZE];
+    unsigned seed = 1;
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = rand_r(&seed);
+    }
+
+    debug("Check %s checksums match the tables for every alignment and length",
+          crc32c_hardware() ? "hardware" : "software");
+    for (size_t offset = 0; offset < 16; offset++) {
+        for (size_t length = 0; length < 64; length++) {
+            assert(crc32c(0, data + offset, length) == crc32c_software(0, data + offset, length));
+        }
+        size_t length = sizeof(data) - 16;
+        assert(crc32c(0, data + offset, length) == crc32c_software(0, data + offset, length));
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int test_02_crc32c_chaining() {
+    static char data[DATA_SIZE];
+    unsigned seed = 2;
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = rand_r(&seed);
+    }
+
+    debug("Check a checksum continued piece by piece matches one pass");
+    uint32_t whole = crc32c(0, data, sizeof(data));
+    for (size_t split = 0; split <= sizeof(data); split += 97) {
+        assert(crc32c(crc32c(0, data, split), data + split, sizeof(data) - split) == whole);
+        assert(crc32c_software(crc32c(0, data, split), data + split, sizeof(data) - split) == whole);
+    }
+
+    debug("Check a single changed bit changes the checksum");
+    data[1000] ^= 0x10;
+    assert(crc32c(0, data, sizeof(data)) != whole);
+
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test crc32c check values\n");
+        fprintf(stderr, "    1. Test crc32c against crc32c_software\n");
+        fprintf(stderr, "    2. Test crc32c chaining\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_crc32c_vectors(); break;
+        case 1:  status = test_01_crc32c_software(); break;
+        case 2:  status = test_02_crc32c_chaining(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
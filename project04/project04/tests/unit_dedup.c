@@ -0,0 +1,103 @@
+/* unit_dedup.c: Unit tests for SimpleFS block deduplication index */
+
+#include "sfs/dedup.h"
+#include "sfs/logging.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Constants */
+
+#define BLOCKS (10000)
+
+/* Functions */
+
+int test_00_dedup_index() {
+    DedupIndex *index = dedup_create(0);
+    assert(index);
+    assert(index->capacity == DEDUP_INDEX_MIN);
+
+    debug("Check lookups find what was inserted");
+    assert(dedup_lookup(index, 1234) == 0);
+    assert(dedup_insert(index, 1234, 7));
+    assert(dedup_insert(index, 5678, 8));
+    assert(dedup_lookup(index, 1234) == 7);
+    assert(dedup_lookup(index, 5678) == 8);
+    assert(dedup_lookup(index, 9999) == 0);
+    assert(index->count == 2);
+
+    debug("Check block 0 is never inserted");
+    assert(dedup_insert(index, 1, 0) == false);
+
+    debug("Check blocks sharing a hash are all kept");
+    assert(dedup_insert(index, 1234, 9));
+    assert(dedup_remove(index, 1234, 7));
+    assert(dedup_lookup(index, 1234) == 9);
+    assert(dedup_remove(index, 1234, 7) == false);
+    assert(dedup_remove(index, 1234, 9));
+    assert(dedup_lookup(index, 1234) == 0);
+    assert(index->count == 1);
+
+    debug("Check clear empties the index");
+    dedup_clear(index);
+    assert(index->count == 0);
+    assert(dedup_lookup(index, 5678) == 0);
+
+    dedup_delete(index);
+    return EXIT_SUCCESS;
+}
+
+int test_01_dedup_growth() {
+    DedupIndex *index = dedup_create(16);
+    assert(index);
+
+    debug("Check the index grows as it fills");
+    for (uint32_t block = 1; block <= BLOCKS; block++) {
+        assert(dedup_insert(index, block % 997, block));
+    }
+    assert(index->count == BLOCKS);
+    assert(index->capacity >= 2 * BLOCKS);
+
+    debug("Check removals keep every probe run intact");
+    for (uint32_t block = 1; block <= BLOCKS; block += 2) {
+        assert(dedup_remove(index, block % 997, block));
+    }
+    assert(index->count == BLOCKS / 2);
+    for (uint32_t block = 2; block <= BLOCKS; block += 2) {
+        assert(dedup_lookup(index, block % 997) != 0);
+        assert(dedup_remove(index, block % 997, block));
+    }
+    assert(index->count == 0);
+    for (size_t slot = 0; slot < index->capacity; slot++) {
+        assert(index->entries[slot].block == 0);
+    }
+
+    dedup_delete(index);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test dedup index\n");
+        fprintf(stderr, "    1. Test dedup index growth\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_dedup_index(); break;
+        case 1:  status = test_01_dedup_growth(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,295 @@
+/* unit_dir.c: Unit tests for SimpleFS directories */
+
+#include "sfs/dir.h"
+#include "sfs/logging.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/* Constants */
+
+#define DISK_PATH   "data/image.unit"
+#define DISK_BLOCKS (2000)
+
+/* Functions */
+
+void test_cleanup() {
+    unlink(DISK_PATH);
+}
+
+Disk *test_disk(FileSystem *fs) {
+    assert(system("truncate -s 0 " DISK_PATH) == EXIT_SUCCESS);
+
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+    assert(fs_format(fs, disk));
+    assert(fs_mount(fs, disk));
+    return disk;
+}
+
+int test_00_dir_open() {
+    FileSystem fs = {0};
+    Disk *disk = test_disk(&fs);
+
+    debug("Check opening creates and records the root directory");
+    assert(fs_root(&fs) < 0);
+    DirTree *tree = dir_open(&fs);
+    assert(tree);
+    assert(fs_root(&fs) == tree->root);
+
+    EntryType type = ENTRY_FILE;
+    assert(dir_lookup(tree, "/", &type) == tree->root);
+    assert(type == ENTRY_DIRECTORY);
+    assert(dir_lookup(tree, "", NULL) == tree->root);
+    assert(dir_lookup(tree, "/..", NULL) == tree->root);
+
+    DirEntry *entries = NULL;
+    assert(dir_list(tree, "/", &entries) == 0);
+    free(entries);
+
+    debug("Check the root directory survives remounting");
+    size_t root = tree->root;
+    assert(dir_mkdir(tree, "/keep") >= 0);
+    dir_close(tree);
+    fs_unmount(&fs);
+
+    assert(fs_mount(&fs, disk));
+    assert(fs_root(&fs) == (ssize_t)root);
+    tree = dir_open(&fs);
+    assert(tree);
+    assert(tree->root == root);
+    assert(dir_lookup(tree, "/keep", &type) >= 0);
+    assert(type == ENTRY_DIRECTORY);
+
+    debug("Check opening fails if the root is not a directory");
+    dir_close(tree);
+    assert(fs_write(&fs, root, (char[BLOCK_SIZE]){0}, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(dir_open(&fs) == NULL);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_01_dir_paths() {
+    FileSystem fs = {0};
+    Disk *disk = test_disk(&fs);
+    DirTree *tree = dir_open(&fs);
+    assert(tree);
+
+    debug("Check creating nested files and directories");
+    ssize_t a = dir_mkdir(tree, "/a");
+    ssize_t b = dir_mkdir(tree, "/a/b");
+    ssize_t f = dir_create(tree, "/a/b/file");
+    assert(a >= 0 && b >= 0 && f >= 0);
+    assert(a != b && b != f);
+
+    EntryType type = ENTRY_DIRECTORY;
+    assert(dir_lookup(tree, "/a/b/file", &type) == f);
+    assert(type == ENTRY_FILE);
+    assert(dir_lookup(tree, "a//b/./file", NULL) == f);
+    assert(dir_lookup(tree, "/a/b/../b/file", NULL) == f);
+    assert(dir_lookup(tree, "/a/b/", NULL) == b);
+    assert(dir_lookup(tree, "/a/b/..", NULL) == a);
+
+    debug("Check missing paths and files used as directories");
+    assert(dir_lookup(tree, "/a/c", NULL) < 0);
+    assert(dir_lookup(tree, "/a/b/file/x", NULL) < 0);
+    assert(dir_create(tree, "/a/c/file") < 0);
+    assert(dir_create(tree, "/a/b/file/x") < 0);
+
+    debug("Check invalid and duplicate names");
+    char name[DIR_NAME_MAX + 3] = "/";
+    memset(name + 1, 'n', DIR_NAME_MAX + 1);
+    assert(dir_create(tree, name) < 0);
+    name[DIR_NAME_MAX + 1] = 0;
+    assert(dir_create(tree, name) >= 0);
+    assert(dir_create(tree, "/a/.") < 0);
+    assert(dir_create(tree, "/a/..") < 0);
+    assert(dir_create(tree, "/") < 0);
+    assert(dir_create(tree, "/a/b") < 0);
+    assert(dir_mkdir(tree, "/a/b/file") < 0);
+
+    debug("Check listing a directory");
+    DirEntry *entries = NULL;
+    assert(dir_list(tree, "/a", &entries) == 1);
+    assert(entries[0].inode_number == b);
+    assert(entries[0].type == ENTRY_DIRECTORY);
+    assert(entries[0].length == 1 && entries[0].name[0] == 'b');
+    free(entries);
+    assert(dir_list(tree, "/a/b/file", &entries) < 0);
+
+    dir_close(tree);
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_02_dir_unlink() {
+    FileSystem fs = {0};
+    Disk *disk = test_disk(&fs);
+    DirTree *tree = dir_open(&fs);
+    assert(tree);
+
+    ssize_t a = dir_mkdir(tree, "/a");
+    ssize_t f = dir_create(tree, "/a/file");
+    assert(a >= 0 && f >= 0);
+    assert(fs_write(&fs, f, (char[BLOCK_SIZE]){1}, BLOCK_SIZE, 0) == BLOCK_SIZE);
+
+    debug("Check a directory must be empty to be removed");
+    assert(dir_unlink(tree, "/a") == false);
+    assert(dir_lookup(tree, "/a", NULL) == a);
+
+    debug("Check removing a file removes its name and Inode");
+    assert(dir_unlink(tree, "/a/file"));
+    assert(dir_lookup(tree, "/a/file", NULL) < 0);
+    assert(fs_stat(&fs, f) < 0);
+    assert(dir_unlink(tree, "/a/file") == false);
+
+    debug("Check removing an empty directory");
+    assert(dir_unlink(tree, "/a"));
+    assert(dir_lookup(tree, "/a", NULL) < 0);
+    assert(fs_stat(&fs, a) < 0);
+    assert(dir_unlink(tree, "/") == false);
+
+    DirEntry *entries = NULL;
+    assert(dir_list(tree, "/", &entries) == 0);
+    free(entries);
+
+    dir_close(tree);
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_03_dir_grow() {
+    FileSystem fs = {0};
+    Disk *disk = test_disk(&fs);
+    DirTree *tree = dir_open(&fs);
+    assert(tree);
+    assert(dir_mkdir(tree, "/big") >= 0);
+
+    debug("Check a directory grows past many buckets");
+    const size_t count = 5000;
+    char path[BUFSIZ];
+    ssize_t *inodes = calloc(count, sizeof(ssize_t));
+    assert(inodes);
+    for (size_t i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "/big/file-%lu", i);
+        inodes[i] = dir_create(tree, path);
+        assert(inodes[i] >= 0);
+    }
+
+    DirEntry *entries = NULL;
+    assert(dir_list(tree, "/big", &entries) == (ssize_t)count);
+    free(entries);
+
+    debug("Check every name is found after remounting");
+    dir_close(tree);
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    tree = dir_open(&fs);
+    assert(tree);
+    for (size_t i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "/big/file-%lu", i);
+        assert(dir_lookup(tree, path, NULL) == inodes[i]);
+    }
+
+    debug("Check a lookup in a large directory reads the header, one pointer block, and one bucket");
+    memset(tree->dentries, 0, DCACHE_ENTRIES * sizeof(Dentry));
+    assert(dir_lookup(tree, "/big", NULL) >= 0);
+    size_t reads = disk->reads;
+    assert(dir_lookup(tree, "/big/file-4321", NULL) == inodes[4321]);
+    assert(disk->reads - reads <= 3);
+
+    debug("Check removing half the names");
+    for (size_t i = 0; i < count; i += 2) {
+        snprintf(path, sizeof(path), "/big/file-%lu", i);
+        assert(dir_unlink(tree, path));
+    }
+    for (size_t i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "/big/file-%lu", i);
+        assert(dir_lookup(tree, path, NULL) == (i % 2 ? inodes[i] : -1));
+    }
+
+    free(inodes);
+    dir_close(tree);
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_04_dcache() {
+    FileSystem fs = {0};
+    Disk *disk = test_disk(&fs);
+    DirTree *tree = dir_open(&fs);
+    assert(tree);
+
+    assert(dir_mkdir(tree, "/a") >= 0);
+    assert(dir_mkdir(tree, "/a/b") >= 0);
+    ssize_t f = dir_create(tree, "/a/b/file");
+    assert(f >= 0);
+
+    debug("Check resolving a cached path reads nothing");
+    size_t hits = tree->hits;
+    size_t reads = disk->reads;
+    assert(dir_lookup(tree, "/a/b/file", NULL) == f);
+    assert(tree->hits == hits + 3);
+    assert(disk->reads == reads);
+
+    debug("Check a removed name leaves the cache");
+    assert(dir_unlink(tree, "/a/b/file"));
+    size_t misses = tree->misses;
+    assert(dir_lookup(tree, "/a/b/file", NULL) < 0);
+    assert(tree->misses == misses + 1);
+
+    debug("Check a fresh tree fills its cache from disk");
+    dir_close(tree);
+    tree = dir_open(&fs);
+    assert(tree);
+    assert(dir_lookup(tree, "/a/b", NULL) >= 0);
+    assert(tree->misses == 2 && tree->hits == 0);
+    assert(dir_lookup(tree, "/a/b", NULL) >= 0);
+    assert(tree->misses == 2 && tree->hits == 2);
+
+    dir_close(tree);
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test dir_open\n");
+        fprintf(stderr, "    1. Test dir_lookup/dir_create/dir_mkdir\n");
+        fprintf(stderr, "    2. Test dir_unlink\n");
+        fprintf(stderr, "    3. Test dir_grow\n");
+        fprintf(stderr, "    4. Test dentry cache\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    assert(atexit(test_cleanup) == EXIT_SUCCESS);
+
+    switch (number) {
+        case 0:  status = test_00_dir_open(); break;
+        case 1:  status = test_01_dir_paths(); break;
+        case 2:  status = test_02_dir_unlink(); break;
+        case 3:  status = test_03_dir_grow(); break;
+        case 4:  status = test_04_dcache(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
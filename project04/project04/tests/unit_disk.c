@@ -106,6 +106,299 @@ int test_02_disk_write() {
     return EXIT_SUCCESS;
 }
 
+int test_03_disk_cache() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    debug("Check enabling cache");
+    assert(disk_cache(disk, DISK_BLOCKS - 1));
+    assert(disk->cache);
+
+    char data[BLOCK_SIZE] = {0};
+    for (size_t b = 0; b < DISK_BLOCKS - 1; b++) {
+        debug("Check cached write block %lu", b);
+        memset(data, b, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+        assert(disk->writes == 0);
+    }
+
+    for (size_t b = 0; b < DISK_BLOCKS - 1; b++) {
+        debug("Check cached read block %lu", b);
+        memset(data, 0, BLOCK_SIZE);
+        assert(disk_read(disk, b, data) == BLOCK_SIZE);
+        for (size_t i = 0; i < BLOCK_SIZE; i++) {
+            assert(data[i] == b);
+        }
+        assert(disk->hits  == b + 1);
+        assert(disk->reads == 0);
+    }
+
+    debug("Check eviction writes back dirty block");
+    assert(disk_read(disk, DISK_BLOCKS - 1, data) == BLOCK_SIZE);
+    assert(disk->misses    == 1);
+    assert(disk->reads     == 1);
+    assert(disk->evictions == 1);
+    assert(disk->writes    == 1);
+
+    debug("Check flush writes back remaining dirty blocks");
+    assert(disk_flush(disk));
+    assert(disk->writes == DISK_BLOCKS - 1);
+    assert(disk_flush(disk));
+    assert(disk->writes == DISK_BLOCKS - 1);
+
+    debug("Check disabling cache");
+    assert(disk_cache(disk, 0));
+    assert(disk->cache == NULL);
+    for (size_t b = 0; b < DISK_BLOCKS - 1; b++) {
+        assert(disk_read(disk, b, data) == BLOCK_SIZE);
+        for (size_t i = 0; i < BLOCK_SIZE; i++) {
+            assert(data[i] == b);
+        }
+    }
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_04_disk_vectored() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    char data[DISK_BLOCKS][BLOCK_SIZE];
+    char *buffers[DISK_BLOCKS];
+    size_t blocks[DISK_BLOCKS] = {0, 1, 3, 2};
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(data[b], blocks[b] + 1, BLOCK_SIZE);
+        buffers[b] = data[b];
+    }
+
+    debug("Check bad disk");
+    assert(disk_writev(NULL, blocks, buffers, DISK_BLOCKS) == DISK_FAILURE);
+    assert(disk_readv(NULL, blocks, buffers, DISK_BLOCKS) == DISK_FAILURE);
+
+    debug("Check bad block");
+    size_t bad_blocks[2] = {0, DISK_BLOCKS};
+    assert(disk_writev(disk, bad_blocks, buffers, 2) == DISK_FAILURE);
+    assert(disk_readv(disk, bad_blocks, buffers, 2) == DISK_FAILURE);
+    assert(disk->writes == 0);
+
+    debug("Check vectored write");
+    assert(disk_writev(disk, blocks, buffers, DISK_BLOCKS) == DISK_BLOCKS*BLOCK_SIZE);
+    assert(disk->writes == DISK_BLOCKS);
+
+    debug("Check vectored read");
+    memset(data, 0, sizeof(data));
+    size_t reversed[DISK_BLOCKS] = {3, 2, 1, 0};
+    assert(disk_readv(disk, reversed, buffers, DISK_BLOCKS) == DISK_BLOCKS*BLOCK_SIZE);
+    assert(disk->reads == DISK_BLOCKS);
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        for (size_t i = 0; i < BLOCK_SIZE; i++) {
+            assert(data[b][i] == reversed[b] + 1);
+        }
+    }
+
+    debug("Check vectored read served from cache");
+    assert(disk_cache(disk, DISK_BLOCKS));
+    memset(data[0], 42, BLOCK_SIZE);
+    assert(disk_write(disk, 1, data[0]) == BLOCK_SIZE);
+    memset(data, 0, sizeof(data));
+    assert(disk_readv(disk, blocks, buffers, DISK_BLOCKS) == DISK_BLOCKS*BLOCK_SIZE);
+    assert(disk->hits   == 1);
+    assert(disk->misses == DISK_BLOCKS - 1);
+    assert(data[0][0] == 1);
+    assert(data[1][0] == 42);
+    assert(data[2][0] == 4);
+    assert(data[3][0] == 3);
+
+    debug("Check vectored write refreshes cache");
+    memset(data[1], 7, BLOCK_SIZE);
+    assert(disk_writev(disk, blocks, buffers, 2) == 2*BLOCK_SIZE);
+    assert(disk_read(disk, 1, data[0]) == BLOCK_SIZE);
+    assert(data[0][0] == 7);
+    assert(disk->hits == 2);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_05_disk_map() {
+    debug("Check map on pread backend");
+    Disk *disk = disk_open_backend(DISK_PATH, DISK_BLOCKS, DISK_PREAD);
+    assert(disk);
+    assert(disk->map == NULL);
+    assert(disk_map(disk, 0, 1) == NULL);
+    disk_close(disk);
+
+    disk = disk_open_backend(DISK_PATH, DISK_BLOCKS, DISK_MMAP);
+    assert(disk);
+    assert(disk->map);
+    assert(disk->backend == DISK_MMAP);
+
+    char data[BLOCK_SIZE] = {0};
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(data, b + 1, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+    }
+
+    debug("Check bad range");
+    assert(disk_map(disk, DISK_BLOCKS, 1) == NULL);
+    assert(disk_map(disk, 1, DISK_BLOCKS) == NULL);
+    assert(disk_map(disk, 1, 0) == NULL);
+
+    debug("Check mapped run");
+    const char *mapped = disk_map(disk, 1, DISK_BLOCKS - 1);
+    assert(mapped);
+    for (size_t b = 1; b < DISK_BLOCKS; b++) {
+        assert(mapped[(b - 1) * BLOCK_SIZE] == b + 1);
+    }
+
+    debug("Check map writes back dirty cached block");
+    assert(disk_cache(disk, DISK_BLOCKS));
+    memset(data, 42, BLOCK_SIZE);
+    assert(disk_write(disk, 2, data) == BLOCK_SIZE);
+    assert(mapped[BLOCK_SIZE] == 3);
+    assert(disk_map(disk, 1, 2) == mapped);
+    assert(mapped[BLOCK_SIZE] == 42);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_06_disk_queue() {
+    debug("Check queue on pread backend");
+    Disk *disk = disk_open_backend(DISK_PATH, DISK_BLOCKS, DISK_PREAD);
+    assert(disk);
+    assert(disk_queue_depth(disk, 8) == false);
+
+    char data[DISK_BLOCKS][BLOCK_SIZE];
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(data[b], b + 1, BLOCK_SIZE);
+        assert(disk_queue_write(disk, b, data[b]));
+    }
+    assert(disk_drain(disk));
+    assert(disk->writes == DISK_BLOCKS);
+    disk_close(disk);
+
+    debug("Check queue on uring backend");
+    disk = disk_open_backend(DISK_PATH, DISK_BLOCKS, DISK_URING);
+    assert(disk);
+    assert(disk->ring || disk->backend == DISK_PREAD);
+    assert(disk_queue_read(disk, DISK_BLOCKS, data[0]) == false);
+
+    char copy[DISK_BLOCKS][BLOCK_SIZE];
+    for (unsigned depth = 1; depth <= 8; depth *= 2) {
+        assert(!disk->ring || disk_queue_depth(disk, depth));
+        memset(copy, 0, sizeof(copy));
+        for (size_t b = 0; b < DISK_BLOCKS; b++) {
+            assert(disk_queue_read(disk, b, copy[b]));
+        }
+        assert(disk_drain(disk));
+        assert(memcmp(data, copy, sizeof(data)) == 0);
+    }
+    assert(disk->reads == 4 * DISK_BLOCKS);
+
+    debug("Check queued writes");
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(data[b], 42 + b, BLOCK_SIZE);
+        assert(disk_queue_write(disk, b, data[b]));
+    }
+    assert(disk_drain(disk));
+    assert(disk->writes == DISK_BLOCKS);
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        assert(disk_read(disk, b, copy[b]) == BLOCK_SIZE);
+        assert(copy[b][BLOCK_SIZE - 1] == 42 + b);
+    }
+
+    debug("Check queued reads with cache");
+    assert(disk_cache(disk, 2));
+    assert(disk_read(disk, 1, copy[1]) == BLOCK_SIZE);
+    memset(copy, 0, sizeof(copy));
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        assert(disk_queue_read(disk, b, copy[b]));
+    }
+    assert(disk_drain(disk));
+    assert(memcmp(data, copy, sizeof(data)) == 0);
+    assert(disk->hits == 1);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_07_disk_model() {
+    debug("Check device names");
+    DiskModel model;
+    for (DiskDevice d = 0; d < DISK_DEVICES; d++) {
+        assert(disk_model_parse(disk_device_name(d), &model));
+        assert(model.device == d);
+    }
+    assert(disk_model_parse("floppy", &model) == false);
+
+    Disk *disk = disk_open_backend(DISK_PATH, DISK_BLOCKS, DISK_PREAD);
+    assert(disk);
+    assert(disk_model(NULL, &model) == false);
+    model = (DiskModel){.device = DISK_SSD, .bandwidth = 1000000000};
+    assert(disk_model(disk, &model) == false);
+
+    debug("Check hdd seeks only when a request does not follow the last");
+    char data[DISK_BLOCKS][BLOCK_SIZE] = {{0}};
+    const uint64_t transfer = 1000000;
+    model = (DiskModel){.device = DISK_HDD, .seek_ns = 100, .track_ns = 100, .rotation_ns = 2000,
+                        .bandwidth = BLOCK_SIZE * (1000000000 / transfer)};
+    assert(disk_model(disk, &model));
+    assert(disk_read(disk, 0, data[0]) == BLOCK_SIZE);
+    assert(disk_read(disk, 1, data[1]) == BLOCK_SIZE);
+    assert(disk->modeled_ns == 2 * transfer);
+    assert(disk_write(disk, 3, data[3]) == BLOCK_SIZE);
+    assert(disk->modeled_ns == 3 * transfer + 100 + 1000);
+
+    debug("Check hdd seeks take longer the further they go");
+    model.seek_ns = 10100;
+    assert(disk_model(disk, &model));
+    disk->modeled_ns = 0;
+    assert(disk_read(disk, 1, data[1]) == BLOCK_SIZE);
+    assert(disk->modeled_ns == transfer + 100 + 5000 + 1000);
+
+    debug("Check ssd pays its latency once per request");
+    model = (DiskModel){.device = DISK_SSD, .latency_ns = 1000, .queue_depth = 32,
+                        .bandwidth = BLOCK_SIZE * (1000000000 / transfer)};
+    assert(disk_model(disk, &model));
+    disk->modeled_ns = 0;
+    assert(disk_read(disk, 2, data[2]) == BLOCK_SIZE);
+    assert(disk->modeled_ns == transfer + 1000);
+
+    size_t blocks[DISK_BLOCKS] = {0, 1, 2, 3};
+    char *buffers[DISK_BLOCKS] = {data[0], data[1], data[2], data[3]};
+    disk->modeled_ns = 0;
+    assert(disk_readv(disk, blocks, buffers, DISK_BLOCKS) == DISK_BLOCKS*BLOCK_SIZE);
+    assert(disk->modeled_ns == DISK_BLOCKS * transfer + 1000);
+
+    debug("Check nothing is charged once the model is removed");
+    assert(disk_model(disk, NULL));
+    assert(disk->model.device == DISK_IDEAL);
+    disk->modeled_ns = 0;
+    assert(disk_read(disk, 3, data[3]) == BLOCK_SIZE);
+    assert(disk->modeled_ns == 0);
+    disk_close(disk);
+
+    debug("Check queued ssd requests overlap up to the queue depth");
+    disk = disk_open_backend(DISK_PATH, DISK_BLOCKS, DISK_URING);
+    assert(disk);
+    if (disk->ring) {
+        assert(disk_model(disk, &model));
+        for (unsigned depth = 1; depth <= 2; depth++) {
+            assert(disk_queue_depth(disk, depth));
+            disk->modeled_ns = 0;
+            for (size_t b = 0; b < DISK_BLOCKS; b++) {
+                assert(disk_queue_read(disk, b, data[b]));
+            }
+            assert(disk_drain(disk));
+            assert(disk->modeled_ns == DISK_BLOCKS * transfer + DISK_BLOCKS / depth * 1000);
+        }
+    }
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
 /* Main execution */
 
 int main(int argc, char *argv[]) {
@@ -115,6 +408,11 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "    0. Test disk_open\n");
         fprintf(stderr, "    1. Test disk_read\n");
         fprintf(stderr, "    2. Test disk_write\n");
+        fprintf(stderr, "    3. Test disk_cache\n");
+        fprintf(stderr, "    4. Test disk_readv/disk_writev\n");
+        fprintf(stderr, "    5. Test disk_map\n");
+        fprintf(stderr, "    6. Test disk_queue_read/disk_queue_write\n");
+        fprintf(stderr, "    7. Test disk_model\n");
         return EXIT_FAILURE;
     }
 
@@ -127,6 +425,11 @@ int main(int argc, char *argv[]) {
         case 0:  status = test_00_disk_open(); break;
         case 1:  status = test_01_disk_read(); break;
         case 2:  status = test_02_disk_write(); break;
+        case 3:  status = test_03_disk_cache(); break;
+        case 4:  status = test_04_disk_vectored(); break;
+        case 5:  status = test_05_disk_map(); break;
+        case 6:  status = test_06_disk_queue(); break;
+        case 7:  status = test_07_disk_model(); break;
         default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }
 
@@ -1,7 +1,10 @@
 /* unit_fs.c: Unit tests for SimpleFS file system */
 
+#include "sfs/crc32c.h"
 #include "sfs/fs.h"
+#include "sfs/journal.h"
 #include "sfs/logging.h"
+#include "sfs/utils.h"
 
 #include <assert.h>
 #include <limits.h>
@@ -15,6 +18,52 @@ void test_cleanup() {
     unlink("data/image.unit");
 }
 
+void forge_zero_crc32c(char *data) {
+    /* Each bit of the last four bytes changes the CRC by a fixed amount, so solve for the bits that cancel it */
+    uint32_t target = crc32c(0, data, BLOCK_SIZE);
+    uint32_t columns[32];
+    uint32_t combos[32];
+    for (int i = 0; i < 32; i++) {
+        data[BLOCK_SIZE - 4 + i / 8] ^= 1 << (i % 8);
+        columns[i] = crc32c(0, data, BLOCK_SIZE) ^ target;
+        data[BLOCK_SIZE - 4 + i / 8] ^= 1 << (i % 8);
+        combos[i] = 1u << i;
+    }
+
+    for (int bit = 0; bit < 32; bit++) {
+        int pivot = bit;
+        while (pivot < 32 && !((columns[pivot] >> bit) & 1)) {
+            pivot++;
+        }
+        assert(pivot < 32);
+
+        uint32_t column = columns[pivot], combo = combos[pivot];
+        columns[pivot] = columns[bit];
+        combos[pivot] = combos[bit];
+        columns[bit] = column;
+        combos[bit] = combo;
+        for (int j = 0; j < 32; j++) {
+            if (j != bit && ((columns[j] >> bit) & 1)) {
+                columns[j] ^= columns[bit];
+                combos[j] ^= combos[bit];
+            }
+        }
+    }
+
+    uint32_t flips = 0;
+    for (int bit = 0; bit < 32; bit++) {
+        if ((target >> bit) & 1) {
+            flips ^= combos[bit];
+        }
+    }
+    for (int i = 0; i < 32; i++) {
+        if ((flips >> i) & 1) {
+            data[BLOCK_SIZE - 4 + i / 8] ^= 1 << (i % 8);
+        }
+    }
+    assert(crc32c(0, data, BLOCK_SIZE) == 0);
+}
+
 int test_00_fs_mount() {
     Disk *disk = disk_open("data/image.5", 5);
     assert(disk);
@@ -24,11 +73,11 @@ int test_00_fs_mount() {
     assert(fs_mount(&fs, disk));
     assert(fs.disk           == disk);
     assert(fs.free_blocks);
-    assert(fs.free_blocks[0] == false);
-    assert(fs.free_blocks[1] == false);
-    assert(fs.free_blocks[2] == false);
-    assert(fs.free_blocks[3] == true);
-    assert(fs.free_blocks[4] == true);
+    assert(bitmap_test(fs.free_blocks, 0) == false);
+    assert(bitmap_test(fs.free_blocks, 1) == false);
+    assert(bitmap_test(fs.free_blocks, 2) == false);
+    assert(bitmap_test(fs.free_blocks, 3) == true);
+    assert(bitmap_test(fs.free_blocks, 4) == true);
 
     debug("Check mounting filesystem (already mounted)");
     assert(fs_mount(&fs, disk) == false);
@@ -43,26 +92,26 @@ int test_00_fs_mount() {
     assert(fs_mount(&fs, disk));
     assert(fs.disk           == disk);
     assert(fs.free_blocks);
-    assert(fs.free_blocks[0] == false);
-    assert(fs.free_blocks[1] == false);
-    assert(fs.free_blocks[2] == false);
-    assert(fs.free_blocks[3] == true);
-    assert(fs.free_blocks[4] == false);
-    assert(fs.free_blocks[5] == false);
-    assert(fs.free_blocks[6] == false);
-    assert(fs.free_blocks[7] == false);
-    assert(fs.free_blocks[8] == false);
-    assert(fs.free_blocks[9] == false);
-    assert(fs.free_blocks[10] == false);
-    assert(fs.free_blocks[11] == false);
-    assert(fs.free_blocks[12] == false);
-    assert(fs.free_blocks[13] == false);
-    assert(fs.free_blocks[14] == false);
-    assert(fs.free_blocks[15] == true);
-    assert(fs.free_blocks[16] == true);
-    assert(fs.free_blocks[17] == true);
-    assert(fs.free_blocks[18] == true);
-    assert(fs.free_blocks[19] == true);
+    assert(bitmap_test(fs.free_blocks, 0) == false);
+    assert(bitmap_test(fs.free_blocks, 1) == false);
+    assert(bitmap_test(fs.free_blocks, 2) == false);
+    assert(bitmap_test(fs.free_blocks, 3) == true);
+    assert(bitmap_test(fs.free_blocks, 4) == false);
+    assert(bitmap_test(fs.free_blocks, 5) == false);
+    assert(bitmap_test(fs.free_blocks, 6) == false);
+    assert(bitmap_test(fs.free_blocks, 7) == false);
+    assert(bitmap_test(fs.free_blocks, 8) == false);
+    assert(bitmap_test(fs.free_blocks, 9) == false);
+    assert(bitmap_test(fs.free_blocks, 10) == false);
+    assert(bitmap_test(fs.free_blocks, 11) == false);
+    assert(bitmap_test(fs.free_blocks, 12) == false);
+    assert(bitmap_test(fs.free_blocks, 13) == false);
+    assert(bitmap_test(fs.free_blocks, 14) == false);
+    assert(bitmap_test(fs.free_blocks, 15) == true);
+    assert(bitmap_test(fs.free_blocks, 16) == true);
+    assert(bitmap_test(fs.free_blocks, 17) == true);
+    assert(bitmap_test(fs.free_blocks, 18) == true);
+    assert(bitmap_test(fs.free_blocks, 19) == true);
 
     debug("Check mounting filesystem (already mounted)");
     assert(fs_mount(&fs, disk) == false);
@@ -85,6 +134,7 @@ int test_01_fs_create() {
     assert(fs_create(&fs) == 0);
     for (size_t i = 2; i < 128; i++) {
         assert(fs_create(&fs) == i);
+        assert(fs_sync(&fs));
 
         Block block;
         assert(disk_read(fs.disk, 1, block.data) != DISK_FAILURE);
@@ -115,14 +165,15 @@ int test_02_fs_remove() {
 
     debug("Check removing inode 2");
     assert(fs_remove(&fs, 2));
-    assert(fs.free_blocks[4]);
-    assert(fs.free_blocks[5]);
-    assert(fs.free_blocks[6]);
-    assert(fs.free_blocks[7]);
-    assert(fs.free_blocks[8]);
-    assert(fs.free_blocks[9]);
-    assert(fs.free_blocks[13]);
-    assert(fs.free_blocks[14]);
+    assert(bitmap_test(fs.free_blocks, 4));
+    assert(bitmap_test(fs.free_blocks, 5));
+    assert(bitmap_test(fs.free_blocks, 6));
+    assert(bitmap_test(fs.free_blocks, 7));
+    assert(bitmap_test(fs.free_blocks, 8));
+    assert(bitmap_test(fs.free_blocks, 9));
+    assert(bitmap_test(fs.free_blocks, 13));
+    assert(bitmap_test(fs.free_blocks, 14));
+    assert(fs_sync(&fs));
 
     Block block;
     assert(disk_read(fs.disk, 1, block.data) != DISK_FAILURE);
@@ -164,8 +215,1218 @@ int test_03_fs_stat() {
     return EXIT_SUCCESS;
 }
 
+int test_04_fs_statfs() {
+    assert(system("cp data/image.20 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 20);
+    assert(disk);
+
+    FileSystem fs = {0};
+    StatFS stat = {0};
+    debug("Check statfs on unmounted filesystem");
+    assert(fs_statfs(&fs, &stat) == false);
+
+    assert(fs_mount(&fs, disk));
+
+    debug("Check statfs after mount");
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.blocks      == 20);
+    assert(stat.data_blocks == 17);
+    assert(stat.free_blocks == 6);
+    assert(stat.inodes      == 256);
+
+    debug("Check statfs after allocation");
+    assert(allocate_free_block(&fs) == 3);
+    assert(allocate_free_block(&fs) == 15);
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.free_blocks == 4);
+
+    debug("Check statfs after remove");
+    assert(fs_remove(&fs, 2));
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.free_blocks == 12);
+    assert(stat.free_blocks == bitmap_recount(fs.free_blocks));
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_05_allocate_free_extent() {
+    assert(system("cp data/image.20 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 20);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+
+    uint32_t allocated = 0;
+    debug("Check extent skips runs that are too short");
+    assert(allocate_free_extent(&fs, 3, &allocated) == 15);
+    assert(allocated == 3);
+    assert(bitmap_test(fs.free_blocks, 3));
+
+    debug("Check extent truncated when no run is long enough");
+    assert(allocate_free_extent(&fs, 4, &allocated) == 18);
+    assert(allocated == 2);
+
+    debug("Check reservation gathers several extents");
+    assert(fs_remove(&fs, 3));
+    uint32_t blocks[5] = {0};
+    assert(reserve_free_blocks(&fs, blocks, 5) == 4);
+    assert(blocks[0] == 3);
+    assert(blocks[1] == 10);
+    assert(blocks[2] == 11);
+    assert(blocks[3] == 12);
+    assert(fs.free_blocks->count == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_06_fs_read() {
+    Disk *disk = disk_open("data/image.20", 20);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+
+    debug("Check reading whole file");
+    char expected[27160] = {0};
+    assert(fs_read(&fs, 2, expected, sizeof(expected), 0) == 27160);
+    assert(disk->reads == 4 + 1 + 7);
+
+    debug("Check reading at unaligned offsets");
+    char data[27160] = {0};
+    size_t offsets[] = {1, 4095, 4096, 5000, 20479, 27159};
+    for (size_t i = 0; i < sizeof(offsets) / sizeof(size_t); i++) {
+        for (size_t length = 1; length < 9000; length += 1499) {
+            ssize_t expected_length = min(length, 27160 - offsets[i]);
+            memset(data, 0, sizeof(data));
+            assert(fs_read(&fs, 2, data, length, offsets[i]) == expected_length);
+            assert(memcmp(data, expected + offsets[i], expected_length) == 0);
+        }
+    }
+
+    debug("Check reading past end of file");
+    assert(fs_read(&fs, 2, data, sizeof(data), 27160) == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_07_fs_read_map() {
+    debug("Check mapping without mmap backend");
+    Disk *disk = disk_open_backend("data/image.20", 20, DISK_PREAD);
+    assert(disk);
+
+    FileSystem fs = {0};
+    const char *mapped = NULL;
+    assert(fs_mount(&fs, disk));
+    assert(fs_read_map(&fs, 2, 0, &mapped) < 0);
+    fs_unmount(&fs);
+    disk_close(disk);
+
+    disk = disk_open_backend("data/image.20", 20, DISK_MMAP);
+    assert(disk);
+    assert(fs_mount(&fs, disk));
+
+    char expected[27160] = {0};
+    assert(fs_read(&fs, 2, expected, sizeof(expected), 0) == 27160);
+
+    debug("Check mapping contiguous direct blocks");
+    assert(fs_read_map(&fs, 2, 100, &mapped) == 5*BLOCK_SIZE - 100);
+    assert(memcmp(mapped, expected + 100, 5*BLOCK_SIZE - 100) == 0);
+
+    debug("Check mapping indirect blocks");
+    assert(fs_read_map(&fs, 2, 5*BLOCK_SIZE, &mapped) == 27160 - 5*BLOCK_SIZE);
+    assert(memcmp(mapped, expected + 5*BLOCK_SIZE, 27160 - 5*BLOCK_SIZE) == 0);
+
+    debug("Check mapping past end of file");
+    assert(fs_read_map(&fs, 2, 27160, &mapped) == 0);
+    assert(fs_read_map(&fs, 1, 0, &mapped) < 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_08_fs_indirect_trees() {
+    const size_t blocks = 1200;
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.version == FS_VERSION);
+
+    StatFS empty = {0};
+    assert(fs_statfs(&fs, &empty));
+
+    debug("Check writing through the double indirect tree");
+    size_t length = (DIRECT_POINTERS_V1 + POINTERS_PER_BLOCK + 10) * BLOCK_SIZE + 123;
+    char *data = malloc(length);
+    char *copy = malloc(length);
+    assert(data && copy);
+    for (size_t i = 0; i < length; i++) {
+        data[i] = i * 7 + i / BLOCK_SIZE;
+    }
+
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    assert(fs_write(&fs, inode_number, data, length, 0) == length);
+    assert(fs_stat(&fs, inode_number) == length);
+    assert(fs.inode_table[0].inodes[inode_number].indirect);
+    assert(fs.inode_table[0].inodes[inode_number].double_indirect);
+    assert(fs.inode_table[0].inodes[inode_number].triple_indirect == 0);
+    assert(fs_sync(&fs));
+
+    size_t reads = disk->reads;
+    assert(fs_read(&fs, inode_number, copy, length, 0) == length);
+    assert(memcmp(data, copy, length) == 0);
+    assert(disk->reads - reads == length / BLOCK_SIZE + 1 + 3);
+
+    debug("Check writing through the triple indirect tree");
+    size_t offset = (size_t)(DIRECT_POINTERS_V1 + POINTERS_PER_BLOCK + POINTERS_PER_BLOCK * POINTERS_PER_BLOCK) * BLOCK_SIZE + 100;
+    assert(fs_write(&fs, inode_number, data, 10, offset) == 10);
+    assert(fs_stat(&fs, inode_number) == offset + 10);
+    assert(fs.inode_table[0].inodes[inode_number].triple_indirect);
+    assert(fs_read(&fs, inode_number, copy, 100, offset) == 10);
+    assert(memcmp(data, copy, 10) == 0);
+
+    StatFS used = {0};
+    assert(fs_statfs(&fs, &used));
+    fs_unmount(&fs);
+
+    debug("Check remounting");
+    assert(fs_mount(&fs, disk));
+    StatFS remounted = {0};
+    assert(fs_statfs(&fs, &remounted));
+    assert(remounted.free_blocks == used.free_blocks);
+    assert(fs_stat(&fs, inode_number) == offset + 10);
+    assert(fs_read(&fs, inode_number, copy, length, 0) == length);
+    assert(memcmp(data, copy, length) == 0);
+
+    debug("Check removing");
+    assert(fs_remove(&fs, inode_number));
+    assert(fs_statfs(&fs, &remounted));
+    assert(remounted.free_blocks == empty.free_blocks);
+
+    debug("Check a removal that cannot read a pointer block still frees the inode");
+    inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    assert(fs_write(&fs, inode_number, data, length, 0) == length);
+    fs.inode_table[0].inodes[inode_number].triple_indirect = blocks + 1;
+    assert(!fs_remove(&fs, inode_number));
+    assert(fs_stat(&fs, inode_number) < 0);
+    assert(fs_sync(&fs));
+    assert(fs_statfs(&fs, &remounted));
+    assert(remounted.free_blocks == empty.free_blocks);
+    assert(fs_fsck(&fs) == 0);
+
+    free(data);
+    free(copy);
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_09_fs_readahead() {
+    assert(system("cp data/image.200 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+
+    debug("Check sequential reads are served from read-ahead buffer");
+    char data[409305] = {0};
+    size_t reads = disk->reads;
+    size_t offset = 0;
+    ssize_t result;
+    while ((result = fs_read(&fs, 9, data + offset, 4000, offset)) > 0) {
+        offset += result;
+    }
+    assert(offset == sizeof(data));
+    assert(fs.readahead[9 % READAHEAD_STREAMS].window > READAHEAD_MIN);
+    assert(disk->reads - reads < 100 + 10);
+
+    debug("Check random reads close the window");
+    char sample[10] = {0};
+    assert(fs_read(&fs, 9, sample, 10, 300000) == 10);
+    assert(fs.readahead[9 % READAHEAD_STREAMS].window == 0);
+
+    char expected[409305] = {0};
+    assert(fs_read(&fs, 9, expected, sizeof(expected), 0) == sizeof(expected));
+    assert(memcmp(data, expected, sizeof(expected)) == 0);
+    assert(memcmp(sample, expected + 300000, 10) == 0);
+
+    debug("Check writes invalidate read-ahead buffer");
+    assert(fs_read(&fs, 9, data, 4096, 0) == 4096);
+    assert(fs_read(&fs, 9, data, 4096, 4096) == 4096);
+    memset(data, 'x', 4096);
+    assert(fs_write(&fs, 9, data, 4096, 8192) == 4096);
+    memset(data, 0, 4096);
+    assert(fs_read(&fs, 9, data, 4096, 8192) == 4096);
+    assert(data[0] == 'x' && data[4095] == 'x');
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_10_fs_holes() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 100);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+
+    StatFS empty = {0};
+    assert(fs_statfs(&fs, &empty));
+
+    debug("Check all-zero blocks are left as holes");
+    char data[3 * BLOCK_SIZE] = {0};
+    memset(data, 'a', BLOCK_SIZE);
+    memset(data + 2 * BLOCK_SIZE, 'c', BLOCK_SIZE);
+
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    assert(fs_write(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+
+    StatFS stat = {0};
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.free_blocks == empty.free_blocks - 2);
+    assert(fs.inode_table[0].inodes[inode_number].direct[1] == 0);
+
+    debug("Check holes read back as zeros without disk reads");
+    char copy[3 * BLOCK_SIZE] = {0};
+    assert(fs_read(&fs, inode_number, copy, sizeof(copy), 0) == sizeof(copy));
+    assert(memcmp(data, copy, sizeof(copy)) == 0);
+
+    size_t reads = disk->reads;
+    memset(copy, 'x', sizeof(copy));
+    assert(fs_read(&fs, inode_number, copy, 100, BLOCK_SIZE + 10) == 100);
+    assert(copy[0] == 0 && copy[99] == 0);
+    assert(disk->reads == reads);
+
+    debug("Check writing past the end leaves a hole");
+    size_t offset = 50 * BLOCK_SIZE;
+    assert(fs_write(&fs, inode_number, data, BLOCK_SIZE, offset) == BLOCK_SIZE);
+    assert(fs_stat(&fs, inode_number) == offset + BLOCK_SIZE);
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.free_blocks == empty.free_blocks - 4);
+    assert(fs_read(&fs, inode_number, copy, BLOCK_SIZE, 20 * BLOCK_SIZE) == BLOCK_SIZE);
+    assert(copy[0] == 0 && copy[BLOCK_SIZE - 1] == 0);
+    assert(fs_read(&fs, inode_number, copy, BLOCK_SIZE, offset) == BLOCK_SIZE);
+    assert(memcmp(data, copy, BLOCK_SIZE) == 0);
+
+    if (disk->map) {
+        const char *mapped = NULL;
+        assert(fs_read_map(&fs, inode_number, BLOCK_SIZE + 10, &mapped) == BLOCK_SIZE - 10);
+        assert(mapped[0] == 0 && mapped[BLOCK_SIZE - 11] == 0);
+    }
+
+    debug("Check writing zeros over a hole allocates nothing");
+    memset(data, 0, sizeof(data));
+    assert(fs_write(&fs, inode_number, data, 100, 30 * BLOCK_SIZE + 7) == 100);
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.free_blocks == empty.free_blocks - 4);
+
+    debug("Check removing issues no writes");
+    size_t writes = disk->writes;
+    assert(fs_remove(&fs, inode_number));
+    assert(disk->writes == writes);
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.free_blocks == empty.free_blocks);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
 /* Main execution */
 
+int test_11_fs_format_mode() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 100);
+    assert(disk);
+
+    char junk[BLOCK_SIZE];
+    memset(junk, 'x', sizeof(junk));
+    for (size_t block = 0; block < disk->blocks; block++) {
+        assert(disk_write(disk, block, junk) == BLOCK_SIZE);
+    }
+
+    debug("Check fast format only writes the superblock, inode table, and free bitmap");
+    FileSystem fs = {0};
+    size_t writes = disk->writes;
+    assert(fs_format_mode(&fs, disk, FORMAT_FAST));
+    assert(disk->writes - writes == 1 + fs.meta_data.inode_blocks + fs.meta_data.bitmap_blocks);
+
+    debug("Check fast formatted disk mounts empty");
+    assert(fs_mount(&fs, disk));
+    StatFS stat = {0};
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.free_blocks == disk->blocks - 1 - fs.meta_data.inode_blocks - fs.meta_data.bitmap_blocks);
+    assert(stat.inodes == fs.meta_data.inodes);
+
+    char data[2 * BLOCK_SIZE];
+    memset(data, 'a', sizeof(data));
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    assert(fs_write(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+
+    char copy[2 * BLOCK_SIZE] = {0};
+    assert(fs_read(&fs, inode_number, copy, sizeof(copy), 0) == sizeof(copy));
+    assert(memcmp(data, copy, sizeof(copy)) == 0);
+
+    debug("Check formatting a mounted disk fails");
+    assert(fs_format_mode(&fs, disk, FORMAT_SECURE) == false);
+    fs_unmount(&fs);
+
+    debug("Check secure format overwrites every block");
+    writes = disk->writes;
+    assert(fs_format_mode(&fs, disk, FORMAT_SECURE));
+    assert(disk->writes - writes == disk->blocks);
+    for (size_t block = 1 + fs.meta_data.inode_blocks + fs.meta_data.bitmap_blocks; block < disk->blocks; block++) {
+        assert(disk_read(disk, block, copy) == BLOCK_SIZE);
+        for (size_t i = 0; i < BLOCK_SIZE; i++) {
+            assert(copy[i] == 0);
+        }
+    }
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_12_fs_free_bitmap() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 100);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs.meta_data.bitmap_blocks == 1);
+
+    debug("Check mount reads the free bitmap instead of walking inodes");
+    size_t reads = disk->reads;
+    assert(fs_mount(&fs, disk));
+    assert(disk->reads - reads == 1 + fs.meta_data.inode_blocks + fs.meta_data.bitmap_blocks);
+    assert(fs.meta_data.clean);
+
+    StatFS empty = {0};
+    assert(fs_statfs(&fs, &empty));
+    assert(empty.data_blocks == disk->blocks - 1 - fs.meta_data.inode_blocks - fs.meta_data.bitmap_blocks);
+    assert(empty.free_blocks == empty.data_blocks);
+
+    debug("Check the first change marks the superblock unclean");
+    char data[8 * BLOCK_SIZE];
+    memset(data, 'a', sizeof(data));
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    assert(fs.meta_data.clean == false);
+    assert(fs_write(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+
+    Block block = {{0}};
+    assert(disk_read(disk, 0, block.data) == BLOCK_SIZE);
+    assert(block.super.clean == false);
+
+    debug("Check sync writes the bitmap back and marks the superblock clean");
+    assert(fs_sync(&fs));
+    assert(fs.meta_data.clean);
+    assert(disk_read(disk, 0, block.data) == BLOCK_SIZE);
+    assert(block.super.clean);
+    fs_unmount(&fs);
+
+    reads = disk->reads;
+    assert(fs_mount(&fs, disk));
+    assert(disk->reads - reads == 1 + fs.meta_data.inode_blocks + fs.meta_data.bitmap_blocks);
+
+    StatFS stat = {0};
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.free_blocks == empty.free_blocks - 9);
+    assert(fs_fsck(&fs) == 0);
+
+    debug("Check removing returns blocks to the persistent bitmap");
+    assert(fs_remove(&fs, inode_number));
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.free_blocks == empty.free_blocks);
+    assert(fs_fsck(&fs) == 0);
+
+    inode_number = fs_create(&fs);
+    assert(fs_write(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+    fs_unmount(&fs);
+
+    debug("Check a corrupt bitmap falls back to walking inodes");
+    assert(disk_read(disk, 1 + fs.meta_data.inode_blocks, block.data) == BLOCK_SIZE);
+    memset(block.data, 0xff, 8);
+    assert(disk_write(disk, 1 + fs.meta_data.inode_blocks, block.data) == BLOCK_SIZE);
+    assert(fs_mount(&fs, disk));
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.free_blocks == empty.free_blocks - 9);
+    assert(fs_fsck(&fs) == 0);
+
+    debug("Check fsck repairs a bitmap that disagrees with the inodes");
+    bitmap_set(fs.free_blocks, fs.inode_table[0].inodes[inode_number].direct[0]);
+    assert(fs_fsck(&fs) == 1);
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.free_blocks == empty.free_blocks - 9);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_13_fs_parallel_scan() {
+    debug("Check scanning with many threads matches scanning with one");
+    const char *threads[] = {"1", "3", "64"};
+    uint64_t *words = NULL;
+    size_t count = 0;
+
+    for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+        assert(setenv("SFS_SCAN_THREADS", threads[t], 1) == 0);
+
+        Disk *disk = disk_open("data/image.200", 200);
+        assert(disk);
+
+        FileSystem fs = {0};
+        assert(fs_mount(&fs, disk));
+        if (!words) {
+            words = calloc(fs.free_blocks->nwords, sizeof(uint64_t));
+            assert(words);
+            memcpy(words, fs.free_blocks->words, fs.free_blocks->nwords * sizeof(uint64_t));
+            count = fs.free_blocks->count;
+        } else {
+            assert(memcmp(words, fs.free_blocks->words, fs.free_blocks->nwords * sizeof(uint64_t)) == 0);
+            assert(fs.free_blocks->count == count);
+        }
+        assert(bitmap_test(fs.free_blocks, 0) == false);
+        assert(bitmap_test(fs.free_blocks, 20) == false);
+
+        fs_unmount(&fs);
+        disk_close(disk);
+    }
+    free(words);
+
+    debug("Check fsck with many threads on a larger image");
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+    assert(setenv("SFS_SCAN_THREADS", "8", 1) == 0);
+
+    Disk *disk = disk_open("data/image.unit", 1200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+
+    char data[20 * BLOCK_SIZE];
+    memset(data, 'a', sizeof(data));
+    for (size_t i = 0; i < 40; i++) {
+        ssize_t inode_number = fs_create(&fs);
+        assert(inode_number >= 0);
+        assert(fs_write(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+        if (i % 3 == 0) {
+            assert(fs_remove(&fs, inode_number));
+        }
+    }
+
+    StatFS stat = {0};
+    assert(fs_statfs(&fs, &stat));
+    assert(fs_fsck(&fs) == 0);
+
+    StatFS checked = {0};
+    assert(fs_statfs(&fs, &checked));
+    assert(checked.free_blocks == stat.free_blocks);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_14_fs_journal() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 1200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs.meta_data.journal_blocks == 1200 / JOURNAL_RATIO);
+    assert(fs_mount(&fs, disk));
+    assert(fs.journal);
+
+    StatFS empty = {0};
+    assert(fs_statfs(&fs, &empty));
+    assert(empty.data_blocks == disk->blocks - 1 - fs.meta_data.inode_blocks - fs.meta_data.bitmap_blocks - fs.meta_data.journal_blocks);
+
+    debug("Check several operations share one commit");
+    char data[DIRECT_POINTERS_V1 * BLOCK_SIZE];
+    memset(data, 'a', sizeof(data));
+    for (size_t i = 0; i < 3; i++) {
+        ssize_t inode_number = fs_create(&fs);
+        assert(inode_number == (ssize_t)i);
+        assert(fs_write(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+    }
+    assert(fs.journal->commits == 0);
+    assert(fs_sync(&fs));
+    assert(fs.journal->commits == 1);
+
+    debug("Check released blocks stay allocated until the removal commits");
+    uint32_t released = fs.inode_table[0].inodes[2].direct[0];
+    assert(fs_remove(&fs, 2));
+    assert(bitmap_test(fs.free_blocks, released) == false);
+    StatFS stat = {0};
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.free_blocks == empty.free_blocks - 2 * DIRECT_POINTERS_V1);
+
+    debug("Check a crash before the next commit loses only uncommitted changes");
+    memset(data, 'b', sizeof(data));
+    assert(fs_write(&fs, 0, data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(fs_create(&fs) == 2);
+    fs.disk = NULL;
+    fs_unmount(&fs);
+
+    size_t reads = disk->reads;
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.clean == false);
+    assert(disk->reads - reads == 2 + fs.meta_data.inode_blocks + fs.meta_data.bitmap_blocks);
+    assert(fs_stat(&fs, 1) == sizeof(data));
+    assert(fs_stat(&fs, 2) == sizeof(data));
+    assert(fs_stat(&fs, 3) < 0);
+    assert(fs_fsck(&fs) == 0);
+
+    debug("Check a committed transaction is replayed if it never reached its home blocks");
+    assert(fs_remove(&fs, 1));
+    assert(fs_remove(&fs, 2));
+    assert(fs_sync(&fs));
+    assert(fs_statfs(&fs, &stat));
+    fs_unmount(&fs);
+
+    JournalHeader header;
+    assert(disk_read(disk, 1 + fs.meta_data.inode_blocks + fs.meta_data.bitmap_blocks, (char *)&header) == BLOCK_SIZE);
+    assert(header.magic == JOURNAL_MAGIC && header.count >= 2);
+
+    Block block = {{0}};
+    assert(disk_read(disk, 0, block.data) == BLOCK_SIZE);
+    block.super.clean = 0;
+    block.super.journal_sequence = header.sequence;
+    assert(disk_write(disk, 0, block.data) == BLOCK_SIZE);
+    memset(block.data, 0, BLOCK_SIZE);
+    assert(disk_write(disk, 1, block.data) == BLOCK_SIZE);
+
+    assert(fs_mount(&fs, disk));
+    assert(fs_stat(&fs, 0) == sizeof(data));
+    assert(fs_stat(&fs, 1) < 0);
+    StatFS replayed = {0};
+    assert(fs_statfs(&fs, &replayed));
+    assert(replayed.free_blocks == stat.free_blocks);
+    assert(fs_fsck(&fs) == 0);
+
+    debug("Check a full disk commits to reuse the blocks a removal released");
+    size_t length = (size_t)(replayed.free_blocks - 3) * BLOCK_SIZE; /* Indirect, double indirect, and one pointer block */
+    char *fill = malloc(length);
+    assert(fill);
+    memset(fill, 'c', length);
+    ssize_t filler = fs_create(&fs);
+    assert(filler >= 0);
+    assert(fs_write(&fs, filler, fill, length, 0) == (ssize_t)length);
+    assert(fs_sync(&fs));
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.free_blocks == 0);
+    free(fill);
+
+    size_t commits = fs.journal->commits;
+    assert(fs_remove(&fs, 0));
+    ssize_t reused = fs_create(&fs);
+    assert(reused >= 0);
+    assert(fs_write(&fs, reused, data, sizeof(data), 0) == sizeof(data));
+    assert(fs.journal->commits == commits + 1);
+    assert(fs_fsck(&fs) == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_15_fs_create_many() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 40);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.inode_blocks == 4);
+
+    StatFS stat = {0};
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.free_inodes == stat.inodes);
+
+    debug("Check creating many inodes dirties each inode block once");
+    uint32_t inodes[4 * INODES_PER_BLOCK];
+    assert(fs_create_many(&fs, inodes, 300) == 300);
+    for (size_t i = 0; i < 300; i++) {
+        assert(inodes[i] == i);
+        assert(fs_stat(&fs, i) == 0);
+    }
+    assert(fs.dirty_inode_blocks[0] && fs.dirty_inode_blocks[1] && fs.dirty_inode_blocks[2]);
+    assert(fs.dirty_inode_blocks[3] == false);
+    assert(fs.dirty_blocks == 3);
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.free_inodes == stat.inodes - 300);
+
+    debug("Check removed inodes are handed out again lowest first");
+    assert(fs_remove(&fs, 200));
+    assert(fs_remove(&fs, 7));
+    assert(fs_create(&fs) == 7);
+    assert(fs_create(&fs) == 200);
+    assert(fs_create(&fs) == 300);
+
+    debug("Check the free inode bitmap is rebuilt by mount");
+    assert(fs_remove(&fs, 42));
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.free_inodes == stat.inodes - 300);
+    assert(fs_create(&fs) == 42);
+
+    debug("Check creating more inodes than are free");
+    assert(fs_create_many(&fs, inodes, 4 * INODES_PER_BLOCK) == 4 * INODES_PER_BLOCK - 301);
+    assert(inodes[0] == 301);
+    assert(fs_create(&fs) < 0);
+    assert(fs_create_many(&fs, inodes, 1) == 0);
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.free_inodes == 0);
+
+    fs_unmount(&fs);
+    assert(fs_create_many(&fs, inodes, 1) < 0);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_16_fs_partial_write() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 40);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+
+    char expected[4 * BLOCK_SIZE];
+    char data[4 * BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(expected); i++) {
+        expected[i] = 'a' + i % 26;
+    }
+    assert(fs_write(&fs, inode_number, expected, 3 * BLOCK_SIZE, 0) == 3 * BLOCK_SIZE);
+
+    debug("Check an unaligned write keeps the bytes around it");
+    size_t reads = disk->reads;
+    memset(data, 'x', 100);
+    assert(fs_write(&fs, inode_number, data, 100, 10) == 100);
+    memcpy(expected + 10, data, 100);
+    assert(disk->reads == reads + 1);
+
+    debug("Check a write across blocks reads only its partial ends");
+    reads = disk->reads;
+    memset(data, 'y', 2 * BLOCK_SIZE);
+    assert(fs_write(&fs, inode_number, data, 2 * BLOCK_SIZE, BLOCK_SIZE / 2) == 2 * BLOCK_SIZE);
+    memcpy(expected + BLOCK_SIZE / 2, data, 2 * BLOCK_SIZE);
+    assert(disk->reads == reads + 2);
+
+    debug("Check whole aligned blocks are written without reading");
+    reads = disk->reads;
+    memset(data, 'z', BLOCK_SIZE);
+    assert(fs_write(&fs, inode_number, data, BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+    memcpy(expected + BLOCK_SIZE, data, BLOCK_SIZE);
+    assert(disk->reads == reads);
+
+    debug("Check a partial write to a new block starts from zeros");
+    reads = disk->reads;
+    memset(expected + 3 * BLOCK_SIZE, 0, BLOCK_SIZE);
+    memset(data, 'w', 10);
+    assert(fs_write(&fs, inode_number, data, 10, 3 * BLOCK_SIZE + 20) == 10);
+    memcpy(expected + 3 * BLOCK_SIZE + 20, data, 10);
+    assert(disk->reads == reads);
+    assert(fs_stat(&fs, inode_number) == 3 * BLOCK_SIZE + 30);
+
+    assert(fs_read(&fs, inode_number, data, sizeof(data), 0) == 3 * BLOCK_SIZE + 30);
+    assert(memcmp(data, expected, 3 * BLOCK_SIZE + 30) == 0);
+
+    debug("Check the merged blocks reach the disk");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    memset(data, 0, sizeof(data));
+    assert(fs_read(&fs, inode_number, data, sizeof(data), 0) == 3 * BLOCK_SIZE + 30);
+    assert(memcmp(data, expected, 3 * BLOCK_SIZE + 30) == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_17_fs_checksums() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 100);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format_mode(&fs, disk, FORMAT_CHECKSUMS));
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.checksum_blocks == 1);
+    assert(fs.checksum_table);
+
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+
+    char expected[2 * BLOCK_SIZE];
+    char data[2 * BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(expected); i++) {
+        expected[i] = 'a' + i % 26;
+    }
+    assert(fs_write(&fs, inode_number, expected, sizeof(expected), 0) == sizeof(expected));
+
+    debug("Check scrubbing a clean file system");
+    size_t checked = 0;
+    assert(fs_scrub(&fs, &checked) == 0);
+    assert(checked == 2);
+
+    debug("Check checksums survive remounting");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(fs_read(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+    assert(memcmp(data, expected, sizeof(data)) == 0);
+
+    debug("Check reading a corrupted block fails");
+    Inode inode;
+    assert(load_inode(&inode, inode_number, &fs));
+    Block garbage;
+    memset(garbage.data, 'x', BLOCK_SIZE);
+    assert(disk_write(disk, inode.direct[0], garbage.data) == BLOCK_SIZE);
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+
+    StatFS stat = {0};
+    assert(fs_read(&fs, inode_number, data, sizeof(data), 0) < 0);
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.checksum_errors >= 1);
+    assert(fs_read(&fs, inode_number, data, BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(memcmp(data, expected + BLOCK_SIZE, BLOCK_SIZE) == 0);
+
+    debug("Check scrubbing finds the corrupted block");
+    size_t errors = stat.checksum_errors;
+    assert(fs_scrub(&fs, &checked) == 1);
+    assert(checked == 2);
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.checksum_errors == errors + 1);
+
+    debug("Check a partial write does not merge into a corrupted block");
+    assert(fs_write(&fs, inode_number, data, 10, 5) < 0);
+
+    debug("Check a failed write past the end maps no new blocks");
+    StatFS before = {0};
+    assert(fs_statfs(&fs, &before));
+    assert(fs_write(&fs, inode_number, expected, sizeof(expected), 5) < 0);
+    assert(fs_stat(&fs, inode_number) == sizeof(expected));
+    assert(load_inode(&inode, inode_number, &fs));
+    assert(inode.direct[2] == 0);
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.free_blocks == before.free_blocks);
+
+    debug("Check rewriting the whole block repairs it");
+    assert(fs_write(&fs, inode_number, expected, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(fs_scrub(&fs, &checked) == 0);
+    assert(fs_read(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+    assert(memcmp(data, expected, sizeof(data)) == 0);
+
+    debug("Check a block whose CRC32C is 0 is still checked");
+    memcpy(garbage.data, expected, BLOCK_SIZE);
+    forge_zero_crc32c(garbage.data);
+    assert(fs_write(&fs, inode_number, garbage.data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(fs_scrub(&fs, &checked) == 0);
+    assert(load_inode(&inode, inode_number, &fs));
+    garbage.data[0] ^= 1;
+    assert(disk_write(disk, inode.direct[0], garbage.data) == BLOCK_SIZE);
+    assert(fs_scrub(&fs, &checked) == 1);
+
+    debug("Check scrubbing fails without checksums");
+    fs_unmount(&fs);
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    assert(fs.checksum_table == NULL);
+    assert(fs_scrub(&fs, &checked) < 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_18_fs_inline_data() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 40);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+
+    StatFS before = {0};
+    StatFS after = {0};
+    assert(fs_statfs(&fs, &before));
+
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+
+    debug("Check a tiny file is kept in its Inode");
+    char expected[INLINE_DATA_MAX + 1] = "0123456789";
+    char data[BLOCK_SIZE];
+    assert(fs_write(&fs, inode_number, expected, 10, 0) == 10);
+    assert(fs_statfs(&fs, &after));
+    assert(after.free_blocks == before.free_blocks);
+
+    Inode inode;
+    assert(load_inode(&inode, inode_number, &fs));
+    assert(inode.valid & INODE_INLINE);
+
+    debug("Check overwriting and appending within the Inode");
+    memcpy(expected + 5, "abcdefghijklmnopqrs", INLINE_DATA_MAX - 5);
+    assert(fs_write(&fs, inode_number, expected + 5, INLINE_DATA_MAX - 5, 5) == INLINE_DATA_MAX - 5);
+    assert(fs_stat(&fs, inode_number) == INLINE_DATA_MAX);
+
+    debug("Check reading inline data after remounting reads no data blocks");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    size_t reads = disk->reads;
+    assert(fs_read(&fs, inode_number, data, sizeof(data), 0) == INLINE_DATA_MAX);
+    assert(memcmp(data, expected, INLINE_DATA_MAX) == 0);
+    assert(fs_read(&fs, inode_number, data, 4, 20) == 4);
+    assert(memcmp(data, expected + 20, 4) == 0);
+    assert(disk->reads == reads);
+
+    debug("Check mapped inline data is a copy later writes leave alone");
+    if (disk->map) {
+        const char *mapped = NULL;
+        assert(fs_read_map(&fs, inode_number, 20, &mapped) == 4);
+        assert(memcmp(mapped, expected + 20, 4) == 0);
+        assert(fs_write(&fs, inode_number, "WXYZ", 4, 20) == 4);
+        assert(memcmp(mapped, expected + 20, 4) == 0);
+        assert(fs_write(&fs, inode_number, expected + 20, 4, 20) == 4);
+    }
+
+    debug("Check inline data is not mistaken for block pointers");
+    assert(fs_fsck(&fs) == 0);
+
+    debug("Check growing past the Inode moves the data to a block");
+    memset(expected + INLINE_DATA_MAX, 'z', 1);
+    assert(fs_write(&fs, inode_number, expected + INLINE_DATA_MAX, 1, INLINE_DATA_MAX) == 1);
+    assert(load_inode(&inode, inode_number, &fs));
+    assert(!(inode.valid & INODE_INLINE));
+    assert(fs_stat(&fs, inode_number) == INLINE_DATA_MAX + 1);
+    assert(fs_statfs(&fs, &after));
+    assert(after.free_blocks == before.free_blocks - 1);
+    assert(fs_read(&fs, inode_number, data, sizeof(data), 0) == INLINE_DATA_MAX + 1);
+    assert(memcmp(data, expected, INLINE_DATA_MAX + 1) == 0);
+
+    debug("Check removing an inline file releases no blocks");
+    ssize_t tiny = fs_create(&fs);
+    assert(tiny >= 0);
+    assert(fs_write(&fs, tiny, (char[]){1, 0, 0, 0, 2, 0, 0, 0}, 8, 0) == 8);
+    assert(fs_remove(&fs, tiny));
+    assert(fs_statfs(&fs, &after));
+    assert(after.free_blocks == before.free_blocks - 1);
+    assert(fs_fsck(&fs) == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_19_fs_compression() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 400);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format_mode(&fs, disk, FORMAT_COMPRESSION));
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.extent_blocks == EXTENT_BLOCKS);
+
+    StatFS before = {0};
+    StatFS after = {0};
+    assert(fs_statfs(&fs, &before));
+
+    debug("Check text takes a fraction of its blocks");
+    const size_t size = 8 * EXTENT_BLOCKS * BLOCK_SIZE;
+    static char expected[8 * EXTENT_BLOCKS * BLOCK_SIZE];
+    static char data[8 * EXTENT_BLOCKS * BLOCK_SIZE];
+    size_t length = 0;
+    for (unsigned line = 0; length < size; line++) {
+        length += snprintf(expected + length, size - length, "12:%02u:%02u sfs: write inode %u ok\n",
+                           line / 60 % 60, line % 60, line % 7);
+    }
+
+    ssize_t text = fs_create(&fs);
+    assert(text >= 0);
+    assert(fs_write(&fs, text, expected, size, 0) == (ssize_t)size);
+    assert(fs_statfs(&fs, &after));
+    assert(before.free_blocks - after.free_blocks < size / BLOCK_SIZE / 2);
+
+    debug("Check reads after remounting decompress only the extents touched");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    size_t reads = disk->reads;
+    assert(fs_read(&fs, text, data, size, 0) == (ssize_t)size);
+    assert(memcmp(data, expected, size) == 0);
+    assert(disk->reads - reads < size / BLOCK_SIZE / 2);
+
+    reads = disk->reads;
+    assert(fs_read(&fs, text, data, 100, 3 * BLOCK_SIZE + 7) == 100);
+    assert(memcmp(data, expected + 3 * BLOCK_SIZE + 7, 100) == 0);
+    assert(disk->reads - reads < EXTENT_BLOCKS);
+
+    const char *mapped;
+    assert(fs_read_map(&fs, text, 0, &mapped) < 0);
+
+    debug("Check overwriting part of an extent");
+    memset(expected + 5 * BLOCK_SIZE - 10, '#', 20);
+    assert(fs_write(&fs, text, expected + 5 * BLOCK_SIZE - 10, 20, 5 * BLOCK_SIZE - 10) == 20);
+    assert(fs_read(&fs, text, data, size, 0) == (ssize_t)size);
+    assert(memcmp(data, expected, size) == 0);
+
+    debug("Check random data and zeros are stored as they are");
+    ssize_t random = fs_create(&fs);
+    assert(random >= 0);
+    unsigned seed = 19;
+    for (size_t i = 0; i < EXTENT_BLOCKS * BLOCK_SIZE; i++) {
+        expected[i] = i < 2 * BLOCK_SIZE ? 0 : rand_r(&seed);
+    }
+    StatFS middle = {0};
+    assert(fs_statfs(&fs, &middle));
+    assert(fs_write(&fs, random, expected, EXTENT_BLOCKS * BLOCK_SIZE, 0) == EXTENT_BLOCKS * BLOCK_SIZE);
+    assert(fs_statfs(&fs, &after));
+    assert(middle.free_blocks - after.free_blocks == (EXTENT_BLOCKS - 2) + 1);   // Plus the indirect block
+    assert(fs_read(&fs, random, data, size, 0) == EXTENT_BLOCKS * BLOCK_SIZE);
+    assert(memcmp(data, expected, EXTENT_BLOCKS * BLOCK_SIZE) == 0);
+
+    debug("Check the checksums and free block bitmap agree");
+    assert(fs_sync(&fs));
+    assert(fs_fsck(&fs) == 0);
+    size_t checked = 0;
+    assert(fs_scrub(&fs, &checked) == 0);
+    assert(checked == before.free_blocks - after.free_blocks - 2);   // Less the two indirect blocks
+
+    debug("Check removing compressed files releases their blocks");
+    assert(fs_remove(&fs, text));
+    assert(fs_remove(&fs, random));
+    assert(fs_sync(&fs));
+    assert(fs_statfs(&fs, &after));
+    assert(after.free_blocks == before.free_blocks);
+    assert(fs_fsck(&fs) == 0);
+
+    debug("Check an extent that cannot be mapped leaves the free blocks alone");
+    ssize_t filler = fs_create(&fs);
+    assert(filler >= 0);
+    size_t filler_size = (before.free_blocks - EXTENT_BLOCKS - 1) * BLOCK_SIZE;   // Less the indirect block
+    char *filler_data = malloc(filler_size);
+    assert(filler_data);
+    for (size_t i = 0; i < filler_size; i++) {
+        filler_data[i] = rand_r(&seed);
+    }
+    assert(fs_write(&fs, filler, filler_data, filler_size, 0) == (ssize_t)filler_size);
+    free(filler_data);
+    assert(fs_statfs(&fs, &middle));
+    assert(middle.free_blocks == EXTENT_BLOCKS);
+
+    ssize_t full = fs_create(&fs);
+    assert(full >= 0);
+    for (size_t i = 0; i < EXTENT_BLOCKS * BLOCK_SIZE; i++) {
+        expected[i] = rand_r(&seed);
+    }
+    assert(fs_write(&fs, full, expected, EXTENT_BLOCKS * BLOCK_SIZE, 0) < 0);
+    assert(fs_statfs(&fs, &after));
+    assert(after.free_blocks == middle.free_blocks);
+    assert(fs_stat(&fs, full) == 0);
+    assert(fs_sync(&fs));
+    assert(fs_fsck(&fs) == 0);
+
+    assert(fs_remove(&fs, filler));
+    assert(fs_remove(&fs, full));
+    assert(fs_sync(&fs));
+    assert(fs_statfs(&fs, &after));
+    assert(after.free_blocks == before.free_blocks);
+    assert(fs_fsck(&fs) == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_20_fs_dedup() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 400);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format_mode(&fs, disk, FORMAT_COMPRESSION | FORMAT_DEDUP) == false);
+    assert(fs_format_mode(&fs, disk, FORMAT_DEDUP));
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.dedup);
+
+    StatFS before = {0};
+    StatFS after = {0};
+    assert(fs_statfs(&fs, &before));
+    assert(before.shared_blocks == 0);
+
+    debug("Check repeated blocks within a file are stored once");
+    const size_t size = 16 * BLOCK_SIZE;
+    static char expected[16 * BLOCK_SIZE];
+    static char data[16 * BLOCK_SIZE];
+    unsigned seed = 20;
+    for (size_t i = 0; i < size / 2; i++) {
+        expected[i] = expected[i + size / 2] = rand_r(&seed);
+    }
+
+    ssize_t original = fs_create(&fs);
+    assert(original >= 0);
+    assert(fs_write(&fs, original, expected, size, 0) == (ssize_t)size);
+    assert(fs_statfs(&fs, &after));
+    assert(before.free_blocks - after.free_blocks == 8 + 1);   // Plus the indirect block
+    assert(after.shared_blocks == 8);
+
+    debug("Check a copy shares every block and writes no data");
+    ssize_t copy = fs_create(&fs);
+    assert(copy >= 0);
+    size_t writes = disk->writes;
+    assert(fs_write(&fs, copy, expected, size, 0) == (ssize_t)size);
+    assert(disk->writes - writes <= 1);                     // Only the indirect block
+    assert(fs_statfs(&fs, &after));
+    assert(before.free_blocks - after.free_blocks == 8 + 2);
+    assert(after.shared_blocks == 8 + 16);
+    assert(fs_read(&fs, copy, data, size, 0) == (ssize_t)size);
+    assert(memcmp(data, expected, size) == 0);
+
+    debug("Check rewriting the same contents changes nothing");
+    writes = disk->writes;
+    assert(fs_write(&fs, original, expected, size, 0) == (ssize_t)size);
+    assert(disk->writes == writes);
+    assert(fs_statfs(&fs, &after));
+    assert(after.shared_blocks == 8 + 16);
+
+    debug("Check writing a shared block leaves the other files alone");
+    assert(fs_write(&fs, copy, "#", 1, 2 * BLOCK_SIZE + 5) == 1);
+    assert(fs_read(&fs, original, data, size, 0) == (ssize_t)size);
+    assert(memcmp(data, expected, size) == 0);
+    assert(fs_read(&fs, copy, data, size, 0) == (ssize_t)size);
+    assert(data[2 * BLOCK_SIZE + 5] == '#');
+    data[2 * BLOCK_SIZE + 5] = expected[2 * BLOCK_SIZE + 5];
+    assert(memcmp(data, expected, size) == 0);
+    assert(fs_statfs(&fs, &after));
+    assert(after.shared_blocks == 8 + 16 - 1);
+
+    debug("Check zeros written over a shared block leave a hole");
+    memset(data, 0, BLOCK_SIZE);
+    assert(fs_write(&fs, copy, data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(fs_statfs(&fs, &after));
+    assert(after.shared_blocks == 8 + 16 - 2);
+    assert(fs_read(&fs, original, data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(memcmp(data, expected, BLOCK_SIZE) == 0);
+
+    debug("Check reference counts survive a remount");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(fs_statfs(&fs, &after));
+    assert(after.shared_blocks == 8 + 16 - 2);
+    assert(fs_fsck(&fs) == 0);
+    size_t checked = 0;
+    assert(fs_scrub(&fs, &checked) == 0);
+
+    debug("Check fsck recounts a wrong reference count");
+    uint32_t block = fs.inode_table[original / INODES_PER_BLOCK].inodes[original % INODES_PER_BLOCK].direct[1];
+    fs.checksum_table[fs.meta_data.checksum_blocks / 2 + block / CHECKSUMS_PER_BLOCK].pointers[block % CHECKSUMS_PER_BLOCK] = 1;
+    assert(fs_fsck(&fs) == 1);
+    assert(fs_statfs(&fs, &after));
+    assert(after.shared_blocks == 8 + 16 - 2);
+
+    debug("Check fsck refuses a pointer outside the data region");
+    Inode *inode = &fs.inode_table[original / INODES_PER_BLOCK].inodes[original % INODES_PER_BLOCK];
+    inode->direct[1] = fs.meta_data.blocks;
+    assert(fs_fsck(&fs) == -1);
+    inode->direct[1] = 1;
+    assert(fs_fsck(&fs) == -1);
+    inode->direct[1] = block;
+    assert(fs_fsck(&fs) == 0);
+
+    debug("Check removing a file keeps the blocks still shared");
+    assert(fs_remove(&fs, original));
+    assert(fs_read(&fs, copy, data, size, 0) == (ssize_t)size);
+    assert(memcmp(data + BLOCK_SIZE, expected + BLOCK_SIZE, BLOCK_SIZE) == 0);
+    assert(memcmp(data + 3 * BLOCK_SIZE, expected + 3 * BLOCK_SIZE, size - 3 * BLOCK_SIZE) == 0);
+    assert(fs_remove(&fs, copy));
+    assert(fs_sync(&fs));
+    assert(fs_statfs(&fs, &after));
+    assert(after.free_blocks == before.free_blocks);
+    assert(after.shared_blocks == 0);
+    assert(fs_fsck(&fs) == 0);
+
+    debug("Check a write that cannot map every block puts the old ones back");
+    ssize_t target = fs_create(&fs);
+    assert(target >= 0);
+    assert(fs_write(&fs, target, expected, 2 * BLOCK_SIZE, 0) == 2 * BLOCK_SIZE);
+    assert(fs_statfs(&fs, &after));
+    size_t length = (size_t)(after.free_blocks - 4 - 1) * BLOCK_SIZE;   // Leave four blocks once the indirect block is taken
+    char *fill = malloc(length);
+    assert(fill);
+    for (size_t i = 0; i < length; i++) {
+        fill[i] = rand_r(&seed);
+    }
+    ssize_t filler = fs_create(&fs);
+    assert(filler >= 0);
+    assert(fs_write(&fs, filler, fill, length, 0) == (ssize_t)length);
+    assert(fs_statfs(&fs, &after));
+    assert(after.free_blocks == 4);
+
+    // The direct blocks are mapped before the indirect block is found missing
+    for (size_t i = 0; i < 4 * BLOCK_SIZE; i++) {
+        fill[i] = rand_r(&seed);
+    }
+    assert(fs_write(&fs, target, fill, 4 * BLOCK_SIZE, 0) < 0);
+    free(fill);
+    assert(fs_stat(&fs, target) == 2 * BLOCK_SIZE);
+    assert(fs_read(&fs, target, data, 2 * BLOCK_SIZE, 0) == 2 * BLOCK_SIZE);
+    assert(memcmp(data, expected, 2 * BLOCK_SIZE) == 0);
+    assert(fs_statfs(&fs, &after));
+    assert(after.free_blocks == 4);
+    assert(fs_fsck(&fs) == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
 int main(int argc, char *argv[]) {
     if (argc != 2) {
         fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
@@ -174,6 +1435,23 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "    1. Test fs_create\n");
         fprintf(stderr, "    2. Test fs_remove\n");
         fprintf(stderr, "    3. Test fs_stat\n");
+        fprintf(stderr, "    4. Test fs_statfs\n");
+        fprintf(stderr, "    5. Test allocate_free_extent\n");
+        fprintf(stderr, "    6. Test fs_read\n");
+        fprintf(stderr, "    7. Test fs_read_map\n");
+        fprintf(stderr, "    8. Test double and triple indirect blocks\n");
+        fprintf(stderr, "    9. Test fs_read read-ahead\n");
+        fprintf(stderr, "    10. Test sparse files\n");
+        fprintf(stderr, "    11. Test fs_format_mode\n");
+        fprintf(stderr, "    12. Test persistent free block bitmap\n");
+        fprintf(stderr, "    13. Test parallel inode scan\n");
+        fprintf(stderr, "    14. Test metadata journal\n");
+        fprintf(stderr, "    15. Test fs_create_many\n");
+        fprintf(stderr, "    16. Test fs_write partial blocks\n");
+        fprintf(stderr, "    17. Test data block checksums\n");
+        fprintf(stderr, "    18. Test inline data\n");
+        fprintf(stderr, "    19. Test compression\n");
+        fprintf(stderr, "    20. Test deduplication\n");
         return EXIT_FAILURE;
     }
 
@@ -187,6 +1465,23 @@ int main(int argc, char *argv[]) {
         case 1:  status = test_01_fs_create(); break;
         case 2:  status = test_02_fs_remove(); break;
         case 3:  status = test_03_fs_stat(); break;
+        case 4:  status = test_04_fs_statfs(); break;
+        case 5:  status = test_05_allocate_free_extent(); break;
+        case 6:  status = test_06_fs_read(); break;
+        case 7:  status = test_07_fs_read_map(); break;
+        case 8:  status = test_08_fs_indirect_trees(); break;
+        case 9:  status = test_09_fs_readahead(); break;
+        case 10: status = test_10_fs_holes(); break;
+        case 11: status = test_11_fs_format_mode(); break;
+        case 12: status = test_12_fs_free_bitmap(); break;
+        case 13: status = test_13_fs_parallel_scan(); break;
+        case 14: status = test_14_fs_journal(); break;
+        case 15: status = test_15_fs_create_many(); break;
+        case 16: status = test_16_fs_partial_write(); break;
+        case 17: status = test_17_fs_checksums(); break;
+        case 18: status = test_18_fs_inline_data(); break;
+        case 19: status = test_19_fs_compression(); break;
+        case 20: status = test_20_fs_dedup(); break;
         default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }
 
@@ -0,0 +1,223 @@
+/* unit_journal.c: Unit tests for SimpleFS metadata journal */
+
+#include "sfs/journal.h"
+#include "sfs/logging.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/* Constants */
+
+#define DISK_PATH      "data/image.unit"
+#define DISK_BLOCKS    (32)
+#define JOURNAL_START  (20)
+#define JOURNAL_BLOCKS (8)
+
+/* Functions */
+
+void test_cleanup() {
+    unlink(DISK_PATH);
+}
+
+Disk *test_disk() {
+    assert(system("truncate -s 0 " DISK_PATH) == EXIT_SUCCESS);
+
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+    return disk;
+}
+
+void fill_block(char *data, size_t block, char pattern) {
+    memset(data, pattern, BLOCK_SIZE);
+    data[0] = block;
+}
+
+void check_block(Disk *disk, size_t block, char pattern) {
+    char data[BLOCK_SIZE];
+    char expected[BLOCK_SIZE] = {0};
+    if (pattern) {
+        fill_block(expected, block, pattern);
+    }
+    assert(disk_read(disk, block, data) == BLOCK_SIZE);
+    assert(memcmp(data, expected, BLOCK_SIZE) == 0);
+}
+
+int test_00_journal_buffer() {
+    Disk *disk = test_disk();
+    Journal *journal = journal_create(JOURNAL_START, JOURNAL_BLOCKS, 1);
+    assert(journal);
+    assert(journal->capacity == JOURNAL_BLOCKS - 1);
+    assert(journal_create(JOURNAL_START, 1, 1) == NULL);
+
+    debug("Check buffered blocks read back without touching the disk");
+    char data[BLOCK_SIZE];
+    char copy[BLOCK_SIZE];
+    size_t writes = disk->writes;
+    for (size_t block = 1; block < 20; block++) {
+        fill_block(data, block, 'a');
+        assert(journal_write(journal, disk, block, data));
+    }
+    fill_block(data, 5, 'b');
+    assert(journal_write(journal, disk, 5, data));
+    assert(journal->count == 19);
+    assert(disk->writes == writes);
+
+    size_t reads = disk->reads;
+    assert(journal_read(journal, disk, 5, copy));
+    assert(memcmp(data, copy, BLOCK_SIZE) == 0);
+    assert(journal_read(journal, disk, 7, copy));
+    assert(copy[0] == 7 && copy[1] == 'a');
+    assert(disk->reads == reads);
+
+    debug("Check unbuffered blocks are read from the disk");
+    assert(journal_read(journal, disk, 25, copy));
+    assert(disk->reads == reads + 1);
+
+    debug("Check a missing journal goes straight to the disk");
+    fill_block(data, 25, 'b');
+    assert(journal_write(NULL, disk, 25, data));
+    assert(disk->writes == writes + 1);
+    check_block(disk, 25, 'b');
+
+    debug("Check released blocks are dropped from the buffer");
+    assert(journal_release(journal, 7));
+    assert(journal->nfrees == 1 && journal->frees[0] == 7);
+    assert(journal_read(journal, disk, 7, copy));
+    assert(disk->reads == reads + 3);
+
+    journal_delete(journal);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_01_journal_commit() {
+    Disk *disk = test_disk();
+    Journal *journal = journal_create(JOURNAL_START, JOURNAL_BLOCKS, 1);
+    assert(journal);
+
+    debug("Check commit logs and checkpoints buffered and extra blocks");
+    char data[BLOCK_SIZE];
+    for (size_t block = 1; block < 4; block++) {
+        fill_block(data, block, 'a');
+        assert(journal_write(journal, disk, block, data));
+    }
+
+    char extra[BLOCK_SIZE];
+    fill_block(extra, 10, 'x');
+    uint32_t homes[] = {10};
+    char *images[] = {extra};
+    assert(journal_commit(journal, disk, homes, images, 1));
+    assert(journal->commits == 1);
+    assert(journal->sequence == 2);
+    assert(journal->count == 0);
+    for (size_t block = 1; block < 4; block++) {
+        check_block(disk, block, 'a');
+    }
+    check_block(disk, 10, 'x');
+
+    debug("Check commits larger than the journal are split");
+    for (size_t block = 1; block < 18; block++) {
+        fill_block(data, block, 'c');
+        assert(journal_write(journal, disk, block, data));
+    }
+    assert(journal_release(journal, 17));
+    assert(journal_commit(journal, disk, NULL, NULL, 0));
+    assert(journal->commits == 1 + 3);
+    for (size_t block = 1; block < 17; block++) {
+        check_block(disk, block, 'c');
+    }
+    check_block(disk, 17, 0);
+
+    debug("Check an empty commit logs nothing");
+    assert(journal_commit(journal, disk, NULL, NULL, 0));
+    assert(journal->commits == 4);
+
+    journal_delete(journal);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_02_journal_replay() {
+    Disk *disk = test_disk();
+    Journal *journal = journal_create(JOURNAL_START, JOURNAL_BLOCKS, 5);
+    assert(journal);
+
+    debug("Check a logged transaction is replayed to its home blocks");
+    char data[3][BLOCK_SIZE];
+    uint32_t homes[] = {2, 4, 9};
+    char *images[] = {data[0], data[1], data[2]};
+    for (size_t i = 0; i < 3; i++) {
+        fill_block(data[i], homes[i], 'r');
+    }
+    assert(journal_log(journal, disk, homes, images, 3));
+    check_block(disk, 4, 0);
+
+    uint32_t sequence = 5;
+    assert(journal_replay(disk, JOURNAL_START, JOURNAL_BLOCKS, &sequence));
+    assert(sequence == 6);
+    for (size_t i = 0; i < 3; i++) {
+        check_block(disk, homes[i], 'r');
+    }
+
+    debug("Check an older transaction is not replayed");
+    assert(disk_write(disk, 4, (char[BLOCK_SIZE]){0}) == BLOCK_SIZE);
+    assert(journal_replay(disk, JOURNAL_START, JOURNAL_BLOCKS, &sequence));
+    assert(sequence == 6);
+    check_block(disk, 4, 0);
+
+    debug("Check a torn transaction is not replayed");
+    sequence = 5;
+    char block[BLOCK_SIZE];
+    assert(disk_read(disk, JOURNAL_START + 2, block) == BLOCK_SIZE);
+    block[100] ^= 1;
+    assert(disk_write(disk, JOURNAL_START + 2, block) == BLOCK_SIZE);
+    assert(journal_replay(disk, JOURNAL_START, JOURNAL_BLOCKS, &sequence));
+    assert(sequence == 5);
+    check_block(disk, 4, 0);
+
+    debug("Check a transaction pointing into the journal is not replayed");
+    homes[1] = JOURNAL_START + 1;
+    assert(journal_log(journal, disk, homes, images, 3));
+    assert(journal_replay(disk, JOURNAL_START, JOURNAL_BLOCKS, &sequence));
+    assert(sequence == 5);
+
+    debug("Check a transaction must fit in the journal");
+    assert(journal_log(journal, disk, homes, images, JOURNAL_BLOCKS) == false);
+    assert(journal_log(journal, disk, homes, images, 0) == false);
+
+    journal_delete(journal);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test journal_read/journal_write\n");
+        fprintf(stderr, "    1. Test journal_commit\n");
+        fprintf(stderr, "    2. Test journal_replay\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    assert(atexit(test_cleanup) == EXIT_SUCCESS);
+
+    switch (number) {
+        case 0:  status = test_00_journal_buffer(); break;
+        case 1:  status = test_01_journal_commit(); break;
+        case 2:  status = test_02_journal_replay(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
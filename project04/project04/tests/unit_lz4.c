@@ -0,0 +1,142 @@
+/* unit_lz4.c: Unit tests for SimpleFS LZ4 block compression */
+
+#include "sfs/lz4.h"
+#include "sfs/logging.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Constants */
+
+#define DATA_SIZE (8 * 4096)
+
+/* Functions */
+
+void fill_text(char *data, size_t length, unsigned seed) {
+    static const char *words[] = {"mount", "sync", "read", "write", "remove"};
+    size_t i = 0;
+    for (unsigned line = 0; i < length; line++) {
+        int n = snprintf(data + i, length - i, "2024-01-01 12:%02u:%02u sfs: %s inode %u ok\n", line / 60 % 60,
+                         line % 60, words[rand_r(&seed) % 5], rand_r(&seed) % 100);
+        i += n > 0 ? (size_t)n : length;
+    }
+}
+
+int test_00_lz4_roundtrip() {
+    static char data[DATA_SIZE], packed[DATA_SIZE * 2], copy[DATA_SIZE];
+
+    debug("Check empty and tiny buffers are all literals");
+    assert(lz4_compress("", 0, packed, sizeof(packed)) == 1);
+    assert(lz4_decompress(packed, 1, copy, sizeof(copy)) == 0);
+    for (size_t length = 1; length <= 16; length++) {
+        memset(data, 'a', length);
+        size_t n = lz4_compress(data, length, packed, sizeof(packed));
+        assert(n > 0);
+        assert(lz4_decompress(packed, n, copy, sizeof(copy)) == (ssize_t)length);
+        assert(memcmp(data, copy, length) == 0);
+    }
+
+    debug("Check text compresses and comes back whole at every length");
+    fill_text(data, sizeof(data), 1);
+    for (size_t length = 17; length <= sizeof(data); length = length * 3 / 2) {
+        size_t n = lz4_compress(data, length, packed, sizeof(packed));
+        assert(n > 0);
+        assert(lz4_decompress(packed, n, copy, sizeof(copy)) == (ssize_t)length);
+        assert(memcmp(data, copy, length) == 0);
+    }
+    size_t n = lz4_compress(data, sizeof(data), packed, sizeof(packed));
+    assert(n < sizeof(data) / 2);
+
+    debug("Check runs compress to almost nothing");
+    memset(data, 0, sizeof(data));
+    n = lz4_compress(data, sizeof(data), packed, sizeof(packed));
+    assert(n > 0 && n < 256);
+    assert(lz4_decompress(packed, n, copy, sizeof(copy)) == sizeof(data));
+    assert(memcmp(data, copy, sizeof(data)) == 0);
+
+    debug("Check random data still round trips");
+    unsigned seed = 2;
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = rand_r(&seed);
+    }
+    n = lz4_compress(data, sizeof(data), packed, sizeof(packed));
+    assert(n > sizeof(data));
+    assert(lz4_decompress(packed, n, copy, sizeof(copy)) == sizeof(data));
+    assert(memcmp(data, copy, sizeof(data)) == 0);
+    return EXIT_SUCCESS;
+}
+
+int test_01_lz4_capacity() {
+    static char data[DATA_SIZE], packed[DATA_SIZE * 2], copy[DATA_SIZE];
+
+    debug("Check output that does not fit is refused");
+    unsigned seed = 3;
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = rand_r(&seed);
+    }
+    assert(lz4_compress(data, sizeof(data), packed, sizeof(data) - 4096) == 0);
+
+    fill_text(data, sizeof(data), 4);
+    size_t n = lz4_compress(data, sizeof(data), packed, sizeof(packed));
+    assert(lz4_compress(data, sizeof(data), packed, n / 2) == 0);
+
+    debug("Check decompression stops at capacity");
+    n = lz4_compress(data, sizeof(data), packed, sizeof(packed));
+    assert(lz4_decompress(packed, n, copy, sizeof(copy) - 1) == -1);
+    assert(lz4_decompress(packed, n, copy, sizeof(copy)) == sizeof(data));
+    return EXIT_SUCCESS;
+}
+
+int test_02_lz4_corrupt() {
+    static char data[DATA_SIZE], packed[DATA_SIZE * 2], copy[DATA_SIZE];
+
+    debug("Check truncated and damaged blocks fail without overrunning");
+    fill_text(data, sizeof(data), 5);
+    size_t n = lz4_compress(data, sizeof(data), packed, sizeof(packed));
+    for (size_t length = 0; length < n; length += 7) {
+        ssize_t result = lz4_decompress(packed, length, copy, sizeof(copy));
+        assert(result <= (ssize_t)sizeof(copy));
+    }
+
+    unsigned seed = 6;
+    for (size_t trial = 0; trial < 1000; trial++) {
+        static char damaged[DATA_SIZE * 2];
+        memcpy(damaged, packed, n);
+        damaged[rand_r(&seed) % n] ^= 1 + rand_r(&seed) % 255;
+        ssize_t result = lz4_decompress(damaged, n, copy, sizeof(copy));
+        assert(result <= (ssize_t)sizeof(copy));
+    }
+
+    debug("Check a match before any output is refused");
+    char bad[] = {0x04, 0x01, 0x00};
+    assert(lz4_decompress(bad, sizeof(bad), copy, sizeof(copy)) == -1);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test lz4 round trips\n");
+        fprintf(stderr, "    1. Test lz4 capacity limits\n");
+        fprintf(stderr, "    2. Test lz4 on corrupt blocks\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_lz4_roundtrip(); break;
+        case 1:  status = test_01_lz4_capacity(); break;
+        case 2:  status = test_02_lz4_corrupt(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,183 @@
+/* unit_stats.c: Unit tests for SimpleFS latency histograms and call tracing */
+
+#include "sfs/fs.h"
+#include "sfs/logging.h"
+#include "sfs/stats.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/* Constants */
+
+#define DISK_PATH   "data/image.unit"
+#define DISK_BLOCKS (200)
+
+/* Functions */
+
+void test_cleanup() {
+    unlink(DISK_PATH);
+}
+
+int test_00_stats_histogram() {
+    stats_reset();
+
+    debug("Check calls are counted in log-sized buckets");
+    uint64_t now = stats_start();
+    for (size_t i = 0; i < 99; i++) {
+        stats_record_duration(STAT_FS_STAT, now, 3000, i, 0);
+    }
+    stats_record_duration(STAT_FS_STAT, now, 1000000, 99, -1);
+
+    Histogram histogram;
+    stats_histogram(STAT_FS_STAT, &histogram);
+    assert(histogram.calls == 100);
+    assert(histogram.failures == 1);
+    assert(histogram.max_ns == 1000000);
+    assert(histogram.total_ns == 99 * 3000 + 1000000);
+
+    size_t counted = 0;
+    for (size_t b = 0; b < STATS_BUCKETS; b++) {
+        counted += histogram.buckets[b];
+    }
+    assert(counted == 100);
+    assert(histogram.buckets[0] == 0);
+
+    debug("Check percentiles come from the buckets");
+    uint64_t p50 = stats_percentile(&histogram, 0.5);
+    assert(p50 >= 3000 && p50 <= 8192);
+    assert(stats_percentile(&histogram, 0.99) <= 8192);
+    assert(stats_percentile(&histogram, 1.0) == histogram.max_ns);
+
+    debug("Check nothing is counted while disabled");
+    stats_enable(false);
+    assert(stats_start() == 0);
+    stats_record(STAT_FS_STAT, stats_start(), 0, 0);
+    stats_enable(true);
+    stats_histogram(STAT_FS_STAT, &histogram);
+    assert(histogram.calls == 100);
+
+    debug("Check reset clears every histogram");
+    stats_reset();
+    stats_histogram(STAT_FS_STAT, &histogram);
+    assert(histogram.calls == 0 && histogram.max_ns == 0);
+    assert(stats_percentile(&histogram, 0.5) == 0);
+    return EXIT_SUCCESS;
+}
+
+int test_01_stats_trace() {
+    TraceRecord records[8];
+
+    debug("Check nothing is traced until tracing starts");
+    stats_record(STAT_DISK_READ, stats_start(), 1, 0);
+    assert(stats_trace_records(records, 8) == 0);
+
+    debug("Check the ring buffer keeps the most recent calls in order");
+    assert(stats_trace(4));
+    for (uint64_t block = 0; block < 6; block++) {
+        stats_record(STAT_DISK_READ, stats_start(), block, BLOCK_SIZE);
+    }
+    assert(stats_trace_records(records, 8) == 4);
+    for (size_t i = 0; i < 4; i++) {
+        assert(records[i].op == STAT_DISK_READ);
+        assert(records[i].argument == i + 2);
+        assert(records[i].result == BLOCK_SIZE);
+        assert(records[i].thread == records[0].thread);
+    }
+    assert(stats_trace_records(records, 2) == 2);
+    assert(records[0].argument == 4 && records[1].argument == 5);
+
+    debug("Check stopping tracing drops the records");
+    assert(stats_trace(0));
+    stats_record(STAT_DISK_READ, stats_start(), 9, 0);
+    assert(stats_trace_records(records, 8) == 0);
+
+    debug("Check operation names");
+    StatOp op;
+    for (StatOp o = 0; o < STAT_OPS; o++) {
+        assert(stats_op_parse(stats_op_name(o), &op));
+        assert(op == o);
+    }
+    assert(stats_op_parse("fs_bogus", &op) == false);
+    return EXIT_SUCCESS;
+}
+
+int test_02_stats_calls() {
+    assert(system("truncate -s 0 " DISK_PATH) == EXIT_SUCCESS);
+
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    stats_reset();
+    assert(fs_mount(&fs, disk));
+
+    debug("Check file system and disk calls are timed");
+    char data[2 * BLOCK_SIZE] = {1};
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    assert(fs_write(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_read(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_stat(&fs, inode_number + 1) < 0);
+
+    StatOp ops[] = {STAT_FS_MOUNT, STAT_FS_CREATE, STAT_FS_WRITE, STAT_FS_READ, STAT_FS_STAT};
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        Histogram histogram;
+        stats_histogram(ops[i], &histogram);
+        assert(histogram.calls == 1);
+        assert(histogram.failures == (ops[i] == STAT_FS_STAT));
+    }
+
+    Histogram histogram;
+    stats_histogram(STAT_DISK_READ, &histogram);
+    assert(histogram.calls >= 1);
+    stats_histogram(STAT_DISK_WRITEV, &histogram);
+    assert(histogram.calls >= 1);
+
+    debug("Check traced calls carry their Inode");
+    assert(stats_trace(STATS_TRACE_DEFAULT));
+    assert(fs_read(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+    TraceRecord records[STATS_TRACE_DEFAULT];
+    size_t count = stats_trace_records(records, STATS_TRACE_DEFAULT);
+    assert(count >= 1);
+    assert(records[count - 1].op == STAT_FS_READ);
+    assert(records[count - 1].argument == (uint64_t)inode_number);
+    assert(records[count - 1].result == sizeof(data));
+    assert(stats_trace(0));
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test stats histograms\n");
+        fprintf(stderr, "    1. Test stats trace\n");
+        fprintf(stderr, "    2. Test stats of file system calls\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    assert(atexit(test_cleanup) == EXIT_SUCCESS);
+
+    switch (number) {
+        case 0:  status = test_00_stats_histogram(); break;
+        case 1:  status = test_01_stats_trace(); break;
+        case 2:  status = test_02_stats_calls(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
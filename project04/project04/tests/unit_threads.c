@@ -0,0 +1,305 @@
+/* unit_threads.c: Multi-threaded stress tests for SimpleFS file system */
+
+#include "sfs/fs.h"
+#include "sfs/logging.h"
+#include "sfs/utils.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+/* Constants */
+
+#define IMAGE_BLOCKS (20000)  /* Large enough for several allocator shards */
+#define MAX_THREADS  (8)
+#define FILE_BLOCKS  (16)
+
+/* Structures */
+
+typedef struct Worker Worker;
+struct Worker {
+    FileSystem *fs;         /* Mounted file system shared by every worker */
+    size_t id;              /* Worker number */
+    ssize_t inode_number;   /* Inode the worker writes (or -1) */
+    size_t iterations;      /* Number of rounds to run */
+    size_t bytes;           /* Number of bytes moved */
+};
+
+/* Functions */
+
+void test_cleanup() {
+    unlink("data/image.unit");
+}
+
+Disk *test_disk(FileSystem *fs) {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", IMAGE_BLOCKS);
+    assert(disk);
+    assert(fs_format(fs, disk));
+    assert(fs_mount(fs, disk));
+    assert(fs->nshards > 1);
+    return disk;
+}
+
+void run_workers(Worker *workers, size_t count, void *(*function)(void *)) {
+    pthread_t threads[MAX_THREADS];
+    for (size_t i = 0; i < count; i++) {
+        assert(pthread_create(&threads[i], NULL, function, &workers[i]) == 0);
+    }
+    for (size_t i = 0; i < count; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+}
+
+void *write_read_worker(void *arg) {
+    Worker *worker = arg;
+    char data[FILE_BLOCKS * BLOCK_SIZE];
+    char check[FILE_BLOCKS * BLOCK_SIZE];
+
+    // Write the file a few blocks at a time, then read it back in uneven pieces
+    for (size_t n = 0; n < worker->iterations; n++) {
+        memset(data, 'a' + (worker->id + n) % 26, sizeof(data));
+        size_t piece = BLOCK_SIZE * (1 + worker->id % 3);
+        for (size_t offset = 0; offset < sizeof(data); offset += piece) {
+            size_t length = min(piece, sizeof(data) - offset);
+            assert(fs_write(worker->fs, worker->inode_number, data + offset, length, offset) == (ssize_t)length);
+        }
+
+        for (size_t offset = 0; offset < sizeof(check); offset += 3000) {
+            size_t length = min((size_t)3000, sizeof(check) - offset);
+            assert(fs_read(worker->fs, worker->inode_number, check + offset, length, offset) == (ssize_t)length);
+        }
+        assert(memcmp(data, check, sizeof(data)) == 0);
+        worker->bytes += 2 * sizeof(data);
+    }
+
+    return NULL;
+}
+
+void *overwrite_worker(void *arg) {
+    Worker *worker = arg;
+    char data[FILE_BLOCKS * BLOCK_SIZE];
+
+    for (size_t n = 0; n < worker->iterations; n++) {
+        memset(data, 'a' + n % 26, sizeof(data));
+        assert(fs_write(worker->fs, worker->inode_number, data, sizeof(data), 0) == sizeof(data));
+    }
+
+    return NULL;
+}
+
+void *uniform_reader_worker(void *arg) {
+    Worker *worker = arg;
+    char data[FILE_BLOCKS * BLOCK_SIZE];
+
+    // Each write replaces the whole file, so a read must never see two patterns
+    for (size_t n = 0; n < worker->iterations; n++) {
+        assert(fs_read(worker->fs, worker->inode_number, data, sizeof(data), 0) == sizeof(data));
+        for (size_t i = 1; i < sizeof(data); i++) {
+            assert(data[i] == data[0]);
+        }
+    }
+
+    return NULL;
+}
+
+void *churn_worker(void *arg) {
+    Worker *worker = arg;
+    char data[FILE_BLOCKS * BLOCK_SIZE];
+    memset(data, 'a' + worker->id, sizeof(data));
+
+    for (size_t n = 0; n < worker->iterations; n++) {
+        ssize_t inode_number = fs_create(worker->fs);
+        assert(inode_number >= 0);
+
+        size_t length = BLOCK_SIZE * (1 + (worker->id + n) % FILE_BLOCKS) - n % 100;
+        assert(fs_write(worker->fs, inode_number, data, length, 0) == (ssize_t)length);
+        assert(fs_stat(worker->fs, inode_number) == (ssize_t)length);
+        assert(fs_remove(worker->fs, inode_number));
+    }
+
+    return NULL;
+}
+
+void *sync_worker(void *arg) {
+    Worker *worker = arg;
+
+    for (size_t n = 0; n < worker->iterations; n++) {
+        StatFS stat = {0};
+        assert(fs_statfs(worker->fs, &stat));
+        assert(stat.free_blocks <= stat.data_blocks);
+        assert(fs_sync(worker->fs));
+    }
+
+    return NULL;
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int test_00_threads_separate_inodes() {
+    debug("Check threads writing and reading their own inodes");
+    FileSystem fs = {0};
+    Disk *disk = test_disk(&fs);
+
+    Worker workers[MAX_THREADS];
+    for (size_t i = 0; i < MAX_THREADS; i++) {
+        workers[i] = (Worker){&fs, i, fs_create(&fs), 20, 0};
+        assert(workers[i].inode_number == (ssize_t)i);
+    }
+    run_workers(workers, MAX_THREADS, write_read_worker);
+
+    debug("Check every file holds its last pattern and the bitmap is consistent");
+    char data[FILE_BLOCKS * BLOCK_SIZE];
+    for (size_t i = 0; i < MAX_THREADS; i++) {
+        assert(fs_stat(&fs, i) == sizeof(data));
+        assert(fs_read(&fs, i, data, sizeof(data), 0) == sizeof(data));
+        for (size_t b = 0; b < sizeof(data); b++) {
+            assert(data[b] == 'a' + (char)((i + 19) % 26));
+        }
+    }
+    assert(fs_fsck(&fs) == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_01_threads_shared_inode() {
+    debug("Check readers never see a torn write (with and without a cache)");
+    for (size_t capacity = 0; capacity <= 64; capacity += 64) {
+        FileSystem fs = {0};
+        Disk *disk = test_disk(&fs);
+        assert(disk_cache(disk, capacity));
+
+        ssize_t inode_number = fs_create(&fs);
+        assert(inode_number >= 0);
+
+        Worker workers[4];
+        workers[0] = (Worker){&fs, 0, inode_number, 200, 0};
+        overwrite_worker(&workers[0]);
+        for (size_t i = 1; i < 4; i++) {
+            workers[i] = (Worker){&fs, i, inode_number, 200, 0};
+        }
+
+        pthread_t writer;
+        assert(pthread_create(&writer, NULL, overwrite_worker, &workers[0]) == 0);
+        run_workers(workers + 1, 3, uniform_reader_worker);
+        assert(pthread_join(writer, NULL) == 0);
+
+        assert(fs_fsck(&fs) == 0);
+        fs_unmount(&fs);
+        disk_close(disk);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int test_02_threads_create_remove() {
+    debug("Check create, write, and remove churn across threads with syncs");
+    FileSystem fs = {0};
+    Disk *disk = test_disk(&fs);
+
+    StatFS empty = {0};
+    assert(fs_statfs(&fs, &empty));
+
+    Worker workers[MAX_THREADS];
+    for (size_t i = 0; i < MAX_THREADS; i++) {
+        workers[i] = (Worker){&fs, i, -1, 100, 0};
+    }
+    run_workers(workers, MAX_THREADS - 1, churn_worker);
+
+    pthread_t syncer;
+    workers[MAX_THREADS - 1].iterations = 20;
+    assert(pthread_create(&syncer, NULL, sync_worker, &workers[MAX_THREADS - 1]) == 0);
+    run_workers(workers, MAX_THREADS - 1, churn_worker);
+    assert(pthread_join(syncer, NULL) == 0);
+
+    debug("Check every block and inode came back");
+    StatFS stat = {0};
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.free_blocks == empty.free_blocks);
+    for (size_t i = 0; i < MAX_THREADS; i++) {
+        assert(fs_stat(&fs, i) < 0);
+    }
+    assert(fs_fsck(&fs) == 0);
+
+    debug("Check the synced image mounts with the same free blocks");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.clean);
+    assert(fs_statfs(&fs, &stat));
+    assert(stat.free_blocks == empty.free_blocks);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_03_threads_benchmark() {
+    debug("Measure write and read throughput as threads are added");
+    printf("%8s %12s %10s %10s\n", "threads", "bytes", "seconds", "MB/s");
+
+    for (size_t count = 1; count <= MAX_THREADS; count *= 2) {
+        FileSystem fs = {0};
+        Disk *disk = test_disk(&fs);
+
+        Worker workers[MAX_THREADS];
+        for (size_t i = 0; i < count; i++) {
+            workers[i] = (Worker){&fs, i, fs_create(&fs), 80 / count, 0};
+        }
+
+        double start = now();
+        run_workers(workers, count, write_read_worker);
+        double seconds = now() - start;
+
+        size_t bytes = 0;
+        for (size_t i = 0; i < count; i++) {
+            bytes += workers[i].bytes;
+        }
+        printf("%8lu %12lu %10.4f %10.2f\n", count, bytes, seconds, bytes / (1024.0 * 1024.0) / seconds);
+
+        assert(fs_fsck(&fs) == 0);
+        fs_unmount(&fs);
+        disk_close(disk);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test threads on separate inodes\n");
+        fprintf(stderr, "    1. Test threads on a shared inode\n");
+        fprintf(stderr, "    2. Test concurrent create and remove\n");
+        fprintf(stderr, "    3. Test thread scaling benchmark\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    assert(atexit(test_cleanup) == EXIT_SUCCESS);
+
+    switch (number) {
+        case 0:  status = test_00_threads_separate_inodes(); break;
+        case 1:  status = test_01_threads_shared_inode(); break;
+        case 2:  status = test_02_threads_create_remove(); break;
+        case 3:  status = test_03_threads_benchmark(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */